@@ -0,0 +1,62 @@
+/*
+*   Growable byte ring buffer used to reassemble stream data per connection.
+*   Capacity is always a power of two; the buffer only grows when a write
+*   cannot fit and is linearized on demand when a caller needs a contiguous view.
+*
+*   Author: Fu Qiao
+*   Email:  fqiao@protonmail.com
+*
+*/
+
+#ifndef __BYTE_RING_BUFFER_H__
+#define __BYTE_RING_BUFFER_H__
+
+#include <cstddef>
+#include <memory>
+
+namespace common {
+
+class ByteRingBuffer {
+
+public:
+  explicit ByteRingBuffer(size_t initialCapacity = 4096);
+  ~ByteRingBuffer();
+
+  ByteRingBuffer(const ByteRingBuffer& other) = delete;
+  ByteRingBuffer& operator=(const ByteRingBuffer& other) = delete;
+
+  size_t Size() const { return _size; }
+  size_t Capacity() const { return _capacity; }
+  bool Empty() const { return _size == 0; }
+
+  //Returns the contiguous free region at the tail, at least minFree bytes long.
+  //Fill it directly (e.g. with recv) and then call CommitWrite.
+  char* PrepareWrite(size_t minFree, size_t& available);
+  void CommitWrite(size_t length);
+
+  void Append(const char* data, size_t length);
+
+  //Copy up to length bytes from the front without consuming them
+  size_t Peek(void* destination, size_t length) const;
+
+  //Make the first length bytes contiguous and return a pointer to them.
+  //The pointer stays valid until the next write or Consume.
+  const char* Linearize(size_t length);
+
+  void Consume(size_t length);
+
+  //Drop the content and give oversized storage back
+  void Reset();
+
+private:
+  void Reallocate(size_t capacity);
+
+  size_t _initial_capacity;
+  size_t _capacity;
+  size_t _head {0};
+  size_t _size {0};
+  std::unique_ptr<char[]> _storage;
+};
+}
+
+#endif
@@ -9,7 +9,43 @@
 
 #define SERVER_TCP_PORT 8517   //TCP for message transmission
 #define SERVER_UDP_PORT 8964   //UDP for periodic status/new messages check
+#define SERVER_ADMIN_PORT 8518 //loopback only, answers with a metrics snapshot
+#define STATS_DUMP_INTERVAL_MS 10000 //how often metrics are written to the stats file
 #define HEARTBEAT_RATE 5
+#define PRESENCE_TIMEOUT_MS (3 * HEARTBEAT_RATE * 1000) //users silent for three heartbeats go offline
+#define TCP_IDLE_TIMEOUT_MS 300000    //connections without any inbound traffic are closed
+#define TIMER_TICK_MS 100             //resolution of the timing wheel
+#define TIMING_WHEEL_LEVELS 4
 #define SOCKET_MSG_BUF_SIZE 8192
+#define MESSAGE_QUEUE_CAPACITY 65536 //bound of every inbound/outbound message queue
+#define CONTROL_LANE_CAPACITY 16384  //intake bound per transport for heartbeats and anonymous requests
+#define BULK_LANE_CAPACITY 65536     //intake bound per transport for everything else
+#define CONTROL_LANE_WEIGHT 8        //control requests taken per bulk request while both are waiting
+#define OVERLOAD_TARGET_MS 20        //queueing delay above which requests start being shed, 0 disables
+#define OVERLOAD_INTERVAL_MS 200     //how long the delay must stay above target before each shedding step
+#define RATE_LIMIT_SLOTS 65536       //token buckets of the rate limiter, 16 bytes each
+#define RATE_LIMIT_CONNECTIONS 2000  //TCP connections per second accepted from one address, 0 is unlimited
+#define RATE_LIMIT_REQUESTS 50000    //requests per second taken from one address, 0 is unlimited
+#define DEDUP_CACHE_ENTRIES 65536    //requests with a request id remembered for retransmits
+#define DEDUP_WINDOW_MS 30000        //how long a reply is replayed to retransmits, 0 disables
+#define DEDUP_PENDING_MS 5000        //how long retransmits of an unanswered request are dropped
+#define DEDUP_MAX_REPLY_BYTES 2048   //larger replies are not kept, their retransmits run again
+#define TCP_REACTOR_THREADS 4       //epoll reactors serving accepted TCP connections
+#define UDP_BATCH_SIZE 64            //datagrams per recvmmsg/sendmmsg call
+#define TCP_MAX_FRAME_SIZE 1048576   //connections announcing a larger frame are dropped
+#define TCP_ZEROCOPY_MIN_BYTES 65536 //replies this large are sent with MSG_ZEROCOPY, 0 disables
+#define TCP_OUTBOUND_BUDGET 1048576  //unsent reply bytes at which a connection is no longer read
+#define TCP_STALL_TIMEOUT_MS 10000   //connections over their budget this long are disconnected
+#define FRIEND_MERGE_INTERVAL_MS 5000 //how often pending friend edits are folded into the graph
+#define FRIEND_DELTA_LIMIT 65536      //pending friend edits that trigger an early merge
+#define MAILBOX_DIRECTORY "mailbox"  //default location of the mailbox segment files
+#define MAILBOX_SEGMENT_SIZE 67108864 //bytes per memory-mapped mailbox segment
+#define MAILBOX_POLL_TCP_BYTES 262144 //soft limit of messages returned by one poll over TCP
+#define MAILBOX_POLL_UDP_BYTES 1024  //over UDP the whole reply has to fit one datagram
+#define PERSIST_BATCH_SIZE 1000      //documents per bulk write
+#define PERSIST_FLUSH_INTERVAL_MS 100 //longest a mutation waits for its batch to fill
+#define PERSIST_MAX_PENDING 100000    //unflushed documents before submitters block
+#define LONG_POLL_MAX_WAIT_MS 60000   //longest a POLL_MESSAGE may stay parked
+#define LONG_POLL_MAX_PARKED 4        //parked polls per user, further ones are answered at once
 
 #endif
\ No newline at end of file
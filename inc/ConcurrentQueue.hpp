@@ -1,12 +1,22 @@
 /*
-*   A simplified thread-safe queue data structure.
+*   A bounded multi-producer/multi-consumer queue.
+*
+*   Slots follow Dmitry Vyukov's bounded MPMC ring: every slot carries a
+*   sequence number, so producers and consumers only contend on their own
+*   position counter and never take a lock on the fast path. The mutex and
+*   condition variables are only touched when a thread actually has to
+*   sleep, i.e. the queue is empty (consumers) or full (producers).
 */
 
 #ifndef __CONCURRENT_QUEUE_HPP__
 #define __CONCURRENT_QUEUE_HPP__
 
-#include <queue>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
 #include <mutex>
+#include <vector>
 
 namespace common {
 
@@ -14,57 +24,208 @@ template <typename T>
 class ConcurrentQueue {
 
 private:
-  mutable std::mutex _mutex;
-  std::queue<T> _queue;
+  struct Slot {
+    std::atomic<size_t> Sequence;
+    T Value;
+  };
 
-public:
-  ConcurrentQueue() {}
-  ~ConcurrentQueue() {}
+  std::unique_ptr<Slot[]> _slots;
+  size_t _mask;
+
+  alignas(64) std::atomic<size_t> _enqueue_pos {0};
+  alignas(64) std::atomic<size_t> _dequeue_pos {0};
+
+  alignas(64) std::mutex _wait_mutex;
+  std::condition_variable _not_empty;
+  std::condition_variable _not_full;
+  std::atomic<int> _consumers_waiting {0};
+  std::atomic<int> _producers_waiting {0};
 
-  ConcurrentQueue(const ConcurrentQueue &other) {
-    if (this != &other)
+  static size_t RoundUpPowerOfTwo(size_t value) {
+    size_t result = 2;
+    while (result < value)
     {
-      std::lock_guard<std::mutex> guard(other._mutex);
-      _queue = other._queue;
+      result <<= 1;
     }
+    return result;
   }
 
-  ConcurrentQueue &operator=(const ConcurrentQueue &other) {
-    if (this != &other)
+  //Pairs with the waiter counter increment in the blocking calls: either the
+  //sleeper sees our update on its re-check, or we see the sleeper here.
+  void Notify(std::atomic<int> &waiting, std::condition_variable &cv) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiting.load(std::memory_order_relaxed) > 0)
     {
-      std::lock_guard<std::mutex> guard(other._mutex);
-      _queue = other._queue;
+      std::lock_guard<std::mutex> guard(_wait_mutex);
+      cv.notify_all();
     }
-    return *this;
   }
 
-  void Push(const T &t) {
-    std::lock_guard<std::mutex> guard(_mutex);
-    _queue.push(t);
+  template <typename Pred>
+  bool WaitFor(std::atomic<int> &waiting, std::condition_variable &cv, std::chrono::milliseconds timeout, Pred ready) {
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    std::unique_lock<std::mutex> lock(_wait_mutex);
+    waiting.fetch_add(1, std::memory_order_seq_cst);
+    bool result = cv.wait_until(lock, deadline, ready);
+    waiting.fetch_sub(1, std::memory_order_relaxed);
+    return result;
   }
 
-  void Pop() {
-    std::lock_guard<std::mutex> guard(_mutex);
-    if (!_queue.empty())
+  bool Enqueue(T &&t) {
+    Slot *slot;
+    size_t pos = _enqueue_pos.load(std::memory_order_relaxed);
+    while (true)
     {
-      _queue.pop();
+      slot = &_slots[pos & _mask];
+      size_t seq = slot->Sequence.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+      if (diff == 0)
+      {
+        if (_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+        {
+          break;
+        }
+      }
+      else if (diff < 0)
+      {
+        return false;
+      }
+      else
+      {
+        pos = _enqueue_pos.load(std::memory_order_relaxed);
+      }
     }
+
+    slot->Value = std::move(t);
+    slot->Sequence.store(pos + 1, std::memory_order_release);
+    return true;
   }
 
-  bool Empty() const {
-    std::lock_guard<std::mutex> guard(_mutex);
-    return _queue.empty();
+  bool Dequeue(T &t) {
+    Slot *slot;
+    size_t pos = _dequeue_pos.load(std::memory_order_relaxed);
+    while (true)
+    {
+      slot = &_slots[pos & _mask];
+      size_t seq = slot->Sequence.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+      if (diff == 0)
+      {
+        if (_dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+        {
+          break;
+        }
+      }
+      else if (diff < 0)
+      {
+        return false;
+      }
+      else
+      {
+        pos = _dequeue_pos.load(std::memory_order_relaxed);
+      }
+    }
+
+    t = std::move(slot->Value);
+    slot->Value = T();
+    slot->Sequence.store(pos + _mask + 1, std::memory_order_release);
+    return true;
   }
 
-  bool Front(T &t) const {
-    std::lock_guard<std::mutex> guard(_mutex);
-    if (_queue.empty())
+public:
+  explicit ConcurrentQueue(size_t capacity = 65536)
+      : _slots(new Slot[RoundUpPowerOfTwo(capacity)]), _mask(RoundUpPowerOfTwo(capacity) - 1) {
+    for (size_t i = 0; i <= _mask; ++i)
+    {
+      _slots[i].Sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  ~ConcurrentQueue() {}
+
+  ConcurrentQueue(const ConcurrentQueue &other) = delete;
+  ConcurrentQueue &operator=(const ConcurrentQueue &other) = delete;
+
+  //Returns false when the queue is full; that is the backpressure signal
+  bool TryPush(T &&t) {
+    if (!Enqueue(std::move(t)))
     {
       return false;
     }
-    t = _queue.front();
+    Notify(_consumers_waiting, _not_empty);
     return true;
   }
+
+  //Blocks while the queue is full, returns false if still full after timeout.
+  //t is left untouched on failure.
+  bool Push(T &&t, std::chrono::milliseconds timeout) {
+    if (TryPush(std::move(t)))
+    {
+      return true;
+    }
+
+    //the predicate runs under _wait_mutex, so notify only once it is released
+    bool pushed = WaitFor(_producers_waiting, _not_full, timeout, [&] { return Enqueue(std::move(t)); });
+    if (pushed)
+    {
+      Notify(_consumers_waiting, _not_empty);
+    }
+    return pushed;
+  }
+
+  bool TryPop(T &t) {
+    if (!Dequeue(t))
+    {
+      return false;
+    }
+    Notify(_producers_waiting, _not_full);
+    return true;
+  }
+
+  //Blocks while the queue is empty, returns false if nothing arrived before timeout
+  bool Pop(T &t, std::chrono::milliseconds timeout) {
+    if (TryPop(t))
+    {
+      return true;
+    }
+
+    bool popped = WaitFor(_consumers_waiting, _not_empty, timeout, [&] { return Dequeue(t); });
+    if (popped)
+    {
+      Notify(_producers_waiting, _not_full);
+    }
+    return popped;
+  }
+
+  //Waits up to timeout for the first message, then drains up to maxCount
+  //without blocking again. Returns the number of messages appended to out.
+  size_t PopBatch(std::vector<T> &out, size_t maxCount, std::chrono::milliseconds timeout) {
+    size_t count = 0;
+    T t;
+    if (maxCount == 0 || !Pop(t, timeout))
+    {
+      return 0;
+    }
+
+    do
+    {
+      out.push_back(std::move(t));
+      ++count;
+    } while (count < maxCount && TryPop(t));
+
+    return count;
+  }
+
+  //Approximate when other threads are active
+  size_t Size() const {
+    size_t enqueued = _enqueue_pos.load(std::memory_order_relaxed);
+    size_t dequeued = _dequeue_pos.load(std::memory_order_relaxed);
+    return enqueued > dequeued ? enqueued - dequeued : 0;
+  }
+
+  bool Empty() const { return Size() == 0; }
+
+  size_t Capacity() const { return _mask + 1; }
 };
 }
-#endif
\ No newline at end of file
+#endif
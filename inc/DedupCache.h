@@ -0,0 +1,127 @@
+/*
+*   DedupCache remembers recently answered requests by client and request
+*   id, so a retransmit is answered with the first attempt's reply instead
+*   of being executed again.
+*
+*   A request takes part when it carries both a user id and a request id.
+*   Begin registers it as pending before it goes to the workers; the reply
+*   built for it fills the entry in. A retransmit arriving meanwhile is
+*   dropped, the reply is on its way. One arriving later, within the
+*   window, gets the cached reply replayed straight from the network
+*   thread. A pending entry whose reply never came stops holding back
+*   retransmits after the pending timeout, they are executed then. A
+*   request expected to wait longer for its reply, a parked poll, holds
+*   its entry pending until its own deadline instead.
+*
+*   The cache is split into shards, each a fixed array of entries behind
+*   its own mutex with an index by key. Entries are evicted in CLOCK order:
+*   the hand skips an entry replayed since its last pass once, expired and
+*   empty ones are taken at once. Replies over DEDUP_MAX_REPLY_BYTES are
+*   not kept, a retransmit of such a request (a large poll) runs again.
+*
+*   Author: Fu Qiao
+*   Email:  fqiao@protonmail.com
+*
+*/
+
+#ifndef __DEDUP_CACHE_H__
+#define __DEDUP_CACHE_H__
+
+#include "NetworkRequest.h"
+#include "Common.hpp"
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace sobertalk {
+
+class DedupCache final {
+
+public:
+  enum class Outcome {
+
+    MISS,     //first seen, the request goes on to the workers
+
+    PENDING,  //a retransmit of a request still in flight
+
+    HIT       //a retransmit of an answered request, the reply is cached
+  };
+
+  DedupCache(size_t entries = DEDUP_CACHE_ENTRIES, int64_t windowMs = DEDUP_WINDOW_MS,
+             int64_t pendingMs = DEDUP_PENDING_MS);
+
+  DedupCache(const DedupCache& other) = delete;
+  DedupCache& operator=(const DedupCache& other) = delete;
+
+  static bool Applies(const common::NetworkRequest& request) {
+    return request.GetRequestId() != 0 && !request.GetUserId().empty();
+  }
+
+  //Look request up at now (common::Metrics::Now()). On a HIT reply is set to the cached reply.
+  Outcome Begin(const common::NetworkRequest& request, uint64_t now, common::NetworkRequest& reply);
+
+  //Cache reply for the pending request with its user and request id, if there is one
+  void Complete(const common::NetworkRequest& reply, uint64_t now);
+
+  //Keep request's pending entry holding back retransmits at least until until
+  void Hold(const common::NetworkRequest& request, uint64_t until);
+
+  //Drop request's entry, a retransmit runs again
+  void Forget(const common::NetworkRequest& request);
+
+  //Entries pending or cached, expired ones included until they are evicted
+  size_t Size() const;
+
+private:
+  enum class State : uint8_t {
+
+    EMPTY,
+
+    PENDING,
+
+    DONE
+  };
+
+  struct Entry {
+    uint64_t Key {0};
+    std::string UserId;
+    uint64_t RequestId {0};
+    common::NetworkRequest::RequestType Type {common::NetworkRequest::RequestType::UNKNOWN};
+    std::string Result;
+    uint64_t Until {0};  //pending: retransmits are dropped until then; done: replayed until then
+    State Status {State::EMPTY};
+    bool Referenced {false};
+  };
+
+  struct Shard {
+    mutable std::mutex Mutex;
+    std::unordered_map<uint64_t, uint32_t> Index;  //by key, to the entry
+    std::vector<Entry> Entries;
+    uint32_t Hand {0};
+  };
+
+  static constexpr size_t SHARDS = 16;
+
+  static uint64_t KeyOf(const common::NetworkRequest& request);
+
+  Shard& ShardOf(uint64_t key) const { return *_shards[key % _shards.size()]; }
+
+  static bool Matches(const Entry& entry, const common::NetworkRequest& request);
+
+  static bool Expired(const Entry& entry, uint64_t now) { return now > entry.Until; }
+
+  //Free an entry for a new key, by the CLOCK hand
+  uint32_t Evict(Shard& shard, uint64_t now);
+
+  void Release(Shard& shard, Entry& entry);
+
+  std::vector<std::unique_ptr<Shard>> _shards;
+  uint64_t _window_ns;
+  uint64_t _pending_ns;
+};
+}
+
+#endif
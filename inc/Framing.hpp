@@ -0,0 +1,92 @@
+/*
+*   Length-prefixed stream framing shared by both server and client.
+*
+*   Every frame on a TCP stream is a 4 byte big-endian payload length
+*   followed by the payload itself.
+*
+*/
+
+#ifndef __FRAMING_HPP__
+#define __FRAMING_HPP__
+
+#include "ByteRingBuffer.h"
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <string_view>
+
+namespace common {
+
+static const size_t FRAME_HEADER_SIZE = sizeof(uint32_t);
+
+enum class FrameStatus {
+
+  COMPLETE,
+
+  INCOMPLETE,
+
+  OVERSIZED
+};
+
+//Look at the front of buffer for a complete frame. On COMPLETE, payload views
+//the contiguous payload inside buffer; release it with ConsumeFrame once done.
+static inline FrameStatus PeekFrame(ByteRingBuffer &buffer, size_t maxFrameSize, std::string_view &payload) {
+  if (buffer.Size() < FRAME_HEADER_SIZE)
+  {
+    return FrameStatus::INCOMPLETE;
+  }
+
+  uint32_t length;
+  buffer.Peek(&length, FRAME_HEADER_SIZE);
+  length = ntohl(length);
+
+  if (length > maxFrameSize)
+  {
+    return FrameStatus::OVERSIZED;
+  }
+
+  if (buffer.Size() < FRAME_HEADER_SIZE + length)
+  {
+    return FrameStatus::INCOMPLETE;
+  }
+
+  const char *frame = buffer.Linearize(FRAME_HEADER_SIZE + length);
+  payload = std::string_view(frame + FRAME_HEADER_SIZE, length);
+  return FrameStatus::COMPLETE;
+}
+
+static inline void ConsumeFrame(ByteRingBuffer &buffer, const std::string_view &payload) {
+  buffer.Consume(FRAME_HEADER_SIZE + payload.size());
+}
+
+static inline void AppendFrameHeader(std::string &out, size_t payloadLength) {
+  uint32_t length = htonl(static_cast<uint32_t>(payloadLength));
+  out.append(reinterpret_cast<const char *>(&length), FRAME_HEADER_SIZE);
+}
+
+static inline void AppendFrame(std::string &out, const char *payload, size_t payloadLength) {
+  AppendFrameHeader(out, payloadLength);
+  out.append(payload, payloadLength);
+}
+
+static inline void AppendFrame(std::string &out, const std::string &payload) {
+  AppendFrame(out, payload.data(), payload.size());
+}
+
+//Reserve a header for a payload encoded straight into out; returns where the frame starts
+static inline size_t BeginFrame(std::string &out) {
+  size_t start = out.size();
+  out.append(FRAME_HEADER_SIZE, '\0');
+  return start;
+}
+
+//Fill in the header reserved by BeginFrame once the payload has been appended,
+//counting trailing payload bytes that are sent from another buffer
+static inline void EndFrame(std::string &out, size_t start, size_t trailing = 0) {
+  uint32_t length = htonl(static_cast<uint32_t>(out.size() - start - FRAME_HEADER_SIZE + trailing));
+  memcpy(&out[start], &length, FRAME_HEADER_SIZE);
+}
+}
+
+#endif
@@ -0,0 +1,183 @@
+/*
+*   FriendGraph stores the (symmetric) friendships between users, keyed by
+*   the dense user index handed out by UserRegistry.
+*
+*   The bulk of the graph is an immutable CSR snapshot: one offsets array
+*   and one array of sorted neighbour indexes, so all friends of a user are
+*   a contiguous run of integers. Edits go to a small delta buffer, sharded
+*   by user, which readers merge on the fly with the snapshot's run. A
+*   background thread periodically folds the delta into a new snapshot,
+*   publishes it and drops the edits it absorbed.
+*
+*   Presence is kept next to the graph as a bitmap over user indexes, so
+*   iterating the online friends of a user is a scan over sorted integers
+*   testing bits, without touching any UserRecord.
+*
+*   Author: Fu Qiao
+*   Email:  fqiao@protonmail.com
+*
+*/
+
+#ifndef __FRIEND_GRAPH_H__
+#define __FRIEND_GRAPH_H__
+
+#include "Common.hpp"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace sobertalk {
+
+class FriendGraph final {
+
+public:
+  FriendGraph();
+
+  ~FriendGraph();
+
+  FriendGraph(const FriendGraph& other) = delete;
+  FriendGraph& operator=(const FriendGraph& other) = delete;
+
+  //Start and stop the background merge thread
+  void Start();
+
+  void Stop();
+
+  //Returns false if a == b or they already are friends
+  bool Add(uint32_t a, uint32_t b);
+
+  //Returns false if they are not friends
+  bool Remove(uint32_t a, uint32_t b);
+
+  bool AreFriends(uint32_t a, uint32_t b) const;
+
+  //Drop every friendship of user
+  void RemoveAll(uint32_t user);
+
+  //Call visit(friendIndex) for every friend of user, in ascending index order
+  template<typename Visitor>
+  void ForEachFriend(uint32_t user, Visitor&& visit) const;
+
+  template<typename Visitor>
+  void ForEachOnlineFriend(uint32_t user, Visitor&& visit) const;
+
+  void SetOnline(uint32_t user, bool online);
+
+  bool IsOnline(uint32_t user) const;
+
+  //Fold the delta buffer into a new snapshot now
+  void Merge();
+
+private:
+  struct Edit {
+    uint32_t Friend;
+    bool Added;
+    uint64_t Sequence;
+  };
+
+  struct Snapshot {
+    std::vector<uint64_t> Offsets {0};  //Offsets[u]..Offsets[u + 1] is u's run in Neighbors
+    std::vector<uint32_t> Neighbors;
+
+    uint32_t Vertices() const { return static_cast<uint32_t>(Offsets.size() - 1); }
+  };
+
+  struct DeltaShard {
+    mutable std::mutex Mutex;
+    std::unordered_map<uint32_t, std::vector<Edit>> Edits;  //per user, in sequence order
+  };
+
+  static constexpr size_t DELTA_SHARDS = 64;
+  static constexpr size_t ONLINE_CHUNK_BITS = 16;
+  static constexpr size_t ONLINE_CHUNK_WORDS = (size_t(1) << ONLINE_CHUNK_BITS) / 64;
+  static constexpr size_t ONLINE_CHUNKS = 65536;
+
+  DeltaShard& ShardOf(uint32_t user) const { return *_shards[user % _shards.size()]; }
+
+  //Keep only the newest edit per friend, ordered by friend
+  static void Reduce(std::vector<Edit>& edits);
+
+  //Copy user's pending edits, reduced, and then the snapshot they apply to
+  std::shared_ptr<const Snapshot> Load(uint32_t user, std::vector<Edit>& edits) const;
+
+  //Must hold the delta shard of a
+  bool ContainsLocked(uint32_t a, uint32_t b) const;
+
+  //Must hold the delta shard of user
+  void AppendLocked(uint32_t user, uint32_t other, bool added);
+
+  //Lock the delta shards of a and b in a fixed order, then apply the edit to both
+  bool Apply(uint32_t a, uint32_t b, bool added);
+
+  void RunMerger();
+
+  std::shared_ptr<const Snapshot> _snapshot;
+  std::vector<std::unique_ptr<DeltaShard>> _shards;
+  std::atomic<uint64_t> _sequence {0};
+  std::atomic<size_t> _delta_size {0};
+
+  std::mutex _online_mutex;
+  std::unique_ptr<std::atomic<std::atomic<uint64_t>*>[]> _online;
+
+  std::mutex _merge_mutex;
+  std::mutex _wakeup_mutex;
+  std::condition_variable _merger_wakeup;
+  std::atomic<bool> _should_stop {false};
+  std::thread* _merger {NULL};
+};
+
+template<typename Visitor>
+void FriendGraph::ForEachFriend(uint32_t user, Visitor&& visit) const {
+
+  std::vector<Edit> edits;
+  auto snapshot = Load(user, edits);
+
+  const uint32_t* it = nullptr;
+  const uint32_t* end = nullptr;
+  if (user < snapshot->Vertices()) {
+    it = snapshot->Neighbors.data() + snapshot->Offsets[user];
+    end = snapshot->Neighbors.data() + snapshot->Offsets[user + 1];
+  }
+
+  //common case: nothing pending, one sequential pass over the run
+  if (edits.empty()) {
+    for (; it != end; ++it) {
+      visit(*it);
+    }
+    return;
+  }
+
+  auto edit = edits.begin();
+  while (it != end || edit != edits.end()) {
+    if (edit == edits.end() || (it != end && *it < edit->Friend)) {
+      visit(*it++);
+      continue;
+    }
+
+    if (it != end && *it == edit->Friend) {
+      ++it;
+    }
+    if (edit->Added) {
+      visit(edit->Friend);
+    }
+    ++edit;
+  }
+}
+
+template<typename Visitor>
+void FriendGraph::ForEachOnlineFriend(uint32_t user, Visitor&& visit) const {
+  ForEachFriend(user, [this, &visit](uint32_t friendIndex) {
+    if (IsOnline(friendIndex)) {
+      visit(friendIndex);
+    }
+  });
+}
+
+}
+
+#endif
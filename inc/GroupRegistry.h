@@ -0,0 +1,88 @@
+/*
+*   GroupRegistry keeps the members of group conversations.
+*
+*   Groups are keyed by name and hash to one of a fixed number of shards.
+*   A group's members are an immutable, sorted vector of user indexes held
+*   by a shared_ptr: joins and leaves publish a new vector under the shard
+*   lock, a sender only copies the pointer. Fanning a message out to
+*   hundreds of members so never holds a lock nor blocks a join.
+*
+*   Each user's groups are indexed as well, so a deleted user can be taken
+*   out of all of them. Requests of one user are processed in order, so the
+*   two indexes never disagree for long.
+*
+*   Author: Fu Qiao
+*   Email:  fqiao@protonmail.com
+*
+*/
+
+#ifndef __GROUP_REGISTRY_H__
+#define __GROUP_REGISTRY_H__
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace sobertalk {
+
+class GroupRegistry final {
+
+public:
+  using Members = std::vector<uint32_t>;  //user indexes, ascending
+
+  enum class Result {
+
+    OK,
+
+    NOT_FOUND,  //no such group, or the user is not a member
+
+    EXISTS      //the user is a member already
+  };
+
+  explicit GroupRegistry(size_t shards = 64);
+
+  GroupRegistry(const GroupRegistry& other) = delete;
+  GroupRegistry& operator=(const GroupRegistry& other) = delete;
+
+  //Returns false if the group exists already, owner becomes its first member
+  bool Create(const std::string& group, uint32_t owner);
+
+  Result Join(const std::string& group, uint32_t user);
+
+  //The last member leaving removes the group
+  Result Leave(const std::string& group, uint32_t user);
+
+  //Leave every group of user, returns the groups left
+  std::vector<std::string> LeaveAll(uint32_t user);
+
+  //NULL if the group does not exist, the members never change once returned
+  std::shared_ptr<const Members> MembersOf(const std::string& group) const;
+
+private:
+  struct GroupShard {
+    mutable std::mutex Mutex;
+    std::unordered_map<std::string, std::shared_ptr<const Members>> Groups;
+  };
+
+  struct MembershipShard {
+    std::mutex Mutex;
+    std::unordered_map<uint32_t, std::vector<std::string>> Groups;  //by user index
+  };
+
+  GroupShard& GroupShardOf(const std::string& group) const;
+
+  MembershipShard& MembershipShardOf(uint32_t user) const { return *_memberships[user % _memberships.size()]; }
+
+  void AddMembership(uint32_t user, const std::string& group);
+
+  void RemoveMembership(uint32_t user, const std::string& group);
+
+  std::vector<std::unique_ptr<GroupShard>> _groups;
+  std::vector<std::unique_ptr<MembershipShard>> _memberships;
+};
+}
+
+#endif
@@ -0,0 +1,151 @@
+/*
+*   IoUring is a minimal io_uring instance for the socket reactors
+*
+*   It talks to the kernel through the raw io_uring_setup/enter/register
+*   system calls, so no liburing is needed. Next to the submission and
+*   completion rings it registers one provided buffer ring: multishot
+*   receives pick a buffer from it only when data arrives, so idle
+*   connections pin no receive memory. Buffers go back to the kernel with
+*   ReturnBuffer() once their data has been copied out.
+*
+*   Submission entries are only queued by NextSqe() and the Prepare*()
+*   helpers; they reach the kernel together in Submit()/SubmitAndWait(),
+*   one system call for any number of accepts, receives and sends.
+*
+*   Destroying an instance cancels every operation still in the kernel and
+*   waits for their last completions, so the receive buffers and whatever
+*   the caller's sends point to are no longer referenced afterwards.
+*
+*   An instance is used by one thread at a time.
+*
+*   Author: Fu Qiao
+*   Email:  fqiao@protonmail.com
+*
+*/
+
+#ifndef __IO_URING_H__
+#define __IO_URING_H__
+
+#include "Network.hpp"
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <cstdint>
+
+namespace network {
+
+//Socket I/O backend of the TCP reactors, chosen at startup
+enum class IoBackend {
+
+  EPOLL,    //readiness from epoll, one system call per accept, recv and send
+
+  IO_URING  //completions from io_uring, falls back to EPOLL where unsupported
+};
+
+class IoUring final {
+
+public:
+  //Throws SocketException if the kernel refuses the ring or the buffer ring
+  IoUring(unsigned entries, unsigned bufferCount, size_t bufferSize);
+
+  ~IoUring();
+
+  //True if the running kernel offers everything used here: multishot accept
+  //and recv (6.0), provided buffer rings and waiting with a timeout
+  static bool Supported();
+
+  //A cleared submission entry, the queued ones are submitted first if the ring is full
+  struct io_uring_sqe* NextSqe();
+
+  //Every Prepare*() queues one entry, userData comes back in its completions
+  void PrepareMultishotAccept(int listener, uint64_t userData, int flags);
+
+  void PrepareMultishotRecv(int descriptor, uint64_t userData);
+
+  void PrepareSend(int descriptor, const void* data, size_t length, uint64_t userData);
+
+  void PrepareMultishotPoll(int descriptor, uint32_t events, uint64_t userData);
+
+  //Cancel the operations submitted with target as their user data
+  void PrepareCancel(uint64_t target, uint64_t userData);
+
+  //Hand the queued entries to the kernel without waiting
+  void Submit();
+
+  //Hand the queued entries to the kernel and wait for a completion for at most timeoutMs
+  void SubmitAndWait(int timeoutMs);
+
+  //Call handler(const io_uring_cqe&) for every available completion, returns their number
+  template <typename Handler>
+  unsigned Drain(Handler handler) {
+    unsigned head = *_cq_head;
+    unsigned tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+    unsigned count = tail - head;
+    for (; head != tail; ++head) {
+      const struct io_uring_cqe& cqe = _cqes[head & _cq_mask];
+      if (!(cqe.flags & IORING_CQE_F_MORE)) {
+        --_in_flight;
+      }
+      handler(cqe);
+    }
+    __atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+    return count;
+  }
+
+  //Buffer picked by a completion carrying IORING_CQE_F_BUFFER
+  static uint16_t BufferId(const struct io_uring_cqe& cqe) { return cqe.flags >> IORING_CQE_BUFFER_SHIFT; }
+
+  const char* Buffer(uint16_t id) const { return _buffers + static_cast<size_t>(id) * _buffer_size; }
+
+  void ReturnBuffer(uint16_t id);
+
+  IoUring(const IoUring& other) = delete;
+  IoUring& operator=(const IoUring& other) = delete;
+
+private:
+  static constexpr uint16_t BUFFER_GROUP = 0;
+
+  void MapRings(const struct io_uring_params& params);
+
+  void RegisterBuffers(unsigned bufferCount);
+
+  //Returns false if the kernel could not take the entries yet
+  bool Enter(unsigned minComplete, int timeoutMs);
+
+  //Cancel everything in flight and wait for it, false if the kernel did not let go in time
+  bool CancelAll();
+
+  void Release();
+
+  int _ring_fd {-1};
+
+  void* _sq_ring {nullptr};
+  size_t _sq_ring_size {0};
+  void* _cq_ring {nullptr};
+  size_t _cq_ring_size {0};
+  struct io_uring_sqe* _sqes {nullptr};
+  size_t _sqes_size {0};
+
+  unsigned* _sq_head {nullptr};
+  unsigned* _sq_tail {nullptr};
+  unsigned _sq_mask {0};
+  unsigned _sq_entries {0};
+  unsigned _sq_local_tail {0};  //entries up to here are queued, *_sq_tail is what the kernel sees
+  unsigned _in_flight {0};      //queued or submitted operations whose last completion is not drained yet
+
+  unsigned* _cq_head {nullptr};
+  unsigned* _cq_tail {nullptr};
+  unsigned _cq_mask {0};
+  struct io_uring_cqe* _cqes {nullptr};
+
+  //io_uring_buf_ring declares its entries in a way that C++ lays out differently from C,
+  //so the ring is addressed as a plain array whose first entry overlays the tail
+  struct io_uring_buf* _buffer_ring {nullptr};
+  size_t _buffer_ring_size {0};
+  unsigned _buffer_mask {0};
+  unsigned _buffer_tail {0};
+  char* _buffers {nullptr};
+  size_t _buffer_size;
+};
+}
+
+#endif
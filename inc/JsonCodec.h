@@ -0,0 +1,58 @@
+/*
+*   JsonCodec reads and writes the JSON documents of NetworkRequest in a
+*   single pass, without building a boost::property_tree.
+*
+*   The writer produces byte for byte what write_json produced before: the
+*   keys in the order request_type, parameters, user_id, every value quoted,
+*   '/' escaped, bytes from 0x80 on copied as they are, one trailing newline.
+*   A request id, where there is one, follows the user id.
+*
+*   The reader scans the document in place and decodes the four fields
+*   straight into their strings. It only takes the shape clients actually
+*   send: an object of string or plain integer values, with simple escapes
+*   and valid UTF-8. Anything else (\u escapes, nested values, duplicated
+*   fields, malformed input) makes it return false, and the caller hands the
+*   document to the general parser, which also reports the errors. Plain
+*   runs of text are skipped 16 bytes at a time with SSE2 where available.
+*
+*   Author: Fu Qiao
+*   Email:  fqiao@protonmail.com
+*
+*/
+
+#ifndef __JSON_CODEC_H__
+#define __JSON_CODEC_H__
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace common {
+
+struct JsonRequestFields {
+
+  int Type {0};
+  std::string Parameters;
+  std::string UserId;
+  uint64_t RequestId {0};
+};
+
+//Parse a request document, false if it needs the general parser. Never throws.
+bool ParseJsonRequest(std::string_view document, JsonRequestFields& fields);
+
+//Append a request document, user id left out when empty and request id when 0
+void AppendJsonRequest(std::string& out, int type, std::string_view parameters, std::string_view userId,
+                       uint64_t requestId);
+
+//The same document in two parts, cut inside the parameters: the head with the
+//parameters' beginning, and the tail with their rest and everything after them
+void AppendJsonRequestHead(std::string& out, int type, std::string_view parameters);
+
+void AppendJsonRequestTail(std::string& out, std::string_view parameters, std::string_view userId,
+                           uint64_t requestId);
+
+//Append value escaped like write_json, without the quotes
+void AppendJsonEscaped(std::string& out, std::string_view value);
+}
+
+#endif
@@ -0,0 +1,166 @@
+/*
+*   MailboxStore keeps every user's inbox in append-only, memory-mapped
+*   segment files.
+*
+*   All messages, whatever their recipient, are appended one after the other
+*   to the active segment; once it is full a new one is started. Each user
+*   has an in-memory index of (sequence, segment, offset) entries, so a poll
+*   never scans the segments. A poll carries the client's cursor, the last
+*   sequence it has received: entries up to the cursor are dropped from the
+*   index, everything after it is copied into one reply buffer. A segment
+*   counts the index entries still pointing into it; a background thread
+*   deletes full segments once that count reaches zero and periodically
+*   schedules dirty pages for write-back.
+*
+*   A message sent to many recipients at once is stored once: a body record
+*   without recipient, followed in the same segment by one small reference
+*   record per recipient carrying its sequence and the body's offset. Their
+*   index entries all point at the body.
+*
+*   On startup the existing segments are replayed to rebuild the index.
+*   Acknowledged cursors are not persisted, so after a restart clients get
+*   everything past the cursor they poll with, i.e. delivery is at-least-once.
+*   A user's sequences must keep rising across restarts, or new messages
+*   would fall below a cursor the client already holds and be dropped
+*   unread. Before a segment is deleted, every user appearing in it whose
+*   inbox is empty has its last sequence appended to a small sequence file
+*   beside the segments, synced first; startup reads it before the
+*   segments. A user is only written again once its sequence moved, and the
+*   file is rewritten once it holds twice as many records as users.
+*
+*   Author: Fu Qiao
+*   Email:  fqiao@protonmail.com
+*
+*/
+
+#ifndef __MAILBOX_STORE_H__
+#define __MAILBOX_STORE_H__
+
+#include "Common.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace sobertalk {
+
+class MailboxStore final {
+
+public:
+  MailboxStore(const std::string& directory, size_t segmentSize = MAILBOX_SEGMENT_SIZE);
+
+  ~MailboxStore();
+
+  MailboxStore(const MailboxStore& other) = delete;
+  MailboxStore& operator=(const MailboxStore& other) = delete;
+
+  //Replay existing segments and start the background maintenance thread
+  void Start();
+
+  void Stop();
+
+  //Append body to recipient's inbox and return its per-recipient sequence
+  //number. Throws std::invalid_argument if the message can never fit a segment.
+  uint64_t Append(const std::string& recipient, const std::string& sender, const std::string& body);
+
+  //Append body once for all recipients, each gets a sequence of its own in
+  //sequences, in recipient order. Throws like Append().
+  void AppendShared(const std::vector<std::string>& recipients, const std::string& sender, const std::string& body,
+                    std::vector<uint64_t>& sequences);
+
+  /*
+    Acknowledge everything up to cursor and append the messages after it to out,
+    stopping once maxBytes is exceeded (at least one message is always returned).
+    Each message is encoded as
+
+        <sequence>,<sender length>,<body length>\n<sender><body>
+
+    Returns the number of messages appended.
+  */
+  size_t Poll(const std::string& user, uint64_t cursor, std::string& out, size_t maxBytes);
+
+  //Sequence of the newest message in user's inbox, 0 if it never received any
+  uint64_t LastSequence(const std::string& user);
+
+private:
+  struct Segment {
+    Segment(uint64_t id, const std::string& path, size_t size, bool create);
+    ~Segment();
+
+    const uint64_t Id;
+    const std::string Path;
+    const size_t Size;
+    char* Data {nullptr};
+    size_t Tail {0};
+    bool Sealed {false};
+    std::atomic<size_t> Live {0};
+  };
+
+  struct Entry {
+    uint64_t Sequence;
+    Segment* Owner;
+    size_t Offset;  //of the record holding the body
+  };
+
+  struct Mailbox {
+    std::mutex Mutex;
+    uint64_t LastSequence {0};
+    std::deque<Entry> Entries;
+  };
+
+  struct MailboxShard {
+    std::mutex Mutex;
+    std::unordered_map<std::string, std::unique_ptr<Mailbox>> Mailboxes;
+  };
+
+  Mailbox& MailboxOf(const std::string& user);
+
+  void Recover();
+
+  //Must hold _append_mutex
+  Segment& Roll();
+
+  //Append to out the sequence record of user, unless a record of its inbox
+  //still carries its last sequence or the sequence file already has it
+  void Retire(const std::string& user, std::string& out);
+
+  //Read the sequence file into _retired, then rewrite it without stale or torn records
+  void RecoverSequences();
+
+  //Replace the sequence file by one record per user of _retired, false on failure
+  bool CompactSequences();
+
+  void Maintain();
+
+  std::string SegmentPath(uint64_t id) const;
+
+  std::string SequencePath() const;
+
+  const std::string _directory;
+  const size_t _segment_size;
+
+  std::mutex _append_mutex;
+  std::map<uint64_t, std::unique_ptr<Segment>> _segments;
+  Segment* _active {nullptr};
+
+  std::vector<std::unique_ptr<MailboxShard>> _shards;
+
+  //Only touched by Recover() and the maintenance thread
+  std::unordered_map<std::string, uint64_t> _retired;  //last sequence of each user in the sequence file
+  size_t _retired_records {0};                         //records in the file, stale ones included
+  int _sequence_fd {-1};                               //the file, opened for appending
+
+  std::mutex _maintenance_mutex;
+  std::condition_variable _maintenance_wakeup;
+  std::atomic<bool> _should_stop {false};
+  std::thread* _maintenance {NULL};
+};
+}
+
+#endif
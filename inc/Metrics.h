@@ -0,0 +1,259 @@
+/*
+*   Metrics collects the server's latency histograms and counters.
+*
+*   A request passes the stages parse -> queue_in -> process -> queue_out
+*   -> send; total spans from the read that completed the request to the
+*   write of its reply. Every stage keeps one latency histogram per request
+*   type.
+*
+*   Histograms are HDR-style: values below 16ns get a bucket each, above
+*   that every power of two is split into 16 linear sub-buckets, so a
+*   recorded latency is off by at most 1/16 of its value. Recording is a
+*   bucket lookup and three relaxed stores.
+*
+*   Every thread records into a block of its own. The blocks are never
+*   written by another thread, so recording takes no lock and no atomic
+*   read-modify-write. Snapshot() sums the blocks of all threads and reads
+*   the registered gauges. Blocks of finished threads stay registered, so
+*   their counts remain in the totals.
+*
+*   Author: Fu Qiao
+*   Email:  fqiao@protonmail.com
+*
+*/
+
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace common {
+
+enum class Stage : uint8_t {
+
+  PARSE,      //decoding a received frame or datagram
+
+  QUEUE_IN,   //waiting in the intake queues for a worker
+
+  PROCESS,    //running the request handler
+
+  QUEUE_OUT,  //waiting in the outbound queues for the network thread
+
+  SEND,       //handing the reply to its reactor, encoding and writing it
+
+  TOTAL,      //from the read that completed the request to the write of its reply
+
+  COUNT
+};
+
+enum class Counter : uint8_t {
+
+  BYTES_RECEIVED,
+
+  BYTES_SENT,
+
+  RECEIVE_CALLS,    //recv, recvfrom and recvmmsg, or io_uring receive completions
+
+  SEND_CALLS,       //send, sendto and sendmmsg, or io_uring send completions
+
+  ACCEPT_CALLS,
+
+  POLL_CALLS,       //epoll_wait
+
+  RING_ENTERS,      //io_uring_enter, each submits and reaps any number of operations
+
+  WOULD_BLOCK,      //socket calls answered with EAGAIN
+
+  SOCKET_ERRORS,
+
+  REQUESTS_DROPPED, //requests lost to a full intake queue or worker shards
+
+  REPLIES_DROPPED,  //replies lost to a full outbound queue
+
+  CONNECTIONS_THROTTLED, //connections that stopped being read for exceeding their outbound budget
+
+  CONNECTIONS_EVICTED,   //throttled connections closed for not draining
+
+  REQUESTS_SHED,    //requests answered busy by the overload control
+
+  REQUESTS_LIMITED, //requests dropped for exceeding their source's rate limit
+
+  CONNECTIONS_LIMITED, //connections closed right after accept for the same reason
+
+  REQUESTS_DEDUPLICATED, //retransmits answered from the dedup cache or dropped while in flight
+
+  COUNT
+};
+
+//Single writer histogram, readable from any thread while it is written
+class LatencyHistogram final {
+
+public:
+  static constexpr int SUB_BUCKET_BITS = 4;
+  static constexpr int MAX_EXPONENT = 36;  //larger values (over a minute) land in the last bucket
+  static constexpr size_t SUB_BUCKETS = size_t(1) << SUB_BUCKET_BITS;
+  static constexpr size_t BUCKETS = (MAX_EXPONENT - SUB_BUCKET_BITS + 2) * SUB_BUCKETS;
+
+  static size_t BucketOf(uint64_t value) {
+    if (value < SUB_BUCKETS) {
+      return value;
+    }
+    int exponent = 63 - __builtin_clzll(value);
+    if (exponent > MAX_EXPONENT) {
+      return BUCKETS - 1;
+    }
+    int shift = exponent - SUB_BUCKET_BITS;
+    return (shift + 1) * SUB_BUCKETS + ((value >> shift) & (SUB_BUCKETS - 1));
+  }
+
+  //Largest value falling into bucket
+  static uint64_t BucketLimit(size_t bucket) {
+    if (bucket < SUB_BUCKETS) {
+      return bucket;
+    }
+    int shift = bucket / SUB_BUCKETS - 1;
+    return ((SUB_BUCKETS + bucket % SUB_BUCKETS + 1) << shift) - 1;
+  }
+
+  void Record(uint64_t value) {
+    Bump(_buckets[BucketOf(value)], 1);
+    Bump(_count, 1);
+    Bump(_sum, value);
+    if (value > _max.load(std::memory_order_relaxed)) {
+      _max.store(value, std::memory_order_relaxed);
+    }
+  }
+
+  uint64_t Count() const { return _count.load(std::memory_order_relaxed); }
+
+private:
+  friend class HistogramSnapshot;
+
+  //only the owning thread writes, so a plain load and store suffice
+  static void Bump(std::atomic<uint64_t>& cell, uint64_t value) {
+    cell.store(cell.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+  }
+
+  std::atomic<uint64_t> _buckets[BUCKETS] {};
+  std::atomic<uint64_t> _count {0};
+  std::atomic<uint64_t> _sum {0};
+  std::atomic<uint64_t> _max {0};
+};
+
+//Sum of histograms taken by the reader
+class HistogramSnapshot final {
+
+public:
+  HistogramSnapshot() : _buckets(LatencyHistogram::BUCKETS, 0) {}
+
+  void Add(const LatencyHistogram& histogram);
+
+  uint64_t Count() const { return _count; }
+  uint64_t Max() const { return _max; }
+  double Mean() const { return _count == 0 ? 0 : static_cast<double>(_sum) / _count; }
+
+  //Upper bound of the bucket holding the given percentile, percentile in [0, 100]
+  uint64_t Percentile(double percentile) const;
+
+private:
+  std::vector<uint64_t> _buckets;
+  uint64_t _count {0};
+  uint64_t _sum {0};
+  uint64_t _max {0};
+};
+
+class Metrics final {
+
+public:
+  //request types 0 .. REQUEST_TYPES - 1 are told apart, larger ones count as 0 (UNKNOWN)
+  static constexpr size_t REQUEST_TYPES = 16;
+  static constexpr size_t STAGES = static_cast<size_t>(Stage::COUNT);
+  static constexpr size_t COUNTERS = static_cast<size_t>(Counter::COUNT);
+
+  //Name of a request type in snapshots, e.g. "push_message"
+  static std::string TypeName(size_t type);
+
+  static Metrics& Instance() {
+    //intentionally leaked: threads may record while static objects are destroyed
+    static Metrics* metrics = new Metrics();
+    return *metrics;
+  }
+
+  //Monotonic timestamp in nanoseconds, the unit of every recorded latency
+  static uint64_t Now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  static void Record(Stage stage, int requestType, uint64_t latencyNs) {
+    Local().Histogram(stage, requestType).Record(latencyNs);
+  }
+
+  //Record the time from start to end, a start of 0 means it was never taken
+  static void RecordSince(Stage stage, int requestType, uint64_t start, uint64_t end) {
+    if (start != 0 && end >= start) {
+      Record(stage, requestType, end - start);
+    }
+  }
+
+  static void Count(Counter counter, uint64_t value = 1) {
+    std::atomic<uint64_t>& cell = Local().Counters[static_cast<size_t>(counter)];
+    cell.store(cell.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+  }
+
+  //read is called by Snapshot() from any thread until the gauge is unregistered
+  void RegisterGauge(const std::string& name, std::function<int64_t()> read);
+  void UnregisterGauge(const std::string& name);
+
+  //Plain text, one metric per line:
+  //  uptime_ms <ms>
+  //  gauge <name> <value>
+  //  counter <name> <value>
+  //  latency <stage> <request type> count <n> mean_us <x> p50_us <x> p99_us <x> p999_us <x> max_us <x>
+  std::string Snapshot();
+
+  Metrics(const Metrics& other) = delete;
+  Metrics& operator=(const Metrics& other) = delete;
+
+private:
+  struct ThreadBlock {
+    //histograms are created on first use, most stage and type pairs never occur on a given thread
+    std::atomic<LatencyHistogram*> Histograms[STAGES][REQUEST_TYPES] {};
+    std::atomic<uint64_t> Counters[COUNTERS] {};
+
+    LatencyHistogram& Histogram(Stage stage, int requestType) {
+      size_t type = requestType >= 0 && static_cast<size_t>(requestType) < REQUEST_TYPES ? requestType : 0;
+      auto& slot = Histograms[static_cast<size_t>(stage)][type];
+      LatencyHistogram* histogram = slot.load(std::memory_order_relaxed);
+      if (histogram == nullptr) {
+        histogram = new LatencyHistogram();
+        slot.store(histogram, std::memory_order_release);
+      }
+      return *histogram;
+    }
+  };
+
+  Metrics();
+
+  static ThreadBlock& Local() {
+    static thread_local ThreadBlock* block = Instance().Register();
+    return *block;
+  }
+
+  ThreadBlock* Register();
+
+  std::mutex _mutex;
+  std::vector<ThreadBlock*> _blocks;
+  std::map<std::string, std::function<int64_t()>> _gauges;
+  const uint64_t _started;
+};
+}
+
+#endif
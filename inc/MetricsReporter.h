@@ -0,0 +1,61 @@
+/*
+*   MetricsReporter publishes common::Metrics snapshots outside the server.
+*
+*   The admin port listens on the loopback interface only. Every connection
+*   gets one snapshot and is closed, so `nc localhost 8518` or `curl
+*   localhost:8518` both work; a client opening with "GET " is answered
+*   with an HTTP/1.0 header first. Optionally the snapshot is also written
+*   to a file every interval and once more on Stop(). The file is replaced
+*   atomically, so readers never see a partial snapshot.
+*
+*   Author: Fu Qiao
+*   Email:  fqiao@protonmail.com
+*
+*/
+
+#ifndef __METRICS_REPORTER_H__
+#define __METRICS_REPORTER_H__
+
+#include "Common.hpp"
+#include "Network.hpp"
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+
+namespace sobertalk {
+
+class MetricsReporter final {
+
+public:
+  //adminPort 0 disables the admin port, an empty dumpPath the periodic dumps.
+  //Throws network::SocketException if the admin port cannot be bound.
+  MetricsReporter(uint16_t adminPort, const std::string& dumpPath, int dumpIntervalMs = STATS_DUMP_INTERVAL_MS);
+
+  ~MetricsReporter();
+
+  MetricsReporter(const MetricsReporter& other) = delete;
+  MetricsReporter& operator=(const MetricsReporter& other) = delete;
+
+  void Start();
+
+  void Stop();
+
+private:
+  void Run();
+
+  //Answer every connection waiting on the admin port
+  void Serve();
+
+  void Dump();
+
+  std::unique_ptr<network::TcpSocket> _listener;
+  const std::string _dump_path;
+  const int _dump_interval_ms;
+
+  std::atomic<bool> _should_stop {false};
+  std::thread* _reporter {NULL};
+};
+}
+
+#endif
@@ -0,0 +1,42 @@
+/*
+*   MongoPersistenceSink writes each batch of the write-behind pipeline with
+*   one unordered bulk_write per collection: upserts become replace_one with
+*   upsert, removals delete_one, both filtered on _id. Batches are coalesced
+*   upstream, so a document occurs at most once per batch and the order of
+*   operations does not matter.
+*
+*   Only compiled when libmongocxx is available (HAVE_MONGOCXX). The client
+*   is used by the pipeline's flusher thread alone.
+*
+*   Author: Fu Qiao
+*   Email:  fqiao@protonmail.com
+*
+*/
+
+#ifndef __MONGO_PERSISTENCE_SINK_H__
+#define __MONGO_PERSISTENCE_SINK_H__
+
+#ifdef HAVE_MONGOCXX
+
+#include "PersistenceSink.h"
+#include <mongocxx/client.hpp>
+
+namespace sobertalk {
+
+class MongoPersistenceSink final : public PersistenceSink {
+
+public:
+  //The database is taken from the URI, "sobertalk" if it names none
+  explicit MongoPersistenceSink(const std::string& uri);
+
+  void Write(const std::vector<Mutation>& batch) override;
+
+private:
+  mongocxx::client _client;
+  std::string _database;
+};
+}
+
+#endif
+
+#endif
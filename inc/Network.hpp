@@ -17,6 +17,11 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <netdb.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <netinet/ip.h>
+#include <linux/errqueue.h>
 
 #include <stdlib.h>
 #include <errno.h>
@@ -24,6 +29,7 @@
 #include <string.h>
 #include <string>
 #include <sstream>
+#include <memory>
 
 namespace network {
 
@@ -38,8 +44,49 @@ namespace network {
     const char *what() { return _message.c_str(); }
   };
 
+  //What a socket call reported to the socket hook was
+  enum class SocketCall {
+
+    SEND,    //send, sendmsg, sendto and sendmmsg, with the bytes sent
+
+    RECEIVE, //recv, recvfrom and recvmmsg, with the bytes received
+
+    ACCEPT,
+
+    POLL,    //epoll_wait, with the number of ready descriptors
+
+    RING_ENTER, //io_uring_enter, with its result
+
+    ERROR    //a call that raised a SocketException
+  };
+
+  //Optional observer of socket calls, e.g. to count them. It gets the call and the result of
+  //the system call, -1 with errno set on failure. Install it before any socket is in use;
+  //none is installed by default.
+  typedef void (*SocketHook)(SocketCall call, ssize_t result);
+
+  inline SocketHook &InstalledSocketHook() {
+    static SocketHook hook = NULL;
+    return hook;
+  }
+
+  static inline void SetSocketHook(SocketHook hook) {
+    InstalledSocketHook() = hook;
+  }
+
+  static inline void NotifySocketHook(SocketCall call, ssize_t result) {
+    SocketHook hook = InstalledSocketHook();
+    if (hook != NULL)
+    {
+      int error = errno;
+      hook(call, result);
+      errno = error;
+    }
+  }
+
     //Throw socket related exceptions and expose details about errno.
   static inline std::string RaiseSocketException(const char *customMessage) {
+    NotifySocketHook(SocketCall::ERROR, -1);
     std::stringstream ss;
     ss << customMessage << " " << strerror(errno);
     throw SocketException(ss.str());
@@ -61,6 +108,15 @@ namespace network {
     }
   }
 
+  //A remote address kept by value, e.g. the sender of a datagram we reply to
+  struct Endpoint {
+    struct sockaddr_storage Storage;
+    socklen_t Length {0};
+
+    const struct sockaddr *Get() const { return (const struct sockaddr *)&Storage; }
+    bool Empty() const { return Length == 0; }
+  };
+
     /*
     Interface for socket system call is:
 
@@ -79,35 +135,65 @@ namespace network {
     Socket(const Socket &other);
     Socket &operator=(const Socket &other);
 
-    void SaveSockAddr(const struct sockaddr *raw_sockaddr) {
-      if (_sockaddr != NULL)
+    //The address is kept inline, large enough for IPv6, so no socket allocates besides itself
+    void SaveSockAddr(const struct sockaddr *raw_sockaddr, socklen_t length) {
+      if (length > sizeof(_address))
       {
-        memset(_sockaddr, 0, sizeof(struct sockaddr));
+        length = sizeof(_address);
       }
-      else
+      memcpy(&_address, raw_sockaddr, length);
+      _addrlen = length;
+    }
+
+  public:
+    //Switch O_NONBLOCK on the descriptor, required by anything driven from a Reactor
+    void SetBlocking(bool block) {
+      int flags = fcntl(_descriptor, F_GETFL, 0);
+      if (flags == -1)
       {
-        _sockaddr = (struct sockaddr *)malloc(sizeof(struct sockaddr));
-        if (_sockaddr == NULL)
-        {
-          RaiseSocketException("Error when saving sockaddr: ");
-        }
+        RaiseSocketException("Error when fcntl(F_GETFL): ");
+      }
+
+      flags = block ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK);
+      if (fcntl(_descriptor, F_SETFL, flags) == -1)
+      {
+        RaiseSocketException("Error when fcntl(F_SETFL): ");
+      }
+    }
+
+    //Bounds blocking receives so that receive loops can observe a stop flag
+    void SetReceiveTimeout(int milliseconds) {
+      struct timeval tv;
+      tv.tv_sec = milliseconds / 1000;
+      tv.tv_usec = (milliseconds % 1000) * 1000;
+      if (setsockopt(_descriptor, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1)
+      {
+        RaiseSocketException("Error when setsockopt(SO_RCVTIMEO): ");
       }
-      memcpy(_sockaddr, raw_sockaddr, sizeof(struct sockaddr));
     }
 
-  public:
     int Descriptor() const { return _descriptor; }
     int Family() const { return _family; }
+    //The peer of an accepted socket, the address the socket was made with otherwise
+    const struct sockaddr *RawAddress() const { return (const struct sockaddr *)&_address; }
     int Type() const { return _type; }
     std::string Address() const { return _ip_address; }
     uint16_t Port() const { return _port; }
 
   protected:
     int _descriptor;
-    struct sockaddr *_sockaddr;
-    socklen_t _addrlen;
+    struct sockaddr_storage _address;
+    socklen_t _addrlen {0};
+
+    struct sockaddr *SockAddr() { return (struct sockaddr *)&_address; }
 
-    Socket(const char *address, uint16_t port, int stype, bool block = true) : _port(port) {
+    //A NULL address binds every local address, otherwise the socket is bound to
+    //address only with bindAddress and is left for Connect/SendTo without it.
+    //reusePort sets SO_REUSEPORT so several sockets can bind the same port and
+    //let the kernel spread incoming connections/datagrams across them.
+    //With block == false the socket is created non-blocking
+    Socket(const char *address, uint16_t port, int stype, bool block = true, bool reusePort = false, bool bindAddress = false)
+        : _type(stype), _port(port), _descriptor(-1) {
 
       struct addrinfo hints, *result, *p;
 
@@ -129,7 +215,7 @@ namespace network {
       char _ip_addr_str[INET6_ADDRSTRLEN];
       for (p = result; p != NULL; p = p->ai_next)
       {
-        if ((sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
+        if ((sockfd = socket(p->ai_family, p->ai_socktype | (block ? 0 : SOCK_NONBLOCK), p->ai_protocol)) == -1)
         {
           continue;
         }
@@ -139,8 +225,13 @@ namespace network {
           RaiseSocketException("Error when setsockopt: ");
         }
 
+        if (reusePort && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1)
+        {
+          RaiseSocketException("Error when setsockopt(SO_REUSEPORT): ");
+        }
+
         _descriptor = sockfd;
-        if (address == NULL)
+        if (address == NULL || bindAddress)
         { //auto bind if using local host
           if (bind(_descriptor, p->ai_addr, p->ai_addrlen) == -1)
           {
@@ -149,10 +240,9 @@ namespace network {
         }
 
         ParseSockAddr(p->ai_addr, _ip_addr_str, &_port);
-        SaveSockAddr(p->ai_addr);
+        SaveSockAddr(p->ai_addr, p->ai_addrlen);
         _ip_address = _ip_addr_str;
         _family = p->ai_family;
-        _addrlen = p->ai_addrlen;
 
         break;
       }
@@ -162,28 +252,21 @@ namespace network {
 
     //Used by Accept only
     Socket(int descriptor, const struct sockaddr *raw_sockaddr, int stype = SOCK_STREAM)
-        : _descriptor(descriptor), _type(stype) {
+        : _type(stype), _descriptor(descriptor) {
 
       char _ip_addr_str[INET6_ADDRSTRLEN];
       ParseSockAddr(raw_sockaddr, _ip_addr_str, &_port);
       _ip_address = _ip_addr_str;
       _family = raw_sockaddr->sa_family;
-      _addrlen = _family == AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
-      SaveSockAddr(raw_sockaddr);
+      SaveSockAddr(raw_sockaddr, _family == AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6));
     }
 
-    ~Socket() {
+    virtual ~Socket() {
       if (_descriptor != -1)
       {
         close(_descriptor);
         _descriptor = -1;
       }
-
-      if (_sockaddr != NULL)
-      {
-        free(_sockaddr);
-        _sockaddr = NULL;
-      }
     }
   };
 
@@ -192,33 +275,65 @@ namespace network {
   public:
     static CommunicationSocket *Connect(const char *remoteAddr, uint16_t remotePort, int stype = SOCK_STREAM) {
       CommunicationSocket *sock = new CommunicationSocket(remoteAddr, remotePort, stype);
-      if (connect(sock->_descriptor, sock->_sockaddr, sock->_addrlen) == -1)
+      if (connect(sock->_descriptor, sock->SockAddr(), sock->_addrlen) == -1)
       {
+        int error = errno;
+        delete sock;
+        errno = error;
         RaiseSocketException("Error when connect: ");
       }
 
       return sock;
     }
 
-  protected:
-    CommunicationSocket(const char *addr, uint16_t port, int stype, bool block = true)
-        : Socket(addr, port, stype, block) {}
-
+    //Public so the caller of Connect() owns the socket it gets
     ~CommunicationSocket() {}
 
+  protected:
+    CommunicationSocket(const char *addr, uint16_t port, int stype, bool block = true, bool reusePort = false,
+                        bool bindAddress = false)
+        : Socket(addr, port, stype, block, reusePort, bindAddress) {}
+
     CommunicationSocket(const CommunicationSocket &other) = delete;
     CommunicationSocket &operator=(const CommunicationSocket &other) = delete;
 
   public:
+    //Returns -1 instead of throwing when a non-blocking socket would block
     int Send(const void *buffer, int bufferLen) {
-      int sent;
-      if ((sent = send(_descriptor, buffer, bufferLen, 0)) == -1)
+      int sent = send(_descriptor, buffer, bufferLen, MSG_NOSIGNAL);
+      NotifySocketHook(SocketCall::SEND, sent);
+      if (sent == -1)
       {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+          return -1;
+        }
         RaiseSocketException("Error when send: ");
       }
       return sent;
     }
 
+    //Gathers count buffers into one sendmsg; flags (e.g. MSG_MORE, MSG_ZEROCOPY) are added to MSG_NOSIGNAL.
+    //Returns -1 instead of throwing when a non-blocking socket would block
+    ssize_t SendMessage(const struct iovec *buffers, int count, int flags = 0) {
+      struct msghdr message;
+      memset(&message, 0, sizeof(message));
+      message.msg_iov = const_cast<struct iovec *>(buffers);
+      message.msg_iovlen = count;
+
+      ssize_t sent = sendmsg(_descriptor, &message, MSG_NOSIGNAL | flags);
+      NotifySocketHook(SocketCall::SEND, sent);
+      if (sent == -1)
+      {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+          return -1;
+        }
+        RaiseSocketException("Error when sendmsg: ");
+      }
+      return sent;
+    }
+
     //send all data in buffer and return true on success, otherwise false
     bool SendAll(const char *buffer, int bufferLen) {
       int sent = 0;
@@ -227,6 +342,10 @@ namespace network {
       while (sent < bufferLen)
       {
         int _n = Send(buffer + sent, left);
+        if (_n == -1)
+        {
+          break;
+        }
         sent += _n;
         left -= _n;
       }
@@ -234,15 +353,25 @@ namespace network {
       return sent == bufferLen ? true : false;
     }
 
+    //Returns -1 instead of throwing when a non-blocking socket would block
     int Recv(void *buffer, int bufferLen) {
       int _recv = recv(_descriptor, buffer, bufferLen, 0);
+      NotifySocketHook(SocketCall::RECEIVE, _recv);
       if (_recv == -1)
       {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+          return -1;
+        }
         RaiseSocketException("Error when recv: ");
       }
       return _recv;
     }
 
+    void Shutdown(int how = SHUT_RDWR) {
+      shutdown(_descriptor, how);
+    }
+
   protected:
     CommunicationSocket(int descriptor, const struct sockaddr *raw_sockaddr, int stype)
         : Socket(descriptor, raw_sockaddr, stype) {
@@ -252,8 +381,8 @@ namespace network {
   class TcpSocket : public CommunicationSocket {
 
   public:
-    TcpSocket(const char *address, uint16_t port, bool block = true)
-        : CommunicationSocket(address, port, SOCK_STREAM, block) {
+    TcpSocket(const char *address, uint16_t port, bool block = true, bool reusePort = false, bool bindAddress = false)
+        : CommunicationSocket(address, port, SOCK_STREAM, block, reusePort, bindAddress) {
     }
 
     ~TcpSocket() {}
@@ -261,6 +390,61 @@ namespace network {
     TcpSocket(const TcpSocket &other) = delete;
     TcpSocket &operator=(const TcpSocket &other) = delete;
 
+    //Allow MSG_ZEROCOPY sends, returns false if the kernel does not support them
+    bool EnableZeroCopy() {
+      int yes = 1;
+      return setsockopt(_descriptor, SOL_SOCKET, SO_ZEROCOPY, &yes, sizeof(yes)) == 0;
+    }
+
+    //Hand every MSG_ZEROCOPY completion queued on the socket to completed(first, last), the
+    //inclusive range of zero-copy send calls whose buffers the kernel has released.
+    //Returns false if the socket has failed.
+    template <typename Completed>
+    bool ReapZeroCopy(Completed completed) {
+      while (true)
+      {
+        char control[128];
+        struct msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        if (recvmsg(_descriptor, &message, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+        {
+          break;
+        }
+
+        for (struct cmsghdr *header = CMSG_FIRSTHDR(&message); header != NULL; header = CMSG_NXTHDR(&message, header))
+        {
+          bool recvErr = (header->cmsg_level == SOL_IP && header->cmsg_type == IP_RECVERR) ||
+                         (header->cmsg_level == SOL_IPV6 && header->cmsg_type == IPV6_RECVERR);
+          if (!recvErr)
+          {
+            continue;
+          }
+          const struct sock_extended_err *error = (const struct sock_extended_err *)CMSG_DATA(header);
+          if (error->ee_errno != 0 || error->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+          {
+            return false;
+          }
+          completed(error->ee_info, error->ee_data);
+        }
+      }
+
+      int error = 0;
+      socklen_t length = sizeof(error);
+      return (errno == EAGAIN || errno == EWOULDBLOCK) &&
+             getsockopt(_descriptor, SOL_SOCKET, SO_ERROR, &error, &length) == 0 && error == 0;
+    }
+
+    //Make closing the socket reset the connection, dropping whatever the kernel still has queued
+    void Abort() {
+      struct linger reset;
+      reset.l_onoff = 1;
+      reset.l_linger = 0;
+      setsockopt(_descriptor, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+    }
+
     void Listen(int backLog = SOMAXCONN) {
       if (listen(_descriptor, backLog) == -1)
       {
@@ -268,22 +452,73 @@ namespace network {
       }
     }
 
-    TcpSocket *Accept() {
+    //With block == false the accepted socket is non-blocking, and NULL is
+    //returned once a non-blocking listener has drained its backlog
+    TcpSocket *Accept(bool block = true) {
+      struct sockaddr_storage remoteAddr;
+      socklen_t remoteAddrSize = sizeof(remoteAddr);
+      struct sockaddr *sockAddr = (struct sockaddr *)&remoteAddr;
+
+      int new_fd = accept4(_descriptor, sockAddr, &remoteAddrSize, block ? 0 : SOCK_NONBLOCK);
+      NotifySocketHook(SocketCall::ACCEPT, new_fd);
+      if (new_fd == -1)
+      {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED)
+        {
+          return NULL;
+        }
+        RaiseSocketException("Error when accept: ");
+      }
+
+      return new TcpSocket(Accepted(), new_fd, sockAddr);
+    }
+
+    //Like Accept, but the socket and its control block come from allocator in one allocation
+    template <typename Allocator>
+    std::shared_ptr<TcpSocket> AcceptShared(const Allocator &allocator, bool block = true) {
       struct sockaddr_storage remoteAddr;
       socklen_t remoteAddrSize = sizeof(remoteAddr);
       struct sockaddr *sockAddr = (struct sockaddr *)&remoteAddr;
 
-      int new_fd = accept(_descriptor, sockAddr, &remoteAddrSize);
+      int new_fd = accept4(_descriptor, sockAddr, &remoteAddrSize, block ? 0 : SOCK_NONBLOCK);
+      NotifySocketHook(SocketCall::ACCEPT, new_fd);
       if (new_fd == -1)
       {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED)
+        {
+          return nullptr;
+        }
         RaiseSocketException("Error when accept: ");
       }
 
-      return new TcpSocket(new_fd, sockAddr);
+      return std::allocate_shared<TcpSocket>(allocator, Accepted(), new_fd, sockAddr);
+    }
+
+    //Wraps a descriptor accepted without Accept (e.g. by io_uring), looking up its peer address.
+    //Returns nullptr and closes descriptor if the peer is already gone
+    template <typename Allocator>
+    static std::shared_ptr<TcpSocket> AdoptShared(const Allocator &allocator, int descriptor) {
+      struct sockaddr_storage remoteAddr;
+      socklen_t remoteAddrSize = sizeof(remoteAddr);
+      struct sockaddr *sockAddr = (struct sockaddr *)&remoteAddr;
+
+      if (getpeername(descriptor, sockAddr, &remoteAddrSize) == -1)
+      {
+        close(descriptor);
+        return nullptr;
+      }
+
+      return std::allocate_shared<TcpSocket>(allocator, Accepted(), descriptor, sockAddr);
     }
 
   private:
-    TcpSocket(int descriptor, const struct sockaddr *raw_sockaddr)
+    //Only TcpSocket can make one, so only Accept can build sockets from a descriptor
+    struct Accepted {
+      explicit Accepted() = default;
+    };
+
+  public:
+    TcpSocket(Accepted, int descriptor, const struct sockaddr *raw_sockaddr)
         : CommunicationSocket(descriptor, raw_sockaddr, SOCK_STREAM) {
     }
   };
@@ -291,8 +526,8 @@ namespace network {
   class UdpSocket : public CommunicationSocket {
 
   public:
-    UdpSocket(const char *address, int port, bool block = true)
-        : CommunicationSocket(address, port, SOCK_DGRAM, block) {
+    UdpSocket(const char *address, int port, bool block = true, bool reusePort = false)
+        : CommunicationSocket(address, port, SOCK_DGRAM, block, reusePort) {
     }
 
     ~UdpSocket() {}
@@ -301,6 +536,7 @@ namespace network {
 
     int SendTo(const void *buffer, int bufferLen, const struct sockaddr *sa, socklen_t addrLen = sizeof(struct sockaddr_storage)) {
       int _sent = sendto(_descriptor, buffer, bufferLen, 0, sa, addrLen);
+      NotifySocketHook(SocketCall::SEND, _sent);
       if (_sent == -1)
       {
         RaiseSocketException("Error when sendto: ");
@@ -309,7 +545,7 @@ namespace network {
     }
 
     int SendTo(const void *buffer, int bufferLen) {
-      return SendTo(buffer, bufferLen, _sockaddr, _addrlen);
+      return SendTo(buffer, bufferLen, SockAddr(), _addrlen);
     }
 
     bool SendAllTo(const char *buffer, int bufferLen, const struct sockaddr *sa) {
@@ -328,6 +564,7 @@ namespace network {
     int RecvFrom(void *buffer, int bufferLen, struct sockaddr *sa, socklen_t addrLen = sizeof(struct sockaddr_storage)) {
       socklen_t remoteAddrSize = addrLen;
       int _recv = recvfrom(_descriptor, buffer, bufferLen, 0, sa, &remoteAddrSize);
+      NotifySocketHook(SocketCall::RECEIVE, _recv);
 
       if (_recv == -1)
       {
@@ -336,6 +573,54 @@ namespace network {
 
       return _recv;
     }
+
+    //Batched receive, returns the number of datagrams filled in or -1 when a
+    //non-blocking socket has nothing to read or the receive timeout expired
+    int RecvMany(struct mmsghdr *messages, unsigned int count, int flags = MSG_WAITFORONE) {
+      int _recv = recvmmsg(_descriptor, messages, count, flags, NULL);
+      NotifySocketHook(SocketCall::RECEIVE, TotalLength(messages, _recv));
+      if (_recv == -1)
+      {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        {
+          return -1;
+        }
+        RaiseSocketException("Error when recvmmsg: ");
+      }
+      return _recv;
+    }
+
+    //Batched send, returns how many of the leading messages went out or -1 when
+    //the first one would block. A failed message stops the batch and is reported
+    //by the next call, as sendmmsg does.
+    int SendMany(struct mmsghdr *messages, unsigned int count) {
+      int _sent = sendmmsg(_descriptor, messages, count, 0);
+      NotifySocketHook(SocketCall::SEND, TotalLength(messages, _sent));
+      if (_sent == -1)
+      {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        {
+          return -1;
+        }
+        RaiseSocketException("Error when sendmmsg: ");
+      }
+      return _sent;
+    }
+
+  private:
+    //Bytes moved by the first count messages of a batch, or -1 if the call failed
+    static ssize_t TotalLength(const struct mmsghdr *messages, int count) {
+      if (count == -1)
+      {
+        return -1;
+      }
+      ssize_t total = 0;
+      for (int i = 0; i < count; ++i)
+      {
+        total += messages[i].msg_len;
+      }
+      return total;
+    }
   };
 }
 
@@ -2,11 +2,26 @@
 #define __NETWORK_REQUEST__
 
 #include "Network.hpp"
+#include <cstdint>
 #include <string>
+#include <string_view>
 #include <memory>
 
 namespace common {
 
+//JSON is the original codec and stays the default. BINARY frames start with
+//BINARY_MAGIC, a byte that can never open a JSON document, which is how a
+//connection negotiates the codec with its first request.
+enum class WireFormat {
+
+  JSON,
+
+  BINARY
+};
+
+struct NetworkRequestView;
+class SharedParameters;
+
 class NetworkRequest {
 
 public:
@@ -29,31 +44,147 @@ enum class RequestType {
 
   REGULAR_CHECK,
 
-  CHANGE_STATUS
+  CHANGE_STATUS,
+
+  STATS,
+
+  CREATE_GROUP,
+
+  JOIN_GROUP,
+
+  LEAVE_GROUP,
+
+  PUSH_GROUP_MESSAGE
 };
 
-NetworkRequest(const std::string& parameters = "", RequestType rtype = RequestType::UNKNOWN);
+NetworkRequest(const std::string& parameters = "", RequestType rtype = RequestType::UNKNOWN, const std::string& userId = "");
+NetworkRequest(std::string&& parameters, RequestType rtype, std::string&& userId);
 ~NetworkRequest();
 
 NetworkRequest(const NetworkRequest& other) = default;
 NetworkRequest& operator=(const NetworkRequest& other) = default;
+NetworkRequest(NetworkRequest&& other) = default;
+NetworkRequest& operator=(NetworkRequest&& other) = default;
 
 RequestType GetRequestType() const;
 const std::string& GetParameters() const;
 
+//Id of the user issuing the request, empty for anonymous requests.
+//Requests of the same user are processed in arrival order.
+const std::string& GetUserId() const;
+
+//Id the client gave the request, 0 when it gave none. A retransmit carries
+//the same id and gets the first attempt's reply, see DedupCache.
+uint64_t GetRequestId() const { return _request_id; }
+void SetRequestId(uint64_t requestId) { _request_id = requestId; }
+
 std::string ToString() const;
 static NetworkRequest FromString(const std::string& request);
 
+/*
+  Binary layout, all integers big-endian:
+
+    0  uint8   BINARY_MAGIC
+    1  uint8   BINARY_VERSION
+    2  uint8   request type
+    3  uint8   flags, see BINARY_FLAG_*
+    4  uint32  length of parameters
+    8  ...     optional sections, in flag bit order
+       ...     parameters, raw bytes
+
+  Optional sections:
+    BINARY_FLAG_USER_ID     uint16 length, then the user id bytes
+    BINARY_FLAG_REQUEST_ID  uint64 request id
+*/
+static const uint8_t BINARY_MAGIC = 0xB7;
+static const uint8_t BINARY_VERSION = 1;
+static const size_t BINARY_HEADER_SIZE = 8;
+static const uint8_t BINARY_FLAG_USER_ID = 0x01;
+static const uint8_t BINARY_FLAG_REQUEST_ID = 0x02;
+//Longest user id the binary codec can carry. Decode refuses longer ones in
+//either format, so every request received can be answered in both.
+static const size_t MAX_USER_ID_SIZE = UINT16_MAX;
+
+//Both throw std::invalid_argument for a user id over MAX_USER_ID_SIZE
+std::string ToBinary() const;
+void AppendBinary(std::string& out) const;
+
+//The returned view points into buffer, throws std::invalid_argument on malformed input
+static NetworkRequestView FromBinary(std::string_view buffer);
+
+std::string Encode(WireFormat format) const;
+//Append the encoding to out, reusing its capacity
+void EncodeTo(std::string& out, WireFormat format) const;
+static NetworkRequest Decode(std::string_view buffer, WireFormat format);
+
+//Encode the request as if shared.Raw() followed its parameters, up to where
+//shared.Tail(format) takes over. The request must carry shared's user id.
+void EncodeHeadTo(std::string& out, WireFormat format, const SharedParameters& shared) const;
+static WireFormat DetectFormat(std::string_view buffer);
+
 private:
 
+ //One pass over the common shape of the document, boost::property_tree for the rest
+ static NetworkRequest FromJson(std::string_view request);
+
  RequestType _rtype;
  std::string _parameters;
+ std::string _user_id;
+ uint64_t _request_id {0};
+};
+
+//The end of the parameters of a fan-out, identical for every recipient, encoded
+//once per wire format. Only the part of each request before it is encoded per
+//recipient, the tail is referenced by all of them and never changes.
+class SharedParameters final {
+
+public:
+ SharedParameters(std::string raw, const std::string& userId);
+
+ const std::string& Raw() const { return _raw; }
+
+ const std::string& UserId() const { return _user_id; }
+
+ //The encoding from Raw() to the end of the request
+ const std::string& Tail(WireFormat format) const { return format == WireFormat::BINARY ? _raw : _json_tail; }
+
+private:
+ std::string _raw;
+ std::string _user_id;
+ std::string _json_tail;  //Raw() escaped, the closing quote and the user id
+};
+
+//Non-owning decoded request, only valid as long as the buffer it was decoded from
+struct NetworkRequestView {
+
+ NetworkRequest::RequestType Type {NetworkRequest::RequestType::UNKNOWN};
+ std::string_view Parameters;
+ std::string_view UserId;
+ uint64_t RequestId {0};
+
+ NetworkRequest ToRequest() const {
+   NetworkRequest request(std::string(Parameters), Type, std::string(UserId));
+   request.SetRequestId(RequestId);
+   return request;
+ }
 };
 
 struct SocketMessage {
 
  NetworkRequest Request;
  std::shared_ptr<network::CommunicationSocket> SptrSocket;
+ WireFormat Format {WireFormat::JSON};
+ //UDP only: the sender, replies go back to it through SptrSocket (the listener)
+ network::Endpoint Peer;
+ //common::Metrics::Now() timestamps: the read completing the request, copied to its replies,
+ //and the hand-over to the current queue. 0 when not taken, e.g. for notices.
+ uint64_t ReceivedAt {0};
+ uint64_t EnqueuedAt {0};
+ //Fan-out only: the parameters continue with Shared->Raw()
+ std::shared_ptr<const SharedParameters> Shared;
+
+ //Encode the whole request, shared parameters included
+ void EncodeTo(std::string& out) const;
 };
 }
 #endif
\ No newline at end of file
@@ -12,9 +12,14 @@
 #include "Network.hpp"
 #include "ConcurrentQueue.hpp"
 #include "NetworkRequest.h"
+#include "RequestLanes.h"
+#include "RateLimiter.h"
+#include "DedupCache.h"
+#include "OverloadControl.h"
 #include <memory>
 #include <thread>
 #include <atomic>
+#include <vector>
 
 namespace sobertalk {
   
@@ -24,24 +29,73 @@ protected:
   using SocketMessage = common::SocketMessage;
   using SocketMessageQueue = common::ConcurrentQueue<SocketMessage>;
 
-  std::shared_ptr<SocketMessageQueue> _queue_in;  
+  std::shared_ptr<RequestLanes> _queue_in;
 
   std::shared_ptr<SocketMessageQueue> _queue_out;
 
-  std::thread* _thread_in {NULL};
+  std::vector<std::thread> _threads_in;
 
   std::thread* _thread_out {NULL};
 
   std::atomic<bool> _should_stop;
 
+  size_t _listener_shards {1};
+
+  bool _pin_threads {false};
+
+  std::shared_ptr<common::RateLimiter> _limiter;
+
+  common::RateLimits _limits;
+
+  std::shared_ptr<DedupCache> _dedup;
+
+  std::shared_ptr<OverloadControl> _overload;
+
   virtual void Init() = 0;
 
-  NetworkServiceManager(std::shared_ptr<SocketMessageQueue> queue_In, std::shared_ptr<SocketMessageQueue> queue_Out);
+  NetworkServiceManager(std::shared_ptr<RequestLanes> queue_In, std::shared_ptr<SocketMessageQueue> queue_Out);
 
   ~NetworkServiceManager();
 
   void SetStop();
 
+  void Join();
+
+  //Pin the calling thread to one core (modulo the cores available) when thread pinning is enabled
+  void PinThread(size_t index) const;
+
+  //Rate limit checks by source address, all true without a limiter. The
+  //first two run before anything is parsed, the last once the type is known.
+  bool AdmitConnection(const struct sockaddr* source);
+
+  bool AdmitRequest(const struct sockaddr* source);
+
+  bool AdmitRequest(const struct sockaddr* source, common::NetworkRequest::RequestType type);
+
+  //Decode payload into request, false when its type is over the source's rate.
+  //A binary request is checked on the view into payload, so a refused one is
+  //never copied out. Throws std::invalid_argument on malformed input.
+  bool DecodeRequest(const struct sockaddr* source, std::string_view payload, common::WireFormat format,
+                     common::NetworkRequest& request);
+
+  //True for a retransmit of a request seen before, which must not reach the
+  //workers again: with its reply cached the reply is queued once more,
+  //otherwise the retransmit is dropped. False without a dedup cache.
+  bool Deduplicate(const SocketMessage& message);
+
+  //Undo Deduplicate for a request that never made it to the workers
+  void ForgetRequest(const SocketMessage& message);
+
+  //Turn away a request the intake has no room for: forget it like
+  //ForgetRequest and fill reply with the answer SoberTalkApp::AnswerBusy
+  //gives, at least at level 1. False without an overload control, the
+  //request is then dropped unanswered.
+  bool AnswerBusy(const SocketMessage& message, SocketMessage& reply);
+
+  //True if message is turned away on arrival by the overload level (see
+  //OverloadControl::ShedOnArrival), reply is then its busy answer
+  bool ShedOnArrival(const SocketMessage& message, SocketMessage& reply);
+
 public:
   
   virtual void HandleRequestOut() = 0;
@@ -52,6 +106,23 @@ public:
 
   virtual void Stop();
 
+  //Bind that many SO_REUSEPORT listeners to the same port, each served by its
+  //own receive thread and optionally pinned to a core. Call before Start().
+  void SetListenerShards(size_t listeners, bool pinThreads = false);
+
+  //Limit what each source address may send. Managers given the same limiter
+  //share the buckets, so an address's UDP and TCP requests count together.
+  //Call before Start().
+  void SetRateLimits(std::shared_ptr<common::RateLimiter> limiter, const common::RateLimits& limits);
+
+  //Answer retransmitted requests from dedup, which the replies fill in.
+  //Call before Start().
+  void SetDedupCache(std::shared_ptr<DedupCache> dedup);
+
+  //Answer requests turned away before the workers with the retry delay of
+  //overload's current level. Call before Start().
+  void SetOverloadControl(std::shared_ptr<OverloadControl> overload);
+
 private:
 
   NetworkServiceManager(const NetworkServiceManager& other);
@@ -0,0 +1,79 @@
+/*
+*   OverloadControl decides when the server is overloaded, from how long
+*   requests waited before a worker picked them up, in the manner of CoDel.
+*
+*   Queue length says little about overload: a long queue draining fast is
+*   fine, a short one that never drains is not. What matters is the
+*   sojourn time, and that it stays above the target for a whole interval
+*   rather than in a burst. Once it has, the controller reports overload
+*   level 1, and one level more for every further interval the sojourn
+*   does not drop below the target, up to MAX_LEVEL. A single request
+*   picked up below the target ends the overload at once, and so does an
+*   interval without any request picked up: there is no queue left then.
+*
+*   ShedLevel() says from which level each request type is shed, the least
+*   valuable first. Workers shed by it the requests that waited past the
+*   target; the network intake sheds by it on arrival, before a request
+*   takes a slot in the queue it would only wait in. Observe and Level are
+*   lock free and may be called from every worker and network thread.
+*
+*   Author: Fu Qiao
+*   Email:  fqiao@protonmail.com
+*
+*/
+
+#ifndef __OVERLOAD_CONTROL_H__
+#define __OVERLOAD_CONTROL_H__
+
+#include "Common.hpp"
+#include "NetworkRequest.h"
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+namespace sobertalk {
+
+class OverloadControl final {
+
+public:
+  static constexpr int MAX_LEVEL = 3;
+
+  //targetMs == 0 disables the controller, Level() then always is 0
+  OverloadControl(int64_t targetMs = OVERLOAD_TARGET_MS, int64_t intervalMs = OVERLOAD_INTERVAL_MS);
+
+  OverloadControl(const OverloadControl& other) = delete;
+  OverloadControl& operator=(const OverloadControl& other) = delete;
+
+  //Feed the sojourn of a request picked up at now, both in common::Metrics::Now() nanoseconds
+  void Observe(uint64_t sojournNs, uint64_t now);
+
+  //0 while not overloaded, otherwise 1 to MAX_LEVEL
+  int Level(uint64_t now) const;
+
+  //How long a client turned away at level should wait before trying again
+  int64_t RetryAfterMs(int level) const { return _interval_ns / 1000000 * level; }
+
+  //Result of a request turned away at level: "ERROR_BUSY\n<retry after ms>"
+  std::string BusyResult(int level) const { return "ERROR_BUSY\n" + std::to_string(RetryAfterMs(level)); }
+
+  bool AboveTarget(uint64_t sojournNs) const { return _target_ns > 0 && sojournNs >= _target_ns; }
+
+  //Lowest level at which requests of type are shed, above MAX_LEVEL for those that never are.
+  //Heartbeats only go from level 1 if the worker finds they change nothing.
+  static int ShedLevel(common::NetworkRequest::RequestType type);
+
+  //True if a request of type arriving at now is to be answered busy instead of queued: its
+  //type is shed at the current level. Heartbeats are left to the workers.
+  bool ShedOnArrival(common::NetworkRequest::RequestType type, uint64_t now) const;
+
+private:
+  const uint64_t _target_ns;
+  const uint64_t _interval_ns;
+
+  //when the sojourn went above the target without dropping below since, 0 if it did not
+  std::atomic<uint64_t> _above_since {0};
+  std::atomic<uint64_t> _last_observed {0};
+};
+}
+
+#endif
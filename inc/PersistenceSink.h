@@ -0,0 +1,78 @@
+/*
+*   PersistenceSink is the destination of the write-behind pipeline: it
+*   receives batches of document mutations and writes them in one go.
+*
+*   A mutation always carries the whole document, so any two mutations of
+*   the same document can be coalesced by keeping the later one. Sinks may
+*   write the mutations of one batch in any order; Write throws if the
+*   batch could not be stored and is then retried as a whole.
+*
+*   MemoryPersistenceSink keeps everything in process and stands in for the
+*   database in tests and when no database is configured.
+*
+*   Author: Fu Qiao
+*   Email:  fqiao@protonmail.com
+*
+*/
+
+#ifndef __PERSISTENCE_SINK_H__
+#define __PERSISTENCE_SINK_H__
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace sobertalk {
+
+struct Mutation {
+
+  enum class Kind {
+
+    UPSERT,
+
+    REMOVE
+  };
+
+  Kind Operation {Kind::UPSERT};
+  std::string Collection;
+  std::string Key;       //document _id
+  std::string Document;  //JSON object without _id, unused for REMOVE
+};
+
+class PersistenceSink {
+
+public:
+  virtual ~PersistenceSink() {}
+
+  virtual void Write(const std::vector<Mutation>& batch) = 0;
+
+  //Pick a sink from a URI: "memory" or a mongodb:// connection string
+  static std::unique_ptr<PersistenceSink> Create(const std::string& uri);
+};
+
+class MemoryPersistenceSink final : public PersistenceSink {
+
+public:
+  void Write(const std::vector<Mutation>& batch) override;
+
+  //Empty if the document does not exist
+  std::string Find(const std::string& collection, const std::string& key) const;
+
+  size_t Size(const std::string& collection) const;
+
+  size_t Batches() const;
+
+private:
+  mutable std::mutex _mutex;
+  std::map<std::string, std::map<std::string, std::string>> _collections;
+  size_t _batches {0};
+};
+
+//Quote and escape text as a JSON string literal
+std::string JsonString(const std::string& text);
+
+}
+
+#endif
@@ -0,0 +1,81 @@
+/*
+*   RateLimiter holds token buckets of many clients in one fixed-size,
+*   open-addressed table, without locks.
+*
+*   A bucket is a single 64-bit word: the coarse time of its last refill in
+*   milliseconds and its tokens in thousandths. Taking a token refills the
+*   bucket for the time passed since and swaps in the new word with one
+*   compare-and-swap; a request refused within the same clock tick does not
+*   even write. The clock is CLOCK_MONOTONIC_COARSE, read without a system
+*   call.
+*
+*   Keys are probed linearly over a few slots. A slot whose key is new is
+*   claimed, one idle long enough to have refilled anyway is taken over.
+*   When every probed slot is busy the check lets the request pass: a full
+*   table must not lock legitimate clients out. A slot taken over while
+*   its old key is still in use may charge one token to the wrong bucket,
+*   the limits are approximate by design.
+*
+*   Author: Fu Qiao
+*   Email:  fqiao@protonmail.com
+*
+*/
+
+#ifndef __RATE_LIMITER_H__
+#define __RATE_LIMITER_H__
+
+#include "Common.hpp"
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <sys/socket.h>
+
+namespace common {
+
+struct RateLimit {
+
+  uint32_t Rate {0};   //tokens per second, 0 is unlimited
+  uint32_t Burst {0};  //tokens a bucket holds, 0 takes twice the rate; at most 4294
+};
+
+//What one source address may send, see NetworkServiceManager::SetRateLimits
+struct RateLimits {
+
+  static constexpr size_t TYPES = 16;
+
+  RateLimit Connections {RATE_LIMIT_CONNECTIONS, 0};  //TCP connections accepted
+  RateLimit Requests {RATE_LIMIT_REQUESTS, 0};        //datagrams and frames of any type, before parsing
+  RateLimit Types[TYPES] {};                          //by request type, once parsed
+};
+
+class RateLimiter final {
+
+public:
+  explicit RateLimiter(size_t slots = RATE_LIMIT_SLOTS);
+
+  RateLimiter(const RateLimiter& other) = delete;
+  RateLimiter& operator=(const RateLimiter& other) = delete;
+
+  //Take a token from key's bucket under limit, false if there is none left
+  bool Allow(uint64_t key, const RateLimit& limit);
+
+  //Key of a source address without its port, IPv6 addresses by their /64
+  //prefix. salt tells apart the limits checked for the same address.
+  static uint64_t KeyOf(const struct sockaddr* address, uint64_t salt);
+
+private:
+  struct Slot {
+    std::atomic<uint64_t> Key {0};
+    std::atomic<uint64_t> Bucket {0};  //last refill << 32 | tokens in thousandths
+  };
+
+  std::atomic<uint64_t>* Find(uint64_t key, uint32_t now);
+
+  static uint32_t CoarseNow();
+
+  std::unique_ptr<Slot[]> _slots;
+  size_t _mask;
+};
+}
+
+#endif
@@ -0,0 +1,55 @@
+/*
+*   Reactor wraps an edge-triggered epoll instance together with an eventfd
+*   so that other threads can wake the thread blocked in Wait()
+*
+*   Author: Fu Qiao
+*   Email:  fqiao@protonmail.com
+*
+*/
+
+#ifndef __REACTOR_H__
+#define __REACTOR_H__
+
+#include "Network.hpp"
+#include <sys/epoll.h>
+#include <vector>
+
+namespace network {
+
+class Reactor {
+
+public:
+  explicit Reactor(int maxEvents = 256);
+
+  ~Reactor();
+
+  //data is handed back untouched in epoll_event::data.ptr, it must not be NULL
+  void Add(int fd, uint32_t events, void *data);
+
+  void Modify(int fd, uint32_t events, void *data);
+
+  void Remove(int fd);
+
+  //Block for at most timeoutMs (-1 for ever), returns number of ready events.
+  //Wakeups are consumed internally and never reported as events.
+  int Wait(int timeoutMs);
+
+  const struct epoll_event &Event(int index) const { return _events[index]; }
+
+  //Thread-safe, interrupts a concurrent Wait()
+  void Wakeup();
+
+  //The epoll descriptor, readable whenever Wait() would report an event or a wakeup
+  int Descriptor() const { return _epoll_fd; }
+
+  Reactor(const Reactor &other) = delete;
+  Reactor &operator=(const Reactor &other) = delete;
+
+private:
+  int _epoll_fd {-1};
+  int _wakeup_fd {-1};
+  std::vector<struct epoll_event> _events;
+};
+}
+
+#endif
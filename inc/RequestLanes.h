@@ -0,0 +1,107 @@
+/*
+*   RequestLanes is the intake of the worker pool, split into one bounded
+*   lane per transport and request class.
+*
+*   Control requests are the ones without per-user order: heartbeats and
+*   anonymous requests. Everything else is bulk. Each lane has its own
+*   depth limit, so a storm of bulk messages fills its own lane and is
+*   pushed back on there, while heartbeats still find room in theirs.
+*
+*   Lanes are drained by weighted round robin: every round takes up to the
+*   control weight from each control lane and one request from each bulk
+*   lane, so heartbeats overtake a bulk backlog without starving it. Lanes
+*   never reorder the ordered requests of one connection or datagram
+*   source, they all travel in the same bulk lane; between TCP and UDP
+*   there was no arrival order to keep in the first place.
+*
+*   Author: Fu Qiao
+*   Email:  fqiao@protonmail.com
+*
+*/
+
+#ifndef __REQUEST_LANES_H__
+#define __REQUEST_LANES_H__
+
+#include "ConcurrentQueue.hpp"
+#include "NetworkRequest.h"
+#include "Common.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace sobertalk {
+
+class RequestLanes final {
+
+using SocketMessage = common::SocketMessage;
+using SocketMessageQueue = common::ConcurrentQueue<SocketMessage>;
+
+public:
+  enum class Transport {
+
+    TCP,
+
+    UDP
+  };
+
+  enum class Lane {
+
+    TCP_CONTROL,
+
+    UDP_CONTROL,
+
+    TCP_BULK,
+
+    UDP_BULK,
+
+    COUNT
+  };
+
+  RequestLanes(size_t controlCapacity = CONTROL_LANE_CAPACITY, size_t bulkCapacity = BULK_LANE_CAPACITY,
+               size_t controlWeight = CONTROL_LANE_WEIGHT);
+
+  RequestLanes(const RequestLanes& other) = delete;
+  RequestLanes& operator=(const RequestLanes& other) = delete;
+
+  static Lane LaneOf(Transport transport, const common::NetworkRequest& request);
+
+  static bool IsControl(Lane lane) { return lane == Lane::TCP_CONTROL || lane == Lane::UDP_CONTROL; }
+
+  //Returns false when the request's lane is full
+  bool TryPush(Transport transport, SocketMessage&& message);
+
+  //Blocks while the request's lane is full, message is left untouched on failure
+  bool Push(Transport transport, SocketMessage&& message, std::chrono::milliseconds timeout);
+
+  //Waits up to timeout for the first request, then takes up to maxCount
+  //across the lanes by their weights. With controlOnly the bulk lanes are
+  //left alone. Returns the number of requests appended to out. Meant for
+  //a single consumer, only one thread is ever woken up.
+  size_t PopBatch(std::vector<SocketMessage>& out, size_t maxCount, std::chrono::milliseconds timeout,
+                  bool controlOnly = false);
+
+  //Approximate when other threads are active
+  size_t Size(Lane lane) const { return _lanes[static_cast<int>(lane)]->Size(); }
+
+  size_t Size() const;
+
+  size_t ControlWeight() const { return _control_weight; }
+
+private:
+  size_t Drain(std::vector<SocketMessage>& out, size_t maxCount, bool controlOnly);
+
+  void Notify();
+
+  std::vector<std::unique_ptr<SocketMessageQueue>> _lanes;
+  size_t _control_weight;
+
+  std::mutex _wait_mutex;
+  std::condition_variable _ready;
+  std::atomic<bool> _sleeping {false};
+};
+}
+
+#endif
@@ -0,0 +1,159 @@
+/*
+*   SlabAllocator is a standard allocator handing out single objects from
+*   fixed-size slabs, for the long-lived shared objects created on the hot
+*   path (accepted sockets, user routes) through std::allocate_shared.
+*
+*   Every object size has one process-wide SlabPool. Blocks are carved from
+*   slabs of SLAB_BLOCKS blocks and never returned to the system; freed
+*   blocks go to a small per-thread cache first and are handed back to the
+*   shared free list in bulk, so most allocations and releases take no lock
+*   even when objects are freed on another thread than the one that made
+*   them. Arrays (n > 1) fall back to operator new.
+*
+*   Author: Fu Qiao
+*   Email:  fqiao@protonmail.com
+*
+*/
+
+#ifndef __SLAB_ALLOCATOR_HPP__
+#define __SLAB_ALLOCATOR_HPP__
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+
+namespace common {
+
+template<size_t BlockSize, size_t Alignment>
+class SlabPool final {
+
+public:
+  static SlabPool& Instance() {
+    //intentionally leaked: blocks may be released by threads outliving static destruction
+    static SlabPool* pool = new SlabPool();
+    return *pool;
+  }
+
+  void* Allocate() {
+    Cache& cache = LocalCache();
+    if (cache.Head == nullptr) {
+      Refill(cache);
+    }
+
+    Node* node = cache.Head;
+    cache.Head = node->Next;
+    --cache.Count;
+    return node;
+  }
+
+  void Deallocate(void* block) {
+    Cache& cache = LocalCache();
+    Node* node = static_cast<Node*>(block);
+    node->Next = cache.Head;
+    cache.Head = node;
+
+    if (++cache.Count >= 2 * CACHE_BLOCKS) {
+      Drain(cache, CACHE_BLOCKS);
+    }
+  }
+
+private:
+  struct Node {
+    Node* Next;
+  };
+
+  struct Cache {
+    Node* Head {nullptr};
+    size_t Count {0};
+
+    ~Cache() {
+      if (Count > 0) {
+        Instance().Drain(*this, Count);
+      }
+    }
+  };
+
+  static constexpr size_t BLOCK_BYTES = ((BlockSize < sizeof(Node) ? sizeof(Node) : BlockSize) + Alignment - 1) / Alignment * Alignment;
+  static constexpr size_t SLAB_BLOCKS = 64;
+  static constexpr size_t CACHE_BLOCKS = 32;
+
+  SlabPool() {}
+
+  static Cache& LocalCache() {
+    static thread_local Cache cache;
+    return cache;
+  }
+
+  //Move up to CACHE_BLOCKS blocks from the shared list, carving a new slab if it is empty
+  void Refill(Cache& cache) {
+    std::lock_guard<std::mutex> guard(_mutex);
+    if (_free == nullptr) {
+      char* slab = static_cast<char*>(::operator new(BLOCK_BYTES * SLAB_BLOCKS, std::align_val_t(Alignment)));
+      for (size_t i = 0; i < SLAB_BLOCKS; ++i) {
+        Node* node = reinterpret_cast<Node*>(slab + i * BLOCK_BYTES);
+        node->Next = _free;
+        _free = node;
+      }
+    }
+
+    for (size_t i = 0; i < CACHE_BLOCKS && _free != nullptr; ++i) {
+      Node* node = _free;
+      _free = node->Next;
+      node->Next = cache.Head;
+      cache.Head = node;
+      ++cache.Count;
+    }
+  }
+
+  void Drain(Cache& cache, size_t count) {
+    std::lock_guard<std::mutex> guard(_mutex);
+    for (size_t i = 0; i < count && cache.Head != nullptr; ++i) {
+      Node* node = cache.Head;
+      cache.Head = node->Next;
+      --cache.Count;
+      node->Next = _free;
+      _free = node;
+    }
+  }
+
+  std::mutex _mutex;
+  Node* _free {nullptr};
+};
+
+template<typename T>
+class SlabAllocator {
+
+public:
+  using value_type = T;
+
+  SlabAllocator() noexcept {}
+
+  template<typename U>
+  SlabAllocator(const SlabAllocator<U>&) noexcept {}
+
+  T* allocate(size_t n) {
+    if (n != 1) {
+      return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(alignof(T))));
+    }
+    return static_cast<T*>(SlabPool<sizeof(T), alignof(T)>::Instance().Allocate());
+  }
+
+  void deallocate(T* p, size_t n) noexcept {
+    if (n != 1) {
+      ::operator delete(p, std::align_val_t(alignof(T)));
+      return;
+    }
+    SlabPool<sizeof(T), alignof(T)>::Instance().Deallocate(p);
+  }
+
+  template<typename U>
+  bool operator==(const SlabAllocator<U>&) const noexcept { return true; }
+
+  template<typename U>
+  bool operator!=(const SlabAllocator<U>&) const noexcept { return false; }
+};
+
+}
+
+#endif
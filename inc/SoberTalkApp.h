@@ -11,9 +11,47 @@
 
 #include "TcpServerNetworkManager.h"
 #include "UdpServerNetworkManager.h"
+#include "WorkerPool.h"
+#include "UserRegistry.h"
+#include "MailboxStore.h"
+#include "TimingWheel.h"
+#include "FriendGraph.h"
+#include "GroupRegistry.h"
+#include "WriteBehindPipeline.h"
+#include "MetricsReporter.h"
+#include "OverloadControl.h"
+#include "DedupCache.h"
+#include <unordered_map>
 
 namespace sobertalk {
 
+//Startup configuration, filled from the command line by main()
+struct SoberTalkOptions {
+
+ size_t Workers {0};  //0 picks std::thread::hardware_concurrency()
+ size_t TcpReactors {TCP_REACTOR_THREADS};
+ size_t MaxFrameSize {TCP_MAX_FRAME_SIZE};
+ network::IoBackend TcpIoBackend {network::IoBackend::EPOLL};
+ size_t ZeroCopyMinBytes {TCP_ZEROCOPY_MIN_BYTES};  //0 disables MSG_ZEROCOPY replies
+ size_t OutboundBudget {TCP_OUTBOUND_BUDGET};       //unsent bytes per TCP connection, 0 is unbounded
+ int64_t StallTimeoutMs {TCP_STALL_TIMEOUT_MS};
+ size_t ControlLaneCapacity {CONTROL_LANE_CAPACITY};  //intake depth per transport for heartbeats
+ size_t BulkLaneCapacity {BULK_LANE_CAPACITY};        //intake depth per transport for the rest
+ size_t ControlLaneWeight {CONTROL_LANE_WEIGHT};
+ int64_t OverloadTargetMs {OVERLOAD_TARGET_MS};  //0 disables load shedding
+ int64_t OverloadIntervalMs {OVERLOAD_INTERVAL_MS};
+ common::RateLimits RateLimits;  //per source address, shared by both transports
+ size_t DedupEntries {DEDUP_CACHE_ENTRIES};
+ int64_t DedupWindowMs {DEDUP_WINDOW_MS};  //0 disables the dedup cache
+ size_t ListenerShards {1};  //SO_REUSEPORT listeners per transport
+ bool PinThreads {false};    //pin each listener thread to a core
+ std::string MailboxDirectory {MAILBOX_DIRECTORY};
+ std::string PersistenceUri;  //"memory" or a mongodb:// URI, empty disables persistence
+ uint16_t AdminPort {SERVER_ADMIN_PORT};  //0 disables the metrics admin port
+ std::string StatsFile;       //empty disables the periodic metrics dump
+ int StatsIntervalMs {STATS_DUMP_INTERVAL_MS};
+};
+
 class SoberTalkApp final {
 
 using SocketMessage = common::SocketMessage;
@@ -22,19 +60,161 @@ using SocketMessageQueue = common::ConcurrentQueue<SocketMessage>;
 private:
  std::unique_ptr<TcpServerNetworkManager> _tcpManager;
  std::unique_ptr<UdpServerNetworkManager> _udpManager;
- std::shared_ptr<SocketMessageQueue> _queue_In {nullptr};
- std::shared_ptr<SocketMessageQueue> _queue_Out {nullptr};
+ //one intake lane per transport and request class, see RequestLanes
+ std::shared_ptr<RequestLanes> _queue_In {nullptr};
+ //one outbound queue per transport so each manager can pop without filtering
+ std::shared_ptr<SocketMessageQueue> _queue_TcpOut {nullptr};
+ std::shared_ptr<SocketMessageQueue> _queue_UdpOut {nullptr};
+ std::unique_ptr<WorkerPool> _workers;
+ UserRegistry _users;
+ std::unique_ptr<MailboxStore> _mailboxes;
+ std::shared_ptr<TimingWheel> _timers;
+ FriendGraph _friends;
+ GroupRegistry _groups;
+ std::unique_ptr<WriteBehindPipeline> _persistence;
+ std::unique_ptr<MetricsReporter> _reporter;
+ std::shared_ptr<OverloadControl> _overload;
+ std::shared_ptr<DedupCache> _dedup;  //null when disabled
+
+ //A POLL_MESSAGE waiting on its connection for the user's next message
+ struct ParkedPoll {
+   SocketMessage Message;
+   uint64_t Cursor;
+   uint64_t Id;
+   TimerId Timer;
+ };
+
+ struct ParkingShard {
+   std::mutex Mutex;
+   std::unordered_map<uint32_t, std::vector<ParkedPoll>> Polls;  //by user index
+ };
+
+ std::vector<std::unique_ptr<ParkingShard>> _parking;
+ std::atomic<uint64_t> _next_parked {0};
+
+ /*
+   Runs on a worker thread; requests of one user never run concurrently.
+   The acting user is NetworkRequest::GetUserId(), parameters carry the operand:
+
+     CREATE_USER, DELETE_USER, REGULAR_CHECK   unused
+     CHANGE_STATUS                             numeric UserStatus
+     PUSH_MESSAGE                              <recipient>\n<body>
+     POLL_MESSAGE                              <last sequence received>[,<wait ms>]
+     ADD_FRIEND, DELETE_FRIEND                 the friend's user id
+     CREATE_GROUP, JOIN_GROUP, LEAVE_GROUP     the group's id
+     PUSH_GROUP_MESSAGE                        <group>\n<body>
+
+   CHANGE_STATUS and REGULAR_CHECK keep the user's presence alive; once
+   PRESENCE_TIMEOUT_MS pass without either, the user is marked OFFLINE.
+
+   Replies echo the request type, with the result code as parameters. A
+   successful poll answers "OK\n" followed by the messages as encoded by
+   MailboxStore::Poll. A TCP poll finding nothing is parked for up to its
+   wait (capped at LONG_POLL_MAX_WAIT_MS) and answered as soon as a message
+   for the user arrives, or empty once the wait is over. A message pushed
+   to a user without a parked poll triggers a POLL_MESSAGE notice with
+   parameters "NEW\n<sequence>" over the user's last route, typically the
+   UDP heartbeat, telling the client to poll.
+
+   A group message goes to the mailbox of every other member, with
+   "<group>\n<sender>" as its sender; only members may send. Members
+   without a parked poll get the message itself over their last route: a
+   PUSH_GROUP_MESSAGE with the group as user id and parameters
+   "<sequence>\n<sender>\n<body>". The body is stored and encoded once for
+   the whole group, the notices only differ in their sequence.
+
+   Whenever a user's status changes, its online friends are sent a
+   CHANGE_STATUS message carrying the changed user's id and new status.
+
+   With persistence enabled, users, friendships and group memberships are
+   written behind to the "users", "friendships" and "group_members"
+   collections.
+
+   STATS answers "OK\n" followed by common::Metrics::Snapshot(). It is only
+   served over TCP, a snapshot does not fit a datagram.
+
+   Under overload (see OverloadControl) requests are answered
+   "ERROR_BUSY\n<retry after ms>" instead of being processed, the least
+   valuable first. Level 1 sheds heartbeats of users whose presence does
+   not need them yet, level 2 also polls that waited past the target,
+   level 3 every other request that did. The network intake already
+   turns away polls from level 2 and the other requests from level 3 on
+   arrival, so they do not queue up behind the backlog first. STATS is
+   always served. A request finding its intake lane full, or a heartbeat
+   or anonymous request finding every worker's queue full, is answered
+   busy as well.
+
+   A request may carry a request id, unique per user. Replies echo it, and
+   a retransmit with the same user, type and id within DEDUP_WINDOW_MS is
+   answered with the first reply without running again (see DedupCache).
+   Busy answers are not kept, a retransmit after one runs as new.
+ */
+ void ProcessNetworkRequest(SocketMessage& message);
+
+ void HandleUserRequest(SocketMessage& message);
+
+ void HandleMessageRequest(SocketMessage& message);
+
+ void HandleFriendRequest(SocketMessage& message);
 
- void ProcessNetworkRequest();
+ void HandleGroupRequest(SocketMessage& message);
+
+ void HandleStatsRequest(SocketMessage& message);
+
+ //Answer message busy if the overload level says it is not worth processing now
+ bool Shed(const SocketMessage& message);
+
+ //Answer message "ERROR_BUSY\n<retry after ms>" for overload level, unprocessed
+ void AnswerBusy(const SocketMessage& message, int level);
+
+ ParkingShard& ParkingFor(uint32_t index) { return *_parking[index % _parking.size()]; }
+
+ //Answer the parked polls of recipient, or notify it over its route when there are none.
+ //With content, the notice carries the message, see PUSH_GROUP_MESSAGE.
+ void Deliver(UserRecord& recipient, uint64_t sequence,
+              const std::shared_ptr<const common::SharedParameters>& content = nullptr);
+
+ //Runs on the timing wheel's thread when a parked poll's wait is over
+ void ExpireParkedPoll(uint32_t index, uint64_t id);
+
+ static size_t PollLimit(const SocketMessage& message);
+
+ //Queue the current state of record, or its removal, for persistence
+ void PersistUser(const UserRecord& record);
+
+ void PersistFriendship(const UserRecord& a, const UserRecord& b, bool friends);
+
+ void PersistMembership(const std::string& group, const UserRecord& record, bool member);
+
+ //Update presence and tell every online friend about record's current status
+ void PublishStatus(UserRecord& record);
+
+ //Push the user's presence expiry PRESENCE_TIMEOUT_MS into the future
+ void KeepAlive(UserRecord& record);
+
+ //Runs on the timing wheel's thread once a user missed its heartbeats
+ void ExpirePresence(uint32_t index);
+
+ //Route a reply to the outbound queue of the socket's transport
+ bool Reply(SocketMessage&& message);
+
+ //Answer message on the connection it came from
+ bool Reply(const SocketMessage& message, const std::string& result);
+
+ static std::shared_ptr<const UserRoute> RouteOf(const SocketMessage& message);
+
+ static bool SameRoute(const UserRoute* route, const SocketMessage& message);
 
 public:
- SoberTalkApp();
+ explicit SoberTalkApp(const SoberTalkOptions& options = SoberTalkOptions());
  ~SoberTalkApp();
 
  SoberTalkApp(const SoberTalkApp& other) = delete;
  SoberTalkApp& operator=(const SoberTalkApp& other) = delete;
 
  void Run();
+
+ void Stop();
 };
 }
 
@@ -1,7 +1,55 @@
 /*
 *   TcpServerNetworkManager manages server-side TCP socket communication
 *
-*   Author: Fu Qiao 
+*   Accepted connections are persistent and non-blocking. They are spread
+*   over a set of edge-triggered epoll reactors, each running on its own
+*   thread and owning its connections exclusively; other threads only talk
+*   to a reactor through its pending lists and Reactor::Wakeup().
+*   With listener shards, the first reactors each own one SO_REUSEPORT listener.
+*
+*   Requests and replies are length-prefixed frames (see Framing.hpp), so a
+*   client may pipeline any number of requests on one connection. The codec
+*   of the first frame (JSON or binary) is latched for the connection's replies.
+*
+*   With an idle timeout, each connection has one timer on the timing wheel.
+*   Reads only record the time of the last activity; when the timer fires the
+*   owning reactor either closes the connection or re-arms it for the rest of
+*   the timeout, so busy connections cost the wheel one operation per timeout.
+*
+*   Accepted sockets come from a slab allocator and closed connections are
+*   recycled per reactor together with their buffers, and replies are encoded
+*   straight into the connection's outbound buffer, so a warm server serves
+*   requests without allocating for sockets or I/O buffers.
+*
+*   Replies handed to a reactor are encoded first and written afterwards,
+*   one flush per connection, so a burst of replies costs one sendmsg for
+*   the whole burst rather than one send per reply. Replies of at least the
+*   zero-copy size get a buffer of their own that is gathered into the same
+*   sendmsg but sent with MSG_ZEROCOPY, and kept until the kernel reports it
+*   released on the socket's error queue. A connection closed before that
+*   lingers with its socket until the last completion arrives, and is reset
+*   if it does not arrive in time; it is never reused or freed while the
+*   kernel may still read its buffers. A fan-out reply only has its
+*   head encoded per connection; its shared tail is gathered straight from
+*   the buffer all recipients reference.
+*
+*   Every connection has an outbound budget. A connection whose unsent
+*   replies exceed it is no longer read, so its requests stay in the kernel
+*   and TCP flow control pushes back on the client; reading resumes once
+*   the backlog has drained to half the budget. A connection that stays over
+*   budget for the stall timeout, or reaches four times the budget, is
+*   disconnected. A slow client so only ever holds up itself.
+*
+*   With the io_uring backend a reactor keeps one multishot accept on its
+*   listener and one multishot receive per connection armed, receives land
+*   in the ring's shared buffers, and sends are queued to the ring with at
+*   most one in flight per connection while further replies collect in the
+*   outbound buffer. Everything a loop iteration queued is submitted with
+*   one io_uring_enter, which also waits for the next completions. Wakeups
+*   still go through the reactor's eventfd: the ring polls the epoll
+*   descriptor. Without kernel support the reactors fall back to epoll.
+*
+*   Author: Fu Qiao
 *   Email:  fqiao@protonmail.com
 *
 */
@@ -11,7 +59,17 @@
 #define __TCP_SERVER_NETWORK_MANAGER_H__
 
 #include "NetworkServiceManager.h"
+#include "Reactor.h"
+#include "IoUring.h"
+#include "ByteRingBuffer.h"
+#include "TimingWheel.h"
+#include "Common.hpp"
 #include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
 
 namespace sobertalk {
 
@@ -21,26 +79,195 @@ using TcpSocket = network::TcpSocket;
 using NetworkRequest = common::NetworkRequest;
 
 public:
-  TcpServerNetworkManager(uint16_t port, std::shared_ptr<SocketMessageQueue> queue_In, std::shared_ptr<SocketMessageQueue> queue_Out);
+  TcpServerNetworkManager(uint16_t port, std::shared_ptr<RequestLanes> queue_In, std::shared_ptr<SocketMessageQueue> queue_Out,
+                          size_t reactorThreads = TCP_REACTOR_THREADS, size_t maxFrameSize = TCP_MAX_FRAME_SIZE);
 
   ~TcpServerNetworkManager();
 
+  //Runs the first reactor, the one always owning a listener
   void HandleRequestIn() override;
 
   void HandleRequestOut() override;
 
   void Start() override;
 
+  void Stop() override;
+
+  //Close connections without inbound traffic for timeoutMs, timed by timers. Call before Start().
+  void SetIdleTimeout(std::shared_ptr<TimingWheel> timers, int64_t timeoutMs = TCP_IDLE_TIMEOUT_MS);
+
+  //Call before Start(), IO_URING falls back to EPOLL if the kernel lacks support
+  void SetIoBackend(network::IoBackend backend) { _io_backend = backend; }
+
+  //Send replies of at least minBytes parameters with MSG_ZEROCOPY, 0 disables. Epoll backend only.
+  void SetZeroCopyThreshold(size_t minBytes) { _zero_copy_min = minBytes; }
+
+  //Stop reading connections with budgetBytes of unsent replies, disconnect them after stallTimeoutMs.
+  //The stall timeout needs the timers of SetIdleTimeout(). Call before Start().
+  void SetOutboundBudget(size_t budgetBytes, int64_t stallTimeoutMs = TCP_STALL_TIMEOUT_MS) {
+    _outbound_budget = budgetBytes;
+    _stall_timeout = stallTimeoutMs;
+  }
+
 private:
+  //A buffer written ahead of Connection::Outbound
+  struct Segment {
+    std::string Data;
+    std::shared_ptr<const std::string> Shared;  //sent instead of Data: a fan-out tail other connections send too
+    bool ZeroCopy {false};  //to be sent with MSG_ZEROCOPY
+    bool Pinned {false};    //a zero-copy send included it, keep it until the kernel releases it
+    uint32_t LastSend {0};  //number of the last zero-copy send call that included it
+
+    const std::string& Bytes() const { return Shared ? *Shared : Data; }
+  };
+
+  struct Connection {
+    std::shared_ptr<TcpSocket> Socket;
+    common::ByteRingBuffer Inbound {SOCKET_MSG_BUF_SIZE};
+    std::deque<Segment> Queued;        //large replies and the replies before them
+    std::string Outbound;              //later replies, coalesced
+    size_t OutboundOffset {0};         //bytes of the first of Queued and Outbound already written
+    bool FlushPending {false};         //replies were added since the last flush
+    common::WireFormat Format {common::WireFormat::JSON};
+    bool Negotiated {false};
+    uint64_t Serial {0};  //tells a reused descriptor apart in idle timer callbacks
+    TimerId IdleTimer {INVALID_TIMER};
+    std::chrono::steady_clock::time_point LastActivity;
+
+    bool Throttled {false};            //over the outbound budget, not read until it drains
+    std::chrono::steady_clock::time_point ThrottledSince;
+    TimerId StallTimer {INVALID_TIMER};
+
+    bool ZeroCopyProbed {false};
+    bool ZeroCopy {false};             //SO_ZEROCOPY is enabled on the socket
+    uint32_t ZeroCopySends {0};        //zero-copy send calls so far, the kernel numbers them from 0
+    std::vector<Segment> ZeroCopyHeld; //written, but the kernel may still read from them
+    std::chrono::steady_clock::time_point LingerDeadline;  //closed, reset if still lingering by then
+
+    //io_uring backend only
+    std::string Sending;      //handed to the kernel, Outbound collects the replies behind it
+    size_t SendingOffset {0};
+    int InFlight {0};         //ring operations that still refer to the connection
+    bool Receiving {false};   //a multishot receive is armed
+    bool Closed {false};      //closed, waiting for InFlight to drop to 0
+  };
+
+  struct ReactorContext {
+    network::Reactor Poller;
+    TcpSocket* Listener {nullptr};
+    std::unordered_map<int, std::unique_ptr<Connection>> Connections;
+
+    std::mutex PendingMutex;
+    std::vector<std::shared_ptr<TcpSocket>> PendingAccepted;
+    std::vector<SocketMessage> PendingReplies;
+    std::vector<std::pair<int, uint64_t>> PendingIdle;  //descriptor and serial of fired idle timers
+    std::vector<std::pair<int, uint64_t>> PendingStalled;  //descriptor and serial of fired stall timers
+
+    //closed connections kept with their buffers for the next accept, only touched by the reactor
+    std::vector<std::unique_ptr<Connection>> Spare;
+
+    //closed connections whose zero-copy buffers the kernel has not released yet
+    std::vector<std::unique_ptr<Connection>> Lingering;
+
+    uint64_t NextSerial {0};
+
+    //io_uring backend only
+    std::unique_ptr<network::IoUring> Ring;
+    std::unordered_map<Connection*, std::unique_ptr<Connection>> Draining;  //closed with ring operations pending
+  };
+
   void Init() override;
 
+  void RunReactor(size_t index);
+
+  //A connection always lives on reactor (fd % reactors) so replies can be routed without a lookup table
+  ReactorContext& ReactorFor(int descriptor) { return *_reactors[descriptor % _reactors.size()]; }
+
+  void AcceptConnections(ReactorContext& context);
+
+  //Register socket on the reactor owning its descriptor
+  void HandOver(ReactorContext& context, std::shared_ptr<TcpSocket> socket);
+
+  void Register(ReactorContext& context, std::shared_ptr<TcpSocket> socket);
+
+  void ReadConnection(ReactorContext& context, Connection& connection);
+
+  //Queue every complete inbound frame, returns false if the connection was closed
+  bool DispatchFrames(ReactorContext& context, Connection& connection);
+
+  //Encode reply behind the connection's pending replies
+  void QueueReply(ReactorContext& context, Connection& connection, const SocketMessage& reply);
+
+  //Returns false if the connection failed and has to be closed
+  bool FlushConnection(Connection& connection);
+
+  //Drop the first sent bytes from the connection's pending replies
+  void ConsumeOutbound(Connection& connection, size_t sent);
+
+  //Release the buffers of completed zero-copy sends, returns false if the socket failed
+  bool ReapZeroCopy(Connection& connection);
+
+  //True while the kernel may still read buffers of connection's zero-copy sends
+  static bool ZeroCopyPending(const Connection& connection);
+
+  //Keep a closed connection with zero-copy sends pending until the kernel releases them
+  void Linger(ReactorContext& context, std::unique_ptr<Connection> connection);
+
+  //Recycle lingering connections that got their last completion, reset those past their deadline
+  void ReapLingering(ReactorContext& context);
+
+  //Throttle, resume or evict connection by its unsent bytes, returns false if it was closed
+  bool ApplyBackpressure(ReactorContext& context, Connection& connection);
+
+  void ArmStallTimer(ReactorContext& context, Connection& connection, int64_t delayMs);
+
+  void CheckStalled(ReactorContext& context, int descriptor, uint64_t serial);
+
+  void CloseConnection(ReactorContext& context, int descriptor);
+
+  //Keep a closed connection with its buffers for the next accept, or let it linger first
+  void Recycle(ReactorContext& context, std::unique_ptr<Connection> connection);
+
+  void DrainPending(ReactorContext& context);
+
+  //Arm connection's idle timer to fire delayMs from now
+  void ArmIdleTimer(ReactorContext& context, Connection& connection, int64_t delayMs);
+
+  void CheckIdle(ReactorContext& context, int descriptor, uint64_t serial);
+
+  //The io_uring counterparts of the epoll reactor loop, reads and flushes
+  void RunRing(ReactorContext& context);
+
+  void HandleCompletion(ReactorContext& context, const struct io_uring_cqe& cqe);
+
+  void ArmReceive(ReactorContext& context, Connection& connection);
+
+  void CompleteReceive(ReactorContext& context, Connection& connection, const struct io_uring_cqe& cqe);
+
+  //Hand Outbound to the kernel unless a send is in flight already
+  void QueueSend(ReactorContext& context, Connection& connection);
+
+  void CompleteSend(ReactorContext& context, Connection& connection, const struct io_uring_cqe& cqe);
+
+  //A ring operation on connection completed for good
+  void FinishOperation(ReactorContext& context, Connection& connection);
+
   TcpServerNetworkManager(const TcpServerNetworkManager& other);
   TcpServerNetworkManager& operator=(const TcpServerNetworkManager& other);
 
-  std::unique_ptr<TcpSocket> _listener {nullptr};
+  std::vector<std::unique_ptr<TcpSocket>> _listeners;
   uint16_t _port;
+  size_t _reactor_threads;
+  size_t _max_frame_size;
+  std::vector<std::unique_ptr<ReactorContext>> _reactors;
+  std::shared_ptr<TimingWheel> _timers;
+  int64_t _idle_timeout {TCP_IDLE_TIMEOUT_MS};
+  network::IoBackend _io_backend {network::IoBackend::EPOLL};
+  size_t _zero_copy_min {TCP_ZEROCOPY_MIN_BYTES};
+  size_t _outbound_budget {TCP_OUTBOUND_BUDGET};
+  int64_t _stall_timeout {TCP_STALL_TIMEOUT_MS};
 
 };
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,120 @@
+/*
+*   TimingWheel is a hierarchical timing wheel driving every timeout of the
+*   server: presence expiry of silent users and idle TCP connections.
+*
+*   Time advances in ticks of a fixed length. The wheel has TIMING_WHEEL_LEVELS
+*   levels of 256 slots; level 0 holds timers due within 256 ticks, level n
+*   timers due within 256^(n+1) ticks. Whenever level 0 wraps around, the next
+*   slot of the level above is cascaded down, so a timer is moved at most once
+*   per level over its whole life.
+*
+*   Timers live in a pool and are linked into their slot through indexes,
+*   which makes Schedule, Reschedule and Cancel O(1) without any allocation
+*   once the pool has grown. A TimerId carries a generation so a handle kept
+*   after its timer fired or was cancelled is recognised as stale.
+*
+*   Callbacks run on the wheel's driver thread, outside its lock, and may
+*   schedule new timers. A callback already picked up for expiry may still run
+*   after Cancel returned, so callbacks must check the state they act upon.
+*
+*   Author: Fu Qiao
+*   Email:  fqiao@protonmail.com
+*
+*/
+
+#ifndef __TIMING_WHEEL_H__
+#define __TIMING_WHEEL_H__
+
+#include "Common.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace sobertalk {
+
+using TimerId = uint64_t;
+
+const TimerId INVALID_TIMER = 0;
+
+class TimingWheel final {
+
+public:
+  using Callback = std::function<void()>;
+
+  explicit TimingWheel(int tickMs = TIMER_TICK_MS);
+
+  ~TimingWheel();
+
+  TimingWheel(const TimingWheel& other) = delete;
+  TimingWheel& operator=(const TimingWheel& other) = delete;
+
+  void Start();
+
+  //Pending timers are dropped without running
+  void Stop();
+
+  //Run callback once, delayMs from now rounded up to the next tick
+  TimerId Schedule(int64_t delayMs, Callback callback);
+
+  //Move a pending timer to delayMs from now. Returns false if it already fired or was cancelled.
+  bool Reschedule(TimerId id, int64_t delayMs);
+
+  //Returns false if the timer already fired or was cancelled
+  bool Cancel(TimerId id);
+
+  //Number of pending timers
+  size_t Size() const;
+
+private:
+  static constexpr uint32_t NIL = UINT32_MAX;
+  static constexpr size_t SLOT_BITS = 8;
+  static constexpr size_t SLOTS = size_t(1) << SLOT_BITS;
+
+  struct Timer {
+    uint64_t Expiry {0};  //tick
+    uint32_t Prev {NIL};
+    uint32_t Next {NIL};
+    uint32_t Slot {NIL};  //index into _slots, NIL when not linked
+    uint32_t Generation {1};
+    Callback Fn;
+  };
+
+  //Must hold _mutex for all of the following
+  Timer* Resolve(TimerId id);
+
+  void Link(uint32_t index);
+
+  void Unlink(uint32_t index);
+
+  void Release(uint32_t index);
+
+  void Cascade(size_t level);
+
+  uint64_t TicksFromNow(int64_t delayMs) const;
+
+  //Expire every tick up to now, collecting the due callbacks
+  void Advance(uint64_t now, std::vector<Callback>& due);
+
+  void Drive();
+
+  const std::chrono::milliseconds _tick;
+  const std::chrono::steady_clock::time_point _origin;
+
+  mutable std::mutex _mutex;
+  std::vector<Timer> _timers;
+  std::vector<uint32_t> _free;
+  std::vector<uint32_t> _slots;  //list heads, TIMING_WHEEL_LEVELS * SLOTS
+  uint64_t _current {0};         //next tick to expire
+  size_t _pending {0};
+
+  std::condition_variable _wakeup;
+  std::atomic<bool> _should_stop {false};
+  std::thread* _driver {NULL};
+};
+}
+
+#endif
@@ -1,6 +1,14 @@
 /*
 *   UdpServerNetworkManager manages server-side UDP socket communication
 *
+*   Datagrams are read in batches with recvmmsg into buffers allocated once
+*   in Init(). Replies go out in batches with sendmmsg through the bound
+*   listener itself, addressed to the sender kept in SocketMessage::Peer,
+*   so no per-datagram socket or address lookup is ever made.
+*   With listener shards every SO_REUSEPORT listener gets its own receive
+*   thread and buffers; a reply leaves through the listener that received
+*   its request.
+*
 *   Author: Fu Qiao 
 *   Email:  fqiao@protonmail.com
 *
@@ -11,6 +19,8 @@
 
 #include "NetworkServiceManager.h"
 #include <atomic>
+#include <vector>
+#include <sys/uio.h>
 
 namespace sobertalk {
 
@@ -20,10 +30,11 @@ using UdpSocket = network::UdpSocket;
 using NetworkRequest = common::NetworkRequest;
 
 public:
- UdpServerNetworkManager(uint16_t port, std::shared_ptr<SocketMessageQueue> queue_In, std::shared_ptr<SocketMessageQueue> queue_Out);
+ UdpServerNetworkManager(uint16_t port, std::shared_ptr<RequestLanes> queue_In, std::shared_ptr<SocketMessageQueue> queue_Out);
 
  ~UdpServerNetworkManager();
 
+ //Runs the receive loop of the first listener
  void HandleRequestIn() override;
 
  void HandleRequestOut() override;
@@ -31,14 +42,29 @@ public:
  void Start() override;
 
 private:
+ struct ReceiveShard {
+   std::shared_ptr<UdpSocket> Listener;
+   std::vector<char> Buffers;
+   std::vector<struct iovec> Iovecs;
+   std::vector<struct mmsghdr> Headers;
+   std::vector<network::Endpoint> Peers;
+ };
+
  void Init() override;
 
+ void ReceiveLoop(size_t index);
+
+ //Send one run of replies that share a listener
+ void SendBatch(UdpSocket& listener, struct mmsghdr* headers, unsigned int count);
+
  UdpServerNetworkManager(const UdpServerNetworkManager& other);
  UdpServerNetworkManager& operator=(const UdpServerNetworkManager& other);
 
- std::unique_ptr<UdpSocket> _listener {nullptr};
  uint16_t _port;
 
+ //each shard is only touched by its own receive thread
+ std::vector<std::unique_ptr<ReceiveShard>> _shards;
+
 };
 }
 #endif
\ No newline at end of file
@@ -0,0 +1,144 @@
+/*
+*   UserRegistry keeps every known user and its presence in memory.
+*
+*   User ids are interned: the first time an id is seen it gets a
+*   UserRecord with a dense, never reused index, and the record lives as
+*   long as the registry. Ids hash to one of a fixed number of shards, each
+*   an open-addressed table of record pointers. Lookups never lock: they
+*   probe the currently published table, whose slots are only ever filled,
+*   never cleared. Writers serialize on the shard's mutex; a growing shard
+*   publishes a new table and keeps the old one alive until destruction so
+*   that concurrent readers can finish their probe.
+*
+*   Author: Fu Qiao
+*   Email:  fqiao@protonmail.com
+*
+*/
+
+#ifndef __USER_REGISTRY_H__
+#define __USER_REGISTRY_H__
+
+#include "NetworkRequest.h"
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace sobertalk {
+
+enum class UserStatus : uint8_t {
+
+  OFFLINE,
+
+  ONLINE,
+
+  AWAY,
+
+  BUSY
+};
+
+//How to reach a user: the socket of its last request plus, for UDP, the sender address
+struct UserRoute {
+
+  std::shared_ptr<network::CommunicationSocket> Socket;
+  network::Endpoint Peer;
+  common::WireFormat Format {common::WireFormat::JSON};
+};
+
+struct UserRecord {
+
+  UserRecord(const std::string& id, uint32_t index) : Id(id), Index(index) {}
+
+  UserRecord(const UserRecord& other) = delete;
+  UserRecord& operator=(const UserRecord& other) = delete;
+
+  const std::string Id;
+  const uint32_t Index;
+
+  //false until CREATE_USER and again after DELETE_USER; the record itself is never freed
+  std::atomic<bool> Exists {false};
+  std::atomic<UserStatus> Status {UserStatus::OFFLINE};
+  std::atomic<int64_t> LastSeen {0}; //milliseconds since the epoch
+  std::atomic<uint64_t> PresenceTimer {0}; //TimingWheel handle of the presence expiry, 0 if none
+
+  std::shared_ptr<const UserRoute> GetRoute() const { return std::atomic_load(&_route); }
+  void SetRoute(std::shared_ptr<const UserRoute> route) { std::atomic_store(&_route, std::move(route)); }
+
+private:
+  std::shared_ptr<const UserRoute> _route;
+};
+
+class UserRegistry final {
+
+public:
+  explicit UserRegistry(size_t shards = 64);
+
+  ~UserRegistry();
+
+  UserRegistry(const UserRegistry& other) = delete;
+  UserRegistry& operator=(const UserRegistry& other) = delete;
+
+  //Lock-free, NULL if the id was never interned
+  UserRecord* Find(std::string_view id) const;
+
+  //Lock-free lookup by interned index, NULL if out of range
+  UserRecord* Get(uint32_t index) const;
+
+  //Find or insert the record for id, locking only id's shard on insert
+  UserRecord* Intern(const std::string& id);
+
+  //Returns false if the user already exists
+  bool Create(const std::string& id);
+
+  //Returns false if the user does not exist
+  bool Delete(const std::string& id);
+
+  //Record activity: bumps LastSeen and, if given, the route used to reach the user
+  void Touch(UserRecord& record, std::shared_ptr<const UserRoute> route = nullptr);
+
+  //Number of interned ids, also one past the largest index
+  uint32_t Size() const { return _next_index.load(std::memory_order_acquire); }
+
+  static int64_t Now();
+
+private:
+  struct Table {
+    explicit Table(size_t capacity);
+
+    size_t Mask;
+    std::unique_ptr<std::atomic<UserRecord*>[]> Slots;
+  };
+
+  struct Shard {
+    std::mutex Mutex;
+    std::atomic<Table*> Current {nullptr};
+    size_t Count {0};
+    std::vector<std::unique_ptr<Table>> Tables; //current one last, older ones retired
+    std::vector<std::unique_ptr<UserRecord>> Records;
+  };
+
+  static const size_t INDEX_CHUNK_BITS = 16;
+  static const size_t INDEX_CHUNK_SIZE = size_t(1) << INDEX_CHUNK_BITS;
+  static const size_t INDEX_CHUNKS = 65536;
+
+  static size_t Hash(std::string_view id);
+
+  Shard& ShardOf(size_t hash) const { return *_shards[hash % _shards.size()]; }
+
+  static UserRecord* Probe(const Table& table, size_t hash, std::string_view id);
+
+  static void Insert(Table& table, size_t hash, UserRecord* record);
+
+  void PublishIndex(UserRecord* record);
+
+  std::vector<std::unique_ptr<Shard>> _shards;
+
+  std::mutex _index_mutex;
+  std::atomic<uint32_t> _next_index {0};
+  std::unique_ptr<std::atomic<std::atomic<UserRecord*>*>[]> _index;
+};
+}
+
+#endif
@@ -0,0 +1,109 @@
+/*
+*   WorkerPool runs request handlers on a fixed set of worker threads.
+*
+*   Every worker owns a shard. Requests that must keep per-user order go to
+*   the shard picked by hashing their user id, so one user's requests are
+*   always handled sequentially by the same worker while unrelated users
+*   run in parallel. Order-insensitive requests (heartbeats, anonymous
+*   requests) go to a separate per-shard queue that idle workers are
+*   allowed to steal from.
+*
+*   Requests come in through RequestLanes. Heartbeats keep ahead of a bulk
+*   backlog all the way: while a full shard holds up the dispatcher, it
+*   keeps moving control requests, and workers take up to the control
+*   weight of shared requests for every ordered one.
+*
+*   Author: Fu Qiao
+*   Email:  fqiao@protonmail.com
+*
+*/
+
+#ifndef __WORKER_POOL_H__
+#define __WORKER_POOL_H__
+
+#include "ConcurrentQueue.hpp"
+#include "NetworkRequest.h"
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace sobertalk {
+
+class RequestLanes;
+
+class WorkerPool final {
+
+using SocketMessage = common::SocketMessage;
+using SocketMessageQueue = common::ConcurrentQueue<SocketMessage>;
+
+public:
+  using Handler = std::function<void(SocketMessage&)>;
+
+  //workers == 0 picks std::thread::hardware_concurrency(). rejected gets the
+  //requests no shard had room for, on the dispatcher thread, so their clients
+  //can be answered; they are counted as dropped either way.
+  WorkerPool(std::shared_ptr<RequestLanes> queue_In, Handler handler, size_t workers = 0, Handler rejected = nullptr);
+
+  ~WorkerPool();
+
+  WorkerPool(const WorkerPool& other) = delete;
+  WorkerPool& operator=(const WorkerPool& other) = delete;
+
+  void Start();
+
+  void Stop();
+
+  size_t Workers() const { return _shards.size(); }
+
+  //Requests dispatched to the shards but not picked up yet
+  size_t Backlog() const;
+
+  static bool RequiresOrdering(const common::NetworkRequest& request);
+
+private:
+  struct Shard {
+    explicit Shard(size_t capacity) : Ordered(capacity), Shared(capacity) {}
+
+    SocketMessageQueue Ordered;
+    SocketMessageQueue Shared;
+
+    std::mutex WaitMutex;
+    std::condition_variable Ready;
+    std::atomic<bool> Sleeping {false};
+  };
+
+  //Moves requests from the intake lanes to the shards
+  void Dispatch();
+
+  //Round robin over the shared queues, skipping shards that are full.
+  //False when all of them are, message is left untouched then.
+  bool Share(SocketMessage& message);
+
+  //Count a request no shard took and hand it to the rejected handler
+  void Reject(SocketMessage& message);
+
+  void Work(size_t index);
+
+  bool Steal(size_t thief, SocketMessage& message);
+
+  void Signal(Shard& shard);
+
+  void Run(SocketMessage& message);
+
+  std::shared_ptr<RequestLanes> _queue_in;
+  Handler _handler;
+  Handler _rejected;
+  std::vector<std::unique_ptr<Shard>> _shards;
+
+  std::atomic<bool> _should_stop {false};
+  std::thread* _dispatcher {NULL};
+  std::vector<std::thread> _workers;
+  size_t _next_shared {0};
+};
+}
+
+#endif
@@ -0,0 +1,93 @@
+/*
+*   WriteBehindPipeline decouples request workers from the database.
+*
+*   Workers Submit() mutations and return immediately. A flusher thread
+*   takes everything pending once PERSIST_BATCH_SIZE mutations are waiting
+*   or PERSIST_FLUSH_INTERVAL_MS passed, and hands it to the sink in batches
+*   of at most PERSIST_BATCH_SIZE. A mutation of a document that is still
+*   pending replaces the earlier one, so a hot document is written once per
+*   flush however often it changes.
+*
+*   Unflushed state is bounded: once PERSIST_MAX_PENDING documents are
+*   pending or in flight, Submit blocks until the sink catches up, pushing
+*   back on the workers and from there on the network intake. Failed
+*   batches are retried with exponential backoff. Stop() drains everything
+*   submitted before it returns.
+*
+*   Author: Fu Qiao
+*   Email:  fqiao@protonmail.com
+*
+*/
+
+#ifndef __WRITE_BEHIND_PIPELINE_H__
+#define __WRITE_BEHIND_PIPELINE_H__
+
+#include "Common.hpp"
+#include "PersistenceSink.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace sobertalk {
+
+class WriteBehindPipeline final {
+
+public:
+  WriteBehindPipeline(std::unique_ptr<PersistenceSink> sink,
+                      size_t batchSize = PERSIST_BATCH_SIZE,
+                      int flushIntervalMs = PERSIST_FLUSH_INTERVAL_MS,
+                      size_t maxPending = PERSIST_MAX_PENDING);
+
+  ~WriteBehindPipeline();
+
+  WriteBehindPipeline(const WriteBehindPipeline& other) = delete;
+  WriteBehindPipeline& operator=(const WriteBehindPipeline& other) = delete;
+
+  void Start();
+
+  //Flush everything submitted so far, then stop the flusher
+  void Stop();
+
+  //Queue a mutation, blocking while the pipeline is full
+  void Submit(Mutation mutation);
+
+  //Block until everything submitted so far has been written
+  void Flush();
+
+  //Documents pending or in flight
+  size_t Backlog() const;
+
+  PersistenceSink& Sink() { return *_sink; }
+
+private:
+  void Run();
+
+  //Write batch, retrying until it succeeds or the pipeline gives up during shutdown
+  void WriteBatch(const std::vector<Mutation>& batch);
+
+  static std::string KeyOf(const Mutation& mutation) { return mutation.Collection + '\0' + mutation.Key; }
+
+  std::unique_ptr<PersistenceSink> _sink;
+  const size_t _batch_size;
+  const std::chrono::milliseconds _flush_interval;
+  const size_t _max_pending;
+
+  mutable std::mutex _mutex;
+  std::condition_variable _work;  //wakes the flusher
+  std::condition_variable _space; //wakes blocked submitters and Flush()
+  std::vector<Mutation> _pending;
+  std::unordered_map<std::string, size_t> _index; //document to its slot in _pending
+  size_t _in_flight {0};
+  bool _flush_requested {false};
+
+  std::atomic<bool> _should_stop {false};
+  std::thread* _flusher {NULL};
+};
+}
+
+#endif
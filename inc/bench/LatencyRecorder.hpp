@@ -0,0 +1,72 @@
+/*
+*   LatencyRecorder keeps every latency sample of a benchmark run so the
+*   reported percentiles are exact and two runs can be compared number by
+*   number. Each load thread fills its own recorder, Merge() combines them
+*   once the run is over.
+*
+*   Author: Fu Qiao
+*   Email:  fqiao@protonmail.com
+*
+*/
+
+#ifndef __LATENCY_RECORDER_HPP__
+#define __LATENCY_RECORDER_HPP__
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+namespace bench {
+
+class LatencyRecorder {
+
+public:
+  void Record(std::chrono::nanoseconds latency) {
+    _samples.push_back(latency.count());
+    _sorted = false;
+  }
+
+  void Merge(const LatencyRecorder& other) {
+    _samples.insert(_samples.end(), other._samples.begin(), other._samples.end());
+    _sorted = false;
+  }
+
+  size_t Count() const { return _samples.size(); }
+
+  //Nearest-rank percentile in nanoseconds, percentile in [0, 100]
+  int64_t Percentile(double percentile) {
+    if (_samples.empty()) {
+      return 0;
+    }
+    Sort();
+
+    //99.9 / 100 * 1000 comes out a hair above 999, which would round the rank up to the max
+    double position = percentile * _samples.size() / 100.0;
+    size_t rank = static_cast<size_t>(std::ceil(position - position * 1e-12));
+    return _samples[rank == 0 ? 0 : std::min(rank, _samples.size()) - 1];
+  }
+
+  int64_t Max() {
+    if (_samples.empty()) {
+      return 0;
+    }
+    Sort();
+    return _samples.back();
+  }
+
+private:
+  void Sort() {
+    if (!_sorted) {
+      std::sort(_samples.begin(), _samples.end());
+      _sorted = true;
+    }
+  }
+
+  std::vector<int64_t> _samples;
+  bool _sorted {true};
+};
+}
+
+#endif
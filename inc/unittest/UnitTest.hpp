@@ -0,0 +1,75 @@
+/*
+*   UnitTest is the whole harness of the unittest target. TEST defines and
+*   registers a test case, CHECK and CHECK_EQUAL fail it with the expression
+*   and where it is. src/unittest/main.cpp runs every registered case, or
+*   only those whose name contains its first argument.
+*
+*   Author: Fu Qiao
+*   Email:  fqiao@protonmail.com
+*
+*/
+
+#ifndef __UNIT_TEST_HPP__
+#define __UNIT_TEST_HPP__
+
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace unittest {
+
+using TestFunction = void (*)();
+
+struct TestCase {
+  const char* Name;
+  TestFunction Function;
+};
+
+inline std::vector<TestCase>& Registry() {
+  static std::vector<TestCase> cases;
+  return cases;
+}
+
+struct Registration {
+  Registration(const char* name, TestFunction function) { Registry().push_back({name, function}); }
+};
+
+class Failure : public std::runtime_error {
+
+public:
+  explicit Failure(const std::string& message) : std::runtime_error(message) {}
+};
+
+inline void Fail(const std::string& what, const char* file, int line) {
+  std::stringstream ss;
+  ss << file << ":" << line << ": " << what;
+  throw Failure(ss.str());
+}
+
+template <typename Expected, typename Actual>
+void CheckEqual(const Expected& expected, const Actual& actual, const char* expression, const char* file, int line) {
+  if (!(expected == actual)) {
+    std::stringstream ss;
+    ss << expression << ": expected <" << expected << "> got <" << actual << ">";
+    Fail(ss.str(), file, line);
+  }
+}
+}
+
+#define TEST(name) \
+  static void name(); \
+  static unittest::Registration name##Registration(#name, name); \
+  static void name()
+
+#define CHECK(condition) \
+  do { \
+    if (!(condition)) { \
+      unittest::Fail("CHECK(" #condition ")", __FILE__, __LINE__); \
+    } \
+  } while (0)
+
+#define CHECK_EQUAL(expected, actual) \
+  unittest::CheckEqual((expected), (actual), "CHECK_EQUAL(" #expected ", " #actual ")", __FILE__, __LINE__)
+
+#endif
@@ -0,0 +1,107 @@
+#include "ByteRingBuffer.h"
+#include <algorithm>
+#include <string.h>
+
+namespace common {
+
+namespace {
+  size_t RoundUpPowerOfTwo(size_t value) {
+    size_t result = 1;
+    while (result < value) {
+      result <<= 1;
+    }
+    return result;
+  }
+}
+
+ByteRingBuffer::ByteRingBuffer(size_t initialCapacity)
+  : _initial_capacity(RoundUpPowerOfTwo(std::max<size_t>(initialCapacity, 64))),
+    _capacity(_initial_capacity),
+    _storage(new char[_capacity]) {
+}
+
+ByteRingBuffer::~ByteRingBuffer() {}
+
+char* ByteRingBuffer::PrepareWrite(size_t minFree, size_t& available) {
+
+  if (_size == 0) {
+    _head = 0;
+  }
+
+  size_t tail = (_head + _size) & (_capacity - 1);
+  size_t contiguous;
+  if (_size == _capacity) {
+    contiguous = 0;
+  } else if (tail >= _head) {
+    contiguous = _capacity - tail;
+  } else {
+    contiguous = _head - tail;
+  }
+
+  if (contiguous < minFree) {
+    //linearizing alone is enough when the total free space suffices
+    size_t required = _size + minFree;
+    Reallocate(required <= _capacity ? _capacity : RoundUpPowerOfTwo(required));
+    tail = _size;
+    contiguous = _capacity - _size;
+  }
+
+  available = contiguous;
+  return _storage.get() + tail;
+}
+
+void ByteRingBuffer::CommitWrite(size_t length) {
+  _size += length;
+}
+
+void ByteRingBuffer::Append(const char* data, size_t length) {
+  while (length > 0) {
+    size_t available;
+    char* target = PrepareWrite(1, available);
+    size_t chunk = std::min(available, length);
+    memcpy(target, data, chunk);
+    CommitWrite(chunk);
+    data += chunk;
+    length -= chunk;
+  }
+}
+
+size_t ByteRingBuffer::Peek(void* destination, size_t length) const {
+  length = std::min(length, _size);
+  size_t first = std::min(length, _capacity - _head);
+  memcpy(destination, _storage.get() + _head, first);
+  memcpy(static_cast<char*>(destination) + first, _storage.get(), length - first);
+  return length;
+}
+
+const char* ByteRingBuffer::Linearize(size_t length) {
+  if (_head + length > _capacity) {
+    Reallocate(_capacity);
+  }
+  return _storage.get() + _head;
+}
+
+void ByteRingBuffer::Consume(size_t length) {
+  length = std::min(length, _size);
+  _head = (_head + length) & (_capacity - 1);
+  _size -= length;
+}
+
+void ByteRingBuffer::Reset() {
+  _head = 0;
+  _size = 0;
+  if (_capacity != _initial_capacity) {
+    _capacity = _initial_capacity;
+    _storage.reset(new char[_capacity]);
+  }
+}
+
+void ByteRingBuffer::Reallocate(size_t capacity) {
+  std::unique_ptr<char[]> storage(new char[capacity]);
+  Peek(storage.get(), _size);
+  _storage = std::move(storage);
+  _capacity = capacity;
+  _head = 0;
+}
+
+}
@@ -0,0 +1,176 @@
+#include "DedupCache.h"
+#include <algorithm>
+#include <functional>
+
+namespace sobertalk {
+
+namespace {
+  uint64_t Mix(uint64_t value) {
+    value ^= value >> 33;
+    value *= 0xFF51AFD7ED558CCDULL;
+    value ^= value >> 33;
+    value *= 0xC4CEB9FE1A85EC53ULL;
+    value ^= value >> 33;
+    return value;
+  }
+}
+
+DedupCache::DedupCache(size_t entries, int64_t windowMs, int64_t pendingMs)
+  : _window_ns(std::max<int64_t>(windowMs, 0) * 1000000),
+    _pending_ns(std::max<int64_t>(pendingMs, 0) * 1000000) {
+  size_t perShard = std::max<size_t>(entries / SHARDS, 1);
+  for (size_t i = 0; i < SHARDS; ++i) {
+    _shards.push_back(std::make_unique<Shard>());
+    _shards.back()->Entries.resize(perShard);
+    _shards.back()->Index.reserve(perShard);
+  }
+}
+
+uint64_t DedupCache::KeyOf(const common::NetworkRequest& request) {
+  return Mix(std::hash<std::string>()(request.GetUserId()) ^ Mix(request.GetRequestId()));
+}
+
+bool DedupCache::Matches(const Entry& entry, const common::NetworkRequest& request) {
+  //a client reusing an id for another type of request means a new request
+  return entry.RequestId == request.GetRequestId() && entry.Type == request.GetRequestType() &&
+         entry.UserId == request.GetUserId();
+}
+
+DedupCache::Outcome DedupCache::Begin(const common::NetworkRequest& request, uint64_t now,
+                                      common::NetworkRequest& reply) {
+  if (!Applies(request)) {
+    return Outcome::MISS;
+  }
+
+  uint64_t key = KeyOf(request);
+  Shard& shard = ShardOf(key);
+  std::lock_guard<std::mutex> guard(shard.Mutex);
+
+  uint32_t slot;
+  auto it = shard.Index.find(key);
+  if (it != shard.Index.end()) {
+    slot = it->second;
+    Entry& entry = shard.Entries[slot];
+    if (Matches(entry, request) && !Expired(entry, now)) {
+      if (entry.Status == State::PENDING) {
+        return Outcome::PENDING;
+      }
+      entry.Referenced = true;
+      reply = common::NetworkRequest(entry.Result, entry.Type, entry.UserId);
+      reply.SetRequestId(entry.RequestId);
+      return Outcome::HIT;
+    }
+    //stale, or another request under the same key: the entry starts over for this one
+  } else {
+    slot = Evict(shard, now);
+    shard.Index.emplace(key, slot);
+  }
+
+  Entry& entry = shard.Entries[slot];
+  entry.Key = key;
+  entry.UserId = request.GetUserId();
+  entry.RequestId = request.GetRequestId();
+  entry.Type = request.GetRequestType();
+  entry.Result.clear();
+  entry.Until = now + _pending_ns;
+  entry.Status = State::PENDING;
+  entry.Referenced = false;
+  return Outcome::MISS;
+}
+
+void DedupCache::Complete(const common::NetworkRequest& reply, uint64_t now) {
+  if (!Applies(reply)) {
+    return;
+  }
+
+  uint64_t key = KeyOf(reply);
+  Shard& shard = ShardOf(key);
+  std::lock_guard<std::mutex> guard(shard.Mutex);
+
+  auto it = shard.Index.find(key);
+  if (it == shard.Index.end()) {
+    return;
+  }
+  Entry& entry = shard.Entries[it->second];
+  if (entry.Status != State::PENDING || !Matches(entry, reply)) {
+    return;
+  }
+
+  if (reply.GetParameters().size() > DEDUP_MAX_REPLY_BYTES) {
+    Release(shard, entry);
+    return;
+  }
+  entry.Result = reply.GetParameters();
+  entry.Until = now + _window_ns;
+  entry.Status = State::DONE;
+}
+
+void DedupCache::Hold(const common::NetworkRequest& request, uint64_t until) {
+  if (!Applies(request)) {
+    return;
+  }
+
+  uint64_t key = KeyOf(request);
+  Shard& shard = ShardOf(key);
+  std::lock_guard<std::mutex> guard(shard.Mutex);
+
+  auto it = shard.Index.find(key);
+  if (it == shard.Index.end()) {
+    return;
+  }
+  Entry& entry = shard.Entries[it->second];
+  if (entry.Status == State::PENDING && Matches(entry, request)) {
+    entry.Until = std::max(entry.Until, until);
+    //survive one pass of the hand, a long wait is no reason to be evicted first
+    entry.Referenced = true;
+  }
+}
+
+void DedupCache::Forget(const common::NetworkRequest& request) {
+  if (!Applies(request)) {
+    return;
+  }
+
+  uint64_t key = KeyOf(request);
+  Shard& shard = ShardOf(key);
+  std::lock_guard<std::mutex> guard(shard.Mutex);
+
+  auto it = shard.Index.find(key);
+  if (it != shard.Index.end() && Matches(shard.Entries[it->second], request)) {
+    Release(shard, shard.Entries[it->second]);
+  }
+}
+
+size_t DedupCache::Size() const {
+  size_t size = 0;
+  for (auto& shard : _shards) {
+    std::lock_guard<std::mutex> guard(shard->Mutex);
+    size += shard->Index.size();
+  }
+  return size;
+}
+
+uint32_t DedupCache::Evict(Shard& shard, uint64_t now) {
+  //every entry passed clears its bit, so the second round at the latest finds one
+  while (true) {
+    uint32_t slot = shard.Hand;
+    shard.Hand = (shard.Hand + 1) % shard.Entries.size();
+
+    Entry& entry = shard.Entries[slot];
+    if (entry.Status == State::EMPTY) {
+      return slot;
+    }
+    if (!entry.Referenced || Expired(entry, now)) {
+      Release(shard, entry);
+      return slot;
+    }
+    entry.Referenced = false;
+  }
+}
+
+void DedupCache::Release(Shard& shard, Entry& entry) {
+  shard.Index.erase(entry.Key);
+  entry.Status = State::EMPTY;
+  entry.Result.clear();
+}
+}
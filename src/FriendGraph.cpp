@@ -0,0 +1,294 @@
+#include "FriendGraph.h"
+#include <chrono>
+
+namespace sobertalk {
+
+FriendGraph::FriendGraph()
+  : _snapshot(std::make_shared<Snapshot>()),
+    _online(new std::atomic<std::atomic<uint64_t>*>[ONLINE_CHUNKS]) {
+
+  for (size_t i = 0; i < DELTA_SHARDS; ++i) {
+    _shards.push_back(std::make_unique<DeltaShard>());
+  }
+
+  for (size_t i = 0; i < ONLINE_CHUNKS; ++i) {
+    _online[i].store(nullptr, std::memory_order_relaxed);
+  }
+}
+
+FriendGraph::~FriendGraph() {
+  Stop();
+  for (size_t i = 0; i < ONLINE_CHUNKS; ++i) {
+    delete[] _online[i].load(std::memory_order_relaxed);
+  }
+}
+
+void FriendGraph::Start() {
+  _should_stop = false;
+  _merger = new std::thread(&FriendGraph::RunMerger, this);
+}
+
+void FriendGraph::Stop() {
+  {
+    std::lock_guard<std::mutex> guard(_wakeup_mutex);
+    _should_stop = true;
+  }
+  _merger_wakeup.notify_all();
+
+  if (_merger) {
+    if (_merger->joinable()) {
+      _merger->join();
+    }
+    delete _merger;
+    _merger = NULL;
+  }
+}
+
+bool FriendGraph::Add(uint32_t a, uint32_t b) {
+  return a != b && Apply(a, b, true);
+}
+
+bool FriendGraph::Remove(uint32_t a, uint32_t b) {
+  return a != b && Apply(a, b, false);
+}
+
+bool FriendGraph::AreFriends(uint32_t a, uint32_t b) const {
+  std::lock_guard<std::mutex> guard(ShardOf(a).Mutex);
+  return ContainsLocked(a, b);
+}
+
+void FriendGraph::RemoveAll(uint32_t user) {
+  std::vector<uint32_t> friends;
+  ForEachFriend(user, [&friends](uint32_t friendIndex) { friends.push_back(friendIndex); });
+  for (uint32_t friendIndex : friends) {
+    Remove(user, friendIndex);
+  }
+}
+
+void FriendGraph::SetOnline(uint32_t user, bool online) {
+  auto& slot = _online[user >> ONLINE_CHUNK_BITS];
+  std::atomic<uint64_t>* chunk = slot.load(std::memory_order_acquire);
+  if (chunk == nullptr) {
+    if (!online) {
+      return;
+    }
+
+    std::lock_guard<std::mutex> guard(_online_mutex);
+    chunk = slot.load(std::memory_order_relaxed);
+    if (chunk == nullptr) {
+      chunk = new std::atomic<uint64_t>[ONLINE_CHUNK_WORDS];
+      for (size_t i = 0; i < ONLINE_CHUNK_WORDS; ++i) {
+        chunk[i].store(0, std::memory_order_relaxed);
+      }
+      slot.store(chunk, std::memory_order_release);
+    }
+  }
+
+  size_t bit = user & ((size_t(1) << ONLINE_CHUNK_BITS) - 1);
+  uint64_t mask = uint64_t(1) << (bit & 63);
+  if (online) {
+    chunk[bit >> 6].fetch_or(mask, std::memory_order_relaxed);
+  } else {
+    chunk[bit >> 6].fetch_and(~mask, std::memory_order_relaxed);
+  }
+}
+
+bool FriendGraph::IsOnline(uint32_t user) const {
+  const std::atomic<uint64_t>* chunk = _online[user >> ONLINE_CHUNK_BITS].load(std::memory_order_acquire);
+  if (chunk == nullptr) {
+    return false;
+  }
+  size_t bit = user & ((size_t(1) << ONLINE_CHUNK_BITS) - 1);
+  return (chunk[bit >> 6].load(std::memory_order_relaxed) >> (bit & 63)) & 1;
+}
+
+void FriendGraph::Reduce(std::vector<Edit>& edits) {
+  //stable: edits of one friend stay in sequence order, the last one wins
+  std::stable_sort(edits.begin(), edits.end(),
+                   [](const Edit& x, const Edit& y) { return x.Friend < y.Friend; });
+
+  size_t kept = 0;
+  for (size_t i = 0; i < edits.size(); ++i) {
+    if (i + 1 < edits.size() && edits[i + 1].Friend == edits[i].Friend) {
+      continue;
+    }
+    edits[kept++] = edits[i];
+  }
+  edits.resize(kept);
+}
+
+std::shared_ptr<const FriendGraph::Snapshot> FriendGraph::Load(uint32_t user, std::vector<Edit>& edits) const {
+  {
+    DeltaShard& shard = ShardOf(user);
+    std::lock_guard<std::mutex> guard(shard.Mutex);
+    auto it = shard.Edits.find(user);
+    if (it != shard.Edits.end()) {
+      edits = it->second;
+    }
+  }
+  Reduce(edits);
+
+  //loaded after the delta: a merge publishes its snapshot before dropping the
+  //edits it absorbed, and re-applying an absorbed edit is harmless
+  return std::atomic_load(&_snapshot);
+}
+
+bool FriendGraph::ContainsLocked(uint32_t a, uint32_t b) const {
+  const DeltaShard& shard = ShardOf(a);
+  auto it = shard.Edits.find(a);
+  if (it != shard.Edits.end()) {
+    for (auto edit = it->second.rbegin(); edit != it->second.rend(); ++edit) {
+      if (edit->Friend == b) {
+        return edit->Added;
+      }
+    }
+  }
+
+  auto snapshot = std::atomic_load(&_snapshot);
+  if (a >= snapshot->Vertices()) {
+    return false;
+  }
+  auto first = snapshot->Neighbors.begin() + snapshot->Offsets[a];
+  auto last = snapshot->Neighbors.begin() + snapshot->Offsets[a + 1];
+  return std::binary_search(first, last, b);
+}
+
+void FriendGraph::AppendLocked(uint32_t user, uint32_t other, bool added) {
+  //sequence taken under the shard lock, see Merge()
+  ShardOf(user).Edits[user].push_back({other, added, ++_sequence});
+}
+
+bool FriendGraph::Apply(uint32_t a, uint32_t b, bool added) {
+
+  DeltaShard* first = &ShardOf(a);
+  DeltaShard* second = &ShardOf(b);
+  if (first > second) {
+    std::swap(first, second);
+  }
+
+  std::unique_lock<std::mutex> firstGuard(first->Mutex);
+  std::unique_lock<std::mutex> secondGuard;
+  if (second != first) {
+    secondGuard = std::unique_lock<std::mutex>(second->Mutex);
+  }
+
+  if (ContainsLocked(a, b) == added) {
+    return false;
+  }
+  AppendLocked(a, b, added);
+  AppendLocked(b, a, added);
+
+  if ((_delta_size += 2) >= FRIEND_DELTA_LIMIT) {
+    _merger_wakeup.notify_one();
+  }
+  return true;
+}
+
+void FriendGraph::Merge() {
+
+  std::lock_guard<std::mutex> mergeGuard(_merge_mutex);
+
+  //every edit numbered up to the watermark is already in its shard: sequences
+  //are taken and appended under the same shard lock we wait for below
+  uint64_t watermark = _sequence.load();
+
+  std::vector<std::pair<uint32_t, std::vector<Edit>>> pending;
+  for (auto& shard : _shards) {
+    std::lock_guard<std::mutex> guard(shard->Mutex);
+    for (auto& entry : shard->Edits) {
+      std::vector<Edit> edits;
+      for (const Edit& edit : entry.second) {
+        if (edit.Sequence <= watermark) {
+          edits.push_back(edit);
+        }
+      }
+      if (!edits.empty()) {
+        pending.emplace_back(entry.first, std::move(edits));
+      }
+    }
+  }
+
+  if (pending.empty()) {
+    return;
+  }
+
+  std::sort(pending.begin(), pending.end(),
+            [](const auto& x, const auto& y) { return x.first < y.first; });
+
+  auto current = std::atomic_load(&_snapshot);
+  uint32_t vertices = std::max(current->Vertices(), pending.back().first + 1);
+
+  auto merged = std::make_shared<Snapshot>();
+  merged->Offsets.reserve(static_cast<size_t>(vertices) + 1);
+  merged->Neighbors.reserve(current->Neighbors.size() + _delta_size.load());
+
+  auto next = pending.begin();
+  for (uint32_t user = 0; user < vertices; ++user) {
+    const uint32_t* it = nullptr;
+    const uint32_t* end = nullptr;
+    if (user < current->Vertices()) {
+      it = current->Neighbors.data() + current->Offsets[user];
+      end = current->Neighbors.data() + current->Offsets[user + 1];
+    }
+
+    if (next == pending.end() || next->first != user) {
+      merged->Neighbors.insert(merged->Neighbors.end(), it, end);
+      merged->Offsets.push_back(merged->Neighbors.size());
+      continue;
+    }
+
+    std::vector<Edit>& edits = next->second;
+    Reduce(edits);
+    auto edit = edits.begin();
+    while (it != end || edit != edits.end()) {
+      if (edit == edits.end() || (it != end && *it < edit->Friend)) {
+        merged->Neighbors.push_back(*it++);
+        continue;
+      }
+      if (it != end && *it == edit->Friend) {
+        ++it;
+      }
+      if (edit->Added) {
+        merged->Neighbors.push_back(edit->Friend);
+      }
+      ++edit;
+    }
+    merged->Offsets.push_back(merged->Neighbors.size());
+    ++next;
+  }
+
+  std::shared_ptr<const Snapshot> published = std::move(merged);
+  std::atomic_store(&_snapshot, published);
+
+  size_t absorbed = 0;
+  for (auto& shard : _shards) {
+    std::lock_guard<std::mutex> guard(shard->Mutex);
+    for (auto it = shard->Edits.begin(); it != shard->Edits.end();) {
+      auto& edits = it->second;
+      auto kept = std::remove_if(edits.begin(), edits.end(),
+                                 [watermark](const Edit& edit) { return edit.Sequence <= watermark; });
+      absorbed += edits.end() - kept;
+      edits.erase(kept, edits.end());
+      it = edits.empty() ? shard->Edits.erase(it) : std::next(it);
+    }
+  }
+  _delta_size -= absorbed;
+}
+
+void FriendGraph::RunMerger() {
+
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(_wakeup_mutex);
+      _merger_wakeup.wait_for(lock, std::chrono::milliseconds(FRIEND_MERGE_INTERVAL_MS), [this] {
+        return _should_stop.load() || _delta_size.load() >= FRIEND_DELTA_LIMIT;
+      });
+      if (_should_stop) {
+        return;
+      }
+    }
+    Merge();
+  }
+}
+
+}
@@ -0,0 +1,134 @@
+#include "GroupRegistry.h"
+#include <algorithm>
+#include <functional>
+
+namespace sobertalk {
+
+GroupRegistry::GroupRegistry(size_t shards) {
+  for (size_t i = 0; i < (shards == 0 ? 1 : shards); ++i) {
+    _groups.push_back(std::make_unique<GroupShard>());
+    _memberships.push_back(std::make_unique<MembershipShard>());
+  }
+}
+
+GroupRegistry::GroupShard& GroupRegistry::GroupShardOf(const std::string& group) const {
+  return *_groups[std::hash<std::string>()(group) % _groups.size()];
+}
+
+bool GroupRegistry::Create(const std::string& group, uint32_t owner) {
+  {
+    GroupShard& shard = GroupShardOf(group);
+    std::lock_guard<std::mutex> guard(shard.Mutex);
+    auto& members = shard.Groups[group];
+    if (members) {
+      return false;
+    }
+    members = std::make_shared<const Members>(1, owner);
+  }
+  AddMembership(owner, group);
+  return true;
+}
+
+GroupRegistry::Result GroupRegistry::Join(const std::string& group, uint32_t user) {
+  {
+    GroupShard& shard = GroupShardOf(group);
+    std::lock_guard<std::mutex> guard(shard.Mutex);
+    auto it = shard.Groups.find(group);
+    if (it == shard.Groups.end()) {
+      return Result::NOT_FOUND;
+    }
+
+    const Members& current = *it->second;
+    auto position = std::lower_bound(current.begin(), current.end(), user);
+    if (position != current.end() && *position == user) {
+      return Result::EXISTS;
+    }
+
+    //senders may still be walking the current members, publish a copy
+    auto members = std::make_shared<Members>();
+    members->reserve(current.size() + 1);
+    members->insert(members->end(), current.begin(), position);
+    members->push_back(user);
+    members->insert(members->end(), position, current.end());
+    it->second = std::move(members);
+  }
+  AddMembership(user, group);
+  return Result::OK;
+}
+
+GroupRegistry::Result GroupRegistry::Leave(const std::string& group, uint32_t user) {
+  {
+    GroupShard& shard = GroupShardOf(group);
+    std::lock_guard<std::mutex> guard(shard.Mutex);
+    auto it = shard.Groups.find(group);
+    if (it == shard.Groups.end()) {
+      return Result::NOT_FOUND;
+    }
+
+    const Members& current = *it->second;
+    auto position = std::lower_bound(current.begin(), current.end(), user);
+    if (position == current.end() || *position != user) {
+      return Result::NOT_FOUND;
+    }
+
+    if (current.size() == 1) {
+      shard.Groups.erase(it);
+    } else {
+      auto members = std::make_shared<Members>();
+      members->reserve(current.size() - 1);
+      members->insert(members->end(), current.begin(), position);
+      members->insert(members->end(), position + 1, current.end());
+      it->second = std::move(members);
+    }
+  }
+  RemoveMembership(user, group);
+  return Result::OK;
+}
+
+std::vector<std::string> GroupRegistry::LeaveAll(uint32_t user) {
+  std::vector<std::string> groups;
+  {
+    MembershipShard& shard = MembershipShardOf(user);
+    std::lock_guard<std::mutex> guard(shard.Mutex);
+    auto it = shard.Groups.find(user);
+    if (it == shard.Groups.end()) {
+      return groups;
+    }
+    groups = it->second;
+  }
+
+  for (const std::string& group : groups) {
+    Leave(group, user);
+  }
+  return groups;
+}
+
+std::shared_ptr<const GroupRegistry::Members> GroupRegistry::MembersOf(const std::string& group) const {
+  GroupShard& shard = GroupShardOf(group);
+  std::lock_guard<std::mutex> guard(shard.Mutex);
+  auto it = shard.Groups.find(group);
+  return it == shard.Groups.end() ? nullptr : it->second;
+}
+
+void GroupRegistry::AddMembership(uint32_t user, const std::string& group) {
+  MembershipShard& shard = MembershipShardOf(user);
+  std::lock_guard<std::mutex> guard(shard.Mutex);
+  shard.Groups[user].push_back(group);
+}
+
+void GroupRegistry::RemoveMembership(uint32_t user, const std::string& group) {
+  MembershipShard& shard = MembershipShardOf(user);
+  std::lock_guard<std::mutex> guard(shard.Mutex);
+  auto it = shard.Groups.find(user);
+  if (it == shard.Groups.end()) {
+    return;
+  }
+
+  auto& groups = it->second;
+  groups.erase(std::remove(groups.begin(), groups.end(), group), groups.end());
+  if (groups.empty()) {
+    shard.Groups.erase(it);
+  }
+}
+
+}
@@ -0,0 +1,316 @@
+#include "IoUring.h"
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+
+namespace network {
+
+namespace {
+  const int MIN_KERNEL_MAJOR = 6;  //multishot recv arrived in 6.0
+
+  //how long teardown waits for cancelled operations to complete
+  const std::chrono::milliseconds RELEASE_TIMEOUT(2000);
+  const int RELEASE_WAIT_MS = 50;
+  const uint64_t CANCEL_ALL_DATA = ~0ULL;
+
+  int SetupRing(unsigned entries, struct io_uring_params* params) {
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+  }
+
+  int RegisterRing(int fd, unsigned opcode, void* arg, unsigned count) {
+    return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, count));
+  }
+
+  bool KernelAtLeast(int major) {
+    struct utsname name;
+    if (uname(&name) != 0) {
+      return false;
+    }
+    return atoi(name.release) >= major;
+  }
+
+  void* MapRing(int fd, size_t size, off_t offset) {
+    void* ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+    if (ring == MAP_FAILED) {
+      RaiseSocketException("Error when mmap(io_uring): ");
+    }
+    return ring;
+  }
+}
+
+IoUring::IoUring(unsigned entries, unsigned bufferCount, size_t bufferSize) : _buffer_size(bufferSize) {
+
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  //every submitted operation may complete several times, leave room for the completions
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = entries * 4;
+
+  _ring_fd = SetupRing(entries, &params);
+  if (_ring_fd == -1) {
+    RaiseSocketException("Error when io_uring_setup: ");
+  }
+
+  try {
+    if (!(params.features & IORING_FEAT_EXT_ARG)) {
+      errno = ENOTSUP;
+      RaiseSocketException("Error when io_uring_setup: ");
+    }
+    MapRings(params);
+    RegisterBuffers(bufferCount);
+  } catch (...) {
+    Release();
+    throw;
+  }
+}
+
+IoUring::~IoUring() {
+  Release();
+}
+
+bool IoUring::Supported() {
+  if (!KernelAtLeast(MIN_KERNEL_MAJOR)) {
+    return false;
+  }
+
+  try {
+    IoUring probe(8, 8, 64);
+  } catch (const SocketException&) {
+    return false;
+  }
+  return true;
+}
+
+void IoUring::MapRings(const struct io_uring_params& params) {
+
+  _sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  _cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    _sq_ring_size = _cq_ring_size = std::max(_sq_ring_size, _cq_ring_size);
+  }
+
+  _sq_ring = MapRing(_ring_fd, _sq_ring_size, IORING_OFF_SQ_RING);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    _cq_ring = _sq_ring;
+  } else {
+    _cq_ring = MapRing(_ring_fd, _cq_ring_size, IORING_OFF_CQ_RING);
+  }
+  _sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  _sqes = static_cast<struct io_uring_sqe*>(MapRing(_ring_fd, _sqes_size, IORING_OFF_SQES));
+
+  char* sq = static_cast<char*>(_sq_ring);
+  _sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+  _sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+  _sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+  _sq_entries = params.sq_entries;
+  _sq_local_tail = *_sq_tail;
+
+  //entries are always filled in ring order, so the indirection array is the identity
+  unsigned* array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+  for (unsigned i = 0; i < _sq_entries; ++i) {
+    array[i] = i;
+  }
+
+  char* cq = static_cast<char*>(_cq_ring);
+  _cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+  _cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+  _cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+  _cqes = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+}
+
+void IoUring::RegisterBuffers(unsigned bufferCount) {
+
+  //the buffer ring has to be a power of two in size
+  unsigned entries = 1;
+  while (entries < bufferCount) {
+    entries <<= 1;
+  }
+  _buffer_mask = entries - 1;
+
+  _buffer_ring_size = entries * sizeof(struct io_uring_buf);
+  void* ring = mmap(NULL, _buffer_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring == MAP_FAILED) {
+    RaiseSocketException("Error when mmap(buffer ring): ");
+  }
+  _buffer_ring = static_cast<struct io_uring_buf*>(ring);
+  _buffers = new char[entries * _buffer_size];
+
+  struct io_uring_buf_reg registration;
+  memset(&registration, 0, sizeof(registration));
+  registration.ring_addr = reinterpret_cast<uint64_t>(_buffer_ring);
+  registration.ring_entries = entries;
+  registration.bgid = BUFFER_GROUP;
+  if (RegisterRing(_ring_fd, IORING_REGISTER_PBUF_RING, &registration, 1) != 0) {
+    RaiseSocketException("Error when io_uring_register(PBUF_RING): ");
+  }
+
+  _buffer_tail = 0;
+  for (unsigned id = 0; id < entries; ++id) {
+    ReturnBuffer(static_cast<uint16_t>(id));
+  }
+}
+
+bool IoUring::CancelAll() {
+
+  auto deadline = std::chrono::steady_clock::now() + RELEASE_TIMEOUT;
+  try {
+    //entries that were never submitted are handed over as well and cancelled with the rest
+    struct io_uring_sqe* sqe = NextSqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+    sqe->user_data = CANCEL_ALL_DATA;
+
+    while (_in_flight > 0 && std::chrono::steady_clock::now() < deadline) {
+      SubmitAndWait(RELEASE_WAIT_MS);
+      Drain([](const struct io_uring_cqe&) {});
+    }
+  } catch (const SocketException&) {
+    return false;
+  }
+  return _in_flight == 0;
+}
+
+void IoUring::Release() {
+  //closing the ring fd alone does not wait for the kernel to let go of in-flight
+  //operations, which may still be filling receive buffers or reading send data
+  bool idle = _in_flight == 0 || (_sqes != nullptr && CancelAll());
+  if (_ring_fd != -1) {
+    close(_ring_fd);
+    _ring_fd = -1;
+  }
+  if (_sqes != nullptr) {
+    munmap(_sqes, _sqes_size);
+    _sqes = nullptr;
+  }
+  if (_cq_ring != nullptr && _cq_ring != _sq_ring) {
+    munmap(_cq_ring, _cq_ring_size);
+  }
+  _cq_ring = nullptr;
+  if (_sq_ring != nullptr) {
+    munmap(_sq_ring, _sq_ring_size);
+    _sq_ring = nullptr;
+  }
+  if (!idle) {
+    //leaking beats letting the kernel write into freed memory
+    std::cerr << "io_uring: " << _in_flight << " operations did not complete, leaking their buffers" << std::endl;
+    _buffer_ring = nullptr;
+    _buffers = nullptr;
+    return;
+  }
+  if (_buffer_ring != nullptr) {
+    munmap(_buffer_ring, _buffer_ring_size);
+    _buffer_ring = nullptr;
+  }
+  delete[] _buffers;
+  _buffers = nullptr;
+}
+
+struct io_uring_sqe* IoUring::NextSqe() {
+  while (_sq_local_tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE) >= _sq_entries) {
+    if (!Enter(0, 0)) {
+      RaiseSocketException("Error when io_uring_enter: submission ring is full");
+    }
+  }
+
+  struct io_uring_sqe* sqe = &_sqes[_sq_local_tail & _sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  ++_sq_local_tail;
+  ++_in_flight;
+  return sqe;
+}
+
+void IoUring::PrepareMultishotAccept(int listener, uint64_t userData, int flags) {
+  struct io_uring_sqe* sqe = NextSqe();
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = listener;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = flags;
+  sqe->user_data = userData;
+}
+
+void IoUring::PrepareMultishotRecv(int descriptor, uint64_t userData) {
+  struct io_uring_sqe* sqe = NextSqe();
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = descriptor;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = BUFFER_GROUP;
+  sqe->user_data = userData;
+}
+
+void IoUring::PrepareSend(int descriptor, const void* data, size_t length, uint64_t userData) {
+  struct io_uring_sqe* sqe = NextSqe();
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = descriptor;
+  sqe->addr = reinterpret_cast<uint64_t>(data);
+  sqe->len = static_cast<uint32_t>(length);
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = userData;
+}
+
+void IoUring::PrepareMultishotPoll(int descriptor, uint32_t events, uint64_t userData) {
+  struct io_uring_sqe* sqe = NextSqe();
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = descriptor;
+  sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->poll32_events = events;
+  sqe->user_data = userData;
+}
+
+void IoUring::PrepareCancel(uint64_t target, uint64_t userData) {
+  struct io_uring_sqe* sqe = NextSqe();
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = target;
+  sqe->user_data = userData;
+}
+
+void IoUring::Submit() {
+  if (_sq_local_tail != *_sq_tail) {
+    Enter(0, 0);
+  }
+}
+
+void IoUring::SubmitAndWait(int timeoutMs) {
+  Enter(1, timeoutMs);
+}
+
+bool IoUring::Enter(unsigned minComplete, int timeoutMs) {
+
+  __atomic_store_n(_sq_tail, _sq_local_tail, __ATOMIC_RELEASE);
+  unsigned pending = _sq_local_tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE);
+
+  unsigned flags = 0;
+  struct __kernel_timespec timeout {timeoutMs / 1000, (timeoutMs % 1000) * 1000000LL};
+  struct io_uring_getevents_arg arg;
+  memset(&arg, 0, sizeof(arg));
+  if (minComplete > 0) {
+    flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    arg.ts = reinterpret_cast<uint64_t>(&timeout);
+  }
+
+  long result = syscall(__NR_io_uring_enter, _ring_fd, pending, minComplete, flags, &arg, sizeof(arg));
+  NotifySocketHook(SocketCall::RING_ENTER, result);
+  if (result == -1) {
+    //a timeout or signal only ends the wait, a full completion ring is drained by the caller
+    if (errno == ETIME || errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+      return false;
+    }
+    RaiseSocketException("Error when io_uring_enter: ");
+  }
+  return true;
+}
+
+void IoUring::ReturnBuffer(uint16_t id) {
+  struct io_uring_buf* buffer = &_buffer_ring[_buffer_tail & _buffer_mask];
+  buffer->addr = reinterpret_cast<uint64_t>(_buffers + static_cast<size_t>(id) * _buffer_size);
+  buffer->len = static_cast<uint32_t>(_buffer_size);
+  buffer->bid = id;
+  ++_buffer_tail;
+  __atomic_store_n(&_buffer_ring[0].resv, static_cast<uint16_t>(_buffer_tail), __ATOMIC_RELEASE);
+}
+
+}
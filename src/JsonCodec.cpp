@@ -0,0 +1,400 @@
+#include "JsonCodec.h"
+#include <charconv>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace common {
+
+namespace {
+  const char* HEX_DIGITS = "0123456789ABCDEF";
+  const size_t MAX_TYPE_DIGITS = 9;  //always fits an int
+  const size_t MAX_ID_DIGITS = 20;   //a uint64_t, checked for overflow
+
+  enum class Field {
+
+    TYPE,
+
+    PARAMETERS,
+
+    USER_ID,
+
+    REQUEST_ID,
+
+    OTHER
+  };
+
+  Field FieldOf(std::string_view key) {
+    if (key == "request_type") {
+      return Field::TYPE;
+    }
+    if (key == "parameters") {
+      return Field::PARAMETERS;
+    }
+    if (key == "user_id") {
+      return Field::USER_ID;
+    }
+    if (key == "request_id") {
+      return Field::REQUEST_ID;
+    }
+    return Field::OTHER;
+  }
+
+  //Offset of the first byte a reader has to look at: a quote, a backslash,
+  //a control character or a byte from 0x80 on. size if there is none.
+  size_t FindSpecial(const char* data, size_t size) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i space = _mm_set1_epi8(0x20);
+    for (; i + 16 <= size; i += 16) {
+      __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+      //compared as signed bytes, 0x80 and above are below the space as well
+      __m128i special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)),
+                                     _mm_cmplt_epi8(chunk, space));
+      int mask = _mm_movemask_epi8(special);
+      if (mask != 0) {
+        return i + __builtin_ctz(mask);
+      }
+    }
+#endif
+    for (; i < size; ++i) {
+      unsigned char c = data[i];
+      if (c == '"' || c == '\\' || c < 0x20 || c >= 0x80) {
+        return i;
+      }
+    }
+    return size;
+  }
+
+  //Offset of the first byte the writer has to escape: a quote, a backslash,
+  //a slash or a control character. size if there is none.
+  size_t FindEscaped(const char* data, size_t size) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i slash = _mm_set1_epi8('/');
+    const __m128i control = _mm_set1_epi8(0x1F);
+    for (; i + 16 <= size; i += 16) {
+      __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+      __m128i special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)),
+                                     _mm_or_si128(_mm_cmpeq_epi8(chunk, slash),
+                                                  _mm_cmpeq_epi8(_mm_min_epu8(chunk, control), chunk)));
+      int mask = _mm_movemask_epi8(special);
+      if (mask != 0) {
+        return i + __builtin_ctz(mask);
+      }
+    }
+#endif
+    for (; i < size; ++i) {
+      unsigned char c = data[i];
+      if (c == '"' || c == '\\' || c == '/' || c < 0x20) {
+        return i;
+      }
+    }
+    return size;
+  }
+
+  //Length of the well-formed UTF-8 sequence at data, 0 if it is not one.
+  //Overlong forms, surrogates and code points past U+10FFFF are not.
+  size_t Utf8Length(const unsigned char* data, size_t size) {
+    unsigned char c = data[0];
+    unsigned char low = 0x80;
+    unsigned char high = 0xBF;
+    size_t length;
+    if (c >= 0xC2 && c <= 0xDF) {
+      length = 2;
+    } else if (c >= 0xE0 && c <= 0xEF) {
+      length = 3;
+      low = c == 0xE0 ? 0xA0 : low;
+      high = c == 0xED ? 0x9F : high;
+    } else if (c >= 0xF0 && c <= 0xF4) {
+      length = 4;
+      low = c == 0xF0 ? 0x90 : low;
+      high = c == 0xF4 ? 0x8F : high;
+    } else {
+      return 0;
+    }
+
+    if (size < length || data[1] < low || data[1] > high) {
+      return 0;
+    }
+    for (size_t i = 2; i < length; ++i) {
+      if (data[i] < 0x80 || data[i] > 0xBF) {
+        return 0;
+      }
+    }
+    return length;
+  }
+
+  bool ParseDigits(std::string_view digits, int& value) {
+    if (digits.empty() || digits.size() > MAX_TYPE_DIGITS) {
+      return false;
+    }
+    value = 0;
+    for (char c : digits) {
+      if (c < '0' || c > '9') {
+        return false;
+      }
+      value = value * 10 + (c - '0');
+    }
+    return true;
+  }
+
+  bool ParseDigits(std::string_view digits, uint64_t& value) {
+    if (digits.empty() || digits.size() > MAX_ID_DIGITS) {
+      return false;
+    }
+    auto parsed = std::from_chars(digits.data(), digits.data() + digits.size(), value);
+    return parsed.ec == std::errc() && parsed.ptr == digits.data() + digits.size();
+  }
+
+  class Reader {
+
+  public:
+    explicit Reader(std::string_view document) : _at(document.data()), _end(document.data() + document.size()) {}
+
+    bool AtEnd() const { return _at == _end; }
+
+    void SkipSpace() {
+      while (_at < _end && (*_at == ' ' || *_at == '\n' || *_at == '\r' || *_at == '\t')) {
+        ++_at;
+      }
+    }
+
+    bool Consume(char c) {
+      if (_at < _end && *_at == c) {
+        ++_at;
+        return true;
+      }
+      return false;
+    }
+
+    //After the opening quote: decode the string into out, or only check it when out is NULL
+    bool ReadString(std::string* out) {
+      if (out != nullptr) {
+        out->reserve(_end - _at);
+      }
+
+      while (true) {
+        size_t run = FindSpecial(_at, _end - _at);
+        if (out != nullptr) {
+          out->append(_at, run);
+        }
+        _at += run;
+        if (_at == _end) {
+          return false;
+        }
+
+        unsigned char c = *_at;
+        if (c == '"') {
+          ++_at;
+          return true;
+        }
+
+        if (c == '\\') {
+          if (_end - _at < 2) {
+            return false;
+          }
+          char decoded;
+          switch (_at[1]) {
+            case '"':  decoded = '"'; break;
+            case '\\': decoded = '\\'; break;
+            case '/':  decoded = '/'; break;
+            case 'b':  decoded = '\b'; break;
+            case 'f':  decoded = '\f'; break;
+            case 'n':  decoded = '\n'; break;
+            case 'r':  decoded = '\r'; break;
+            case 't':  decoded = '\t'; break;
+            default:   return false;  //\u and invalid escapes
+          }
+          if (out != nullptr) {
+            out->push_back(decoded);
+          }
+          _at += 2;
+          continue;
+        }
+
+        if (c < 0x20) {
+          return false;
+        }
+
+        size_t length = Utf8Length(reinterpret_cast<const unsigned char*>(_at), _end - _at);
+        if (length == 0) {
+          return false;
+        }
+        if (out != nullptr) {
+          out->append(_at, length);
+        }
+        _at += length;
+      }
+    }
+
+    //After the opening quote: a key of plain ASCII without escapes
+    bool ReadKey(std::string_view& key) {
+      size_t run = FindSpecial(_at, _end - _at);
+      if (_at + run == _end || _at[run] != '"') {
+        return false;
+      }
+      key = std::string_view(_at, run);
+      _at += run + 1;
+      return true;
+    }
+
+    //A non-negative integer without fraction or exponent, the caller checks what follows
+    template <typename Integer>
+    bool ReadInteger(Integer& value) {
+      const char* start = _at;
+      while (_at < _end && *_at >= '0' && *_at <= '9') {
+        ++_at;
+      }
+      std::string_view digits(start, _at - start);
+      //JSON forbids leading zeros
+      if (digits.size() > 1 && digits[0] == '0') {
+        return false;
+      }
+      return ParseDigits(digits, value);
+    }
+
+  private:
+    const char* _at;
+    const char* _end;
+  };
+}
+
+bool ParseJsonRequest(std::string_view document, JsonRequestFields& fields) {
+
+  Reader reader(document);
+  bool seen[4] = {false, false, false, false};
+  std::string typeText;
+  std::string idText;
+  fields.Parameters.clear();
+  fields.UserId.clear();
+  fields.RequestId = 0;
+
+  reader.SkipSpace();
+  if (!reader.Consume('{')) {
+    return false;
+  }
+
+  do {
+    reader.SkipSpace();
+    std::string_view key;
+    if (!reader.Consume('"') || !reader.ReadKey(key)) {
+      return false;
+    }
+    reader.SkipSpace();
+    if (!reader.Consume(':')) {
+      return false;
+    }
+    reader.SkipSpace();
+
+    //the general parser keeps duplicates and picks the first, leave them to it
+    Field field = FieldOf(key);
+    if (field != Field::OTHER) {
+      if (seen[static_cast<int>(field)]) {
+        return false;
+      }
+      seen[static_cast<int>(field)] = true;
+    }
+
+    if (reader.Consume('"')) {
+      std::string* target = field == Field::TYPE ? &typeText :
+                            field == Field::PARAMETERS ? &fields.Parameters :
+                            field == Field::USER_ID ? &fields.UserId :
+                            field == Field::REQUEST_ID ? &idText : nullptr;
+      if (!reader.ReadString(target)) {
+        return false;
+      }
+      if (field == Field::TYPE && !ParseDigits(typeText, fields.Type)) {
+        return false;
+      }
+      if (field == Field::REQUEST_ID && !ParseDigits(idText, fields.RequestId)) {
+        return false;
+      }
+    } else if (field == Field::TYPE) {
+      if (!reader.ReadInteger(fields.Type)) {
+        return false;
+      }
+    } else if (field != Field::REQUEST_ID || !reader.ReadInteger(fields.RequestId)) {
+      return false;
+    }
+    reader.SkipSpace();
+  } while (reader.Consume(','));
+
+  if (!reader.Consume('}')) {
+    return false;
+  }
+  reader.SkipSpace();
+  return reader.AtEnd() && seen[static_cast<int>(Field::TYPE)] && seen[static_cast<int>(Field::PARAMETERS)];
+}
+
+void AppendJsonRequest(std::string& out, int type, std::string_view parameters, std::string_view userId,
+                       uint64_t requestId) {
+  out.reserve(out.size() + parameters.size() + userId.size() + 96);
+  AppendJsonRequestHead(out, type, parameters);
+  AppendJsonRequestTail(out, std::string_view(), userId, requestId);
+}
+
+void AppendJsonRequestHead(std::string& out, int type, std::string_view parameters) {
+  char number[16];
+  auto converted = std::to_chars(number, number + sizeof(number), type);
+
+  out += "{\"request_type\":\"";
+  out.append(number, converted.ptr - number);
+  out += "\",\"parameters\":\"";
+  AppendJsonEscaped(out, parameters);
+}
+
+void AppendJsonRequestTail(std::string& out, std::string_view parameters, std::string_view userId,
+                           uint64_t requestId) {
+  //escaping goes one byte at a time, so the parameters can be cut anywhere
+  AppendJsonEscaped(out, parameters);
+  out += '"';
+  if (!userId.empty()) {
+    out += ",\"user_id\":\"";
+    AppendJsonEscaped(out, userId);
+    out += '"';
+  }
+  if (requestId != 0) {
+    char number[24];
+    auto converted = std::to_chars(number, number + sizeof(number), requestId);
+    out += ",\"request_id\":\"";
+    out.append(number, converted.ptr - number);
+    out += '"';
+  }
+  out += "}\n";
+}
+
+void AppendJsonEscaped(std::string& out, std::string_view value) {
+
+  const char* at = value.data();
+  const char* end = at + value.size();
+  while (true) {
+    size_t run = FindEscaped(at, end - at);
+    out.append(at, run);
+    at += run;
+    if (at == end) {
+      return;
+    }
+
+    unsigned char c = *at++;
+    switch (c) {
+      case '"':  out += "\\\""; break;
+      case '\\': out += "\\\\"; break;
+      case '/':  out += "\\/"; break;
+      case '\b': out += "\\b"; break;
+      case '\f': out += "\\f"; break;
+      case '\n': out += "\\n"; break;
+      case '\r': out += "\\r"; break;
+      case '\t': out += "\\t"; break;
+      default: {
+        char escaped[6] = {'\\', 'u', '0', '0', HEX_DIGITS[c >> 4], HEX_DIGITS[c & 0xF]};
+        out.append(escaped, sizeof(escaped));
+      }
+    }
+  }
+}
+}
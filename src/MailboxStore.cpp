@@ -0,0 +1,586 @@
+#include "MailboxStore.h"
+#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+#include <sstream>
+#include <string_view>
+#include <unordered_set>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace sobertalk {
+
+namespace {
+  const uint32_t RECORD_MAGIC = 0x4D424F58;    //"MBOX"
+  const uint32_t REFERENCE_MAGIC = 0x4D524546; //"MREF", a recipient of a shared body
+  const uint32_t RESERVED_MAGIC = 0x4D525356;  //"MRSV", being written, skipped on replay
+  const uint32_t SEQUENCE_MAGIC = 0x4D534551;  //"MSEQ", a recipient's last sequence, no message
+  const size_t MAILBOX_SHARDS = 64;
+  const char* SEQUENCE_FILE = "sequences.mseq";
+  const size_t SEQUENCE_COMPACT_MIN = 4096;  //stale records the sequence file may hold before a rewrite
+  const std::chrono::milliseconds MAINTENANCE_INTERVAL(1000);
+
+  //Records are stored in host byte order, segments never leave the machine
+  struct RecordHeader {
+    uint32_t Magic;
+    uint32_t Length;          //whole record including header and padding
+    uint64_t Sequence;
+    uint16_t RecipientLength;
+    uint16_t SenderLength;
+    uint32_t BodyLength;
+  };
+
+  size_t RecordLength(size_t recipient, size_t sender, size_t body) {
+    size_t length = sizeof(RecordHeader) + recipient + sender + body;
+    return (length + 7) & ~size_t(7);
+  }
+
+  //Fill the record at target, its magic is published last
+  void WriteRecord(char* target, uint32_t magic, size_t length, uint64_t sequence,
+                   std::string_view recipient, std::string_view sender, std::string_view body) {
+    RecordHeader header;
+    header.Magic = RESERVED_MAGIC;
+    header.Length = static_cast<uint32_t>(length);
+    header.Sequence = sequence;
+    header.RecipientLength = static_cast<uint16_t>(recipient.size());
+    header.SenderLength = static_cast<uint16_t>(sender.size());
+    header.BodyLength = static_cast<uint32_t>(body.size());
+
+    memcpy(target + sizeof(header), recipient.data(), recipient.size());
+    memcpy(target + sizeof(header) + recipient.size(), sender.data(), sender.size());
+    memcpy(target + sizeof(header) + recipient.size() + sender.size(), body.data(), body.size());
+    memcpy(target, &header, sizeof(header));
+    __atomic_store_n(reinterpret_cast<uint32_t*>(target), magic, __ATOMIC_RELEASE);
+  }
+
+  //Read the header of the record at offset, false past the last record written
+  bool ReadHeader(const char* data, size_t size, size_t offset, RecordHeader& header) {
+    if (offset + sizeof(RecordHeader) > size) {
+      return false;
+    }
+    memcpy(&header, data + offset, sizeof(header));
+    return (header.Magic == RECORD_MAGIC || header.Magic == REFERENCE_MAGIC || header.Magic == RESERVED_MAGIC ||
+            header.Magic == SEQUENCE_MAGIC) && header.Length != 0 && offset + header.Length <= size;
+  }
+
+  //Sequence file records: uint64 sequence, uint16 user length, the user
+  const size_t SEQUENCE_HEADER_SIZE = sizeof(uint64_t) + sizeof(uint16_t);
+
+  void AppendSequence(std::string& out, const std::string& user, uint64_t sequence) {
+    uint16_t length = static_cast<uint16_t>(user.size());
+    out.append(reinterpret_cast<const char*>(&sequence), sizeof(sequence));
+    out.append(reinterpret_cast<const char*>(&length), sizeof(length));
+    out.append(user);
+  }
+
+  bool WriteAll(int fd, const std::string& data) {
+    size_t done = 0;
+    while (done < data.size()) {
+      ssize_t written = write(fd, data.data() + done, data.size() - done);
+      if (written == -1 && errno != EINTR) {
+        return false;
+      }
+      done += written == -1 ? 0 : written;
+    }
+    return true;
+  }
+
+  void RaiseSystemError(const std::string& message) {
+    std::stringstream ss;
+    ss << message << " " << strerror(errno);
+    throw std::runtime_error(ss.str());
+  }
+}
+
+MailboxStore::Segment::Segment(uint64_t id, const std::string& path, size_t size, bool create)
+  : Id(id), Path(path), Size(size) {
+
+  int fd = open(path.c_str(), O_RDWR | (create ? O_CREAT | O_EXCL : 0), 0644);
+  if (fd == -1) {
+    RaiseSystemError("Error when opening mailbox segment " + path + ":");
+  }
+
+  if (create && ftruncate(fd, size) == -1) {
+    close(fd);
+    RaiseSystemError("Error when sizing mailbox segment " + path + ":");
+  }
+
+  void* data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    RaiseSystemError("Error when mapping mailbox segment " + path + ":");
+  }
+  Data = static_cast<char*>(data);
+}
+
+MailboxStore::Segment::~Segment() {
+  if (Data != nullptr) {
+    munmap(Data, Size);
+  }
+}
+
+MailboxStore::MailboxStore(const std::string& directory, size_t segmentSize)
+  : _directory(directory), _segment_size(segmentSize) {
+  for (size_t i = 0; i < MAILBOX_SHARDS; ++i) {
+    _shards.push_back(std::make_unique<MailboxShard>());
+  }
+}
+
+MailboxStore::~MailboxStore() {
+  Stop();
+}
+
+void MailboxStore::Start() {
+  boost::filesystem::create_directories(_directory);
+  Recover();
+
+  _should_stop = false;
+  _maintenance = new std::thread(&MailboxStore::Maintain, this);
+}
+
+void MailboxStore::Stop() {
+  {
+    std::lock_guard<std::mutex> guard(_maintenance_mutex);
+    _should_stop = true;
+  }
+  _maintenance_wakeup.notify_all();
+
+  if (_maintenance) {
+    if (_maintenance->joinable()) {
+      _maintenance->join();
+    }
+    delete _maintenance;
+    _maintenance = NULL;
+  }
+
+  std::lock_guard<std::mutex> guard(_append_mutex);
+  if (_active != nullptr) {
+    msync(_active->Data, _active->Size, MS_SYNC);
+  }
+  if (_sequence_fd != -1) {
+    close(_sequence_fd);
+    _sequence_fd = -1;
+  }
+}
+
+std::string MailboxStore::SequencePath() const {
+  return (boost::filesystem::path(_directory) / SEQUENCE_FILE).string();
+}
+
+std::string MailboxStore::SegmentPath(uint64_t id) const {
+  char name[64];
+  snprintf(name, sizeof(name), "segment-%020llu.mbx", static_cast<unsigned long long>(id));
+  return (boost::filesystem::path(_directory) / name).string();
+}
+
+MailboxStore::Mailbox& MailboxStore::MailboxOf(const std::string& user) {
+  MailboxShard& shard = *_shards[std::hash<std::string>()(user) % _shards.size()];
+  std::lock_guard<std::mutex> guard(shard.Mutex);
+  auto& mailbox = shard.Mailboxes[user];
+  if (!mailbox) {
+    mailbox = std::make_unique<Mailbox>();
+  }
+  return *mailbox;
+}
+
+void MailboxStore::RecoverSequences() {
+
+  _retired.clear();
+  std::string path = SequencePath();
+  std::string data;
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd != -1) {
+    data.resize(boost::filesystem::file_size(path));
+    size_t done = 0;
+    while (done < data.size()) {
+      ssize_t received = read(fd, &data[done], data.size() - done);
+      if (received <= 0) {
+        break;
+      }
+      done += received;
+    }
+    close(fd);
+    data.resize(done);
+  }
+
+  //a record torn by a crash can only be the last one, and it was never relied on
+  size_t offset = 0;
+  while (offset + SEQUENCE_HEADER_SIZE <= data.size()) {
+    uint64_t sequence;
+    uint16_t length;
+    memcpy(&sequence, data.data() + offset, sizeof(sequence));
+    memcpy(&length, data.data() + offset + sizeof(sequence), sizeof(length));
+    if (offset + SEQUENCE_HEADER_SIZE + length > data.size()) {
+      break;
+    }
+
+    std::string user(data.data() + offset + SEQUENCE_HEADER_SIZE, length);
+    uint64_t& retired = _retired[user];
+    retired = std::max(retired, sequence);
+    offset += SEQUENCE_HEADER_SIZE + length;
+  }
+
+  for (auto& retired : _retired) {
+    Mailbox& mailbox = MailboxOf(retired.first);
+    mailbox.LastSequence = std::max(mailbox.LastSequence, retired.second);
+  }
+
+  if (!CompactSequences()) {
+    RaiseSystemError("Error when writing mailbox sequences " + path + ":");
+  }
+}
+
+bool MailboxStore::CompactSequences() {
+
+  std::string data;
+  for (auto& retired : _retired) {
+    AppendSequence(data, retired.first, retired.second);
+  }
+
+  //written aside and renamed over the old file, a crash leaves one or the other whole
+  std::string path = SequencePath();
+  std::string temporary = path + ".tmp";
+  int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+  if (fd == -1) {
+    return false;
+  }
+  if (!WriteAll(fd, data) || fdatasync(fd) == -1 || rename(temporary.c_str(), path.c_str()) == -1) {
+    close(fd);
+    unlink(temporary.c_str());
+    return false;
+  }
+
+  int directory = open(_directory.c_str(), O_RDONLY | O_DIRECTORY);
+  if (directory != -1) {
+    fsync(directory);
+    close(directory);
+  }
+
+  //the descriptor follows the rename, later records are appended to the new file
+  if (_sequence_fd != -1) {
+    close(_sequence_fd);
+  }
+  _sequence_fd = fd;
+  _retired_records = _retired.size();
+  return true;
+}
+
+void MailboxStore::Recover() {
+  std::lock_guard<std::mutex> guard(_append_mutex);
+  RecoverSequences();
+
+  std::vector<uint64_t> ids;
+  for (auto& file : boost::filesystem::directory_iterator(_directory)) {
+    unsigned long long id;
+    if (sscanf(file.path().filename().string().c_str(), "segment-%llu.mbx", &id) == 1) {
+      ids.push_back(id);
+    }
+  }
+  std::sort(ids.begin(), ids.end());
+
+  for (uint64_t id : ids) {
+    std::string path = SegmentPath(id);
+    size_t size = boost::filesystem::file_size(path);
+    auto segment = std::make_unique<Segment>(id, path, size, false);
+
+    //replay records until the first slot that was never written
+    size_t offset = 0;
+    RecordHeader header;
+    while (ReadHeader(segment->Data, segment->Size, offset, header)) {
+      const char* record = segment->Data + offset;
+      //checkpoints written into the segments before the sequence file existed
+      if (header.Magic == SEQUENCE_MAGIC) {
+        Mailbox& mailbox = MailboxOf(std::string(record + sizeof(header), header.RecipientLength));
+        mailbox.LastSequence = std::max(mailbox.LastSequence, header.Sequence);
+        offset += header.Length;
+        continue;
+      }
+
+      //shared bodies only count through their references
+      if (header.Magic != RESERVED_MAGIC && header.RecipientLength > 0) {
+        std::string recipient(record + sizeof(header), header.RecipientLength);
+        uint64_t body = offset;
+        if (header.Magic == REFERENCE_MAGIC) {
+          memcpy(&body, record + sizeof(header) + header.RecipientLength, sizeof(body));
+        }
+
+        Mailbox& mailbox = MailboxOf(recipient);
+        mailbox.Entries.push_back({header.Sequence, segment.get(), static_cast<size_t>(body)});
+        mailbox.LastSequence = std::max(mailbox.LastSequence, header.Sequence);
+        ++segment->Live;
+      }
+
+      offset += header.Length;
+    }
+
+    segment->Tail = offset;
+    segment->Sealed = true;
+    _segments[id] = std::move(segment);
+  }
+
+  //references of a shared append may land in a mailbox after later messages of its recipient
+  for (auto& shard : _shards) {
+    for (auto& mailbox : shard->Mailboxes) {
+      auto& entries = mailbox.second->Entries;
+      std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.Sequence < b.Sequence; });
+    }
+  }
+
+  if (_segments.empty()) {
+    Roll();
+  } else {
+    _active = _segments.rbegin()->second.get();
+    _active->Sealed = false;
+  }
+}
+
+MailboxStore::Segment& MailboxStore::Roll() {
+  uint64_t id = _segments.empty() ? 0 : _segments.rbegin()->first + 1;
+  if (_active != nullptr) {
+    _active->Sealed = true;
+    msync(_active->Data, _active->Size, MS_ASYNC);
+  }
+
+  auto segment = std::make_unique<Segment>(id, SegmentPath(id), _segment_size, true);
+  _active = segment.get();
+  _segments[id] = std::move(segment);
+  return *_active;
+}
+
+uint64_t MailboxStore::Append(const std::string& recipient, const std::string& sender, const std::string& body) {
+
+  size_t length = RecordLength(recipient.size(), sender.size(), body.size());
+  if (length > _segment_size || recipient.size() > UINT16_MAX || sender.size() > UINT16_MAX) {
+    throw std::invalid_argument("Message does not fit a mailbox segment");
+  }
+
+  //sequence numbers are handed out under the mailbox lock, so index entries stay sorted
+  Mailbox& mailbox = MailboxOf(recipient);
+  std::lock_guard<std::mutex> mailboxGuard(mailbox.Mutex);
+  uint64_t sequence = mailbox.LastSequence + 1;
+
+  Segment* segment;
+  size_t offset;
+  {
+    std::lock_guard<std::mutex> guard(_append_mutex);
+    segment = _active;
+    if (segment->Tail + length > segment->Size) {
+      segment = &Roll();
+    }
+    offset = segment->Tail;
+    WriteRecord(segment->Data + offset, RECORD_MAGIC, length, sequence, recipient, sender, body);
+    segment->Tail += length;
+    ++segment->Live;
+  }
+
+  mailbox.LastSequence = sequence;
+  mailbox.Entries.push_back({sequence, segment, offset});
+  return sequence;
+}
+
+void MailboxStore::AppendShared(const std::vector<std::string>& recipients, const std::string& sender,
+                                const std::string& body, std::vector<uint64_t>& sequences) {
+
+  sequences.clear();
+  if (recipients.empty()) {
+    return;
+  }
+
+  //the body record and every reference go into one segment, the references locate the body by offset
+  size_t bodyLength = RecordLength(0, sender.size(), body.size());
+  size_t length = bodyLength;
+  for (const std::string& recipient : recipients) {
+    if (recipient.size() > UINT16_MAX) {
+      throw std::invalid_argument("Message does not fit a mailbox segment");
+    }
+    length += RecordLength(recipient.size(), 0, sizeof(uint64_t));
+  }
+  if (length > _segment_size || sender.size() > UINT16_MAX) {
+    throw std::invalid_argument("Message does not fit a mailbox segment");
+  }
+
+  Segment* segment;
+  uint64_t offset;
+  {
+    std::lock_guard<std::mutex> guard(_append_mutex);
+    segment = _active;
+    if (segment->Tail + length > segment->Size) {
+      segment = &Roll();
+    }
+    offset = segment->Tail;
+    WriteRecord(segment->Data + offset, RECORD_MAGIC, bodyLength, 0, std::string_view(), sender, body);
+
+    //reserve the references, replay skips the ones whose recipient was not reached yet
+    size_t slot = offset + bodyLength;
+    for (const std::string& recipient : recipients) {
+      RecordHeader header;
+      memset(&header, 0, sizeof(header));
+      header.Magic = RESERVED_MAGIC;
+      header.Length = static_cast<uint32_t>(RecordLength(recipient.size(), 0, sizeof(uint64_t)));
+      memcpy(segment->Data + slot, &header, sizeof(header));
+      slot += header.Length;
+    }
+
+    segment->Tail += length;
+    segment->Live += recipients.size();
+  }
+
+  //each sequence is handed out under its mailbox lock, one recipient at a time
+  std::string_view target(reinterpret_cast<const char*>(&offset), sizeof(offset));
+  size_t slot = offset + bodyLength;
+  sequences.reserve(recipients.size());
+  for (const std::string& recipient : recipients) {
+    size_t slotLength = RecordLength(recipient.size(), 0, sizeof(uint64_t));
+    Mailbox& mailbox = MailboxOf(recipient);
+    std::lock_guard<std::mutex> guard(mailbox.Mutex);
+    uint64_t sequence = mailbox.LastSequence + 1;
+
+    WriteRecord(segment->Data + slot, REFERENCE_MAGIC, slotLength, sequence, recipient, std::string_view(), target);
+    mailbox.LastSequence = sequence;
+    mailbox.Entries.push_back({sequence, segment, static_cast<size_t>(offset)});
+    sequences.push_back(sequence);
+    slot += slotLength;
+  }
+}
+
+void MailboxStore::Retire(const std::string& user, std::string& out) {
+
+  uint64_t sequence;
+  {
+    Mailbox& mailbox = MailboxOf(user);
+    std::lock_guard<std::mutex> guard(mailbox.Mutex);
+    //a pending entry's record survives, and it carries the last sequence
+    if (!mailbox.Entries.empty() || mailbox.LastSequence == 0) {
+      return;
+    }
+    sequence = mailbox.LastSequence;
+  }
+
+  //an idle user keeps its record, it is not written again for every segment it appeared in
+  uint64_t& retired = _retired[user];
+  if (retired == sequence) {
+    return;
+  }
+  retired = sequence;
+  AppendSequence(out, user, sequence);
+  ++_retired_records;
+}
+
+size_t MailboxStore::Poll(const std::string& user, uint64_t cursor, std::string& out, size_t maxBytes) {
+
+  Mailbox& mailbox = MailboxOf(user);
+  std::lock_guard<std::mutex> guard(mailbox.Mutex);
+
+  while (!mailbox.Entries.empty() && mailbox.Entries.front().Sequence <= cursor) {
+    --mailbox.Entries.front().Owner->Live;
+    mailbox.Entries.pop_front();
+  }
+
+  size_t count = 0;
+  size_t start = out.size();
+  char prefix[64];
+  for (const Entry& entry : mailbox.Entries) {
+    if (count > 0 && out.size() - start >= maxBytes) {
+      break;
+    }
+
+    RecordHeader header;
+    const char* record = entry.Owner->Data + entry.Offset;
+    memcpy(&header, record, sizeof(header));
+
+    int prefixLength = snprintf(prefix, sizeof(prefix), "%llu,%u,%u\n",
+                                static_cast<unsigned long long>(entry.Sequence),
+                                static_cast<unsigned>(header.SenderLength),
+                                static_cast<unsigned>(header.BodyLength));
+    out.append(prefix, prefixLength);
+    //sender and body are adjacent in the record, one copy for both
+    out.append(record + sizeof(header) + header.RecipientLength, header.SenderLength + header.BodyLength);
+    ++count;
+  }
+  return count;
+}
+
+uint64_t MailboxStore::LastSequence(const std::string& user) {
+  Mailbox& mailbox = MailboxOf(user);
+  std::lock_guard<std::mutex> guard(mailbox.Mutex);
+  return mailbox.LastSequence;
+}
+
+void MailboxStore::Maintain() {
+
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(_maintenance_mutex);
+      _maintenance_wakeup.wait_for(lock, MAINTENANCE_INTERVAL, [this] { return _should_stop.load(); });
+      if (_should_stop) {
+        return;
+      }
+    }
+
+    std::vector<std::unique_ptr<Segment>> drained;
+    {
+      std::lock_guard<std::mutex> guard(_append_mutex);
+      if (_active != nullptr) {
+        msync(_active->Data, _active->Size, MS_ASYNC);
+      }
+
+      for (auto it = _segments.begin(); it != _segments.end();) {
+        if (it->second->Sealed && it->second->Live.load() == 0) {
+          drained.push_back(std::move(it->second));
+          it = _segments.erase(it);
+        } else {
+          ++it;
+        }
+      }
+    }
+
+    if (drained.empty()) {
+      continue;
+    }
+
+    //the last sequence of a user whose every message was acknowledged only lives in
+    //these segments; kept in the sequence file, it keeps the user's sequences rising after a restart
+    std::unordered_set<std::string> users;
+    for (auto& segment : drained) {
+      size_t offset = 0;
+      RecordHeader header;
+      while (ReadHeader(segment->Data, segment->Tail, offset, header)) {
+        if (header.Magic != RESERVED_MAGIC && header.RecipientLength > 0) {
+          users.emplace(segment->Data + offset + sizeof(header), header.RecipientLength);
+        }
+        offset += header.Length;
+      }
+    }
+
+    std::string records;
+    for (const std::string& user : users) {
+      Retire(user, records);
+    }
+
+    //the sequences must be on disk before the records they replace are gone. A failed
+    //append may leave a torn record behind, so the file is rewritten instead.
+    if (!records.empty() && _sequence_fd != -1 &&
+        (!WriteAll(_sequence_fd, records) || fdatasync(_sequence_fd) == -1)) {
+      close(_sequence_fd);
+      _sequence_fd = -1;
+    }
+    if ((_sequence_fd == -1 || _retired_records > 2 * _retired.size() + SEQUENCE_COMPACT_MIN) &&
+        !CompactSequences()) {
+      //the segments stay on disk, a restart replays their messages once more
+      continue;
+    }
+
+    //unlink and unmap outside the lock, nobody can reach these segments any more
+    for (auto& segment : drained) {
+      boost::system::error_code ignored;
+      boost::filesystem::remove(segment->Path, ignored);
+    }
+  }
+}
+
+}
@@ -0,0 +1,139 @@
+#include "Metrics.h"
+#include "NetworkRequest.h"
+#include <cmath>
+#include <cstdio>
+
+namespace common {
+
+namespace {
+  const char* STAGE_NAMES[] = {"parse", "queue_in", "process", "queue_out", "send", "total"};
+
+  const char* COUNTER_NAMES[] = {"bytes_received", "bytes_sent", "receive_calls", "send_calls", "accept_calls",
+                                 "poll_calls", "ring_enters", "would_block", "socket_errors", "requests_dropped",
+                                 "replies_dropped", "connections_throttled", "connections_evicted",
+                                 "requests_shed", "requests_limited", "connections_limited",
+                                 "requests_deduplicated"};
+
+  static_assert(sizeof(STAGE_NAMES) / sizeof(STAGE_NAMES[0]) == Metrics::STAGES, "every stage needs a name");
+  static_assert(sizeof(COUNTER_NAMES) / sizeof(COUNTER_NAMES[0]) == Metrics::COUNTERS, "every counter needs a name");
+  static_assert(static_cast<size_t>(NetworkRequest::RequestType::PUSH_GROUP_MESSAGE) < Metrics::REQUEST_TYPES,
+                "request types must fit the metrics");
+}
+
+std::string Metrics::TypeName(size_t type) {
+  using RequestType = NetworkRequest::RequestType;
+  switch (static_cast<RequestType>(type)) {
+    case RequestType::CREATE_USER: return "create_user";
+    case RequestType::DELETE_USER: return "delete_user";
+    case RequestType::PUSH_MESSAGE: return "push_message";
+    case RequestType::POLL_MESSAGE: return "poll_message";
+    case RequestType::ADD_FRIEND: return "add_friend";
+    case RequestType::DELETE_FRIEND: return "delete_friend";
+    case RequestType::REGULAR_CHECK: return "regular_check";
+    case RequestType::CHANGE_STATUS: return "change_status";
+    case RequestType::STATS: return "stats";
+    case RequestType::CREATE_GROUP: return "create_group";
+    case RequestType::JOIN_GROUP: return "join_group";
+    case RequestType::LEAVE_GROUP: return "leave_group";
+    case RequestType::PUSH_GROUP_MESSAGE: return "push_group_message";
+    default: return type == 0 ? "unknown" : "type_" + std::to_string(type);
+  }
+}
+
+void HistogramSnapshot::Add(const LatencyHistogram& histogram) {
+  for (size_t i = 0; i < LatencyHistogram::BUCKETS; ++i) {
+    _buckets[i] += histogram._buckets[i].load(std::memory_order_relaxed);
+  }
+  _count += histogram._count.load(std::memory_order_relaxed);
+  _sum += histogram._sum.load(std::memory_order_relaxed);
+  _max = std::max(_max, histogram._max.load(std::memory_order_relaxed));
+}
+
+uint64_t HistogramSnapshot::Percentile(double percentile) const {
+  //the buckets and the count are read one by one while being written, trust the buckets
+  uint64_t total = 0;
+  for (uint64_t count : _buckets) {
+    total += count;
+  }
+  if (total == 0) {
+    return 0;
+  }
+
+  uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(percentile / 100.0 * total)));
+  uint64_t seen = 0;
+  for (size_t i = 0; i < _buckets.size(); ++i) {
+    seen += _buckets[i];
+    if (seen >= rank) {
+      return std::min(LatencyHistogram::BucketLimit(i), _max);
+    }
+  }
+  return _max;
+}
+
+Metrics::Metrics() : _started(Now()) {
+}
+
+Metrics::ThreadBlock* Metrics::Register() {
+  ThreadBlock* block = new ThreadBlock();
+  std::lock_guard<std::mutex> guard(_mutex);
+  _blocks.push_back(block);
+  return block;
+}
+
+void Metrics::RegisterGauge(const std::string& name, std::function<int64_t()> read) {
+  std::lock_guard<std::mutex> guard(_mutex);
+  _gauges[name] = std::move(read);
+}
+
+void Metrics::UnregisterGauge(const std::string& name) {
+  std::lock_guard<std::mutex> guard(_mutex);
+  _gauges.erase(name);
+}
+
+std::string Metrics::Snapshot() {
+
+  std::lock_guard<std::mutex> guard(_mutex);
+  std::string out;
+  char line[256];
+
+  snprintf(line, sizeof(line), "uptime_ms %llu\n", static_cast<unsigned long long>((Now() - _started) / 1000000));
+  out += line;
+
+  for (auto& gauge : _gauges) {
+    out += "gauge " + gauge.first + " " + std::to_string(gauge.second()) + "\n";
+  }
+
+  for (size_t counter = 0; counter < COUNTERS; ++counter) {
+    uint64_t total = 0;
+    for (ThreadBlock* block : _blocks) {
+      total += block->Counters[counter].load(std::memory_order_relaxed);
+    }
+    out += std::string("counter ") + COUNTER_NAMES[counter] + " " + std::to_string(total) + "\n";
+  }
+
+  auto us = [](double ns) { return ns / 1000.0; };
+  for (size_t stage = 0; stage < STAGES; ++stage) {
+    for (size_t type = 0; type < REQUEST_TYPES; ++type) {
+      HistogramSnapshot histogram;
+      for (ThreadBlock* block : _blocks) {
+        LatencyHistogram* recorded = block->Histograms[stage][type].load(std::memory_order_acquire);
+        if (recorded != nullptr) {
+          histogram.Add(*recorded);
+        }
+      }
+      if (histogram.Count() == 0) {
+        continue;
+      }
+
+      snprintf(line, sizeof(line),
+               "latency %s %s count %llu mean_us %.1f p50_us %.1f p99_us %.1f p999_us %.1f max_us %.1f\n",
+               STAGE_NAMES[stage], TypeName(type).c_str(), static_cast<unsigned long long>(histogram.Count()),
+               us(histogram.Mean()), us(histogram.Percentile(50)), us(histogram.Percentile(99)),
+               us(histogram.Percentile(99.9)), us(histogram.Max()));
+      out += line;
+    }
+  }
+  return out;
+}
+
+}
@@ -0,0 +1,125 @@
+#include "MetricsReporter.h"
+#include "Metrics.h"
+#include <poll.h>
+#include <stdio.h>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+
+namespace sobertalk {
+
+namespace {
+  const char* ADMIN_ADDRESS = "127.0.0.1";
+  const int POLL_INTERVAL_MS = 200;
+  const int ADMIN_READ_TIMEOUT_MS = 100;
+  const char* HTTP_HEADER = "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\nConnection: close\r\n\r\n";
+}
+
+MetricsReporter::MetricsReporter(uint16_t adminPort, const std::string& dumpPath, int dumpIntervalMs)
+  : _dump_path(dumpPath), _dump_interval_ms(dumpIntervalMs > 0 ? dumpIntervalMs : STATS_DUMP_INTERVAL_MS) {
+
+  if (adminPort != 0) {
+    _listener = std::make_unique<network::TcpSocket>(ADMIN_ADDRESS, adminPort, false, false, true);
+    _listener->Listen();
+  }
+}
+
+MetricsReporter::~MetricsReporter() {
+  Stop();
+}
+
+void MetricsReporter::Start() {
+  if (!_listener && _dump_path.empty()) {
+    return;
+  }
+  _should_stop = false;
+  _reporter = new std::thread(&MetricsReporter::Run, this);
+}
+
+void MetricsReporter::Stop() {
+  _should_stop = true;
+
+  if (_reporter) {
+    if (_reporter->joinable()) {
+      _reporter->join();
+    }
+    delete _reporter;
+    _reporter = NULL;
+
+    if (!_dump_path.empty()) {
+      Dump();
+    }
+  }
+}
+
+void MetricsReporter::Run() {
+
+  auto nextDump = std::chrono::steady_clock::now() + std::chrono::milliseconds(_dump_interval_ms);
+  while (!_should_stop) {
+    auto now = std::chrono::steady_clock::now();
+    if (!_dump_path.empty() && now >= nextDump) {
+      Dump();
+      nextDump = now + std::chrono::milliseconds(_dump_interval_ms);
+    }
+
+    if (!_listener) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(POLL_INTERVAL_MS));
+      continue;
+    }
+
+    struct pollfd ready {_listener->Descriptor(), POLLIN, 0};
+    if (poll(&ready, 1, POLL_INTERVAL_MS) > 0) {
+      Serve();
+    }
+  }
+}
+
+void MetricsReporter::Serve() {
+
+  while (true) {
+    std::unique_ptr<network::TcpSocket> client;
+    try {
+      client.reset(_listener->Accept(true));
+    } catch (const std::exception&) {
+      return;
+    }
+    if (!client) {
+      return;
+    }
+
+    try {
+      //the request is only looked at to tell HTTP clients apart, do not wait long for it
+      char request[512];
+      client->SetReceiveTimeout(ADMIN_READ_TIMEOUT_MS);
+      int received = client->Recv(request, sizeof(request));
+
+      std::string response;
+      if (received >= 4 && std::string(request, 4) == "GET ") {
+        response = HTTP_HEADER;
+      }
+      response += common::Metrics::Instance().Snapshot();
+      client->SendAll(response.data(), response.size());
+      client->Shutdown(SHUT_WR);
+    } catch (const std::exception&) {
+      //the admin client went away, nothing to clean up beyond the socket
+    }
+  }
+}
+
+void MetricsReporter::Dump() {
+  std::string temporary = _dump_path + ".tmp";
+  {
+    std::ofstream out(temporary, std::ios::trunc);
+    out << common::Metrics::Instance().Snapshot();
+    if (!out) {
+      std::cerr << "Cannot write metrics to " << temporary << std::endl;
+      return;
+    }
+  }
+
+  if (rename(temporary.c_str(), _dump_path.c_str()) != 0) {
+    std::cerr << "Cannot replace " << _dump_path << std::endl;
+  }
+}
+
+}
@@ -0,0 +1,68 @@
+#include "MongoPersistenceSink.h"
+
+#ifdef HAVE_MONGOCXX
+
+#include <bsoncxx/builder/basic/document.hpp>
+#include <bsoncxx/builder/basic/kvp.hpp>
+#include <bsoncxx/json.hpp>
+#include <mongocxx/bulk_write.hpp>
+#include <mongocxx/instance.hpp>
+#include <mongocxx/model/delete_one.hpp>
+#include <mongocxx/model/replace_one.hpp>
+#include <mongocxx/options/bulk_write.hpp>
+#include <mongocxx/uri.hpp>
+#include <unordered_map>
+
+namespace sobertalk {
+
+namespace {
+  const char* DEFAULT_DATABASE = "sobertalk";
+
+  //the driver must be initialised exactly once per process
+  mongocxx::instance& DriverInstance() {
+    static mongocxx::instance instance {};
+    return instance;
+  }
+}
+
+MongoPersistenceSink::MongoPersistenceSink(const std::string& uri) {
+  DriverInstance();
+  mongocxx::uri parsed(uri);
+  _client = mongocxx::client(parsed);
+  _database = parsed.database().empty() ? DEFAULT_DATABASE : parsed.database();
+}
+
+void MongoPersistenceSink::Write(const std::vector<Mutation>& batch) {
+  using bsoncxx::builder::basic::kvp;
+  using bsoncxx::builder::basic::make_document;
+
+  std::unordered_map<std::string, std::vector<const Mutation*>> byCollection;
+  for (const Mutation& mutation : batch) {
+    byCollection[mutation.Collection].push_back(&mutation);
+  }
+
+  auto database = _client[_database];
+  for (auto& entry : byCollection) {
+    mongocxx::options::bulk_write options;
+    options.ordered(false);
+    auto bulk = database[entry.first].create_bulk_write(options);
+
+    for (const Mutation* mutation : entry.second) {
+      auto filter = make_document(kvp("_id", mutation->Key));
+      if (mutation->Operation == Mutation::Kind::UPSERT) {
+        mongocxx::model::replace_one replace(filter.view(), bsoncxx::from_json(mutation->Document));
+        replace.upsert(true);
+        bulk.append(replace);
+      } else {
+        bulk.append(mongocxx::model::delete_one(filter.view()));
+      }
+    }
+
+    //throws mongocxx::bulk_write_exception, the pipeline retries the batch
+    bulk.execute();
+  }
+}
+
+}
+
+#endif
@@ -1,16 +1,24 @@
 #include "NetworkRequest.h"
+#include "JsonCodec.h"
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/json_parser.hpp>
 #include <sstream>
+#include <stdexcept>
+#include <arpa/inet.h>
+#include <endian.h>
+#include <string.h>
 
 namespace common {
 
 using boost::property_tree::ptree;
 using boost::property_tree::read_json;
-using boost::property_tree::write_json;
 
-NetworkRequest::NetworkRequest(const std::string& parameters, RequestType rtype)
- : _parameters(parameters), _rtype(rtype) {
+NetworkRequest::NetworkRequest(const std::string& parameters, RequestType rtype, const std::string& userId)
+ : _rtype(rtype), _parameters(parameters), _user_id(userId) {
+}
+
+NetworkRequest::NetworkRequest(std::string&& parameters, RequestType rtype, std::string&& userId)
+ : _rtype(rtype), _parameters(std::move(parameters)), _user_id(std::move(userId)) {
 }
 
 NetworkRequest::~NetworkRequest() {}
@@ -19,23 +27,192 @@ NetworkRequest::RequestType NetworkRequest::GetRequestType() const { return _rty
 
 const std::string& NetworkRequest::GetParameters() const { return _parameters; }
 
-std::string NetworkRequest::ToString() const {
- ptree pt;
- std::ostringstream oss;
- pt.put("request_type", static_cast<int>(_rtype));
- pt.put("parameters", _parameters);
+const std::string& NetworkRequest::GetUserId() const { return _user_id; }
 
- write_json(oss, pt, false);
- return oss.str();
+std::string NetworkRequest::ToString() const {
+ std::string out;
+ AppendJsonRequest(out, static_cast<int>(_rtype), _parameters, _user_id, _request_id);
+ return out;
 }
 
 NetworkRequest NetworkRequest::FromString(const std::string& request) {
+ return FromJson(request);
+}
+
+NetworkRequest NetworkRequest::FromJson(std::string_view request) {
+ JsonRequestFields fields;
+ if (ParseJsonRequest(request, fields)) {
+   NetworkRequest parsed(std::move(fields.Parameters), static_cast<RequestType>(fields.Type), std::move(fields.UserId));
+   parsed.SetRequestId(fields.RequestId);
+   return parsed;
+ }
+
+ //unusual documents and malformed ones, which it reports
  ptree pt;
- std::istringstream iss {request};
+ std::istringstream iss {std::string(request)};
  read_json(iss, pt);
  auto rtype = static_cast<NetworkRequest::RequestType>(pt.get<int>("request_type"));
  auto parameters = pt.get<std::string>("parameters");
- return NetworkRequest(parameters, rtype);
+ auto userId = pt.get<std::string>("user_id", "");
+ NetworkRequest parsed(parameters, rtype, userId);
+ parsed.SetRequestId(pt.get<uint64_t>("request_id", 0));
+ return parsed;
+}
+
+std::string NetworkRequest::ToBinary() const {
+ std::string out;
+ AppendBinary(out);
+ return out;
+}
+
+void NetworkRequest::AppendBinary(std::string& out) const {
+ if (_user_id.size() > MAX_USER_ID_SIZE) {
+   throw std::invalid_argument("User id too long for a binary network request");
+ }
+
+ char header[BINARY_HEADER_SIZE];
+ uint32_t length = htonl(static_cast<uint32_t>(_parameters.size()));
+ uint8_t flags = 0;
+ if (!_user_id.empty()) {
+   flags |= BINARY_FLAG_USER_ID;
+ }
+ if (_request_id != 0) {
+   flags |= BINARY_FLAG_REQUEST_ID;
+ }
+
+ header[0] = static_cast<char>(BINARY_MAGIC);
+ header[1] = static_cast<char>(BINARY_VERSION);
+ header[2] = static_cast<char>(_rtype);
+ header[3] = static_cast<char>(flags);
+ memcpy(header + 4, &length, sizeof(length));
+
+ out.reserve(out.size() + BINARY_HEADER_SIZE + sizeof(uint16_t) + _user_id.size() + sizeof(uint64_t) +
+             _parameters.size());
+ out.append(header, BINARY_HEADER_SIZE);
+
+ if (flags & BINARY_FLAG_USER_ID) {
+   uint16_t userLength = htons(static_cast<uint16_t>(_user_id.size()));
+   out.append(reinterpret_cast<const char*>(&userLength), sizeof(userLength));
+   out.append(_user_id);
+ }
+
+ if (flags & BINARY_FLAG_REQUEST_ID) {
+   uint64_t requestId = htobe64(_request_id);
+   out.append(reinterpret_cast<const char*>(&requestId), sizeof(requestId));
+ }
+
+ out.append(_parameters);
+}
+
+NetworkRequestView NetworkRequest::FromBinary(std::string_view buffer) {
+ if (buffer.size() < BINARY_HEADER_SIZE || static_cast<uint8_t>(buffer[0]) != BINARY_MAGIC) {
+   throw std::invalid_argument("Not a binary network request");
+ }
+
+ if (static_cast<uint8_t>(buffer[1]) != BINARY_VERSION) {
+   std::stringstream ss;
+   ss << "Unsupported binary network request version : " << (int)static_cast<uint8_t>(buffer[1]);
+   throw std::invalid_argument(ss.str());
+ }
+
+ NetworkRequestView view;
+ view.Type = static_cast<RequestType>(static_cast<uint8_t>(buffer[2]));
+ uint8_t flags = static_cast<uint8_t>(buffer[3]);
 
+ uint32_t length;
+ memcpy(&length, buffer.data() + 4, sizeof(length));
+ length = ntohl(length);
+
+ size_t offset = BINARY_HEADER_SIZE;
+ if (flags & BINARY_FLAG_USER_ID) {
+   uint16_t userLength;
+   if (buffer.size() < offset + sizeof(userLength)) {
+     throw std::invalid_argument("Truncated binary network request");
+   }
+   memcpy(&userLength, buffer.data() + offset, sizeof(userLength));
+   userLength = ntohs(userLength);
+   offset += sizeof(userLength);
+
+   if (buffer.size() < offset + userLength) {
+     throw std::invalid_argument("Truncated binary network request");
+   }
+   view.UserId = buffer.substr(offset, userLength);
+   offset += userLength;
+ }
+
+ if (flags & BINARY_FLAG_REQUEST_ID) {
+   uint64_t requestId;
+   if (buffer.size() < offset + sizeof(requestId)) {
+     throw std::invalid_argument("Truncated binary network request");
+   }
+   memcpy(&requestId, buffer.data() + offset, sizeof(requestId));
+   view.RequestId = be64toh(requestId);
+   offset += sizeof(requestId);
+ }
+
+ if (length != buffer.size() - offset) {
+   throw std::invalid_argument("Binary network request length mismatch");
+ }
+
+ view.Parameters = buffer.substr(offset, length);
+ return view;
+}
+
+std::string NetworkRequest::Encode(WireFormat format) const {
+ return format == WireFormat::BINARY ? ToBinary() : ToString();
+}
+
+void NetworkRequest::EncodeTo(std::string& out, WireFormat format) const {
+ if (format == WireFormat::BINARY) {
+   AppendBinary(out);
+ } else {
+   AppendJsonRequest(out, static_cast<int>(_rtype), _parameters, _user_id, _request_id);
+ }
+}
+
+NetworkRequest NetworkRequest::Decode(std::string_view buffer, WireFormat format) {
+ if (format == WireFormat::BINARY) {
+   return FromBinary(buffer).ToRequest();
+ }
+
+ NetworkRequest request = FromJson(buffer);
+ if (request._user_id.size() > MAX_USER_ID_SIZE) {
+   throw std::invalid_argument("User id too long for a network request");
+ }
+ return request;
+}
+
+void NetworkRequest::EncodeHeadTo(std::string& out, WireFormat format, const SharedParameters& shared) const {
+ if (format == WireFormat::BINARY) {
+   //shared.Raw() is the last section, the header only has to count it
+   size_t start = out.size();
+   AppendBinary(out);
+   uint32_t length = htonl(static_cast<uint32_t>(_parameters.size() + shared.Raw().size()));
+   memcpy(&out[start + 4], &length, sizeof(length));
+   return;
+ }
+
+ AppendJsonRequestHead(out, static_cast<int>(_rtype), _parameters);
+}
+
+SharedParameters::SharedParameters(std::string raw, const std::string& userId) : _raw(std::move(raw)), _user_id(userId) {
+ //notices never answer a request, there is no request id to carry
+ AppendJsonRequestTail(_json_tail, _raw, _user_id, 0);
+}
+
+void SocketMessage::EncodeTo(std::string& out) const {
+ if (!Shared) {
+   Request.EncodeTo(out, Format);
+   return;
+ }
+ Request.EncodeHeadTo(out, Format, *Shared);
+ out += Shared->Tail(Format);
+}
+
+WireFormat NetworkRequest::DetectFormat(std::string_view buffer) {
+ if (!buffer.empty() && static_cast<uint8_t>(buffer[0]) == BINARY_MAGIC) {
+   return WireFormat::BINARY;
+ }
+ return WireFormat::JSON;
+}
 }
-}
\ No newline at end of file
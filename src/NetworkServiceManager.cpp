@@ -1,22 +1,74 @@
 #include "Common.hpp"
 #include "NetworkServiceManager.h"
+#include "Metrics.h"
+#include <algorithm>
+#include <pthread.h>
+#include <sched.h>
 
 namespace sobertalk {
 
-NetworkServiceManager::NetworkServiceManager(std::shared_ptr<SocketMessageQueue> queue_In, std::shared_ptr<SocketMessageQueue> queue_Out) {
-  Init();
+namespace {
+  //keep the buckets of the different checks on one address apart
+  const uint64_t CONNECTION_SALT = 1;
+  const uint64_t REQUEST_SALT = 2;
+  const uint64_t TYPE_SALT = 16;
+
+  static_assert(static_cast<size_t>(common::NetworkRequest::RequestType::PUSH_GROUP_MESSAGE) < common::RateLimits::TYPES,
+                "request types must fit the rate limits");
+
+  //Keeps the socket counters of common::Metrics, installed as the socket hook by every manager
+  void CountSocketCall(network::SocketCall call, ssize_t result) {
+    switch (call) {
+    case network::SocketCall::SEND:
+    case network::SocketCall::RECEIVE: {
+      bool send = call == network::SocketCall::SEND;
+      common::Metrics::Count(send ? common::Counter::SEND_CALLS : common::Counter::RECEIVE_CALLS);
+      if (result > 0) {
+        common::Metrics::Count(send ? common::Counter::BYTES_SENT : common::Counter::BYTES_RECEIVED, result);
+      } else if (result == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        common::Metrics::Count(common::Counter::WOULD_BLOCK);
+      }
+      break;
+    }
+    case network::SocketCall::ACCEPT:
+      common::Metrics::Count(common::Counter::ACCEPT_CALLS);
+      break;
+    case network::SocketCall::POLL:
+      common::Metrics::Count(common::Counter::POLL_CALLS);
+      break;
+    case network::SocketCall::RING_ENTER:
+      common::Metrics::Count(common::Counter::RING_ENTERS);
+      break;
+    case network::SocketCall::ERROR:
+      common::Metrics::Count(common::Counter::SOCKET_ERRORS);
+      break;
+    }
+  }
+}
+
+//Init() is pure virtual here, derived managers call it from Start()
+NetworkServiceManager::NetworkServiceManager(std::shared_ptr<RequestLanes> queue_In, std::shared_ptr<SocketMessageQueue> queue_Out)
+  : _queue_in(queue_In), _queue_out(queue_Out), _should_stop(false) {
+  network::SetSocketHook(CountSocketCall);
 }
 
 NetworkServiceManager::~NetworkServiceManager() {
   SetStop();
+  Join();
+}
+
+void NetworkServiceManager::Stop() {
+  SetStop();
+  Join();
+}
 
-  if (_thread_in ) {
-    if (_thread_in->joinable()) {
-      _thread_in->join();
+void NetworkServiceManager::Join() {
+  for (auto& thread : _threads_in) {
+    if (thread.joinable()) {
+      thread.join();
     }
-
-    delete _thread_in;
   }
+  _threads_in.clear();
 
   if (_thread_out) {
     if (_thread_out->joinable()) {
@@ -24,15 +76,143 @@ NetworkServiceManager::~NetworkServiceManager() {
     }
 
     delete _thread_out;
+    _thread_out = NULL;
   }
 }
 
-void NetworkServiceManager::Stop() {
-  SetStop();
-}
-
 void NetworkServiceManager::SetStop() {
     _should_stop = true;
 }
 
-}
\ No newline at end of file
+void NetworkServiceManager::SetListenerShards(size_t listeners, bool pinThreads) {
+  _listener_shards = listeners == 0 ? 1 : listeners;
+  _pin_threads = pinThreads;
+}
+
+void NetworkServiceManager::SetRateLimits(std::shared_ptr<common::RateLimiter> limiter,
+                                          const common::RateLimits& limits) {
+  _limiter = limiter;
+  _limits = limits;
+}
+
+void NetworkServiceManager::SetDedupCache(std::shared_ptr<DedupCache> dedup) {
+  _dedup = dedup;
+}
+
+void NetworkServiceManager::SetOverloadControl(std::shared_ptr<OverloadControl> overload) {
+  _overload = overload;
+}
+
+bool NetworkServiceManager::AdmitConnection(const struct sockaddr* source) {
+  if (!_limiter || _limiter->Allow(common::RateLimiter::KeyOf(source, CONNECTION_SALT), _limits.Connections)) {
+    return true;
+  }
+  common::Metrics::Count(common::Counter::CONNECTIONS_LIMITED);
+  return false;
+}
+
+bool NetworkServiceManager::AdmitRequest(const struct sockaddr* source) {
+  if (!_limiter || _limiter->Allow(common::RateLimiter::KeyOf(source, REQUEST_SALT), _limits.Requests)) {
+    return true;
+  }
+  common::Metrics::Count(common::Counter::REQUESTS_LIMITED);
+  return false;
+}
+
+bool NetworkServiceManager::AdmitRequest(const struct sockaddr* source, common::NetworkRequest::RequestType type) {
+  size_t index = static_cast<size_t>(type);
+  if (!_limiter || index >= common::RateLimits::TYPES || _limits.Types[index].Rate == 0 ||
+      _limiter->Allow(common::RateLimiter::KeyOf(source, TYPE_SALT + index), _limits.Types[index])) {
+    return true;
+  }
+  common::Metrics::Count(common::Counter::REQUESTS_LIMITED);
+  return false;
+}
+
+bool NetworkServiceManager::DecodeRequest(const struct sockaddr* source, std::string_view payload,
+                                          common::WireFormat format, common::NetworkRequest& request) {
+  if (format == common::WireFormat::BINARY) {
+    common::NetworkRequestView view = common::NetworkRequest::FromBinary(payload);
+    if (!AdmitRequest(source, view.Type)) {
+      return false;
+    }
+    request = view.ToRequest();
+    return true;
+  }
+
+  request = common::NetworkRequest::Decode(payload, format);
+  return AdmitRequest(source, request.GetRequestType());
+}
+
+bool NetworkServiceManager::Deduplicate(const SocketMessage& message) {
+  if (!_dedup || !DedupCache::Applies(message.Request)) {
+    return false;
+  }
+
+  SocketMessage reply {common::NetworkRequest(), message.SptrSocket, message.Format};
+  auto outcome = _dedup->Begin(message.Request, common::Metrics::Now(), reply.Request);
+  if (outcome == DedupCache::Outcome::MISS) {
+    return false;
+  }
+
+  common::Metrics::Count(common::Counter::REQUESTS_DEDUPLICATED);
+  if (outcome == DedupCache::Outcome::HIT) {
+    reply.Peer = message.Peer;
+    reply.ReceivedAt = message.ReceivedAt;
+    reply.EnqueuedAt = common::Metrics::Now();
+    if (!_queue_out->TryPush(std::move(reply))) {
+      common::Metrics::Count(common::Counter::REPLIES_DROPPED);
+    }
+  }
+  return true;
+}
+
+void NetworkServiceManager::ForgetRequest(const SocketMessage& message) {
+  if (_dedup) {
+    _dedup->Forget(message.Request);
+  }
+}
+
+bool NetworkServiceManager::AnswerBusy(const SocketMessage& message, SocketMessage& reply) {
+  ForgetRequest(message);
+  if (!_overload) {
+    return false;
+  }
+
+  int level = std::max(_overload->Level(common::Metrics::Now()), 1);
+  reply = SocketMessage {common::NetworkRequest(_overload->BusyResult(level), message.Request.GetRequestType(),
+                                                message.Request.GetUserId()),
+                         message.SptrSocket, message.Format};
+  reply.Request.SetRequestId(message.Request.GetRequestId());
+  reply.Peer = message.Peer;
+  reply.ReceivedAt = message.ReceivedAt;
+  reply.EnqueuedAt = common::Metrics::Now();
+  return true;
+}
+
+bool NetworkServiceManager::ShedOnArrival(const SocketMessage& message, SocketMessage& reply) {
+  if (!_overload || !_overload->ShedOnArrival(message.Request.GetRequestType(), common::Metrics::Now())) {
+    return false;
+  }
+  common::Metrics::Count(common::Counter::REQUESTS_SHED);
+  return AnswerBusy(message, reply);
+}
+
+void NetworkServiceManager::PinThread(size_t index) const {
+  if (!_pin_threads) {
+    return;
+  }
+
+  size_t cores = std::thread::hardware_concurrency();
+  if (cores == 0) {
+    return;
+  }
+
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(index % cores, &cpus);
+  //best effort, a restricted cpuset just leaves the thread unpinned
+  pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+}
+
+}
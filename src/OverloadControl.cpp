@@ -0,0 +1,57 @@
+#include "OverloadControl.h"
+#include <algorithm>
+
+namespace sobertalk {
+
+OverloadControl::OverloadControl(int64_t targetMs, int64_t intervalMs)
+  : _target_ns(std::max<int64_t>(targetMs, 0) * 1000000),
+    _interval_ns(std::max<int64_t>(intervalMs, 1) * 1000000) {
+}
+
+void OverloadControl::Observe(uint64_t sojournNs, uint64_t now) {
+  _last_observed.store(now, std::memory_order_relaxed);
+  if (!AboveTarget(sojournNs)) {
+    if (_above_since.load(std::memory_order_relaxed) != 0) {
+      _above_since.store(0, std::memory_order_relaxed);
+    }
+    return;
+  }
+
+  //only the first worker to see the target exceeded starts the clock
+  uint64_t since = 0;
+  _above_since.compare_exchange_strong(since, std::max<uint64_t>(now, 1), std::memory_order_relaxed);
+}
+
+int OverloadControl::ShedLevel(common::NetworkRequest::RequestType type) {
+  using RequestType = common::NetworkRequest::RequestType;
+
+  switch (type) {
+    case RequestType::REGULAR_CHECK:
+      return 1;
+    case RequestType::POLL_MESSAGE:
+      return 2;
+    case RequestType::STATS:
+      return MAX_LEVEL + 1;
+    default:
+      return MAX_LEVEL;
+  }
+}
+
+bool OverloadControl::ShedOnArrival(common::NetworkRequest::RequestType type, uint64_t now) const {
+  if (type == common::NetworkRequest::RequestType::REGULAR_CHECK) {
+    return false;
+  }
+  //the level only rises while requests keep waiting past the target, a new one would wait behind them
+  int level = Level(now);
+  return level > 0 && level >= ShedLevel(type);
+}
+
+int OverloadControl::Level(uint64_t now) const {
+  uint64_t since = _above_since.load(std::memory_order_relaxed);
+  if (since == 0 || now < since + _interval_ns || now > _last_observed.load(std::memory_order_relaxed) + _interval_ns) {
+    return 0;
+  }
+  return static_cast<int>(std::min<uint64_t>((now - since) / _interval_ns, MAX_LEVEL));
+}
+
+}
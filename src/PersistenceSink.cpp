@@ -0,0 +1,83 @@
+#include "PersistenceSink.h"
+#include "MongoPersistenceSink.h"
+#include <stdexcept>
+#include <stdio.h>
+
+namespace sobertalk {
+
+std::unique_ptr<PersistenceSink> PersistenceSink::Create(const std::string& uri) {
+  if (uri == "memory") {
+    return std::make_unique<MemoryPersistenceSink>();
+  }
+
+  if (uri.compare(0, 10, "mongodb://") == 0 || uri.compare(0, 14, "mongodb+srv://") == 0) {
+#ifdef HAVE_MONGOCXX
+    return std::make_unique<MongoPersistenceSink>(uri);
+#else
+    throw std::invalid_argument("Built without libmongocxx, cannot persist to " + uri);
+#endif
+  }
+
+  throw std::invalid_argument("Unknown persistence URI " + uri);
+}
+
+void MemoryPersistenceSink::Write(const std::vector<Mutation>& batch) {
+  std::lock_guard<std::mutex> guard(_mutex);
+  for (const Mutation& mutation : batch) {
+    auto& collection = _collections[mutation.Collection];
+    if (mutation.Operation == Mutation::Kind::UPSERT) {
+      collection[mutation.Key] = mutation.Document;
+    } else {
+      collection.erase(mutation.Key);
+    }
+  }
+  ++_batches;
+}
+
+std::string MemoryPersistenceSink::Find(const std::string& collection, const std::string& key) const {
+  std::lock_guard<std::mutex> guard(_mutex);
+  auto it = _collections.find(collection);
+  if (it == _collections.end()) {
+    return "";
+  }
+  auto document = it->second.find(key);
+  return document == it->second.end() ? "" : document->second;
+}
+
+size_t MemoryPersistenceSink::Size(const std::string& collection) const {
+  std::lock_guard<std::mutex> guard(_mutex);
+  auto it = _collections.find(collection);
+  return it == _collections.end() ? 0 : it->second.size();
+}
+
+size_t MemoryPersistenceSink::Batches() const {
+  std::lock_guard<std::mutex> guard(_mutex);
+  return _batches;
+}
+
+std::string JsonString(const std::string& text) {
+  std::string quoted;
+  quoted.reserve(text.size() + 2);
+  quoted += '"';
+  for (unsigned char c : text) {
+    switch (c) {
+      case '"':  quoted += "\\\""; break;
+      case '\\': quoted += "\\\\"; break;
+      case '\n': quoted += "\\n"; break;
+      case '\r': quoted += "\\r"; break;
+      case '\t': quoted += "\\t"; break;
+      default:
+        if (c < 0x20) {
+          char escaped[8];
+          snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+          quoted += escaped;
+        } else {
+          quoted += static_cast<char>(c);
+        }
+    }
+  }
+  quoted += '"';
+  return quoted;
+}
+
+}
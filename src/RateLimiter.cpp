@@ -0,0 +1,123 @@
+#include "RateLimiter.h"
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <netinet/in.h>
+
+namespace common {
+
+namespace {
+  const uint64_t TOKEN = 1000;              //a bucket counts thousandths of a token
+  const uint64_t MAX_TOKENS = 0xFFFFFFFF;   //what fits the low half of a bucket
+  const size_t PROBES = 8;
+  //a bucket untouched this long is full for any sane limit, its slot may be taken over
+  const uint32_t IDLE_MS = 60000;
+  //how far apart the clock readings of concurrent checks can be
+  const uint32_t CLOCK_SKEW_MS = 1000;
+
+  uint64_t Mix(uint64_t value) {
+    value ^= value >> 33;
+    value *= 0xFF51AFD7ED558CCDULL;
+    value ^= value >> 33;
+    value *= 0xC4CEB9FE1A85EC53ULL;
+    value ^= value >> 33;
+    return value;
+  }
+}
+
+RateLimiter::RateLimiter(size_t slots) {
+  size_t size = 2;
+  while (size < slots) {
+    size <<= 1;
+  }
+  _slots.reset(new Slot[size]);
+  _mask = size - 1;
+}
+
+uint32_t RateLimiter::CoarseNow() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return static_cast<uint32_t>(now.tv_sec * 1000 + now.tv_nsec / 1000000);
+}
+
+uint64_t RateLimiter::KeyOf(const struct sockaddr* address, uint64_t salt) {
+  uint64_t prefix = 0;
+  if (address->sa_family == AF_INET) {
+    prefix = reinterpret_cast<const struct sockaddr_in*>(address)->sin_addr.s_addr;
+  } else if (address->sa_family == AF_INET6) {
+    memcpy(&prefix, &reinterpret_cast<const struct sockaddr_in6*>(address)->sin6_addr, sizeof(prefix));
+  }
+  //0 marks an empty slot
+  return std::max<uint64_t>(Mix(prefix ^ Mix(salt + address->sa_family)), 1);
+}
+
+std::atomic<uint64_t>* RateLimiter::Find(uint64_t key, uint32_t now) {
+  Slot* idle = nullptr;
+  for (size_t probe = 0; probe < PROBES; ++probe) {
+    Slot& slot = _slots[(key + probe) & _mask];
+    uint64_t current = slot.Key.load(std::memory_order_acquire);
+    if (current == key) {
+      return &slot.Bucket;
+    }
+    //a new slot's bucket reads as last refilled at time 0, i.e. full
+    if (current == 0 && slot.Key.compare_exchange_strong(current, key, std::memory_order_acq_rel)) {
+      return &slot.Bucket;
+    }
+    //another thread may just have claimed it for the same key
+    if (current == key) {
+      return &slot.Bucket;
+    }
+    if (idle == nullptr && now - static_cast<uint32_t>(slot.Bucket.load(std::memory_order_relaxed) >> 32) > IDLE_MS) {
+      idle = &slot;
+    }
+  }
+
+  if (idle != nullptr) {
+    uint64_t current = idle->Key.load(std::memory_order_relaxed);
+    if (idle->Key.compare_exchange_strong(current, key, std::memory_order_acq_rel)) {
+      return &idle->Bucket;
+    }
+  }
+  return nullptr;
+}
+
+bool RateLimiter::Allow(uint64_t key, const RateLimit& limit) {
+  if (limit.Rate == 0) {
+    return true;
+  }
+
+  uint32_t now = CoarseNow();
+  std::atomic<uint64_t>* bucket = Find(key, now);
+  if (bucket == nullptr) {
+    return true;
+  }
+
+  uint64_t capacity = std::min<uint64_t>((limit.Burst == 0 ? 2ULL * limit.Rate : limit.Burst) * TOKEN, MAX_TOKENS);
+  uint64_t current = bucket->load(std::memory_order_relaxed);
+  while (true) {
+    //another thread may have read the clock a tick later and refilled already
+    uint32_t last = static_cast<uint32_t>(current >> 32);
+    bool ahead = last - now < CLOCK_SKEW_MS;
+    uint64_t elapsed = ahead ? 0 : now - last;
+    uint64_t stamp = static_cast<uint64_t>(ahead ? last : now) << 32;
+    //milliseconds times tokens per second are thousandths of a token
+    uint64_t tokens = std::min<uint64_t>((current & MAX_TOKENS) + elapsed * limit.Rate, capacity);
+    if (tokens < TOKEN) {
+      if (elapsed == 0) {
+        return false;
+      }
+      //keep the refill, it would be lost otherwise
+      if (bucket->compare_exchange_weak(current, stamp | tokens, std::memory_order_relaxed)) {
+        return false;
+      }
+      continue;
+    }
+
+    uint64_t taken = stamp | (tokens - TOKEN);
+    if (bucket->compare_exchange_weak(current, taken, std::memory_order_relaxed)) {
+      return true;
+    }
+  }
+}
+
+}
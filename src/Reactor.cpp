@@ -0,0 +1,93 @@
+#include "Reactor.h"
+#include <sys/eventfd.h>
+
+namespace network {
+
+Reactor::Reactor(int maxEvents) : _events(maxEvents) {
+
+  _epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (_epoll_fd == -1) {
+    RaiseSocketException("Error when epoll_create1: ");
+  }
+
+  _wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (_wakeup_fd == -1) {
+    close(_epoll_fd);
+    RaiseSocketException("Error when eventfd: ");
+  }
+
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  if (epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, _wakeup_fd, &ev) == -1) {
+    RaiseSocketException("Error when registering wakeup fd: ");
+  }
+}
+
+Reactor::~Reactor() {
+  if (_wakeup_fd != -1) {
+    close(_wakeup_fd);
+  }
+
+  if (_epoll_fd != -1) {
+    close(_epoll_fd);
+  }
+}
+
+void Reactor::Add(int fd, uint32_t events, void *data) {
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = events;
+  ev.data.ptr = data;
+  if (epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+    RaiseSocketException("Error when epoll_ctl(ADD): ");
+  }
+}
+
+void Reactor::Modify(int fd, uint32_t events, void *data) {
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = events;
+  ev.data.ptr = data;
+  if (epoll_ctl(_epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1) {
+    RaiseSocketException("Error when epoll_ctl(MOD): ");
+  }
+}
+
+void Reactor::Remove(int fd) {
+  //the fd may already be gone if the peer reset the connection, nothing to report
+  epoll_ctl(_epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+int Reactor::Wait(int timeoutMs) {
+  int n = epoll_wait(_epoll_fd, _events.data(), static_cast<int>(_events.size()), timeoutMs);
+  NotifySocketHook(SocketCall::POLL, n);
+  if (n == -1) {
+    if (errno == EINTR) {
+      return 0;
+    }
+    RaiseSocketException("Error when epoll_wait: ");
+  }
+
+  //compact out the wakeup notification so callers only see socket events
+  int ready = 0;
+  for (int i = 0; i < n; ++i) {
+    if (_events[i].data.ptr == NULL) {
+      uint64_t counter;
+      while (read(_wakeup_fd, &counter, sizeof(counter)) > 0) {}
+      continue;
+    }
+    _events[ready++] = _events[i];
+  }
+  return ready;
+}
+
+void Reactor::Wakeup() {
+  uint64_t one = 1;
+  //EAGAIN means the counter is already non-zero, i.e. a wakeup is pending
+  ssize_t ignored = write(_wakeup_fd, &one, sizeof(one));
+  (void)ignored;
+}
+
+}
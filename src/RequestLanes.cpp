@@ -0,0 +1,111 @@
+#include "RequestLanes.h"
+#include "WorkerPool.h"
+#include <algorithm>
+
+namespace sobertalk {
+
+namespace {
+  const size_t LANE_COUNT = static_cast<size_t>(RequestLanes::Lane::COUNT);
+}
+
+RequestLanes::RequestLanes(size_t controlCapacity, size_t bulkCapacity, size_t controlWeight)
+  : _control_weight(std::max<size_t>(controlWeight, 1)) {
+
+  for (size_t i = 0; i < LANE_COUNT; ++i) {
+    bool control = IsControl(static_cast<Lane>(i));
+    _lanes.push_back(std::make_unique<SocketMessageQueue>(control ? controlCapacity : bulkCapacity));
+  }
+}
+
+RequestLanes::Lane RequestLanes::LaneOf(Transport transport, const common::NetworkRequest& request) {
+  bool udp = transport == Transport::UDP;
+  if (WorkerPool::RequiresOrdering(request)) {
+    return udp ? Lane::UDP_BULK : Lane::TCP_BULK;
+  }
+  return udp ? Lane::UDP_CONTROL : Lane::TCP_CONTROL;
+}
+
+bool RequestLanes::TryPush(Transport transport, SocketMessage&& message) {
+  Lane lane = LaneOf(transport, message.Request);
+  if (!_lanes[static_cast<int>(lane)]->TryPush(std::move(message))) {
+    return false;
+  }
+  Notify();
+  return true;
+}
+
+bool RequestLanes::Push(Transport transport, SocketMessage&& message, std::chrono::milliseconds timeout) {
+  Lane lane = LaneOf(transport, message.Request);
+  if (!_lanes[static_cast<int>(lane)]->Push(std::move(message), timeout)) {
+    return false;
+  }
+  Notify();
+  return true;
+}
+
+size_t RequestLanes::PopBatch(std::vector<SocketMessage>& out, size_t maxCount, std::chrono::milliseconds timeout,
+                              bool controlOnly) {
+  size_t count = Drain(out, maxCount, controlOnly);
+  if (count > 0 || maxCount == 0 || timeout.count() <= 0) {
+    return count;
+  }
+
+  {
+    std::unique_lock<std::mutex> lock(_wait_mutex);
+    _sleeping.store(true);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    _ready.wait_for(lock, timeout, [&] {
+      for (size_t i = 0; i < LANE_COUNT; ++i) {
+        if ((!controlOnly || IsControl(static_cast<Lane>(i))) && !_lanes[i]->Empty()) {
+          return true;
+        }
+      }
+      return false;
+    });
+    _sleeping.store(false);
+  }
+  return Drain(out, maxCount, controlOnly);
+}
+
+size_t RequestLanes::Size() const {
+  size_t size = 0;
+  for (auto& lane : _lanes) {
+    size += lane->Size();
+  }
+  return size;
+}
+
+size_t RequestLanes::Drain(std::vector<SocketMessage>& out, size_t maxCount, bool controlOnly) {
+  size_t count = 0;
+  bool progress = true;
+  SocketMessage message;
+
+  //control lanes come first in every round, so within a batch they are dispatched first as well
+  while (count < maxCount && progress) {
+    progress = false;
+    for (size_t i = 0; i < LANE_COUNT && count < maxCount; ++i) {
+      bool control = IsControl(static_cast<Lane>(i));
+      if (controlOnly && !control) {
+        continue;
+      }
+
+      size_t quota = control ? _control_weight : 1;
+      for (size_t taken = 0; taken < quota && count < maxCount && _lanes[i]->TryPop(message); ++taken) {
+        out.push_back(std::move(message));
+        ++count;
+        progress = true;
+      }
+    }
+  }
+  return count;
+}
+
+void RequestLanes::Notify() {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (_sleeping.load()) {
+    std::lock_guard<std::mutex> guard(_wait_mutex);
+    _ready.notify_one();
+  }
+}
+
+}
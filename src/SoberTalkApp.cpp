@@ -1,79 +1,713 @@
 #include "SoberTalkApp.h"
 #include "Common.hpp"
+#include "Metrics.h"
+#include "SlabAllocator.hpp"
+#include <algorithm>
+#include <charconv>
 #include <exception>
-#include <
+#include <sstream>
+#include <stdexcept>
+#include <vector>
 
 namespace sobertalk {
 
-SoberTalkApp::SoberTalkApp() {
+namespace {
+  const char* RESULT_OK = "OK";
+  const char* RESULT_EXISTS = "ERROR_EXISTS";
+  const char* RESULT_NOT_FOUND = "ERROR_NOT_FOUND";
+  const char* RESULT_INVALID = "ERROR_INVALID";
+  const char* NOTICE_NEW_MAIL = "NEW";
+  const size_t PARKING_SHARDS = 64;
+  const char* USERS_COLLECTION = "users";
+  const char* FRIENDSHIPS_COLLECTION = "friendships";
+  const char* GROUP_MEMBERS_COLLECTION = "group_members";
+  const char* GAUGES[] = {"queue_in", "queue_tcp_out", "queue_udp_out", "worker_backlog", "persistence_backlog",
+                          "lane_tcp_control", "lane_udp_control", "lane_tcp_bulk", "lane_udp_bulk", "overload_level",
+                          "dedup_entries"};
+  const size_t LANE_GAUGES = 5;  //index of the first lane gauge, in RequestLanes::Lane order
+}
+
+SoberTalkApp::SoberTalkApp(const SoberTalkOptions& options) {
 
-_queue_In = std::make_shared<SocketMessageQueue>();
-_queue_Out = std::make_shared<SocketMessageQueue>();
+_queue_In = std::make_shared<RequestLanes>(options.ControlLaneCapacity, options.BulkLaneCapacity,
+                                           options.ControlLaneWeight);
+_queue_TcpOut = std::make_shared<SocketMessageQueue>(MESSAGE_QUEUE_CAPACITY);
+_queue_UdpOut = std::make_shared<SocketMessageQueue>(MESSAGE_QUEUE_CAPACITY);
 
-_tcpManager = std::make_unique<TcpServerNetworkManager>(SERVER_TCP_PORT, _queue_In, _queue_Out);
-_udpManager = std::make_unique<UdpServerNetworkManager>(SERVER_UDP_PORT, _queue_In, _queue_Out);
+_mailboxes = std::make_unique<MailboxStore>(options.MailboxDirectory);
+_timers = std::make_shared<TimingWheel>();
+if (!options.PersistenceUri.empty()) {
+  _persistence = std::make_unique<WriteBehindPipeline>(PersistenceSink::Create(options.PersistenceUri));
+}
+for (size_t i = 0; i < PARKING_SHARDS; ++i) {
+  _parking.push_back(std::make_unique<ParkingShard>());
+}
 
+_tcpManager = std::make_unique<TcpServerNetworkManager>(SERVER_TCP_PORT, _queue_In, _queue_TcpOut,
+                                                        options.TcpReactors, options.MaxFrameSize);
+_udpManager = std::make_unique<UdpServerNetworkManager>(SERVER_UDP_PORT, _queue_In, _queue_UdpOut);
+_tcpManager->SetListenerShards(options.ListenerShards, options.PinThreads);
+_tcpManager->SetIdleTimeout(_timers);
+_tcpManager->SetIoBackend(options.TcpIoBackend);
+_tcpManager->SetZeroCopyThreshold(options.ZeroCopyMinBytes);
+_tcpManager->SetOutboundBudget(options.OutboundBudget, options.StallTimeoutMs);
+_udpManager->SetListenerShards(options.ListenerShards, options.PinThreads);
+auto limiter = std::make_shared<common::RateLimiter>();
+_tcpManager->SetRateLimits(limiter, options.RateLimits);
+_udpManager->SetRateLimits(limiter, options.RateLimits);
+if (options.DedupWindowMs > 0) {
+  _dedup = std::make_shared<DedupCache>(options.DedupEntries, options.DedupWindowMs);
+  _tcpManager->SetDedupCache(_dedup);
+  _udpManager->SetDedupCache(_dedup);
+}
+_overload = std::make_shared<OverloadControl>(options.OverloadTargetMs, options.OverloadIntervalMs);
+_tcpManager->SetOverloadControl(_overload);
+_udpManager->SetOverloadControl(_overload);
+
+_workers = std::make_unique<WorkerPool>(_queue_In,
+                                        [this](SocketMessage& message) { ProcessNetworkRequest(message); },
+                                        options.Workers,
+                                        [this](SocketMessage& message) {
+                                          int level = _overload->Level(common::Metrics::Now());
+                                          AnswerBusy(message, std::max(level, 1));
+                                        });
+_reporter = std::make_unique<MetricsReporter>(options.AdminPort, options.StatsFile, options.StatsIntervalMs);
+
+common::Metrics& metrics = common::Metrics::Instance();
+metrics.RegisterGauge(GAUGES[0], [this] { return static_cast<int64_t>(_queue_In->Size()); });
+metrics.RegisterGauge(GAUGES[1], [this] { return static_cast<int64_t>(_queue_TcpOut->Size()); });
+metrics.RegisterGauge(GAUGES[2], [this] { return static_cast<int64_t>(_queue_UdpOut->Size()); });
+metrics.RegisterGauge(GAUGES[3], [this] { return static_cast<int64_t>(_workers->Backlog()); });
+if (_persistence) {
+  metrics.RegisterGauge(GAUGES[4], [this] { return static_cast<int64_t>(_persistence->Backlog()); });
+}
+for (size_t i = 0; i < static_cast<size_t>(RequestLanes::Lane::COUNT); ++i) {
+  RequestLanes::Lane lane = static_cast<RequestLanes::Lane>(i);
+  metrics.RegisterGauge(GAUGES[LANE_GAUGES + i], [this, lane] { return static_cast<int64_t>(_queue_In->Size(lane)); });
+}
+metrics.RegisterGauge(GAUGES[9], [this] { return static_cast<int64_t>(_overload->Level(common::Metrics::Now())); });
+if (_dedup) {
+  metrics.RegisterGauge(GAUGES[10], [this] { return static_cast<int64_t>(_dedup->Size()); });
+}
 }
 
 SoberTalkApp::~SoberTalkApp() {
-  _tcpManager->Stop();
-  _udpManager->Stop();
+  Stop();
+  for (const char* gauge : GAUGES) {
+    common::Metrics::Instance().UnregisterGauge(gauge);
+  }
 }
 
 void SoberTalkApp::Run() {
+  _mailboxes->Start();
+  if (_persistence) {
+    _persistence->Start();
+  }
+  _friends.Start();
+  _timers->Start();
+  _workers->Start();
   _tcpManager->Start();
   _udpManager->Start();
+  _reporter->Start();
+}
+
+void SoberTalkApp::Stop() {
+  _reporter->Stop();
+  _tcpManager->Stop();
+  _udpManager->Stop();
+  _workers->Stop();
+  _timers->Stop();
+  _friends.Stop();
+  //after the workers, so every mutation they submitted is flushed
+  if (_persistence) {
+    _persistence->Stop();
+  }
+  _mailboxes->Stop();
+}
+
+void SoberTalkApp::ProcessNetworkRequest(SocketMessage& message) {
+  using RequestType = common::NetworkRequest::RequestType;
+
+  if (Shed(message)) {
+    return;
+  }
+
+  switch (message.Request.GetRequestType()) {
+    case RequestType::CREATE_USER:
+    case RequestType::DELETE_USER:
+    case RequestType::CHANGE_STATUS:
+    case RequestType::REGULAR_CHECK:
+      HandleUserRequest(message);
+      break;
+
+    case RequestType::PUSH_MESSAGE:
+    case RequestType::POLL_MESSAGE:
+      HandleMessageRequest(message);
+      break;
+
+    case RequestType::ADD_FRIEND:
+    case RequestType::DELETE_FRIEND:
+      HandleFriendRequest(message);
+      break;
+
+    case RequestType::CREATE_GROUP:
+    case RequestType::JOIN_GROUP:
+    case RequestType::LEAVE_GROUP:
+    case RequestType::PUSH_GROUP_MESSAGE:
+      HandleGroupRequest(message);
+      break;
+
+    case RequestType::STATS:
+      HandleStatsRequest(message);
+      break;
+
+    default:
+      std::stringstream ss;
+      ss << "Unknown network request type for server. Request type code : " << (int)message.Request.GetRequestType();
+      throw std::invalid_argument(ss.str().c_str());
+  }
+}
+
+void SoberTalkApp::HandleUserRequest(SocketMessage& message) {
+  using RequestType = common::NetworkRequest::RequestType;
+
+  const std::string& userId = message.Request.GetUserId();
+  if (userId.empty()) {
+    Reply(message, RESULT_INVALID);
+    return;
+  }
+
+  switch (message.Request.GetRequestType()) {
+    case RequestType::CREATE_USER:
+      if (!_users.Create(userId)) {
+        Reply(message, RESULT_EXISTS);
+        return;
+      }
+      PersistUser(*_users.Find(userId));
+      Reply(message, RESULT_OK);
+      return;
+
+    case RequestType::DELETE_USER:
+      if (!_users.Delete(userId)) {
+        Reply(message, RESULT_NOT_FOUND);
+        return;
+      }
+      {
+        UserRecord* deleted = _users.Find(userId);
+        _timers->Cancel(deleted->PresenceTimer.exchange(INVALID_TIMER));
+        PublishStatus(*deleted);
+        _friends.ForEachFriend(deleted->Index, [this, deleted](uint32_t friendIndex) {
+          PersistFriendship(*deleted, *_users.Get(friendIndex), false);
+        });
+        _friends.RemoveAll(deleted->Index);
+        for (const std::string& group : _groups.LeaveAll(deleted->Index)) {
+          PersistMembership(group, *deleted, false);
+        }
+        PersistUser(*deleted);
+      }
+      Reply(message, RESULT_OK);
+      return;
+
+    default:
+      break;
+  }
+
+  UserRecord* record = _users.Find(userId);
+  if (record == nullptr || !record->Exists) {
+    Reply(message, RESULT_NOT_FOUND);
+    return;
+  }
+
+  if (message.Request.GetRequestType() == RequestType::CHANGE_STATUS) {
+    int status;
+    try {
+      status = std::stoi(message.Request.GetParameters());
+    } catch (const std::exception&) {
+      status = -1;
+    }
+
+    if (status < static_cast<int>(UserStatus::OFFLINE) || status > static_cast<int>(UserStatus::BUSY)) {
+      Reply(message, RESULT_INVALID);
+      return;
+    }
+    if (record->Status.exchange(static_cast<UserStatus>(status)) != static_cast<UserStatus>(status)) {
+      PublishStatus(*record);
+      PersistUser(*record);
+    }
+  }
+
+  //heartbeats mostly arrive over the same route, only allocate a new one when it moved
+  bool moved = !SameRoute(record->GetRoute().get(), message);
+  _users.Touch(*record, moved ? RouteOf(message) : nullptr);
+  KeepAlive(*record);
+  Reply(message, RESULT_OK);
+}
+
+void SoberTalkApp::KeepAlive(UserRecord& record) {
+  TimerId timer = record.PresenceTimer.load();
+  if (timer != INVALID_TIMER && _timers->Reschedule(timer, PRESENCE_TIMEOUT_MS)) {
+    return;
+  }
+
+  uint32_t index = record.Index;
+  TimerId fresh = _timers->Schedule(PRESENCE_TIMEOUT_MS, [this, index] { ExpirePresence(index); });
+  //heartbeats of one user are not ordered, another worker may have armed a timer meanwhile
+  if (!record.PresenceTimer.compare_exchange_strong(timer, fresh)) {
+    _timers->Cancel(fresh);
+  }
+}
+
+void SoberTalkApp::ExpirePresence(uint32_t index) {
+  UserRecord* record = _users.Get(index);
+  if (record == nullptr || !record->Exists) {
+    return;
+  }
+
+  //a heartbeat racing with the expiry has already armed a new timer
+  if (UserRegistry::Now() - record->LastSeen.load() < PRESENCE_TIMEOUT_MS) {
+    return;
+  }
+  if (record->Status.exchange(UserStatus::OFFLINE) != UserStatus::OFFLINE) {
+    PublishStatus(*record);
+  }
+}
+
+void SoberTalkApp::HandleFriendRequest(SocketMessage& message) {
+  using RequestType = common::NetworkRequest::RequestType;
+
+  const std::string& userId = message.Request.GetUserId();
+  const std::string& friendId = message.Request.GetParameters();
+  if (userId.empty() || friendId.empty() || userId == friendId) {
+    Reply(message, RESULT_INVALID);
+    return;
+  }
+
+  UserRecord* record = _users.Find(userId);
+  UserRecord* friendRecord = _users.Find(friendId);
+  if (record == nullptr || !record->Exists || friendRecord == nullptr || !friendRecord->Exists) {
+    Reply(message, RESULT_NOT_FOUND);
+    return;
+  }
+
+  bool adding = message.Request.GetRequestType() == RequestType::ADD_FRIEND;
+  bool changed = adding ? _friends.Add(record->Index, friendRecord->Index) :
+                          _friends.Remove(record->Index, friendRecord->Index);
+  if (!changed) {
+    Reply(message, adding ? RESULT_EXISTS : RESULT_NOT_FOUND);
+    return;
+  }
+  PersistFriendship(*record, *friendRecord, adding);
+  Reply(message, RESULT_OK);
+}
+
+void SoberTalkApp::HandleGroupRequest(SocketMessage& message) {
+  using RequestType = common::NetworkRequest::RequestType;
+
+  const std::string& userId = message.Request.GetUserId();
+  UserRecord* record = userId.empty() ? nullptr : _users.Find(userId);
+  if (record == nullptr || !record->Exists) {
+    Reply(message, userId.empty() ? RESULT_INVALID : RESULT_NOT_FOUND);
+    return;
+  }
+
+  const std::string& parameters = message.Request.GetParameters();
+  RequestType type = message.Request.GetRequestType();
+  size_t separator = parameters.find('\n');
+  if (parameters.empty() || separator == 0 || (type == RequestType::PUSH_GROUP_MESSAGE) != (separator != std::string::npos)) {
+    Reply(message, RESULT_INVALID);
+    return;
+  }
+
+  if (type != RequestType::PUSH_GROUP_MESSAGE) {
+    GroupRegistry::Result result = GroupRegistry::Result::OK;
+    if (type == RequestType::CREATE_GROUP) {
+      result = _groups.Create(parameters, record->Index) ? GroupRegistry::Result::OK : GroupRegistry::Result::EXISTS;
+    } else if (type == RequestType::JOIN_GROUP) {
+      result = _groups.Join(parameters, record->Index);
+    } else {
+      result = _groups.Leave(parameters, record->Index);
+    }
+
+    if (result == GroupRegistry::Result::OK) {
+      PersistMembership(parameters, *record, type != RequestType::LEAVE_GROUP);
+    }
+    Reply(message, result == GroupRegistry::Result::OK ? RESULT_OK :
+                   result == GroupRegistry::Result::EXISTS ? RESULT_EXISTS : RESULT_NOT_FOUND);
+    return;
+  }
+
+  std::string group = parameters.substr(0, separator);
+  auto members = _groups.MembersOf(group);
+  if (!members || !std::binary_search(members->begin(), members->end(), record->Index)) {
+    Reply(message, RESULT_NOT_FOUND);
+    return;
+  }
+
+  std::vector<UserRecord*> recipients;
+  std::vector<std::string> recipientIds;
+  recipients.reserve(members->size());
+  recipientIds.reserve(members->size());
+  for (uint32_t index : *members) {
+    UserRecord* member = index == record->Index ? nullptr : _users.Get(index);
+    if (member != nullptr && member->Exists) {
+      recipients.push_back(member);
+      recipientIds.push_back(member->Id);
+    }
+  }
+
+  std::vector<uint64_t> sequences;
+  std::string body = parameters.substr(separator + 1);
+  try {
+    _mailboxes->AppendShared(recipientIds, group + "\n" + userId, body, sequences);
+  } catch (const std::invalid_argument&) {
+    Reply(message, RESULT_INVALID);
+    return;
+  }
+  Reply(message, RESULT_OK);
+
+  //encoded here once, the notices to the members only add their sequence
+  auto content = std::make_shared<const common::SharedParameters>(userId + "\n" + body, group);
+  for (size_t i = 0; i < recipients.size(); ++i) {
+    Deliver(*recipients[i], sequences[i], content);
+  }
 }
 
-void SoberTalkApp::ProcessNetworkRequest() {
+void SoberTalkApp::HandleStatsRequest(SocketMessage& message) {
+  if (message.SptrSocket == nullptr || message.SptrSocket->Type() != SOCK_STREAM) {
+    Reply(message, RESULT_INVALID);
+    return;
+  }
+
+  std::string result = RESULT_OK;
+  result += '\n';
+  result += common::Metrics::Instance().Snapshot();
+  Reply(message, result);
+}
+
+bool SoberTalkApp::Shed(const SocketMessage& message) {
   using RequestType = common::NetworkRequest::RequestType;
 
-  while (true) {
+  uint64_t now = common::Metrics::Now();
+  uint64_t sojourn = now > message.EnqueuedAt ? now - message.EnqueuedAt : 0;
+  //the ordered queues are where a backlog builds up, control requests overtake it on purpose
+  if (WorkerPool::RequiresOrdering(message.Request)) {
+    _overload->Observe(sojourn, now);
+  }
+
+  int level = _overload->Level(now);
+  if (level == 0) {
+    return false;
+  }
+
+  RequestType type = message.Request.GetRequestType();
+  switch (type) {
+    case RequestType::REGULAR_CHECK: {
+      //only heartbeats that would neither keep the user from expiring nor move its route
+      UserRecord* record = _users.Find(message.Request.GetUserId());
+      if (record == nullptr || !record->Exists ||
+          UserRegistry::Now() - record->LastSeen.load() > PRESENCE_TIMEOUT_MS - HEARTBEAT_RATE * 1000 ||
+          !SameRoute(record->GetRoute().get(), message)) {
+        return false;
+      }
+      break;
+    }
+
+    default:
+      if (level < OverloadControl::ShedLevel(type) || !_overload->AboveTarget(sojourn)) {
+        return false;
+      }
+  }
+
+  common::Metrics::Count(common::Counter::REQUESTS_SHED);
+  AnswerBusy(message, level);
+  return true;
+}
 
-    SocketMessage message;
-    if (_queue_In->Front(message)) {
-      
-      _queue_In->Pop();
+void SoberTalkApp::AnswerBusy(const SocketMessage& message, int level) {
+  //a busy answer is not the request's outcome, a retransmit has to run it
+  if (_dedup) {
+    _dedup->Forget(message.Request);
+  }
+  Reply(message, _overload->BusyResult(level));
+}
 
-      switch (message.Request.GetRequestType()) {
-        case RequestType::CREATE_USER:
+void SoberTalkApp::PersistUser(const UserRecord& record) {
+  if (!_persistence) {
+    return;
+  }
 
-          break;
+  Mutation mutation;
+  mutation.Collection = USERS_COLLECTION;
+  mutation.Key = record.Id;
+  if (record.Exists) {
+    mutation.Document = "{\"status\":" + std::to_string(static_cast<int>(record.Status.load())) +
+                        ",\"last_seen\":" + std::to_string(record.LastSeen.load()) + "}";
+  } else {
+    mutation.Operation = Mutation::Kind::REMOVE;
+  }
+  _persistence->Submit(std::move(mutation));
+}
 
-        case RequestType::DELETE_USER:
+void SoberTalkApp::PersistFriendship(const UserRecord& a, const UserRecord& b, bool friends) {
+  if (!_persistence) {
+    return;
+  }
 
-          break;
+  //one document per pair, keyed by the two ids in order
+  const UserRecord& first = a.Id < b.Id ? a : b;
+  const UserRecord& second = a.Id < b.Id ? b : a;
 
-        case RequestType::PUSH_MESSAGE:
+  Mutation mutation;
+  mutation.Collection = FRIENDSHIPS_COLLECTION;
+  mutation.Key = first.Id + "\n" + second.Id;
+  if (friends) {
+    mutation.Document = "{\"users\":[" + JsonString(first.Id) + "," + JsonString(second.Id) + "]}";
+  } else {
+    mutation.Operation = Mutation::Kind::REMOVE;
+  }
+  _persistence->Submit(std::move(mutation));
+}
 
-          break;
+void SoberTalkApp::PersistMembership(const std::string& group, const UserRecord& record, bool member) {
+  if (!_persistence) {
+    return;
+  }
 
-        case RequestType::POLL_MESSAGE:
+  //one document per member, the group exists as long as any of them does
+  Mutation mutation;
+  mutation.Collection = GROUP_MEMBERS_COLLECTION;
+  mutation.Key = group + "\n" + record.Id;
+  if (member) {
+    mutation.Document = "{\"group\":" + JsonString(group) + ",\"user\":" + JsonString(record.Id) + "}";
+  } else {
+    mutation.Operation = Mutation::Kind::REMOVE;
+  }
+  _persistence->Submit(std::move(mutation));
+}
 
-          break;
+void SoberTalkApp::PublishStatus(UserRecord& record) {
+  UserStatus status = record.Exists ? record.Status.load() : UserStatus::OFFLINE;
+  _friends.SetOnline(record.Index, status != UserStatus::OFFLINE);
+
+  common::NetworkRequest notice(std::to_string(static_cast<int>(status)),
+                                common::NetworkRequest::RequestType::CHANGE_STATUS, record.Id);
+  _friends.ForEachOnlineFriend(record.Index, [this, &notice](uint32_t friendIndex) {
+    UserRecord* friendRecord = _users.Get(friendIndex);
+    auto route = friendRecord == nullptr ? nullptr : friendRecord->GetRoute();
+    if (!route) {
+      return;
+    }
 
-        case RequestType::ADD_FRIEND:
+    SocketMessage message {notice, route->Socket, route->Format};
+    message.Peer = route->Peer;
+    Reply(std::move(message));
+  });
+}
 
-          break;
+void SoberTalkApp::HandleMessageRequest(SocketMessage& message) {
+  using RequestType = common::NetworkRequest::RequestType;
 
-        case RequestType::DELETE_FRIEND:
+  const std::string& userId = message.Request.GetUserId();
+  UserRecord* record = userId.empty() ? nullptr : _users.Find(userId);
+  if (record == nullptr || !record->Exists) {
+    Reply(message, userId.empty() ? RESULT_INVALID : RESULT_NOT_FOUND);
+    return;
+  }
 
-          break;
+  const std::string& parameters = message.Request.GetParameters();
+  if (message.Request.GetRequestType() == RequestType::PUSH_MESSAGE) {
+    size_t separator = parameters.find('\n');
+    if (separator == std::string::npos || separator == 0) {
+      Reply(message, RESULT_INVALID);
+      return;
+    }
 
-        case RequestType::REGULAR_CHECK:
+    std::string recipientId = parameters.substr(0, separator);
+    UserRecord* recipient = _users.Find(recipientId);
+    if (recipient == nullptr || !recipient->Exists) {
+      Reply(message, RESULT_NOT_FOUND);
+      return;
+    }
 
-          break;
+    uint64_t sequence;
+    try {
+      sequence = _mailboxes->Append(recipientId, userId, parameters.substr(separator + 1));
+    } catch (const std::invalid_argument&) {
+      Reply(message, RESULT_INVALID);
+      return;
+    }
+    Reply(message, RESULT_OK);
+    Deliver(*recipient, sequence);
+    return;
+  }
 
-        case RequestType::CHANGE_STATUS:
+  uint64_t cursor = 0;
+  int64_t waitMs = 0;
+  try {
+    //digits only: stoull would take "-1" for the largest cursor and acknowledge the whole mailbox
+    size_t separator = parameters.find(',');
+    std::string_view digits = std::string_view(parameters).substr(0, separator);
+    if (!digits.empty()) {
+      auto parsed = std::from_chars(digits.data(), digits.data() + digits.size(), cursor);
+      if (parsed.ec != std::errc() || parsed.ptr != digits.data() + digits.size()) {
+        throw std::invalid_argument("Malformed poll cursor");
+      }
+    }
+    if (separator != std::string::npos) {
+      waitMs = std::min<int64_t>(std::stoll(parameters.substr(separator + 1)), LONG_POLL_MAX_WAIT_MS);
+    }
+  } catch (const std::exception&) {
+    Reply(message, RESULT_INVALID);
+    return;
+  }
 
-          break;
+  std::string result = RESULT_OK;
+  result += '\n';
+  if (_mailboxes->Poll(userId, cursor, result, PollLimit(message)) > 0 ||
+      waitMs <= 0 || message.SptrSocket == nullptr || message.SptrSocket->Type() != SOCK_STREAM) {
+    Reply(message, result);
+    return;
+  }
 
-        default:
-          std::stringstream ss;
-          ss << "Unknown network request type for server. Request type code : " << (int)message.Request.GetRequestType();
-          throw std::invalid_argument(ss.str().c_str());
+  //poll again under the parking lock: Deliver() takes the same lock after appending,
+  //so a message is either seen here or finds the parked poll
+  ParkingShard& shard = ParkingFor(record->Index);
+  {
+    std::lock_guard<std::mutex> guard(shard.Mutex);
+    auto& parked = shard.Polls[record->Index];
+    if (_mailboxes->Poll(userId, cursor, result, PollLimit(message)) == 0 && parked.size() < LONG_POLL_MAX_PARKED) {
+      uint64_t id = ++_next_parked;
+      uint32_t index = record->Index;
+      TimerId timer = _timers->Schedule(waitMs, [this, index, id] { ExpireParkedPoll(index, id); });
+      //a retransmit of the poll while it waits must not park a second one
+      if (_dedup) {
+        _dedup->Hold(message.Request, common::Metrics::Now() + (waitMs + TIMER_TICK_MS) * 1000000);
       }
+      parked.push_back({std::move(message), cursor, id, timer});
+      return;
+    }
+  }
+  Reply(message, result);
+}
+
+void SoberTalkApp::Deliver(UserRecord& recipient, uint64_t sequence,
+                           const std::shared_ptr<const common::SharedParameters>& content) {
+
+  std::vector<ParkedPoll> parked;
+  {
+    ParkingShard& shard = ParkingFor(recipient.Index);
+    std::lock_guard<std::mutex> guard(shard.Mutex);
+    auto it = shard.Polls.find(recipient.Index);
+    if (it != shard.Polls.end()) {
+      parked.swap(it->second);
+      shard.Polls.erase(it);
+    }
+  }
+
+  if (parked.empty()) {
+    auto route = recipient.GetRoute();
+    if (!route) {
+      return;
+    }
+
+    //a message too large for a datagram is announced like a direct one and polled over TCP
+    bool datagram = route->Socket == nullptr || route->Socket->Type() != SOCK_STREAM;
+    SocketMessage notice;
+    if (content && !(datagram && content->Raw().size() > MAILBOX_POLL_UDP_BYTES)) {
+      notice.Request = common::NetworkRequest(std::to_string(sequence) + "\n",
+                                              common::NetworkRequest::RequestType::PUSH_GROUP_MESSAGE, content->UserId());
+      notice.Shared = content;
+    } else {
+      notice.Request = common::NetworkRequest(std::string(NOTICE_NEW_MAIL) + "\n" + std::to_string(sequence),
+                                              common::NetworkRequest::RequestType::POLL_MESSAGE, recipient.Id);
+    }
+    notice.SptrSocket = route->Socket;
+    notice.Format = route->Format;
+    notice.Peer = route->Peer;
+    Reply(std::move(notice));
+    return;
+  }
+
+  for (auto& poll : parked) {
+    _timers->Cancel(poll.Timer);
+    std::string result = RESULT_OK;
+    result += '\n';
+    _mailboxes->Poll(recipient.Id, poll.Cursor, result, PollLimit(poll.Message));
+    Reply(poll.Message, result);
+  }
+}
+
+void SoberTalkApp::ExpireParkedPoll(uint32_t index, uint64_t id) {
+
+  ParkedPoll expired;
+  {
+    ParkingShard& shard = ParkingFor(index);
+    std::lock_guard<std::mutex> guard(shard.Mutex);
+    auto it = shard.Polls.find(index);
+    if (it == shard.Polls.end()) {
+      return;
+    }
+
+    auto& parked = it->second;
+    auto poll = std::find_if(parked.begin(), parked.end(), [id](const ParkedPoll& p) { return p.Id == id; });
+    if (poll == parked.end()) {
+      //already answered by Deliver()
+      return;
+    }
+    expired = std::move(*poll);
+    parked.erase(poll);
+    if (parked.empty()) {
+      shard.Polls.erase(it);
     }
   }
+
+  std::string result = RESULT_OK;
+  result += '\n';
+  Reply(expired.Message, result);
+}
+
+size_t SoberTalkApp::PollLimit(const SocketMessage& message) {
+  return message.SptrSocket != nullptr && message.SptrSocket->Type() == SOCK_STREAM ?
+         MAILBOX_POLL_TCP_BYTES : MAILBOX_POLL_UDP_BYTES;
+}
+
+std::shared_ptr<const UserRoute> SoberTalkApp::RouteOf(const SocketMessage& message) {
+  auto route = std::allocate_shared<UserRoute>(common::SlabAllocator<UserRoute>());
+  route->Socket = message.SptrSocket;
+  route->Peer = message.Peer;
+  route->Format = message.Format;
+  return route;
+}
+
+bool SoberTalkApp::SameRoute(const UserRoute* route, const SocketMessage& message) {
+  return route != nullptr && route->Socket == message.SptrSocket && route->Format == message.Format &&
+         route->Peer.Length == message.Peer.Length &&
+         memcmp(&route->Peer.Storage, &message.Peer.Storage, message.Peer.Length) == 0;
+}
+
+bool SoberTalkApp::Reply(const SocketMessage& message, const std::string& result) {
+  SocketMessage reply {common::NetworkRequest(result, message.Request.GetRequestType(), message.Request.GetUserId()),
+                       message.SptrSocket, message.Format};
+  reply.Request.SetRequestId(message.Request.GetRequestId());
+  if (_dedup) {
+    _dedup->Complete(reply.Request, common::Metrics::Now());
+  }
+  reply.Peer = message.Peer;
+  reply.ReceivedAt = message.ReceivedAt;
+  return Reply(std::move(reply));
+}
+
+bool SoberTalkApp::Reply(SocketMessage&& message) {
+  if (message.SptrSocket == nullptr) {
+    return false;
+  }
+
+  auto& queue = message.SptrSocket->Type() == SOCK_STREAM ? _queue_TcpOut : _queue_UdpOut;
+  message.EnqueuedAt = common::Metrics::Now();
+  if (!queue->TryPush(std::move(message))) {
+    common::Metrics::Count(common::Counter::REPLIES_DROPPED);
+    return false;
+  }
+  return true;
 }
 }
\ No newline at end of file
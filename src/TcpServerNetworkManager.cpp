@@ -1,65 +1,1058 @@
 #include "TcpServerNetworkManager.h"
 #include "Common.hpp"
+#include "Framing.hpp"
+#include "Metrics.h"
+#include "SlabAllocator.hpp"
+#include <poll.h>
+#include <algorithm>
+#include <iostream>
 
 namespace sobertalk {
 
+namespace {
+  const uint32_t CONNECTION_EVENTS = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  const int REACTOR_WAIT_MS = 500;
+  const size_t MIN_READ_SIZE = 1024;
+  const size_t REPLY_BATCH_SIZE = 64;
+  const std::chrono::milliseconds QUEUE_WAIT(200);
+  const size_t SPARE_CONNECTIONS = 256;         //recycled connections kept per reactor
+  const size_t SPARE_OUTBOUND_CAPACITY = 65536; //larger outbound buffers are not kept
+  const std::chrono::milliseconds ZERO_COPY_LINGER(10000); //wait for zero-copy completions after a close
+  const int MAX_GATHER = 64;                    //buffers written by one sendmsg
+  const size_t EVICTION_FACTOR = 4;             //connections this many budgets behind are closed at once
+  const size_t SHARED_REFERENCE_MIN = 512;      //shorter fan-out tails are cheaper to copy than to gather
+
+  const unsigned RING_ENTRIES = 1024;          //submission entries per reactor ring
+  const unsigned RING_BUFFERS = 256;           //receive buffers of SOCKET_MSG_BUF_SIZE per reactor ring
+
+  //ring operations carry their kind in the low bits of the user data, connections are aligned beyond them
+  const uint64_t OP_WAKEUP = 1;
+  const uint64_t OP_ACCEPT = 2;
+  const uint64_t OP_RECEIVE = 3;
+  const uint64_t OP_SEND = 4;
+  const uint64_t OP_CANCEL = 5;
+  const uint64_t OP_MASK = 7;
+
+  template <typename T>
+  uint64_t Tag(T* target, uint64_t op) {
+    return reinterpret_cast<uint64_t>(target) | op;
+  }
+}
+
 TcpServerNetworkManager::TcpServerNetworkManager(uint16_t port,
-                                                 std::shared_ptr<SocketMessageQueue> queue_In, 
-                                                 std::shared_ptr<SocketMessageQueue> queue_Out)
-  : NetworkServiceManager(queue_In, queue_Out), _port(port) {
+                                                 std::shared_ptr<RequestLanes> queue_In,
+                                                 std::shared_ptr<SocketMessageQueue> queue_Out,
+                                                 size_t reactorThreads,
+                                                 size_t maxFrameSize)
+  : NetworkServiceManager(queue_In, queue_Out), _port(port),
+    _reactor_threads(reactorThreads == 0 ? 1 : reactorThreads),
+    _max_frame_size(maxFrameSize) {
   }
 
 TcpServerNetworkManager::~TcpServerNetworkManager() {
+  Stop();
 }
 
 void TcpServerNetworkManager::HandleRequestIn() {
+  RunReactor(0);
+}
+
+void TcpServerNetworkManager::RunReactor(size_t index) {
+
+  ReactorContext& context = *_reactors[index];
+  void* listenerTag = context.Listener;
+  PinThread(index);
+
+  if (context.Ring) {
+    RunRing(context);
+    return;
+  }
 
   while (!_should_stop) {
-    std::shared_ptr<TcpSocket> conn = std::make_shared<TcpSocket>(_listener->Accept());
-    char buffer[SOCKET_MSG_BUF_SIZE];
-    conn->Recv(buffer, SOCKET_MSG_BUF_SIZE);
+    int ready = context.Poller.Wait(REACTOR_WAIT_MS);
+
+    for (int i = 0; i < ready; ++i) {
+      const struct epoll_event& ev = context.Poller.Event(i);
+
+      if (listenerTag != nullptr && ev.data.ptr == listenerTag) {
+        AcceptConnections(context);
+        continue;
+      }
+
+      Connection& connection = *static_cast<Connection*>(ev.data.ptr);
+      int fd = connection.Socket->Descriptor();
+
+      if (ev.events & EPOLLIN) {
+        ReadConnection(context, connection);
+        //ReadConnection closes the connection on EOF or error
+        if (context.Connections.find(fd) == context.Connections.end()) {
+          continue;
+        }
+      }
+
+      if (ev.events & EPOLLOUT) {
+        if (!FlushConnection(connection)) {
+          CloseConnection(context, fd);
+          continue;
+        }
+        if (!ApplyBackpressure(context, connection)) {
+          continue;
+        }
+      }
+
+      //zero-copy completions are reported as EPOLLERR, only a failed socket ends the connection
+      uint32_t failed = ev.events & (EPOLLHUP | EPOLLERR);
+      if ((failed & EPOLLERR) && connection.ZeroCopy && ReapZeroCopy(connection)) {
+        failed &= ~EPOLLERR;
+      }
+      if (failed) {
+        CloseConnection(context, fd);
+      }
+    }
+
+    DrainPending(context);
+    if (!context.Lingering.empty()) {
+      ReapLingering(context);
+    }
+  }
+
+  //a reset drops the queued data, so the kernel lets go of the pinned buffers as the sockets close
+  for (auto& connection : context.Connections) {
+    if (ZeroCopyPending(*connection.second)) {
+      connection.second->Socket->Abort();
+    }
+  }
+  for (auto& connection : context.Lingering) {
+    connection->Socket->Abort();
+  }
+  context.Connections.clear();
+  context.Lingering.clear();
+}
+
+void TcpServerNetworkManager::AcceptConnections(ReactorContext& context) {
+
+  while (!_should_stop) {
+    std::shared_ptr<TcpSocket> socket;
+    try {
+      socket = context.Listener->AcceptShared(common::SlabAllocator<TcpSocket>(), false);
+    } catch (const std::exception&) {
+      //EMFILE and friends, retry on the next readiness edge
+      return;
+    }
+
+    if (!socket) {
+      return;
+    }
+    HandOver(context, std::move(socket));
+  }
+}
+
+void TcpServerNetworkManager::HandOver(ReactorContext& context, std::shared_ptr<TcpSocket> socket) {
+  //closed again before it costs a connection slot
+  if (!AdmitConnection(socket->RawAddress())) {
+    return;
+  }
+
+  ReactorContext& owner = ReactorFor(socket->Descriptor());
+  if (&owner == &context) {
+    Register(context, std::move(socket));
+  } else {
+    {
+      std::lock_guard<std::mutex> guard(owner.PendingMutex);
+      owner.PendingAccepted.push_back(std::move(socket));
+    }
+    owner.Poller.Wakeup();
+  }
+}
+
+void TcpServerNetworkManager::Register(ReactorContext& context, std::shared_ptr<TcpSocket> socket) {
+  int fd = socket->Descriptor();
+  std::unique_ptr<Connection> connection;
+  if (context.Spare.empty()) {
+    connection = std::make_unique<Connection>();
+  } else {
+    connection = std::move(context.Spare.back());
+    context.Spare.pop_back();
+  }
+
+  connection->Socket = std::move(socket);
+  connection->Format = common::WireFormat::JSON;
+  connection->Negotiated = false;
+  connection->IdleTimer = INVALID_TIMER;
+  connection->Serial = ++context.NextSerial;
+  connection->LastActivity = std::chrono::steady_clock::now();
+  connection->Throttled = false;
+  connection->StallTimer = INVALID_TIMER;
+  connection->Closed = false;
+  connection->Receiving = false;
+
+  if (context.Ring) {
+    ArmReceive(context, *connection);
+  } else {
+    try {
+      context.Poller.Add(fd, CONNECTION_EVENTS, connection.get());
+    } catch (const std::exception&) {
+      return;
+    }
+  }
+
+  if (_timers) {
+    ArmIdleTimer(context, *connection, _idle_timeout);
+  }
+  context.Connections[fd] = std::move(connection);
+}
+
+void TcpServerNetworkManager::ArmIdleTimer(ReactorContext& context, Connection& connection, int64_t delayMs) {
+  int fd = connection.Socket->Descriptor();
+  uint64_t serial = connection.Serial;
+  ReactorContext* owner = &context;
+
+  //runs on the wheel's thread, only the owning reactor may touch the connection
+  connection.IdleTimer = _timers->Schedule(delayMs, [owner, fd, serial] {
+    {
+      std::lock_guard<std::mutex> guard(owner->PendingMutex);
+      owner->PendingIdle.emplace_back(fd, serial);
+    }
+    owner->Poller.Wakeup();
+  });
+}
+
+void TcpServerNetworkManager::CheckIdle(ReactorContext& context, int descriptor, uint64_t serial) {
+  auto it = context.Connections.find(descriptor);
+  if (it == context.Connections.end() || it->second->Serial != serial) {
+    return;
+  }
+
+  Connection& connection = *it->second;
+  auto idle = std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::steady_clock::now() - connection.LastActivity).count();
+  if (idle >= _idle_timeout) {
+    CloseConnection(context, descriptor);
+  } else {
+    ArmIdleTimer(context, connection, _idle_timeout - idle);
+  }
+}
+
+void TcpServerNetworkManager::ReadConnection(ReactorContext& context, Connection& connection) {
+
+  //the unread requests wait in the kernel until the client takes its replies
+  if (connection.Throttled) {
+    return;
+  }
+  int fd = connection.Socket->Descriptor();
+
+  //edge-triggered: keep reading until the kernel buffer is drained
+  while (true) {
+    size_t available;
+    char* target = connection.Inbound.PrepareWrite(MIN_READ_SIZE, available);
+
+    int received;
+    try {
+      received = connection.Socket->Recv(target, available);
+    } catch (const std::exception&) {
+      CloseConnection(context, fd);
+      return;
+    }
+
+    if (received == -1) {
+      break;
+    }
+
+    if (received == 0) {
+      CloseConnection(context, fd);
+      return;
+    }
+
+    connection.Inbound.CommitWrite(received);
+    if (!DispatchFrames(context, connection)) {
+      return;
+    }
+  }
+}
+
+bool TcpServerNetworkManager::DispatchFrames(ReactorContext& context, Connection& connection) {
+
+  int fd = connection.Socket->Descriptor();
+  connection.LastActivity = std::chrono::steady_clock::now();
+  uint64_t readAt = common::Metrics::Now();
+  uint64_t parseStart = readAt;
+
+  //hand over every complete frame now so the buffer stays near one frame in size
+  std::string_view payload;
+  common::FrameStatus status;
+  const struct sockaddr* source = connection.Socket->RawAddress();
+  bool answered = false;
+  while ((status = common::PeekFrame(connection.Inbound, _max_frame_size, payload)) == common::FrameStatus::COMPLETE) {
+    //over its source's rate the frame is skipped unparsed and unanswered
+    if (!AdmitRequest(source)) {
+      common::ConsumeFrame(connection.Inbound, payload);
+      continue;
+    }
+
+    auto format = NetworkRequest::DetectFormat(payload);
+    if (!connection.Negotiated) {
+      connection.Format = format;
+      connection.Negotiated = true;
+    }
+
+    try {
+      SocketMessage message {NetworkRequest(), connection.Socket, connection.Format};
+      if (!DecodeRequest(source, payload, format, message.Request)) {
+        common::ConsumeFrame(connection.Inbound, payload);
+        continue;
+      }
+      message.ReceivedAt = readAt;
+      message.EnqueuedAt = common::Metrics::Now();
+      common::Metrics::Record(common::Stage::PARSE, static_cast<int>(message.Request.GetRequestType()),
+                              message.EnqueuedAt - parseStart);
+      parseStart = message.EnqueuedAt;
+      if (Deduplicate(message)) {
+        common::ConsumeFrame(connection.Inbound, payload);
+        continue;
+      }
+
+      //under overload the shed types are answered busy before they queue behind the backlog.
+      //A full intake lane stalls this reactor, which in turn lets TCP flow control push back on
+      //clients; a request still without room after QUEUE_WAIT is answered busy as well
+      SocketMessage reply;
+      if (ShedOnArrival(message, reply)) {
+        QueueReply(context, connection, reply);
+        answered = true;
+      } else if (!_queue_in->Push(RequestLanes::Transport::TCP, std::move(message), QUEUE_WAIT)) {
+        common::Metrics::Count(common::Counter::REQUESTS_DROPPED);
+        if (AnswerBusy(message, reply)) {
+          QueueReply(context, connection, reply);
+          answered = true;
+        }
+      }
+    } catch (const std::exception&) {
+      CloseConnection(context, fd);
+      return false;
+    }
+    common::ConsumeFrame(connection.Inbound, payload);
+  }
+
+  //busy answers leave now, the reactor only flushes connections that got replies from the workers
+  if (answered) {
+    if (context.Ring) {
+      connection.FlushPending = false;
+      QueueSend(context, connection);
+    } else if (!FlushConnection(connection)) {
+      CloseConnection(context, fd);
+      return false;
+    }
+  }
+
+  if (status == common::FrameStatus::OVERSIZED) {
+    CloseConnection(context, fd);
+    return false;
+  }
+
+  if (connection.Inbound.Empty()) {
+    connection.Inbound.Reset();
+  }
+  return true;
+}
+
+void TcpServerNetworkManager::QueueReply(ReactorContext& context, Connection& connection, const SocketMessage& reply) {
+
+  connection.FlushPending = true;
+  std::string* target = &connection.Outbound;
+
+  const std::string* tail = reply.Shared ? &reply.Shared->Tail(connection.Format) : nullptr;
+  size_t size = reply.Request.GetParameters().size() + (tail != nullptr ? tail->size() : 0);
+  //the ring sends Outbound as one buffer, there a shared tail is copied like the rest
+  bool reference = tail != nullptr && !context.Ring && tail->size() >= SHARED_REFERENCE_MIN;
+  bool zeroCopy = false;
+
+  if (_zero_copy_min > 0 && !context.Ring && size >= _zero_copy_min) {
+    if (!connection.ZeroCopyProbed) {
+      connection.ZeroCopyProbed = true;
+      connection.ZeroCopy = connection.Socket->EnableZeroCopy();
+    }
+    zeroCopy = connection.ZeroCopy;
+
+    if (zeroCopy && !reference) {
+      //the replies queued before it move ahead into a segment of their own
+      if (!connection.Outbound.empty()) {
+        connection.Queued.push_back(Segment {std::move(connection.Outbound)});
+        connection.Outbound.clear();
+      }
+      connection.Queued.push_back(Segment {});
+      connection.Queued.back().ZeroCopy = true;
+      target = &connection.Queued.back().Data;
+    }
+  }
+
+  size_t frame = common::BeginFrame(*target);
+  if (tail == nullptr) {
+    reply.Request.EncodeTo(*target, connection.Format);
+    common::EndFrame(*target, frame);
+    return;
+  }
+
+  reply.Request.EncodeHeadTo(*target, connection.Format, *reply.Shared);
+  if (!reference) {
+    target->append(*tail);
+    common::EndFrame(*target, frame);
+    return;
+  }
+
+  //the head goes out with the replies before it, the tail from the buffer every recipient shares
+  common::EndFrame(*target, frame, tail->size());
+  connection.Queued.push_back(Segment {std::move(connection.Outbound)});
+  connection.Outbound.clear();
+  connection.Queued.push_back(Segment {});
+  connection.Queued.back().Shared = std::shared_ptr<const std::string>(reply.Shared, tail);
+  connection.Queued.back().ZeroCopy = zeroCopy;
+}
+
+bool TcpServerNetworkManager::FlushConnection(Connection& connection) {
 
-    auto request = NetworkRequest::FromString(buffer);
-    SocketMessage message {request, conn };
-    _queue_in->Push(message);
+  connection.FlushPending = false;
+  struct iovec buffers[MAX_GATHER];
 
+  while (true) {
+    //gather everything pending; a zero-copy segment is sent by a call of its own
+    int count = 0;
+    size_t offset = connection.OutboundOffset;
+    bool zeroCopy = false;
+    for (Segment& segment : connection.Queued) {
+      if (count == MAX_GATHER || (segment.ZeroCopy && count > 0)) {
+        break;
+      }
+      const std::string& bytes = segment.Bytes();
+      buffers[count++] = {const_cast<char*>(bytes.data()) + offset, bytes.size() - offset};
+      offset = 0;
+      if (segment.ZeroCopy) {
+        zeroCopy = true;
+        break;
+      }
+    }
+
+    bool outbound = false;
+    if (count == static_cast<int>(connection.Queued.size()) && !zeroCopy && count < MAX_GATHER &&
+        offset < connection.Outbound.size()) {
+      buffers[count++] = {&connection.Outbound[offset], connection.Outbound.size() - offset};
+      outbound = true;
+    }
+    if (count == 0) {
+      return true;
+    }
+
+    //MSG_MORE keeps the kernel from pushing a short packet between the calls of one flush
+    bool more = count < static_cast<int>(connection.Queued.size()) ||
+                (!outbound && !connection.Outbound.empty());
+    size_t length = 0;
+    for (int i = 0; i < count; ++i) {
+      length += buffers[i].iov_len;
+    }
+
+    ssize_t sent;
+    try {
+      sent = connection.Socket->SendMessage(buffers, count, (zeroCopy ? MSG_ZEROCOPY : 0) | (more ? MSG_MORE : 0));
+      if (zeroCopy && sent > 0) {
+        Segment& segment = connection.Queued.front();
+        segment.Pinned = true;
+        segment.LastSend = connection.ZeroCopySends++;
+      }
+    } catch (const std::exception&) {
+      if (!zeroCopy) {
+        return false;
+      }
+      //ENOBUFS when the kernel cannot pin more pages for the socket: copy this segment instead
+      connection.Queued.front().ZeroCopy = false;
+      continue;
+    }
+
+    if (sent == -1) {
+      //socket buffer is full, the next EPOLLOUT edge resumes the flush
+      return true;
+    }
+    ConsumeOutbound(connection, sent);
+    if (static_cast<size_t>(sent) < length) {
+      //a short write also means a full socket buffer
+      return true;
+    }
   }
 }
 
+void TcpServerNetworkManager::ConsumeOutbound(Connection& connection, size_t sent) {
+
+  while (!connection.Queued.empty()) {
+    Segment& segment = connection.Queued.front();
+    size_t left = segment.Bytes().size() - connection.OutboundOffset;
+    if (sent < left) {
+      connection.OutboundOffset += sent;
+      return;
+    }
+
+    sent -= left;
+    connection.OutboundOffset = 0;
+    if (segment.Pinned) {
+      connection.ZeroCopyHeld.push_back(std::move(segment));
+    }
+    connection.Queued.pop_front();
+  }
+
+  connection.OutboundOffset += sent;
+  if (connection.OutboundOffset == connection.Outbound.size()) {
+    connection.Outbound.clear();
+    connection.OutboundOffset = 0;
+  }
+}
+
+bool TcpServerNetworkManager::ReapZeroCopy(Connection& connection) {
+  std::vector<Segment>& held = connection.ZeroCopyHeld;
+  return connection.Socket->ReapZeroCopy([&held](uint32_t first, uint32_t last) {
+    held.erase(std::remove_if(held.begin(), held.end(), [first, last](const Segment& segment) {
+      return segment.LastSend - first <= last - first;
+    }), held.end());
+  });
+}
+
+void TcpServerNetworkManager::CloseConnection(ReactorContext& context, int descriptor) {
+  auto it = context.Connections.find(descriptor);
+  if (it == context.Connections.end()) {
+    return;
+  }
+
+  if (!context.Ring) {
+    context.Poller.Remove(descriptor);
+  }
+  if (_timers) {
+    _timers->Cancel(it->second->IdleTimer);
+    if (it->second->StallTimer != INVALID_TIMER) {
+      _timers->Cancel(it->second->StallTimer);
+    }
+  }
+  //queued messages may still hold the socket, make sure the peer sees the close now.
+  //On a ring this also ends the pending receive and send of the connection.
+  it->second->Socket->Shutdown();
+
+  std::unique_ptr<Connection> connection = std::move(it->second);
+  context.Connections.erase(it);
+  if (connection->InFlight > 0) {
+    connection->Closed = true;
+    Connection* key = connection.get();
+    context.Draining[key] = std::move(connection);
+    return;
+  }
+  if (ZeroCopyPending(*connection)) {
+    Linger(context, std::move(connection));
+    return;
+  }
+  Recycle(context, std::move(connection));
+}
+
+bool TcpServerNetworkManager::ZeroCopyPending(const Connection& connection) {
+  return !connection.ZeroCopyHeld.empty() ||
+         std::any_of(connection.Queued.begin(), connection.Queued.end(), [](const Segment& segment) {
+           return segment.Pinned;
+         });
+}
+
+void TcpServerNetworkManager::Linger(ReactorContext& context, std::unique_ptr<Connection> connection) {
+  //nothing more is sent, so a partly sent segment only waits for its completion like the held ones
+  for (Segment& segment : connection->Queued) {
+    if (segment.Pinned) {
+      connection->ZeroCopyHeld.push_back(std::move(segment));
+    }
+  }
+  connection->Queued.clear();
+
+  //the socket stays open so its error queue still reports the completions
+  connection->LingerDeadline = std::chrono::steady_clock::now() + ZERO_COPY_LINGER;
+  context.Lingering.push_back(std::move(connection));
+}
+
+void TcpServerNetworkManager::ReapLingering(ReactorContext& context) {
+
+  auto now = std::chrono::steady_clock::now();
+  std::vector<std::unique_ptr<Connection>> done;
+  size_t i = 0;
+  while (i < context.Lingering.size()) {
+    Connection& connection = *context.Lingering[i];
+    //a failed socket still delivers the completions of the sends it dropped, keep reaping
+    ReapZeroCopy(connection);
+    if (!ZeroCopyPending(connection)) {
+      done.push_back(std::move(context.Lingering[i]));
+    } else if (now >= connection.LingerDeadline && connection.Socket.use_count() == 1) {
+      //the peer is not taking the data: closing with a reset makes the kernel drop it and
+      //release the pages. Replies still holding the socket would delay the close, so wait for them
+      connection.Socket->Abort();
+      connection.Socket.reset();
+    } else {
+      ++i;
+      continue;
+    }
+    context.Lingering[i] = std::move(context.Lingering.back());
+    context.Lingering.pop_back();
+  }
+
+  for (auto& connection : done) {
+    Recycle(context, std::move(connection));
+  }
+}
+
+void TcpServerNetworkManager::Recycle(ReactorContext& context, std::unique_ptr<Connection> connection) {
+  //freeing the buffers of a pending zero-copy send would let the kernel read reused memory
+  if (ZeroCopyPending(*connection)) {
+    Linger(context, std::move(connection));
+    return;
+  }
+  if (context.Spare.size() >= SPARE_CONNECTIONS) {
+    return;
+  }
+
+  auto reset = [](std::string& buffer) {
+    if (buffer.capacity() > SPARE_OUTBOUND_CAPACITY) {
+      std::string().swap(buffer);
+    } else {
+      buffer.clear();
+    }
+  };
+  connection->Socket.reset();
+  connection->Inbound.Reset();
+  connection->OutboundOffset = 0;
+  reset(connection->Outbound);
+  connection->SendingOffset = 0;
+  reset(connection->Sending);
+  //nothing is pinned any more, see ZeroCopyPending
+  connection->Queued.clear();
+  connection->ZeroCopyHeld.clear();
+  connection->FlushPending = false;
+  connection->ZeroCopyProbed = false;
+  connection->ZeroCopy = false;
+  connection->ZeroCopySends = 0;
+  context.Spare.push_back(std::move(connection));
+}
+
+void TcpServerNetworkManager::DrainPending(ReactorContext& context) {
+
+  std::vector<std::shared_ptr<TcpSocket>> accepted;
+  std::vector<SocketMessage> replies;
+  std::vector<std::pair<int, uint64_t>> idle;
+  std::vector<std::pair<int, uint64_t>> stalled;
+  {
+    std::lock_guard<std::mutex> guard(context.PendingMutex);
+    accepted.swap(context.PendingAccepted);
+    replies.swap(context.PendingReplies);
+    idle.swap(context.PendingIdle);
+    stalled.swap(context.PendingStalled);
+  }
+
+  for (auto& socket : accepted) {
+    Register(context, std::move(socket));
+  }
+
+  std::vector<int> written;
+  for (auto& reply : replies) {
+    int fd = reply.SptrSocket->Descriptor();
+    auto it = context.Connections.find(fd);
+    if (it == context.Connections.end() || it->second->Socket != reply.SptrSocket) {
+      //connection went away while the request was processed
+      reply.EnqueuedAt = reply.ReceivedAt = 0;
+      continue;
+    }
+
+    Connection& connection = *it->second;
+    if (!connection.FlushPending) {
+      written.push_back(fd);
+    }
+    QueueReply(context, connection, reply);
+  }
+
+  //one flush per connection for all of its replies
+  for (int fd : written) {
+    Connection& connection = *context.Connections[fd];
+    if (context.Ring) {
+      //the send is submitted with everything else this loop iteration queued
+      connection.FlushPending = false;
+      QueueSend(context, connection);
+    } else if (!FlushConnection(connection)) {
+      CloseConnection(context, fd);
+      continue;
+    }
+    ApplyBackpressure(context, connection);
+  }
+
+  uint64_t sentAt = common::Metrics::Now();
+  for (auto& reply : replies) {
+    int type = static_cast<int>(reply.Request.GetRequestType());
+    common::Metrics::RecordSince(common::Stage::SEND, type, reply.EnqueuedAt, sentAt);
+    common::Metrics::RecordSince(common::Stage::TOTAL, type, reply.ReceivedAt, sentAt);
+  }
+
+  for (auto& expired : idle) {
+    CheckIdle(context, expired.first, expired.second);
+  }
+
+  for (auto& expired : stalled) {
+    CheckStalled(context, expired.first, expired.second);
+  }
+}
+
+bool TcpServerNetworkManager::ApplyBackpressure(ReactorContext& context, Connection& connection) {
+
+  if (_outbound_budget == 0) {
+    return true;
+  }
+
+  int fd = connection.Socket->Descriptor();
+  size_t pending = connection.Outbound.size() + connection.Sending.size() -
+                   connection.SendingOffset - connection.OutboundOffset;
+  for (const Segment& segment : connection.Queued) {
+    pending += segment.Bytes().size();
+  }
+
+  if (pending >= _outbound_budget * EVICTION_FACTOR) {
+    common::Metrics::Count(common::Counter::CONNECTIONS_EVICTED);
+    CloseConnection(context, fd);
+    return false;
+  }
+
+  if (!connection.Throttled && pending >= _outbound_budget) {
+    connection.Throttled = true;
+    connection.ThrottledSince = std::chrono::steady_clock::now();
+    common::Metrics::Count(common::Counter::CONNECTIONS_THROTTLED);
+    if (_timers) {
+      ArmStallTimer(context, connection, _stall_timeout);
+    }
+    //completions already on their way are kept in Inbound until the connection resumes
+    if (context.Ring && connection.Receiving) {
+      context.Ring->PrepareCancel(Tag(&connection, OP_RECEIVE), OP_CANCEL);
+    }
+    return true;
+  }
+
+  if (connection.Throttled && pending <= _outbound_budget / 2) {
+    connection.Throttled = false;
+    if (_timers && connection.StallTimer != INVALID_TIMER) {
+      _timers->Cancel(connection.StallTimer);
+      connection.StallTimer = INVALID_TIMER;
+    }
+
+    //no new edge or completion announces what arrived meanwhile, go and get it
+    if (!context.Ring) {
+      ReadConnection(context, connection);
+      auto it = context.Connections.find(fd);
+      return it != context.Connections.end() && it->second.get() == &connection;
+    }
+    if (!DispatchFrames(context, connection)) {
+      return false;
+    }
+    if (!connection.Receiving) {
+      ArmReceive(context, connection);
+    }
+  }
+  return true;
+}
+
+void TcpServerNetworkManager::ArmStallTimer(ReactorContext& context, Connection& connection, int64_t delayMs) {
+  int fd = connection.Socket->Descriptor();
+  uint64_t serial = connection.Serial;
+  ReactorContext* owner = &context;
+
+  connection.StallTimer = _timers->Schedule(delayMs, [owner, fd, serial] {
+    {
+      std::lock_guard<std::mutex> guard(owner->PendingMutex);
+      owner->PendingStalled.emplace_back(fd, serial);
+    }
+    owner->Poller.Wakeup();
+  });
+}
+
+void TcpServerNetworkManager::CheckStalled(ReactorContext& context, int descriptor, uint64_t serial) {
+  auto it = context.Connections.find(descriptor);
+  if (it == context.Connections.end() || it->second->Serial != serial || !it->second->Throttled) {
+    return;
+  }
+
+  Connection& connection = *it->second;
+  connection.StallTimer = INVALID_TIMER;
+  auto stalled = std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::steady_clock::now() - connection.ThrottledSince).count();
+  if (stalled >= _stall_timeout) {
+    common::Metrics::Count(common::Counter::CONNECTIONS_EVICTED);
+    CloseConnection(context, descriptor);
+  } else {
+    ArmStallTimer(context, connection, _stall_timeout - stalled);
+  }
+}
+
+void TcpServerNetworkManager::RunRing(ReactorContext& context) {
+
+  network::IoUring& ring = *context.Ring;
+  ring.PrepareMultishotPoll(context.Poller.Descriptor(), POLLIN, OP_WAKEUP);
+  if (context.Listener != nullptr) {
+    ring.PrepareMultishotAccept(context.Listener->Descriptor(), OP_ACCEPT, SOCK_CLOEXEC);
+  }
+
+  while (!_should_stop) {
+    ring.SubmitAndWait(REACTOR_WAIT_MS);
+    ring.Drain([this, &context](const struct io_uring_cqe& cqe) { HandleCompletion(context, cqe); });
+    DrainPending(context);
+  }
+
+  //destroying the ring cancels the operations still pointing into the connections and waits
+  //for them, so the connections can only go after it
+  for (auto& connection : context.Connections) {
+    connection.second->Socket->Shutdown();
+  }
+  context.Ring.reset();
+  context.Connections.clear();
+  context.Draining.clear();
+}
+
+void TcpServerNetworkManager::HandleCompletion(ReactorContext& context, const struct io_uring_cqe& cqe) {
+
+  network::IoUring& ring = *context.Ring;
+  uint64_t op = cqe.user_data & OP_MASK;
+  bool more = cqe.flags & IORING_CQE_F_MORE;
+
+  switch (op) {
+    case OP_WAKEUP:
+      //only the eventfd is registered with the poller, this just consumes the wakeup
+      context.Poller.Wait(0);
+      if (!more) {
+        ring.PrepareMultishotPoll(context.Poller.Descriptor(), POLLIN, OP_WAKEUP);
+      }
+      return;
+
+    case OP_CANCEL:
+      return;
+
+    case OP_ACCEPT:
+      if (cqe.res >= 0) {
+        std::shared_ptr<TcpSocket> socket = TcpSocket::AdoptShared(common::SlabAllocator<TcpSocket>(), cqe.res);
+        if (socket) {
+          HandOver(context, std::move(socket));
+        }
+      }
+      //EMFILE and friends end the multishot accept, try again with the next submission
+      if (!more) {
+        ring.PrepareMultishotAccept(context.Listener->Descriptor(), OP_ACCEPT, SOCK_CLOEXEC);
+      }
+      return;
+  }
+
+  Connection& connection = *reinterpret_cast<Connection*>(cqe.user_data & ~OP_MASK);
+  if (op == OP_RECEIVE) {
+    CompleteReceive(context, connection, cqe);
+  } else {
+    CompleteSend(context, connection, cqe);
+  }
+}
+
+void TcpServerNetworkManager::ArmReceive(ReactorContext& context, Connection& connection) {
+  context.Ring->PrepareMultishotRecv(connection.Socket->Descriptor(), Tag(&connection, OP_RECEIVE));
+  ++connection.InFlight;
+  connection.Receiving = true;
+}
+
+void TcpServerNetworkManager::CompleteReceive(ReactorContext& context, Connection& connection,
+                                              const struct io_uring_cqe& cqe) {
+
+  network::IoUring& ring = *context.Ring;
+  bool more = cqe.flags & IORING_CQE_F_MORE;
+
+  if (cqe.flags & IORING_CQE_F_BUFFER) {
+    uint16_t id = network::IoUring::BufferId(cqe);
+    if (cqe.res > 0 && !connection.Closed) {
+      connection.Inbound.Append(ring.Buffer(id), cqe.res);
+    }
+    ring.ReturnBuffer(id);
+  }
+
+  if (!more) {
+    connection.Receiving = false;
+  }
+
+  if (!connection.Closed) {
+    common::Metrics::Count(common::Counter::RECEIVE_CALLS);
+    if (cqe.res > 0) {
+      common::Metrics::Count(common::Counter::BYTES_RECEIVED, cqe.res);
+      if (!connection.Throttled && DispatchFrames(context, connection) && !more) {
+        ArmReceive(context, connection);
+      }
+    } else if (cqe.res == -ENOBUFS || cqe.res == -ECANCELED) {
+      //every buffer was taken, they are back by the time the new receive is submitted;
+      //or the receive was cancelled for a throttled connection, which re-arms it when it resumes
+      if (!connection.Throttled) {
+        ArmReceive(context, connection);
+      }
+    } else {
+      CloseConnection(context, connection.Socket->Descriptor());
+    }
+  }
+
+  if (!more) {
+    FinishOperation(context, connection);
+  }
+}
+
+void TcpServerNetworkManager::QueueSend(ReactorContext& context, Connection& connection) {
+  if (!connection.Sending.empty() || connection.Outbound.empty()) {
+    return;
+  }
+
+  connection.Sending.swap(connection.Outbound);
+  connection.SendingOffset = 0;
+  context.Ring->PrepareSend(connection.Socket->Descriptor(), connection.Sending.data(), connection.Sending.size(),
+                            Tag(&connection, OP_SEND));
+  ++connection.InFlight;
+}
+
+void TcpServerNetworkManager::CompleteSend(ReactorContext& context, Connection& connection,
+                                           const struct io_uring_cqe& cqe) {
+
+  if (!connection.Closed) {
+    common::Metrics::Count(common::Counter::SEND_CALLS);
+    if (cqe.res < 0) {
+      CloseConnection(context, connection.Socket->Descriptor());
+    } else {
+      common::Metrics::Count(common::Counter::BYTES_SENT, cqe.res);
+      connection.SendingOffset += cqe.res;
+      if (connection.SendingOffset < connection.Sending.size()) {
+        context.Ring->PrepareSend(connection.Socket->Descriptor(), connection.Sending.data() + connection.SendingOffset,
+                                  connection.Sending.size() - connection.SendingOffset, Tag(&connection, OP_SEND));
+        ++connection.InFlight;
+      } else {
+        connection.Sending.clear();
+        connection.SendingOffset = 0;
+        QueueSend(context, connection);
+        ApplyBackpressure(context, connection);
+      }
+    }
+  }
+
+  FinishOperation(context, connection);
+}
+
+void TcpServerNetworkManager::FinishOperation(ReactorContext& context, Connection& connection) {
+  if (--connection.InFlight > 0 || !connection.Closed) {
+    return;
+  }
+
+  auto it = context.Draining.find(&connection);
+  std::unique_ptr<Connection> closed = std::move(it->second);
+  context.Draining.erase(it);
+  Recycle(context, std::move(closed));
+}
+
 void TcpServerNetworkManager::HandleRequestOut() {
 
+  std::vector<SocketMessage> batch;
+  batch.reserve(REPLY_BATCH_SIZE);
+
   while (!_should_stop) {
-    SocketMessage message;
-    if (_queue_out->Front(message) &&
-        message.SptrSocket != nullptr &&
-        message.Request.GetRequestType() != NetworkRequest::RequestType::UNKNOWN &&
-        message.SptrSocket->Type() == SOCK_STREAM) {
+    batch.clear();
+    if (_queue_out->PopBatch(batch, REPLY_BATCH_SIZE, QUEUE_WAIT) == 0) {
+      continue;
+    }
 
-        _queue_out->Pop();
-        auto request = message.Request.ToString();
-        message.SptrSocket->SendAll(request.c_str(), request.size());
+    std::vector<bool> woken(_reactors.size(), false);
+    uint64_t poppedAt = common::Metrics::Now();
+    for (auto& message : batch) {
+      if (message.SptrSocket == nullptr ||
+          message.Request.GetRequestType() == NetworkRequest::RequestType::UNKNOWN) {
+        continue;
+      }
+
+      common::Metrics::RecordSince(common::Stage::QUEUE_OUT, static_cast<int>(message.Request.GetRequestType()),
+                                   message.EnqueuedAt, poppedAt);
+      message.EnqueuedAt = poppedAt;
+
+      int fd = message.SptrSocket->Descriptor();
+      ReactorContext& owner = ReactorFor(fd);
+      {
+        std::lock_guard<std::mutex> guard(owner.PendingMutex);
+        owner.PendingReplies.push_back(std::move(message));
+      }
+      woken[fd % _reactors.size()] = true;
+    }
+
+    for (size_t i = 0; i < _reactors.size(); ++i) {
+      if (woken[i]) {
+        _reactors[i]->Poller.Wakeup();
+      }
     }
   }
 }
 
 void TcpServerNetworkManager::Init() {
 
-  _listener = std::make_unique<TcpSocket>(NULL, _port);
-  _listener->Listen();
-
   if (!_queue_in) {
-   _queue_in = std::make_shared<SocketMessageQueue>();
+   _queue_in = std::make_shared<RequestLanes>();
   }
 
   if (!_queue_out) {
    _queue_out = std::make_shared<SocketMessageQueue>();
   }
+
+  //every listener needs a reactor of its own
+  size_t reactors = std::max(_reactor_threads, _listener_shards);
+  bool reusePort = _listener_shards > 1;
+
+  _reactors.clear();
+  _listeners.clear();
+  for (size_t i = 0; i < reactors; ++i) {
+    _reactors.push_back(std::make_unique<ReactorContext>());
+  }
+
+  bool ring = _io_backend == network::IoBackend::IO_URING;
+  if (ring && !network::IoUring::Supported()) {
+    std::cerr << "io_uring is not supported by this kernel, TCP falls back to epoll" << std::endl;
+    ring = false;
+  }
+  for (size_t i = 0; ring && i < reactors; ++i) {
+    try {
+      _reactors[i]->Ring = std::make_unique<network::IoUring>(RING_ENTRIES, RING_BUFFERS, SOCKET_MSG_BUF_SIZE);
+    } catch (network::SocketException& e) {
+      std::cerr << e.what() << ", TCP falls back to epoll" << std::endl;
+      for (auto& reactor : _reactors) {
+        reactor->Ring.reset();
+      }
+      ring = false;
+    }
+  }
+
+  for (size_t i = 0; i < _listener_shards; ++i) {
+    auto listener = std::make_unique<TcpSocket>(nullptr, _port, false, reusePort);
+    listener->Listen();
+
+    _reactors[i]->Listener = listener.get();
+    if (!ring) {
+      _reactors[i]->Poller.Add(listener->Descriptor(), EPOLLIN | EPOLLET, listener.get());
+    }
+    _listeners.push_back(std::move(listener));
+  }
+
   _should_stop = false;
 }
 
 void TcpServerNetworkManager::Start() {
-  _thread_in = new std::thread(&TcpServerNetworkManager::HandleRequestIn, this);
+  Init();
+
+  _threads_in.emplace_back(&TcpServerNetworkManager::HandleRequestIn, this);
+  for (size_t i = 1; i < _reactors.size(); ++i) {
+    _threads_in.emplace_back(&TcpServerNetworkManager::RunReactor, this, i);
+  }
   _thread_out = new std::thread(&TcpServerNetworkManager::HandleRequestOut, this);
 }
 
-}
\ No newline at end of file
+void TcpServerNetworkManager::SetIdleTimeout(std::shared_ptr<TimingWheel> timers, int64_t timeoutMs) {
+  _timers = std::move(timers);
+  _idle_timeout = timeoutMs;
+}
+
+void TcpServerNetworkManager::Stop() {
+  SetStop();
+  for (auto& reactor : _reactors) {
+    reactor->Poller.Wakeup();
+  }
+  Join();
+}
+
+}
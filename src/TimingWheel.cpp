@@ -0,0 +1,231 @@
+#include "TimingWheel.h"
+#include <exception>
+
+namespace sobertalk {
+
+TimingWheel::TimingWheel(int tickMs)
+  : _tick(tickMs <= 0 ? 1 : tickMs), _origin(std::chrono::steady_clock::now()),
+    _slots(TIMING_WHEEL_LEVELS * SLOTS, NIL) {
+}
+
+TimingWheel::~TimingWheel() {
+  Stop();
+}
+
+void TimingWheel::Start() {
+  _should_stop = false;
+  _driver = new std::thread(&TimingWheel::Drive, this);
+}
+
+void TimingWheel::Stop() {
+  {
+    std::lock_guard<std::mutex> guard(_mutex);
+    _should_stop = true;
+  }
+  _wakeup.notify_all();
+
+  if (_driver) {
+    if (_driver->joinable()) {
+      _driver->join();
+    }
+    delete _driver;
+    _driver = NULL;
+  }
+}
+
+TimerId TimingWheel::Schedule(int64_t delayMs, Callback callback) {
+
+  std::lock_guard<std::mutex> guard(_mutex);
+
+  uint32_t index;
+  if (_free.empty()) {
+    index = static_cast<uint32_t>(_timers.size());
+    _timers.emplace_back();
+  } else {
+    index = _free.back();
+    _free.pop_back();
+  }
+
+  Timer& timer = _timers[index];
+  timer.Expiry = TicksFromNow(delayMs);
+  timer.Fn = std::move(callback);
+  Link(index);
+  ++_pending;
+
+  return (static_cast<TimerId>(timer.Generation) << 32) | index;
+}
+
+bool TimingWheel::Reschedule(TimerId id, int64_t delayMs) {
+
+  std::lock_guard<std::mutex> guard(_mutex);
+  Timer* timer = Resolve(id);
+  if (timer == nullptr) {
+    return false;
+  }
+
+  uint32_t index = static_cast<uint32_t>(id);
+  Unlink(index);
+  timer->Expiry = TicksFromNow(delayMs);
+  Link(index);
+  return true;
+}
+
+bool TimingWheel::Cancel(TimerId id) {
+
+  std::lock_guard<std::mutex> guard(_mutex);
+  if (Resolve(id) == nullptr) {
+    return false;
+  }
+  Release(static_cast<uint32_t>(id));
+  return true;
+}
+
+size_t TimingWheel::Size() const {
+  std::lock_guard<std::mutex> guard(_mutex);
+  return _pending;
+}
+
+TimingWheel::Timer* TimingWheel::Resolve(TimerId id) {
+  uint32_t index = static_cast<uint32_t>(id);
+  if (index >= _timers.size()) {
+    return nullptr;
+  }
+
+  Timer& timer = _timers[index];
+  if (timer.Generation != static_cast<uint32_t>(id >> 32) || timer.Slot == NIL) {
+    return nullptr;
+  }
+  return &timer;
+}
+
+void TimingWheel::Link(uint32_t index) {
+
+  Timer& timer = _timers[index];
+  uint64_t expiry = timer.Expiry < _current ? _current : timer.Expiry;
+  uint64_t delta = expiry - _current;
+
+  size_t level = 0;
+  while (level + 1 < TIMING_WHEEL_LEVELS && delta >= (uint64_t(1) << (SLOT_BITS * (level + 1)))) {
+    ++level;
+  }
+
+  //beyond the top level's range: park in its furthest slot, the cascade relinks it
+  if (delta >= (uint64_t(1) << (SLOT_BITS * (level + 1)))) {
+    expiry = _current + (uint64_t(1) << (SLOT_BITS * (level + 1))) - 1;
+  }
+
+  uint32_t slot = static_cast<uint32_t>(level * SLOTS + ((expiry >> (SLOT_BITS * level)) & (SLOTS - 1)));
+  timer.Slot = slot;
+  timer.Prev = NIL;
+  timer.Next = _slots[slot];
+  if (timer.Next != NIL) {
+    _timers[timer.Next].Prev = index;
+  }
+  _slots[slot] = index;
+}
+
+void TimingWheel::Unlink(uint32_t index) {
+
+  Timer& timer = _timers[index];
+  if (timer.Prev != NIL) {
+    _timers[timer.Prev].Next = timer.Next;
+  } else {
+    _slots[timer.Slot] = timer.Next;
+  }
+
+  if (timer.Next != NIL) {
+    _timers[timer.Next].Prev = timer.Prev;
+  }
+  timer.Prev = timer.Next = timer.Slot = NIL;
+}
+
+void TimingWheel::Release(uint32_t index) {
+  Unlink(index);
+
+  Timer& timer = _timers[index];
+  timer.Fn = nullptr;
+  //generation 0 would let a handle collide with INVALID_TIMER
+  if (++timer.Generation == 0) {
+    timer.Generation = 1;
+  }
+  _free.push_back(index);
+  --_pending;
+}
+
+void TimingWheel::Cascade(size_t level) {
+
+  uint32_t slot = static_cast<uint32_t>(level * SLOTS + ((_current >> (SLOT_BITS * level)) & (SLOTS - 1)));
+  uint32_t index = _slots[slot];
+  _slots[slot] = NIL;
+
+  while (index != NIL) {
+    uint32_t next = _timers[index].Next;
+    Link(index);
+    index = next;
+  }
+}
+
+uint64_t TimingWheel::TicksFromNow(int64_t delayMs) const {
+  auto due = std::chrono::steady_clock::now() - _origin + std::chrono::milliseconds(delayMs < 0 ? 0 : delayMs);
+  std::chrono::steady_clock::duration tick = _tick;
+  //round up, a timer never fires before its delay elapsed
+  return static_cast<uint64_t>((due + tick - std::chrono::steady_clock::duration(1)) / tick);
+}
+
+void TimingWheel::Advance(uint64_t now, std::vector<Callback>& due) {
+
+  while (_current <= now) {
+    if (_pending == 0) {
+      _current = now + 1;
+      return;
+    }
+
+    size_t slot = _current & (SLOTS - 1);
+    if (slot == 0) {
+      for (size_t level = 1; level < TIMING_WHEEL_LEVELS; ++level) {
+        Cascade(level);
+        if (((_current >> (SLOT_BITS * level)) & (SLOTS - 1)) != 0) {
+          break;
+        }
+      }
+    }
+
+    uint32_t index = _slots[slot];
+    while (index != NIL) {
+      uint32_t next = _timers[index].Next;
+      due.push_back(std::move(_timers[index].Fn));
+      Release(index);
+      index = next;
+    }
+    ++_current;
+  }
+}
+
+void TimingWheel::Drive() {
+
+  std::vector<Callback> due;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      //tick N is due once N ticks have elapsed since the origin
+      _wakeup.wait_until(lock, _origin + _tick * _current, [this] { return _should_stop.load(); });
+      if (_should_stop) {
+        return;
+      }
+
+      auto elapsed = std::chrono::steady_clock::now() - _origin;
+      Advance(static_cast<uint64_t>(elapsed / _tick), due);
+    }
+
+    for (auto& callback : due) {
+      try {
+        callback();
+      } catch (const std::exception&) {
+        //a failing timeout must not take the other timers down with it
+      }
+    }
+    due.clear();
+  }
+}
+
+}
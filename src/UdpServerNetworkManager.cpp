@@ -1,68 +1,228 @@
 #include "UdpServerNetworkManager.h"
 #include "Common.hpp"
+#include "Metrics.h"
 
 namespace sobertalk {
 
-UdpServerNetworkManager::UdpServerNetworkManager(uint16_t port, std::shared_ptr<SocketMessageQueue> queue_In, std::shared_ptr<SocketMessageQueue> queue_Out)
+namespace {
+  const std::chrono::milliseconds QUEUE_WAIT(200);
+  const int RECEIVE_TIMEOUT_MS = 500;
+}
+
+UdpServerNetworkManager::UdpServerNetworkManager(uint16_t port, std::shared_ptr<RequestLanes> queue_In, std::shared_ptr<SocketMessageQueue> queue_Out)
  : NetworkServiceManager(queue_In, queue_Out), _port(port) {
 }
 
 UdpServerNetworkManager::~UdpServerNetworkManager() {
+  Stop();
 }
 
 void UdpServerNetworkManager::Init() {
- 
- _listener = std::make_unique<UdpSocket>(NULL, _port);
+
  if (!_queue_in) {
-   _queue_in = std::make_shared<SocketMessageQueue>();
+   _queue_in = std::make_shared<RequestLanes>();
  }
 
  if (!_queue_out) {
    _queue_out = std::make_shared<SocketMessageQueue>();
  }
 
+ bool reusePort = _listener_shards > 1;
+ _shards.clear();
+ for (size_t i = 0; i < _listener_shards; ++i) {
+   auto shard = std::make_unique<ReceiveShard>();
+   shard->Listener = std::make_shared<UdpSocket>(nullptr, _port, true, reusePort);
+   //the listener stays blocking: the timeout only bounds how long Stop() waits for the receive loop
+   shard->Listener->SetReceiveTimeout(RECEIVE_TIMEOUT_MS);
+
+   shard->Buffers.assign(UDP_BATCH_SIZE * SOCKET_MSG_BUF_SIZE, 0);
+   shard->Iovecs.resize(UDP_BATCH_SIZE);
+   shard->Headers.resize(UDP_BATCH_SIZE);
+   shard->Peers.resize(UDP_BATCH_SIZE);
+   _shards.push_back(std::move(shard));
+ }
+
  _should_stop = false;
 }
 
 void UdpServerNetworkManager::HandleRequestIn() {
+  ReceiveLoop(0);
+}
+
+void UdpServerNetworkManager::ReceiveLoop(size_t index) {
+
+  ReceiveShard& shard = *_shards[index];
+  PinThread(index);
 
   while (!_should_stop) {
 
-    char buffer[SOCKET_MSG_BUF_SIZE];
-    struct sockaddr_storage ss;
-    char addr[INET6_ADDRSTRLEN];
-    uint16_t port;
+    for (size_t i = 0; i < UDP_BATCH_SIZE; ++i) {
+      shard.Iovecs[i].iov_base = &shard.Buffers[i * SOCKET_MSG_BUF_SIZE];
+      shard.Iovecs[i].iov_len = SOCKET_MSG_BUF_SIZE;
+
+      struct msghdr& header = shard.Headers[i].msg_hdr;
+      memset(&header, 0, sizeof(header));
+      header.msg_name = &shard.Peers[i].Storage;
+      header.msg_namelen = sizeof(struct sockaddr_storage);
+      header.msg_iov = &shard.Iovecs[i];
+      header.msg_iovlen = 1;
+    }
 
-    struct sockaddr* sa = (struct sockaddr *)&ss;
-    _listener->RecvFrom(buffer, SOCKET_MSG_BUF_SIZE, sa);
-    network::ParseSockAddr(sa, addr, &port);
+    //blocks until at least one datagram arrives, then takes whatever else is queued. -1 (EAGAIN)
+    //means RECEIVE_TIMEOUT_MS passed without any datagram, not that a burst was drained: the
+    //loop only goes round to check _should_stop.
+    int received;
+    try {
+      received = shard.Listener->RecvMany(shard.Headers.data(), UDP_BATCH_SIZE);
+    } catch (const std::exception&) {
+      continue;
+    }
 
-    auto request = NetworkRequest::FromString(buffer);
-    auto ptrUdpSock = std::make_shared<UdpSocket>(addr, port);
-    _queue_in->Push({request, ptrUdpSock});
+    uint64_t readAt = common::Metrics::Now();
+    uint64_t parseStart = readAt;
+    for (int i = 0; i < received; ++i) {
+      const struct msghdr& header = shard.Headers[i].msg_hdr;
+      if (header.msg_flags & MSG_TRUNC) {
+        continue;
+      }
+
+      //a flooding source costs one bucket lookup per datagram, nothing gets parsed for it
+      const struct sockaddr* source = shard.Peers[i].Get();
+      if (!AdmitRequest(source)) {
+        continue;
+      }
+
+      std::string_view payload(static_cast<const char*>(shard.Iovecs[i].iov_base), shard.Headers[i].msg_len);
+      auto format = NetworkRequest::DetectFormat(payload);
+      try {
+        SocketMessage message {NetworkRequest(), shard.Listener, format};
+        if (!DecodeRequest(source, payload, format, message.Request)) {
+          continue;
+        }
+        message.Peer = shard.Peers[i];
+        message.Peer.Length = header.msg_namelen;
+        message.ReceivedAt = readAt;
+        message.EnqueuedAt = common::Metrics::Now();
+        common::Metrics::Record(common::Stage::PARSE, static_cast<int>(message.Request.GetRequestType()),
+                                message.EnqueuedAt - parseStart);
+        parseStart = message.EnqueuedAt;
+        if (Deduplicate(message)) {
+          continue;
+        }
+
+        //never stall the receive loop on a full lane or queue behind an overload backlog,
+        //the client is told to come back instead
+        SocketMessage reply;
+        bool busy = ShedOnArrival(message, reply);
+        if (!busy && !_queue_in->TryPush(RequestLanes::Transport::UDP, std::move(message))) {
+          common::Metrics::Count(common::Counter::REQUESTS_DROPPED);
+          busy = AnswerBusy(message, reply);
+        }
+        if (busy && !_queue_out->TryPush(std::move(reply))) {
+          common::Metrics::Count(common::Counter::REPLIES_DROPPED);
+        }
+      } catch (const std::exception&) {
+        //malformed datagram, nothing to reply to
+      }
+    }
   }
 }
 
 void UdpServerNetworkManager::HandleRequestOut() {
 
+  std::vector<SocketMessage> batch;
+  //one send buffer per slot, reused across batches so encoding stops allocating once warm;
+  //sized once because the iovecs point into these strings
+  std::vector<std::string> payloads(UDP_BATCH_SIZE);
+  std::vector<struct iovec> iovecs(UDP_BATCH_SIZE);
+  std::vector<struct mmsghdr> headers(UDP_BATCH_SIZE);
+
   while (!_should_stop) {
 
-    SocketMessage message;
-    if (_queue_out->Front(message) &&
-        message.SptrSocket != nullptr && 
-        message.SptrSocket->Type() == SOCK_DGRAM &&
-        message.Request.GetRequestType() != NetworkRequest::RequestType::UNKNOWN) {
+    batch.clear();
+    if (_queue_out->PopBatch(batch, UDP_BATCH_SIZE, QUEUE_WAIT) == 0) {
+      continue;
+    }
+
+    unsigned int count = 0;
+    unsigned int runStart = 0;
+    UdpSocket* runListener = nullptr;
+    uint64_t poppedAt = common::Metrics::Now();
+    for (auto& message : batch) {
+      auto listener = dynamic_cast<UdpSocket*>(message.SptrSocket.get());
+      if (listener == nullptr || message.Peer.Empty() ||
+          message.Request.GetRequestType() == NetworkRequest::RequestType::UNKNOWN) {
+        message.EnqueuedAt = 0;
+        continue;
+      }
+
+      common::Metrics::RecordSince(common::Stage::QUEUE_OUT, static_cast<int>(message.Request.GetRequestType()),
+                                   message.EnqueuedAt, poppedAt);
+      message.EnqueuedAt = poppedAt;
+
+      //replies leave through the listener that received the request, one sendmmsg per listener run
+      if (listener != runListener && count > runStart) {
+        SendBatch(*runListener, &headers[runStart], count - runStart);
+        runStart = count;
+      }
+      runListener = listener;
+
+      std::string& payload = payloads[count];
+      payload.clear();
+      message.EncodeTo(payload);
+      iovecs[count].iov_base = const_cast<char*>(payload.data());
+      iovecs[count].iov_len = payload.size();
+
+      struct msghdr& header = headers[count].msg_hdr;
+      memset(&header, 0, sizeof(header));
+      header.msg_name = &message.Peer.Storage;
+      header.msg_namelen = message.Peer.Length;
+      header.msg_iov = &iovecs[count];
+      header.msg_iovlen = 1;
+      ++count;
+    }
 
-      _queue_out->Pop();
-      auto request = message.Request.ToString();
-      auto ptrUdpSock = std::dynamic_pointer_cast<UdpSocket>(message.SptrSocket);
-      ptrUdpSock->SendTo(request.c_str(), request.size());
+    if (count > runStart) {
+      SendBatch(*runListener, &headers[runStart], count - runStart);
+    }
+
+    uint64_t sentAt = common::Metrics::Now();
+    for (auto& message : batch) {
+      int type = static_cast<int>(message.Request.GetRequestType());
+      common::Metrics::RecordSince(common::Stage::SEND, type, message.EnqueuedAt, sentAt);
+      if (message.EnqueuedAt != 0) {
+        common::Metrics::RecordSince(common::Stage::TOTAL, type, message.ReceivedAt, sentAt);
+      }
     }
   }
 }
 
+void UdpServerNetworkManager::SendBatch(UdpSocket& listener, struct mmsghdr* headers, unsigned int count) {
+  unsigned int sent = 0;
+  while (sent < count && !_should_stop) {
+    int n;
+    try {
+      n = listener.SendMany(headers + sent, count - sent);
+    } catch (const std::exception&) {
+      //the datagram at the head of the batch failed, skip it and keep going
+      ++sent;
+      continue;
+    }
+
+    if (n == -1) {
+      //socket buffer full: the remaining replies are dropped like any lost datagram
+      return;
+    }
+    sent += n;
+  }
+}
+
 void UdpServerNetworkManager::Start() {
-  _thread_in = new std::thread(&UdpServerNetworkManager::HandleRequestIn, this);
+  Init();
+  _threads_in.emplace_back(&UdpServerNetworkManager::HandleRequestIn, this);
+  for (size_t i = 1; i < _shards.size(); ++i) {
+    _threads_in.emplace_back(&UdpServerNetworkManager::ReceiveLoop, this, i);
+  }
   _thread_out = new std::thread(&UdpServerNetworkManager::HandleRequestOut, this);
 }
-}
\ No newline at end of file
+}
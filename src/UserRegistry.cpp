@@ -0,0 +1,169 @@
+#include "UserRegistry.h"
+#include <chrono>
+#include <functional>
+#include <stdexcept>
+
+namespace sobertalk {
+
+namespace {
+  const size_t INITIAL_TABLE_CAPACITY = 256;
+}
+
+UserRegistry::Table::Table(size_t capacity)
+  : Mask(capacity - 1), Slots(new std::atomic<UserRecord*>[capacity]) {
+  for (size_t i = 0; i < capacity; ++i) {
+    Slots[i].store(nullptr, std::memory_order_relaxed);
+  }
+}
+
+UserRegistry::UserRegistry(size_t shards)
+  : _index(new std::atomic<std::atomic<UserRecord*>*>[INDEX_CHUNKS]) {
+
+  for (size_t i = 0; i < INDEX_CHUNKS; ++i) {
+    _index[i].store(nullptr, std::memory_order_relaxed);
+  }
+
+  for (size_t i = 0; i < (shards == 0 ? 1 : shards); ++i) {
+    auto shard = std::make_unique<Shard>();
+    shard->Tables.push_back(std::make_unique<Table>(INITIAL_TABLE_CAPACITY));
+    shard->Current.store(shard->Tables.back().get(), std::memory_order_release);
+    _shards.push_back(std::move(shard));
+  }
+}
+
+UserRegistry::~UserRegistry() {
+  for (size_t i = 0; i < INDEX_CHUNKS; ++i) {
+    delete[] _index[i].load(std::memory_order_relaxed);
+  }
+}
+
+size_t UserRegistry::Hash(std::string_view id) {
+  return std::hash<std::string_view>()(id);
+}
+
+UserRecord* UserRegistry::Probe(const Table& table, size_t hash, std::string_view id) {
+  for (size_t i = (hash >> 16) & table.Mask; ; i = (i + 1) & table.Mask) {
+    UserRecord* record = table.Slots[i].load(std::memory_order_acquire);
+    if (record == nullptr) {
+      return nullptr;
+    }
+    if (record->Id == id) {
+      return record;
+    }
+  }
+}
+
+void UserRegistry::Insert(Table& table, size_t hash, UserRecord* record) {
+  size_t i = (hash >> 16) & table.Mask;
+  while (table.Slots[i].load(std::memory_order_relaxed) != nullptr) {
+    i = (i + 1) & table.Mask;
+  }
+  table.Slots[i].store(record, std::memory_order_release);
+}
+
+UserRecord* UserRegistry::Find(std::string_view id) const {
+  size_t hash = Hash(id);
+  const Table* table = ShardOf(hash).Current.load(std::memory_order_acquire);
+  return Probe(*table, hash, id);
+}
+
+UserRecord* UserRegistry::Get(uint32_t index) const {
+  if (index >= Size()) {
+    return nullptr;
+  }
+  std::atomic<UserRecord*>* chunk = _index[index >> INDEX_CHUNK_BITS].load(std::memory_order_acquire);
+  return chunk[index & (INDEX_CHUNK_SIZE - 1)].load(std::memory_order_acquire);
+}
+
+UserRecord* UserRegistry::Intern(const std::string& id) {
+  size_t hash = Hash(id);
+  Shard& shard = ShardOf(hash);
+
+  UserRecord* record = Probe(*shard.Current.load(std::memory_order_acquire), hash, id);
+  if (record != nullptr) {
+    return record;
+  }
+
+  std::lock_guard<std::mutex> guard(shard.Mutex);
+  Table* table = shard.Current.load(std::memory_order_relaxed);
+  record = Probe(*table, hash, id);
+  if (record != nullptr) {
+    return record;
+  }
+
+  //keep the load factor at or below one half so probes stay short
+  if ((shard.Count + 1) * 2 > table->Mask + 1) {
+    auto grown = std::make_unique<Table>((table->Mask + 1) * 2);
+    for (auto& existing : shard.Records) {
+      Insert(*grown, Hash(existing->Id), existing.get());
+    }
+    table = grown.get();
+    shard.Tables.push_back(std::move(grown));
+    shard.Current.store(table, std::memory_order_release);
+  }
+
+  {
+    std::lock_guard<std::mutex> indexGuard(_index_mutex);
+    uint32_t index = _next_index.load(std::memory_order_relaxed);
+    if ((index >> INDEX_CHUNK_BITS) >= INDEX_CHUNKS) {
+      throw std::length_error("User registry is full");
+    }
+    shard.Records.push_back(std::make_unique<UserRecord>(id, index));
+    record = shard.Records.back().get();
+    PublishIndex(record);
+  }
+
+  Insert(*table, hash, record);
+  ++shard.Count;
+  return record;
+}
+
+void UserRegistry::PublishIndex(UserRecord* record) {
+  auto& slot = _index[record->Index >> INDEX_CHUNK_BITS];
+  std::atomic<UserRecord*>* chunk = slot.load(std::memory_order_relaxed);
+  if (chunk == nullptr) {
+    chunk = new std::atomic<UserRecord*>[INDEX_CHUNK_SIZE];
+    for (size_t i = 0; i < INDEX_CHUNK_SIZE; ++i) {
+      chunk[i].store(nullptr, std::memory_order_relaxed);
+    }
+    slot.store(chunk, std::memory_order_release);
+  }
+  chunk[record->Index & (INDEX_CHUNK_SIZE - 1)].store(record, std::memory_order_release);
+  _next_index.store(record->Index + 1, std::memory_order_release);
+}
+
+bool UserRegistry::Create(const std::string& id) {
+  UserRecord* record = Intern(id);
+  bool expected = false;
+  if (!record->Exists.compare_exchange_strong(expected, true)) {
+    return false;
+  }
+  record->Status.store(UserStatus::OFFLINE);
+  record->LastSeen.store(Now());
+  return true;
+}
+
+bool UserRegistry::Delete(const std::string& id) {
+  UserRecord* record = Find(id);
+  bool expected = true;
+  if (record == nullptr || !record->Exists.compare_exchange_strong(expected, false)) {
+    return false;
+  }
+  record->Status.store(UserStatus::OFFLINE);
+  record->SetRoute(nullptr);
+  return true;
+}
+
+void UserRegistry::Touch(UserRecord& record, std::shared_ptr<const UserRoute> route) {
+  record.LastSeen.store(Now(), std::memory_order_relaxed);
+  if (route) {
+    record.SetRoute(std::move(route));
+  }
+}
+
+int64_t UserRegistry::Now() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+}
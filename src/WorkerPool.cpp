@@ -0,0 +1,205 @@
+#include "WorkerPool.h"
+#include "Common.hpp"
+#include "Metrics.h"
+#include "RequestLanes.h"
+#include <algorithm>
+
+namespace sobertalk {
+
+namespace {
+  const size_t DISPATCH_BATCH_SIZE = 256;
+  const std::chrono::milliseconds QUEUE_WAIT(200);
+  //how long the dispatcher waits on a full shard before it moves control requests again
+  const std::chrono::milliseconds SHARD_RETRY(1);
+  //an idle worker wakes up this often to look for work to steal
+  const std::chrono::milliseconds STEAL_INTERVAL(50);
+}
+
+WorkerPool::WorkerPool(std::shared_ptr<RequestLanes> queue_In, Handler handler, size_t workers, Handler rejected)
+  : _queue_in(queue_In), _handler(handler), _rejected(rejected) {
+
+  if (workers == 0) {
+    workers = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  size_t capacity = std::max<size_t>(MESSAGE_QUEUE_CAPACITY / workers, 1024);
+  for (size_t i = 0; i < workers; ++i) {
+    _shards.push_back(std::make_unique<Shard>(capacity));
+  }
+}
+
+WorkerPool::~WorkerPool() {
+  Stop();
+}
+
+size_t WorkerPool::Backlog() const {
+  size_t backlog = 0;
+  for (auto& shard : _shards) {
+    backlog += shard->Ordered.Size() + shard->Shared.Size();
+  }
+  return backlog;
+}
+
+bool WorkerPool::RequiresOrdering(const common::NetworkRequest& request) {
+  return !request.GetUserId().empty() &&
+         request.GetRequestType() != common::NetworkRequest::RequestType::REGULAR_CHECK;
+}
+
+void WorkerPool::Start() {
+  _should_stop = false;
+  for (size_t i = 0; i < _shards.size(); ++i) {
+    _workers.emplace_back(&WorkerPool::Work, this, i);
+  }
+  _dispatcher = new std::thread(&WorkerPool::Dispatch, this);
+}
+
+void WorkerPool::Stop() {
+  _should_stop = true;
+
+  if (_dispatcher) {
+    if (_dispatcher->joinable()) {
+      _dispatcher->join();
+    }
+    delete _dispatcher;
+    _dispatcher = NULL;
+  }
+
+  for (auto& shard : _shards) {
+    std::lock_guard<std::mutex> guard(shard->WaitMutex);
+    shard->Ready.notify_all();
+  }
+
+  for (auto& worker : _workers) {
+    if (worker.joinable()) {
+      worker.join();
+    }
+  }
+  _workers.clear();
+}
+
+void WorkerPool::Dispatch() {
+
+  std::vector<SocketMessage> batch;
+  std::vector<SocketMessage> control;
+  batch.reserve(DISPATCH_BATCH_SIZE);
+  control.reserve(DISPATCH_BATCH_SIZE);
+  std::hash<std::string> hasher;
+
+  while (!_should_stop) {
+    batch.clear();
+    if (_queue_in->PopBatch(batch, DISPATCH_BATCH_SIZE, QUEUE_WAIT) == 0) {
+      continue;
+    }
+
+    for (auto& message : batch) {
+      if (!RequiresOrdering(message.Request)) {
+        if (!Share(message)) {
+          Reject(message);
+        }
+        continue;
+      }
+
+      Shard& shard = *_shards[hasher(message.Request.GetUserId()) % _shards.size()];
+      //a full shard holds bulk requests back, which backs up their lanes; heartbeats go on meanwhile
+      while (!shard.Ordered.Push(std::move(message), SHARD_RETRY) && !_should_stop) {
+        Signal(shard);
+        control.clear();
+        _queue_in->PopBatch(control, DISPATCH_BATCH_SIZE, std::chrono::milliseconds(0), true);
+        for (auto& request : control) {
+          if (!Share(request)) {
+            Reject(request);
+          }
+        }
+      }
+      Signal(shard);
+    }
+  }
+}
+
+bool WorkerPool::Share(SocketMessage& message) {
+  for (size_t attempt = 0; attempt < _shards.size(); ++attempt) {
+    Shard& shard = *_shards[_next_shared++ % _shards.size()];
+    if (shard.Shared.TryPush(std::move(message))) {
+      Signal(shard);
+      return true;
+    }
+  }
+  return false;
+}
+
+void WorkerPool::Reject(SocketMessage& message) {
+  common::Metrics::Count(common::Counter::REQUESTS_DROPPED);
+  if (!_rejected) {
+    return;
+  }
+
+  try {
+    _rejected(message);
+  } catch (const std::exception&) {
+    //the dispatcher must keep going whatever the handler does
+  }
+}
+
+void WorkerPool::Work(size_t index) {
+
+  Shard& shard = *_shards[index];
+  size_t weight = _queue_in->ControlWeight();
+  size_t controlRun = 0;
+
+  while (!_should_stop) {
+    SocketMessage message;
+    //shared requests first, but every weight of them lets one ordered request through
+    if (controlRun < weight && shard.Shared.TryPop(message)) {
+      ++controlRun;
+      Run(message);
+      continue;
+    }
+    controlRun = 0;
+    if (shard.Ordered.TryPop(message) || shard.Shared.TryPop(message) || Steal(index, message)) {
+      Run(message);
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(shard.WaitMutex);
+    shard.Sleeping.store(true);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    shard.Ready.wait_for(lock, STEAL_INTERVAL, [&] {
+      return _should_stop || !shard.Ordered.Empty() || !shard.Shared.Empty();
+    });
+    shard.Sleeping.store(false);
+  }
+}
+
+bool WorkerPool::Steal(size_t thief, SocketMessage& message) {
+  //only the shared queues: taking from another shard's ordered queue could reorder a user's requests
+  for (size_t i = 1; i < _shards.size(); ++i) {
+    if (_shards[(thief + i) % _shards.size()]->Shared.TryPop(message)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void WorkerPool::Signal(Shard& shard) {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (shard.Sleeping.load()) {
+    std::lock_guard<std::mutex> guard(shard.WaitMutex);
+    shard.Ready.notify_one();
+  }
+}
+
+void WorkerPool::Run(SocketMessage& message) {
+  //the handler may move the message away, e.g. into a parked poll
+  int type = static_cast<int>(message.Request.GetRequestType());
+  uint64_t started = common::Metrics::Now();
+  common::Metrics::RecordSince(common::Stage::QUEUE_IN, type, message.EnqueuedAt, started);
+
+  try {
+    _handler(message);
+  } catch (const std::exception&) {
+    //a bad request must not take the worker down with it
+  }
+  common::Metrics::Record(common::Stage::PROCESS, type, common::Metrics::Now() - started);
+}
+
+}
@@ -0,0 +1,150 @@
+#include "WriteBehindPipeline.h"
+#include <algorithm>
+#include <exception>
+#include <iostream>
+
+namespace sobertalk {
+
+namespace {
+  const std::chrono::milliseconds RETRY_INITIAL_BACKOFF(100);
+  const std::chrono::milliseconds RETRY_MAX_BACKOFF(5000);
+  const int SHUTDOWN_RETRIES = 5;
+}
+
+WriteBehindPipeline::WriteBehindPipeline(std::unique_ptr<PersistenceSink> sink,
+                                         size_t batchSize,
+                                         int flushIntervalMs,
+                                         size_t maxPending)
+  : _sink(std::move(sink)), _batch_size(batchSize == 0 ? 1 : batchSize),
+    _flush_interval(flushIntervalMs), _max_pending(maxPending == 0 ? 1 : maxPending) {
+}
+
+WriteBehindPipeline::~WriteBehindPipeline() {
+  Stop();
+}
+
+void WriteBehindPipeline::Start() {
+  _should_stop = false;
+  _flusher = new std::thread(&WriteBehindPipeline::Run, this);
+}
+
+void WriteBehindPipeline::Stop() {
+  {
+    std::lock_guard<std::mutex> guard(_mutex);
+    _should_stop = true;
+  }
+  _work.notify_all();
+
+  if (_flusher) {
+    if (_flusher->joinable()) {
+      _flusher->join();
+    }
+    delete _flusher;
+    _flusher = NULL;
+  }
+}
+
+void WriteBehindPipeline::Submit(Mutation mutation) {
+
+  std::string key = KeyOf(mutation);
+  std::unique_lock<std::mutex> lock(_mutex);
+
+  while (true) {
+    auto it = _index.find(key);
+    if (it != _index.end()) {
+      //the document is still waiting for its flush, the newer state wins
+      _pending[it->second] = std::move(mutation);
+      return;
+    }
+
+    if (_pending.size() + _in_flight < _max_pending) {
+      break;
+    }
+    _space.wait(lock);
+  }
+
+  _index.emplace(std::move(key), _pending.size());
+  _pending.push_back(std::move(mutation));
+  if (_pending.size() >= _batch_size) {
+    _work.notify_one();
+  }
+}
+
+void WriteBehindPipeline::Flush() {
+  std::unique_lock<std::mutex> lock(_mutex);
+  while (!_pending.empty() || _in_flight > 0) {
+    //the flusher clears the request when it takes a generation, ask again for what came in after
+    if (!_flush_requested) {
+      _flush_requested = true;
+      _work.notify_one();
+    }
+    _space.wait(lock);
+  }
+}
+
+size_t WriteBehindPipeline::Backlog() const {
+  std::lock_guard<std::mutex> guard(_mutex);
+  return _pending.size() + _in_flight;
+}
+
+void WriteBehindPipeline::Run() {
+
+  std::vector<Mutation> taken;
+  std::vector<Mutation> batch;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      _work.wait_for(lock, _flush_interval, [this] {
+        return _should_stop || _flush_requested || _pending.size() >= _batch_size;
+      });
+
+      if (_pending.empty()) {
+        _flush_requested = false;
+        if (_should_stop) {
+          return;
+        }
+        continue;
+      }
+
+      //take everything: documents submitted from here on are coalesced in a fresh generation
+      taken.swap(_pending);
+      _index.clear();
+      _in_flight = taken.size();
+      _flush_requested = false;
+    }
+
+    for (size_t first = 0; first < taken.size(); first += _batch_size) {
+      size_t last = std::min(first + _batch_size, taken.size());
+      batch.assign(std::make_move_iterator(taken.begin() + first), std::make_move_iterator(taken.begin() + last));
+      WriteBatch(batch);
+
+      std::lock_guard<std::mutex> guard(_mutex);
+      _in_flight -= batch.size();
+      _space.notify_all();
+    }
+    taken.clear();
+  }
+}
+
+void WriteBehindPipeline::WriteBatch(const std::vector<Mutation>& batch) {
+
+  auto backoff = RETRY_INITIAL_BACKOFF;
+  int failures = 0;
+  while (true) {
+    try {
+      _sink->Write(batch);
+      return;
+    } catch (const std::exception& e) {
+      ++failures;
+      if (_should_stop && failures >= SHUTDOWN_RETRIES) {
+        std::cerr << "Dropping " << batch.size() << " unpersisted documents: " << e.what() << std::endl;
+        return;
+      }
+    }
+
+    std::this_thread::sleep_for(backoff);
+    backoff = std::min(backoff * 2, RETRY_MAX_BACKOFF);
+  }
+}
+
+}
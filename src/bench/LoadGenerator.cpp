@@ -0,0 +1,820 @@
+/*
+*   talkie-load: load generator for a running talkie server
+*
+*   Opens --connections TCP connections, one bench user each, spread over
+*   --threads load threads, and drives them open loop: every thread sends at
+*   its share of --rate on a fixed schedule and picks an idle connection for
+*   each request. A request that finds no idle connection is counted as
+*   missed rather than delayed, so an overloaded server shows up as missed
+*   sends and tail latency instead of silently lowering the offered load.
+*   Latency is measured from the scheduled send time to the reply.
+*
+*   Next to that, --udp-clients UDP clients send REGULAR_CHECK heartbeats
+*   for the bench users every --heartbeat-ms, staggered evenly.
+*
+*   Only requests scheduled after --warmup seconds are reported. Runs with
+*   the same options and --seed send the same request sequence.
+*
+*   Author: Fu Qiao
+*   Email:  fqiao@protonmail.com
+*
+*/
+
+#include "LatencyRecorder.hpp"
+#include "ByteRingBuffer.h"
+#include "Common.hpp"
+#include "Framing.hpp"
+#include "Network.hpp"
+#include "NetworkRequest.h"
+#include "Reactor.h"
+#include <signal.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+using RequestType = common::NetworkRequest::RequestType;
+using common::NetworkRequest;
+using common::WireFormat;
+
+const size_t REQUEST_TYPES = static_cast<size_t>(RequestType::CHANGE_STATUS) + 1;
+const size_t READ_SIZE = 16384;
+const std::chrono::seconds DRAIN_TIME(2); //how long replies are awaited after the last send
+
+struct MixEntry {
+  const char* Name;
+  RequestType Type;
+  unsigned Weight;
+};
+
+//default mix, roughly a chat client: mostly messages and presence
+const MixEntry DEFAULT_MIX[] = {
+  {"create", RequestType::CREATE_USER, 1},
+  {"delete", RequestType::DELETE_USER, 1},
+  {"push", RequestType::PUSH_MESSAGE, 35},
+  {"poll", RequestType::POLL_MESSAGE, 35},
+  {"add_friend", RequestType::ADD_FRIEND, 4},
+  {"delete_friend", RequestType::DELETE_FRIEND, 4},
+  {"check", RequestType::REGULAR_CHECK, 15},
+  {"status", RequestType::CHANGE_STATUS, 5},
+};
+
+struct LoadOptions {
+  std::string Host {"127.0.0.1"};
+  uint16_t TcpPort {SERVER_TCP_PORT};
+  uint16_t UdpPort {SERVER_UDP_PORT};
+  size_t Connections {1000};
+  size_t UdpClients {1000};
+  size_t Threads {4};
+  double Rate {20000};
+  double Duration {10};
+  double Warmup {2};
+  int HeartbeatMs {HEARTBEAT_RATE * 1000};
+  size_t Payload {64};
+  bool Binary {false};
+  uint64_t Seed {1};
+  std::string Prefix {"bench"};
+  unsigned Weights[REQUEST_TYPES] {};
+};
+
+struct TypeStats {
+  uint64_t Sent {0};
+  uint64_t Replies {0};
+  uint64_t Failures {0}; //replies carrying an ERROR_* result
+  bench::LatencyRecorder Latency;
+};
+
+struct LoadStats {
+  TypeStats Types[REQUEST_TYPES];
+  TypeStats Heartbeats;
+  uint64_t Missed {0};
+  uint64_t Notices {0};
+  uint64_t Lost {0};    //heartbeats without a reply before the next one was due
+  uint64_t Dropped {0}; //connections that failed during the run
+
+  void Merge(const LoadStats& other) {
+    for (size_t i = 0; i < REQUEST_TYPES; ++i) {
+      MergeType(Types[i], other.Types[i]);
+    }
+    MergeType(Heartbeats, other.Heartbeats);
+    Missed += other.Missed;
+    Notices += other.Notices;
+    Lost += other.Lost;
+    Dropped += other.Dropped;
+  }
+
+  static void MergeType(TypeStats& into, const TypeStats& from) {
+    into.Sent += from.Sent;
+    into.Replies += from.Replies;
+    into.Failures += from.Failures;
+    into.Latency.Merge(from.Latency);
+  }
+};
+
+//Releases all load threads at the same instant once every one has connected
+class StartGate {
+
+public:
+  explicit StartGate(size_t parties) : _parties(parties) {}
+
+  Clock::time_point Arrive() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (++_arrived == _parties) {
+      _start = Clock::now();
+      _released.notify_all();
+    } else {
+      _released.wait(lock, [this] { return _arrived == _parties; });
+    }
+    return _start;
+  }
+
+private:
+  std::mutex _mutex;
+  std::condition_variable _released;
+  size_t _parties;
+  size_t _arrived {0};
+  Clock::time_point _start;
+};
+
+struct TcpClient {
+  std::unique_ptr<network::CommunicationSocket> Socket;
+  std::string UserId;
+  common::ByteRingBuffer Inbound;
+  std::string Outbound;
+  size_t OutboundOffset {0};
+  bool Alive {true};
+
+  //the request in flight, at most one per connection
+  bool Busy {false};
+  RequestType PendingType {RequestType::UNKNOWN};
+  std::string PendingUser;
+  Clock::time_point Scheduled;
+
+  uint64_t Cursor {0}; //last mailbox sequence seen by a poll
+};
+
+struct UdpClient {
+  std::unique_ptr<network::UdpSocket> Socket;
+  std::string UserId;
+  std::string Datagram;
+  bool Waiting {false};
+  Clock::time_point Sent;
+};
+
+std::string UserName(const LoadOptions& options, size_t index) {
+  return options.Prefix + std::to_string(index);
+}
+
+std::string Encode(const NetworkRequest& request, const LoadOptions& options) {
+  return request.Encode(options.Binary ? WireFormat::BINARY : WireFormat::JSON);
+}
+
+//Advance the poll cursor past the messages listed in an "OK\n<seq>,<sender>,<body>\n..." reply
+void AdvanceCursor(TcpClient& client, const std::string& result) {
+  //every record starts right after position
+  size_t position = result.find('\n');
+  while (position != std::string::npos && position + 1 < result.size()) {
+    size_t headerEnd = result.find('\n', position + 1);
+    unsigned long long sequence;
+    unsigned senderLength, bodyLength;
+    if (headerEnd == std::string::npos ||
+        sscanf(result.c_str() + position + 1, "%llu,%u,%u", &sequence, &senderLength, &bodyLength) != 3) {
+      return;
+    }
+    client.Cursor = std::max<uint64_t>(client.Cursor, sequence);
+    position = headerEnd + senderLength + bodyLength;
+  }
+}
+
+NetworkRequest BuildRequest(const LoadOptions& options, TcpClient& client, RequestType type, std::mt19937_64& random) {
+
+  std::string peer = UserName(options, random() % options.Connections);
+  if (peer == client.UserId) {
+    peer = UserName(options, (random() % options.Connections + 1) % options.Connections);
+  }
+
+  switch (type) {
+    case RequestType::CREATE_USER:
+    case RequestType::DELETE_USER:
+      //a scratch user per connection, creating and deleting it alternate between OK and ERROR_*
+      return NetworkRequest("", type, client.UserId + "-scratch");
+
+    case RequestType::PUSH_MESSAGE:
+      return NetworkRequest(peer + "\n" + std::string(options.Payload, 'x'), type, client.UserId);
+
+    case RequestType::POLL_MESSAGE:
+      return NetworkRequest(std::to_string(client.Cursor), type, client.UserId);
+
+    case RequestType::ADD_FRIEND:
+    case RequestType::DELETE_FRIEND:
+      return NetworkRequest(peer, type, client.UserId);
+
+    case RequestType::CHANGE_STATUS:
+      //ONLINE, AWAY or BUSY, never OFFLINE so the user keeps receiving notices
+      return NetworkRequest(std::to_string(1 + random() % 3), type, client.UserId);
+
+    default:
+      return NetworkRequest("", type, client.UserId);
+  }
+}
+
+//Blocking round trip used while setting up, before the connection turns non-blocking
+NetworkRequest RoundTrip(TcpClient& client, const NetworkRequest& request, const LoadOptions& options) {
+  std::string frame;
+  common::AppendFrame(frame, Encode(request, options));
+  if (!client.Socket->SendAll(frame.data(), frame.size())) {
+    throw network::SocketException("Error when sending a setup request");
+  }
+
+  while (true) {
+    std::string_view payload;
+    common::FrameStatus status = common::PeekFrame(client.Inbound, TCP_MAX_FRAME_SIZE, payload);
+    if (status == common::FrameStatus::COMPLETE) {
+      NetworkRequest reply = NetworkRequest::Decode(payload, options.Binary ? WireFormat::BINARY : WireFormat::JSON);
+      common::ConsumeFrame(client.Inbound, payload);
+      return reply;
+    }
+    if (status != common::FrameStatus::INCOMPLETE) {
+      throw network::SocketException("Malformed frame from the server");
+    }
+
+    size_t available;
+    char* target = client.Inbound.PrepareWrite(READ_SIZE, available);
+    int received = client.Socket->Recv(target, available);
+    if (received <= 0) {
+      throw network::SocketException("Server closed a setup connection");
+    }
+    client.Inbound.CommitWrite(received);
+  }
+}
+
+class TcpLoadThread {
+
+public:
+  TcpLoadThread(const LoadOptions& options, size_t first, size_t last, size_t threadIndex, StartGate& gate)
+    : _options(options), _first(first), _last(last), _gate(gate), _random(options.Seed + threadIndex) {
+
+    unsigned total = 0;
+    for (size_t i = 0; i < REQUEST_TYPES; ++i) {
+      total += options.Weights[i];
+      _cumulative[i] = total;
+    }
+    _interval = std::chrono::duration_cast<Clock::duration>(
+      std::chrono::duration<double>(options.Threads / options.Rate));
+  }
+
+  void Run() {
+    try {
+      Connect();
+    } catch (const std::exception& e) {
+      std::cerr << "Setup failed: " << e.what() << std::endl;
+      _failed = true;
+    }
+
+    Clock::time_point start = _gate.Arrive();
+    if (_failed) {
+      return;
+    }
+
+    _measure_from = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(_options.Warmup));
+    Clock::time_point end = _measure_from +
+                            std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(_options.Duration));
+    Clock::time_point next = start;
+
+    while (true) {
+      Clock::time_point now = Clock::now();
+      for (; next <= now && next < end; next += _interval) {
+        SendNext(next);
+      }
+
+      if (next >= end && (_in_flight == 0 || now >= end + DRAIN_TIME)) {
+        break;
+      }
+
+      int timeoutMs = 10;
+      if (next < end) {
+        auto until = std::chrono::duration_cast<std::chrono::milliseconds>(next - now).count();
+        timeoutMs = static_cast<int>(std::min<int64_t>(until, 10));
+      }
+
+      int ready = _poller.Wait(timeoutMs);
+      for (int i = 0; i < ready; ++i) {
+        const struct epoll_event& ev = _poller.Event(i);
+        TcpClient& client = *static_cast<TcpClient*>(ev.data.ptr);
+        if (!client.Alive) {
+          continue;
+        }
+        if ((ev.events & EPOLLOUT) && !Flush(client)) {
+          Drop(client);
+          continue;
+        }
+        if (ev.events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+          Read(client);
+        }
+      }
+    }
+  }
+
+  bool Failed() const { return _failed; }
+  const LoadStats& Stats() const { return _stats; }
+
+private:
+  void Connect() {
+    for (size_t i = _first; i < _last; ++i) {
+      auto client = std::make_unique<TcpClient>();
+      client->UserId = UserName(_options, i);
+      client->Socket.reset(network::CommunicationSocket::Connect(_options.Host.c_str(), _options.TcpPort));
+
+      //ERROR_EXISTS is fine, the user is left over from an earlier run
+      RoundTrip(*client, NetworkRequest("", RequestType::CREATE_USER, client->UserId), _options);
+      RoundTrip(*client, NetworkRequest("1", RequestType::CHANGE_STATUS, client->UserId), _options);
+
+      client->Socket->SetBlocking(false);
+      _poller.Add(client->Socket->Descriptor(), EPOLLIN | EPOLLOUT | EPOLLET, client.get());
+      _idle.push_back(client.get());
+      _clients.push_back(std::move(client));
+    }
+  }
+
+  RequestType NextType() {
+    unsigned pick = _random() % _cumulative[REQUEST_TYPES - 1];
+    size_t type = 0;
+    while (pick >= _cumulative[type]) {
+      ++type;
+    }
+    return static_cast<RequestType>(type);
+  }
+
+  void SendNext(Clock::time_point scheduled) {
+    bool measured = scheduled >= _measure_from;
+    if (_idle.empty()) {
+      if (measured) {
+        ++_stats.Missed;
+      }
+      return;
+    }
+
+    size_t slot = _random() % _idle.size();
+    TcpClient& client = *_idle[slot];
+    _idle[slot] = _idle.back();
+    _idle.pop_back();
+
+    RequestType type = NextType();
+    NetworkRequest request = BuildRequest(_options, client, type, _random);
+    client.Busy = true;
+    client.PendingType = type;
+    client.PendingUser = request.GetUserId();
+    client.Scheduled = scheduled;
+    ++_in_flight;
+    if (measured) {
+      ++_stats.Types[static_cast<size_t>(type)].Sent;
+    }
+
+    size_t frame = common::BeginFrame(client.Outbound);
+    request.EncodeTo(client.Outbound, _options.Binary ? WireFormat::BINARY : WireFormat::JSON);
+    common::EndFrame(client.Outbound, frame);
+    if (!Flush(client)) {
+      Drop(client);
+    }
+  }
+
+  bool Flush(TcpClient& client) {
+    while (client.OutboundOffset < client.Outbound.size()) {
+      int sent;
+      try {
+        sent = client.Socket->Send(client.Outbound.data() + client.OutboundOffset,
+                                   client.Outbound.size() - client.OutboundOffset);
+      } catch (const std::exception&) {
+        return false;
+      }
+      if (sent == -1) {
+        return true; //EPOLLOUT resumes
+      }
+      client.OutboundOffset += sent;
+    }
+    client.Outbound.clear();
+    client.OutboundOffset = 0;
+    return true;
+  }
+
+  void Read(TcpClient& client) {
+    while (true) {
+      size_t available;
+      char* target = client.Inbound.PrepareWrite(READ_SIZE, available);
+      int received;
+      try {
+        received = client.Socket->Recv(target, available);
+      } catch (const std::exception&) {
+        received = 0;
+      }
+      if (received == 0) {
+        Drop(client);
+        return;
+      }
+      if (received == -1) {
+        break;
+      }
+      client.Inbound.CommitWrite(received);
+    }
+
+    WireFormat format = _options.Binary ? WireFormat::BINARY : WireFormat::JSON;
+    std::string_view payload;
+    common::FrameStatus status;
+    while ((status = common::PeekFrame(client.Inbound, TCP_MAX_FRAME_SIZE, payload)) == common::FrameStatus::COMPLETE) {
+      NetworkRequest reply;
+      try {
+        reply = NetworkRequest::Decode(payload, format);
+      } catch (const std::exception&) {
+        Drop(client);
+        return;
+      }
+      common::ConsumeFrame(client.Inbound, payload);
+      OnFrame(client, reply);
+    }
+    if (status != common::FrameStatus::INCOMPLETE) {
+      Drop(client);
+    }
+  }
+
+  void OnFrame(TcpClient& client, const NetworkRequest& frame) {
+    const std::string& result = frame.GetParameters();
+
+    //status notices carry the friend's id, mail notices share type and user with a poll reply
+    bool reply = client.Busy && frame.GetRequestType() == client.PendingType && frame.GetUserId() == client.PendingUser &&
+                 !(frame.GetRequestType() == RequestType::POLL_MESSAGE && result.compare(0, 4, "NEW\n") == 0);
+    if (!reply) {
+      ++_stats.Notices;
+      return;
+    }
+
+    if (client.PendingType == RequestType::POLL_MESSAGE) {
+      AdvanceCursor(client, result);
+    }
+
+    if (client.Scheduled >= _measure_from) {
+      TypeStats& stats = _stats.Types[static_cast<size_t>(client.PendingType)];
+      ++stats.Replies;
+      if (result.compare(0, 5, "ERROR") == 0) {
+        ++stats.Failures;
+      }
+      stats.Latency.Record(Clock::now() - client.Scheduled);
+    }
+
+    client.Busy = false;
+    --_in_flight;
+    _idle.push_back(&client);
+  }
+
+  void Drop(TcpClient& client) {
+    if (!client.Alive) {
+      return;
+    }
+    client.Alive = false;
+    _poller.Remove(client.Socket->Descriptor());
+    ++_stats.Dropped;
+
+    if (client.Busy) {
+      --_in_flight;
+    } else {
+      _idle.erase(std::find(_idle.begin(), _idle.end(), &client));
+    }
+  }
+
+  const LoadOptions& _options;
+  const size_t _first;
+  const size_t _last;
+  StartGate& _gate;
+  std::mt19937_64 _random;
+  unsigned _cumulative[REQUEST_TYPES];
+  Clock::duration _interval;
+  Clock::time_point _measure_from;
+
+  network::Reactor _poller {1024};
+  std::vector<std::unique_ptr<TcpClient>> _clients;
+  std::vector<TcpClient*> _idle;
+  size_t _in_flight {0};
+  bool _failed {false};
+  LoadStats _stats;
+};
+
+class UdpLoadThread {
+
+public:
+  UdpLoadThread(const LoadOptions& options, StartGate& gate) : _options(options), _gate(gate) {}
+
+  void Run() {
+    try {
+      for (size_t i = 0; i < _options.UdpClients; ++i) {
+        auto client = std::make_unique<UdpClient>();
+        client->UserId = UserName(_options, i % _options.Connections);
+        client->Datagram = Encode(NetworkRequest("", RequestType::REGULAR_CHECK, client->UserId), _options);
+        client->Socket = std::make_unique<network::UdpSocket>(_options.Host.c_str(), _options.UdpPort);
+        client->Socket->SetBlocking(false);
+        _poller.Add(client->Socket->Descriptor(), EPOLLIN | EPOLLET, client.get());
+        _clients.push_back(std::move(client));
+      }
+    } catch (const std::exception& e) {
+      std::cerr << "UDP setup failed: " << e.what() << std::endl;
+      _clients.clear();
+    }
+
+    Clock::time_point start = _gate.Arrive();
+    if (_clients.empty()) {
+      return;
+    }
+
+    Clock::time_point measureFrom = start +
+      std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(_options.Warmup));
+    Clock::time_point end = measureFrom +
+      std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(_options.Duration));
+    //heartbeats are staggered evenly over the period
+    Clock::duration spacing = std::chrono::duration_cast<Clock::duration>(
+      std::chrono::milliseconds(_options.HeartbeatMs)) / _clients.size();
+
+    uint64_t sent = 0;
+    Clock::time_point next = start;
+    char buffer[SOCKET_MSG_BUF_SIZE];
+    while (true) {
+      Clock::time_point now = Clock::now();
+      for (; next <= now && next < end; next = start + spacing * ++sent) {
+        UdpClient& client = *_clients[sent % _clients.size()];
+        bool measured = next >= measureFrom;
+        if (client.Waiting && measured) {
+          ++_stats.Lost;
+        }
+        try {
+          client.Socket->SendTo(client.Datagram.data(), client.Datagram.size());
+        } catch (const std::exception&) {
+          continue;
+        }
+        client.Waiting = true;
+        client.Sent = next;
+        if (measured) {
+          ++_stats.Heartbeats.Sent;
+        }
+      }
+
+      if (next >= end && now >= end + DRAIN_TIME) {
+        break;
+      }
+
+      int timeoutMs = 10;
+      if (next < end) {
+        auto until = std::chrono::duration_cast<std::chrono::milliseconds>(next - now).count();
+        timeoutMs = static_cast<int>(std::min<int64_t>(until, 10));
+      }
+
+      int ready = _poller.Wait(timeoutMs);
+      for (int i = 0; i < ready; ++i) {
+        UdpClient& client = *static_cast<UdpClient*>(_poller.Event(i).data.ptr);
+        while (true) {
+          NetworkRequest frame;
+          try {
+            int received = client.Socket->Recv(buffer, sizeof(buffer));
+            if (received <= 0) {
+              break;
+            }
+            std::string_view datagram(buffer, received);
+            frame = NetworkRequest::Decode(datagram, NetworkRequest::DetectFormat(datagram));
+          } catch (const std::exception&) {
+            //ECONNREFUSED of an earlier datagram or a malformed reply, the heartbeat counts as lost
+            continue;
+          }
+          if (!client.Waiting || frame.GetRequestType() != RequestType::REGULAR_CHECK || frame.GetUserId() != client.UserId) {
+            ++_stats.Notices;
+            continue;
+          }
+
+          client.Waiting = false;
+          if (client.Sent >= measureFrom) {
+            ++_stats.Heartbeats.Replies;
+            if (frame.GetParameters().compare(0, 5, "ERROR") == 0) {
+              ++_stats.Heartbeats.Failures;
+            }
+            _stats.Heartbeats.Latency.Record(Clock::now() - client.Sent);
+          }
+        }
+      }
+    }
+  }
+
+  const LoadStats& Stats() const { return _stats; }
+
+private:
+  const LoadOptions& _options;
+  StartGate& _gate;
+  network::Reactor _poller {1024};
+  std::vector<std::unique_ptr<UdpClient>> _clients;
+  LoadStats _stats;
+};
+
+void PrintRow(const char* name, TypeStats& stats, double seconds) {
+  auto us = [](int64_t ns) { return ns / 1000.0; };
+  printf("%-14s %10llu %10llu %9llu %11.1f %10.1f %10.1f %10.1f %10.1f\n", name,
+         static_cast<unsigned long long>(stats.Sent), static_cast<unsigned long long>(stats.Replies),
+         static_cast<unsigned long long>(stats.Failures), stats.Replies / seconds,
+         us(stats.Latency.Percentile(50)), us(stats.Latency.Percentile(99)),
+         us(stats.Latency.Percentile(99.9)), us(stats.Latency.Max()));
+}
+
+void Report(const LoadOptions& options, LoadStats& stats) {
+  printf("talkie-load: %zu tcp connections on %zu threads, %zu udp clients, target %.0f req/s, %.1fs measured after %.1fs warmup, %s codec, seed %llu\n\n",
+         options.Connections, options.Threads, options.UdpClients, options.Rate, options.Duration, options.Warmup,
+         options.Binary ? "binary" : "json", static_cast<unsigned long long>(options.Seed));
+  printf("%-14s %10s %10s %9s %11s %10s %10s %10s %10s\n",
+         "request", "sent", "replies", "errors", "replies/s", "p50 us", "p99 us", "p999 us", "max us");
+
+  TypeStats all;
+  for (const MixEntry& entry : DEFAULT_MIX) {
+    TypeStats& type = stats.Types[static_cast<size_t>(entry.Type)];
+    if (type.Sent == 0 && type.Replies == 0) {
+      continue;
+    }
+    PrintRow(entry.Name, type, options.Duration);
+    LoadStats::MergeType(all, type);
+  }
+  PrintRow("all tcp", all, options.Duration);
+  if (stats.Heartbeats.Sent > 0) {
+    PrintRow("udp heartbeat", stats.Heartbeats, options.Duration);
+  }
+
+  printf("\nmissed sends (no idle connection): %llu\nlost heartbeats: %llu\nnotices: %llu\ndropped connections: %llu\n",
+         static_cast<unsigned long long>(stats.Missed), static_cast<unsigned long long>(stats.Lost),
+         static_cast<unsigned long long>(stats.Notices), static_cast<unsigned long long>(stats.Dropped));
+}
+
+void PrintUsage(const char* program) {
+  std::cerr << "Usage: " << program << " [options]\n"
+            << "  --host ADDRESS      server address (default: 127.0.0.1)\n"
+            << "  --tcp-port PORT     (default: " << SERVER_TCP_PORT << ")\n"
+            << "  --udp-port PORT     (default: " << SERVER_UDP_PORT << ")\n"
+            << "  --connections N     TCP connections, one bench user each (default: 1000)\n"
+            << "  --udp-clients N     UDP heartbeat clients (default: 1000)\n"
+            << "  --threads N         TCP load threads (default: 4)\n"
+            << "  --rate N            target TCP requests per second (default: 20000)\n"
+            << "  --duration SECONDS  measured time (default: 10)\n"
+            << "  --warmup SECONDS    unmeasured time before it (default: 2)\n"
+            << "  --heartbeat-ms N    heartbeat period of every UDP client (default: " << HEARTBEAT_RATE * 1000 << ")\n"
+            << "  --payload BYTES     body size of pushed messages (default: 64)\n"
+            << "  --mix SPEC          request weights, e.g. push=50,poll=50 (types: create, delete, push,\n"
+            << "                      poll, add_friend, delete_friend, check, status; unlisted types get 0)\n"
+            << "  --binary            use the binary codec instead of JSON\n"
+            << "  --seed N            seed of the request sequence (default: 1)\n"
+            << "  --prefix NAME       prefix of the bench user ids (default: bench)\n";
+}
+
+bool ParseMix(const std::string& spec, LoadOptions& options) {
+  for (size_t i = 0; i < REQUEST_TYPES; ++i) {
+    options.Weights[i] = 0;
+  }
+
+  size_t position = 0;
+  while (position < spec.size()) {
+    size_t end = spec.find(',', position);
+    if (end == std::string::npos) {
+      end = spec.size();
+    }
+    std::string item = spec.substr(position, end - position);
+    position = end + 1;
+
+    size_t equals = item.find('=');
+    if (equals == std::string::npos) {
+      return false;
+    }
+    std::string name = item.substr(0, equals);
+    auto entry = std::find_if(std::begin(DEFAULT_MIX), std::end(DEFAULT_MIX),
+                              [&name](const MixEntry& e) { return name == e.Name; });
+    if (entry == std::end(DEFAULT_MIX)) {
+      return false;
+    }
+    options.Weights[static_cast<size_t>(entry->Type)] = std::stoul(item.substr(equals + 1));
+  }
+
+  unsigned total = 0;
+  for (size_t i = 0; i < REQUEST_TYPES; ++i) {
+    total += options.Weights[i];
+  }
+  return total > 0;
+}
+
+bool ParseOptions(int argc, char* argv[], LoadOptions& options) {
+  for (const MixEntry& entry : DEFAULT_MIX) {
+    options.Weights[static_cast<size_t>(entry.Type)] = entry.Weight;
+  }
+
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--binary") {
+      options.Binary = true;
+      continue;
+    }
+
+    if (i + 1 >= argc) {
+      return false;
+    }
+    std::string value = argv[++i];
+
+    if (arg == "--host") {
+      options.Host = value;
+    } else if (arg == "--prefix") {
+      options.Prefix = value;
+    } else if (arg == "--mix") {
+      if (!ParseMix(value, options)) {
+        return false;
+      }
+    } else if (arg == "--tcp-port") {
+      options.TcpPort = std::stoul(value);
+    } else if (arg == "--udp-port") {
+      options.UdpPort = std::stoul(value);
+    } else if (arg == "--connections") {
+      options.Connections = std::stoul(value);
+    } else if (arg == "--udp-clients") {
+      options.UdpClients = std::stoul(value);
+    } else if (arg == "--threads") {
+      options.Threads = std::stoul(value);
+    } else if (arg == "--rate") {
+      options.Rate = std::stod(value);
+    } else if (arg == "--duration") {
+      options.Duration = std::stod(value);
+    } else if (arg == "--warmup") {
+      options.Warmup = std::stod(value);
+    } else if (arg == "--heartbeat-ms") {
+      options.HeartbeatMs = std::stoi(value);
+    } else if (arg == "--payload") {
+      options.Payload = std::stoul(value);
+    } else if (arg == "--seed") {
+      options.Seed = std::stoull(value);
+    } else {
+      return false;
+    }
+  }
+
+  return options.Connections > 1 && options.Threads > 0 && options.Threads <= options.Connections &&
+         options.Rate > 0 && options.Duration > 0 && options.Warmup >= 0 && options.HeartbeatMs > 0;
+}
+}
+
+int main(int argc, char* argv[]) {
+
+  LoadOptions options;
+  try {
+    if (!ParseOptions(argc, argv, options)) {
+      PrintUsage(argv[0]);
+      return 1;
+    }
+  } catch (const std::exception&) {
+    PrintUsage(argv[0]);
+    return 1;
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  StartGate gate(options.Threads + (options.UdpClients > 0 ? 1 : 0));
+  std::vector<std::unique_ptr<TcpLoadThread>> loaders;
+  for (size_t i = 0; i < options.Threads; ++i) {
+    size_t first = options.Connections * i / options.Threads;
+    size_t last = options.Connections * (i + 1) / options.Threads;
+    loaders.push_back(std::make_unique<TcpLoadThread>(options, first, last, i, gate));
+  }
+  std::unique_ptr<UdpLoadThread> heartbeats;
+  if (options.UdpClients > 0) {
+    heartbeats = std::make_unique<UdpLoadThread>(options, gate);
+  }
+
+  std::vector<std::thread> threads;
+  for (auto& loader : loaders) {
+    threads.emplace_back(&TcpLoadThread::Run, loader.get());
+  }
+  if (heartbeats) {
+    threads.emplace_back(&UdpLoadThread::Run, heartbeats.get());
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  LoadStats total;
+  bool failed = false;
+  for (auto& loader : loaders) {
+    failed = failed || loader->Failed();
+    total.Merge(loader->Stats());
+  }
+  if (heartbeats) {
+    total.Merge(heartbeats->Stats());
+  }
+  if (failed) {
+    return 1;
+  }
+
+  Report(options, total);
+  return 0;
+}
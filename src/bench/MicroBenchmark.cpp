@@ -0,0 +1,224 @@
+/*
+*   talkie-microbench: microbenchmarks of the request codecs and the
+*   message queue, the two pieces every request passes through
+*
+*   Every benchmark runs --iterations operations after a warmup of a tenth
+*   of that and reports nanoseconds per operation and operations per second.
+*   --filter runs only the benchmarks whose name contains the given text.
+*
+*   Author: Fu Qiao
+*   Email:  fqiao@protonmail.com
+*
+*/
+
+#include "Common.hpp"
+#include "ConcurrentQueue.hpp"
+#include "NetworkRequest.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+using common::NetworkRequest;
+using common::SocketMessage;
+using common::WireFormat;
+using SocketMessageQueue = common::ConcurrentQueue<SocketMessage>;
+
+struct BenchOptions {
+  size_t Iterations {1000000};
+  size_t Payload {64};
+  size_t Threads {4};
+  std::string Filter;
+};
+
+//Keep the compiler from optimising a result away
+template<typename T>
+inline void KeepAlive(const T& value) {
+  asm volatile("" : : "r"(&value) : "memory");
+}
+
+void PrintResult(const std::string& name, size_t operations, Clock::duration elapsed) {
+  double ns = std::chrono::duration<double, std::nano>(elapsed).count() / operations;
+  printf("%-32s %12zu %12.1f %14.0f\n", name.c_str(), operations, ns, 1e9 / ns);
+}
+
+//Time body(i) for every i, after an untimed warmup
+template<typename Body>
+void Run(const BenchOptions& options, const std::string& name, Body body) {
+  if (name.find(options.Filter) == std::string::npos) {
+    return;
+  }
+
+  for (size_t i = 0; i < options.Iterations / 10; ++i) {
+    body(i);
+  }
+
+  auto start = Clock::now();
+  for (size_t i = 0; i < options.Iterations; ++i) {
+    body(i);
+  }
+  PrintResult(name, options.Iterations, Clock::now() - start);
+}
+
+void RunCodecBenchmarks(const BenchOptions& options) {
+
+  NetworkRequest request("bench42\n" + std::string(options.Payload, 'x'),
+                         NetworkRequest::RequestType::PUSH_MESSAGE, "bench7");
+  const std::string json = request.ToString();
+  const std::string binary = request.ToBinary();
+  std::string out;
+
+  Run(options, "request/encode-json", [&](size_t) {
+    std::string encoded = request.ToString();
+    KeepAlive(encoded);
+  });
+
+  Run(options, "request/encode-json-into", [&](size_t) {
+    out.clear();
+    request.EncodeTo(out, WireFormat::JSON);
+    KeepAlive(out);
+  });
+
+  Run(options, "request/encode-binary", [&](size_t) {
+    std::string encoded = request.ToBinary();
+    KeepAlive(encoded);
+  });
+
+  Run(options, "request/encode-binary-into", [&](size_t) {
+    out.clear();
+    request.EncodeTo(out, WireFormat::BINARY);
+    KeepAlive(out);
+  });
+
+  Run(options, "request/decode-json", [&](size_t) {
+    NetworkRequest decoded = NetworkRequest::Decode(json, WireFormat::JSON);
+    KeepAlive(decoded);
+  });
+
+  //\u escapes are left to boost::property_tree
+  std::string unusual = json;
+  unusual.insert(unusual.find("bench42"), "\\u0062");
+  Run(options, "request/decode-json-fallback", [&](size_t) {
+    NetworkRequest decoded = NetworkRequest::Decode(unusual, WireFormat::JSON);
+    KeepAlive(decoded);
+  });
+
+  Run(options, "request/decode-binary", [&](size_t) {
+    NetworkRequest decoded = NetworkRequest::Decode(binary, WireFormat::BINARY);
+    KeepAlive(decoded);
+  });
+
+  Run(options, "request/decode-binary-view", [&](size_t) {
+    common::NetworkRequestView view = NetworkRequest::FromBinary(binary);
+    KeepAlive(view);
+  });
+}
+
+//producers push options.Iterations messages in total, consumers pop them all
+void RunQueueContention(const BenchOptions& options, size_t producers, size_t consumers) {
+
+  std::string name = "queue/push-pop-" + std::to_string(producers) + "x" + std::to_string(consumers);
+  if (name.find(options.Filter) == std::string::npos) {
+    return;
+  }
+
+  SocketMessageQueue queue(MESSAGE_QUEUE_CAPACITY);
+  const std::chrono::milliseconds wait(100);
+  size_t perProducer = options.Iterations / producers;
+  size_t total = perProducer * producers;
+  std::atomic<size_t> popped {0};
+
+  std::vector<std::thread> threads;
+  auto start = Clock::now();
+  for (size_t p = 0; p < producers; ++p) {
+    threads.emplace_back([&queue, &options, perProducer, wait] {
+      for (size_t i = 0; i < perProducer; ++i) {
+        SocketMessage message {NetworkRequest(std::string(options.Payload, 'x'), NetworkRequest::RequestType::PUSH_MESSAGE)};
+        while (!queue.Push(std::move(message), wait)) {
+        }
+      }
+    });
+  }
+  for (size_t c = 0; c < consumers; ++c) {
+    threads.emplace_back([&queue, &popped, total, wait] {
+      SocketMessage message;
+      while (popped.load(std::memory_order_relaxed) < total) {
+        if (queue.Pop(message, wait)) {
+          popped.fetch_add(1, std::memory_order_relaxed);
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  PrintResult(name, total, Clock::now() - start);
+}
+
+void RunQueueBenchmarks(const BenchOptions& options) {
+
+  SocketMessageQueue queue(MESSAGE_QUEUE_CAPACITY);
+  SocketMessage message {NetworkRequest(std::string(options.Payload, 'x'), NetworkRequest::RequestType::PUSH_MESSAGE)};
+
+  //the same message moves in and out, so this is the queue's own cost
+  Run(options, "queue/try-push-pop", [&](size_t) {
+    queue.TryPush(std::move(message));
+    queue.TryPop(message);
+  });
+
+  RunQueueContention(options, 1, 1);
+  RunQueueContention(options, options.Threads, options.Threads);
+}
+
+void PrintUsage(const char* program) {
+  std::cerr << "Usage: " << program << " [options]\n"
+            << "  --iterations N   operations per benchmark (default: 1000000)\n"
+            << "  --payload BYTES  size of the request parameters (default: 64)\n"
+            << "  --threads N      producers and consumers of the contended queue benchmark (default: 4)\n"
+            << "  --filter TEXT    only run benchmarks whose name contains TEXT\n";
+}
+
+bool ParseOptions(int argc, char* argv[], BenchOptions& options) {
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string arg = argv[i];
+    std::string value = argv[i + 1];
+    if (arg == "--filter") {
+      options.Filter = value;
+    } else if (arg == "--iterations") {
+      options.Iterations = std::stoul(value);
+    } else if (arg == "--payload") {
+      options.Payload = std::stoul(value);
+    } else if (arg == "--threads") {
+      options.Threads = std::stoul(value);
+    } else {
+      return false;
+    }
+  }
+  return argc % 2 == 1 && options.Iterations >= options.Threads && options.Threads > 0;
+}
+}
+
+int main(int argc, char* argv[]) {
+
+  BenchOptions options;
+  try {
+    if (!ParseOptions(argc, argv, options)) {
+      PrintUsage(argv[0]);
+      return 1;
+    }
+  } catch (const std::exception&) {
+    PrintUsage(argv[0]);
+    return 1;
+  }
+
+  printf("%-32s %12s %12s %14s\n", "benchmark", "operations", "ns/op", "ops/s");
+  RunCodecBenchmarks(options);
+  RunQueueBenchmarks(options);
+  return 0;
+}
@@ -0,0 +1,197 @@
+/*
+*   talkie: SoberTalk server entry point
+*
+*   Author: Fu Qiao
+*   Email:  fqiao@protonmail.com
+*
+*/
+
+#include "SoberTalkApp.h"
+#include "Metrics.h"
+#include <signal.h>
+#include <iostream>
+#include <memory>
+#include <string>
+
+namespace {
+
+void PrintUsage(const char* program) {
+  std::cerr << "Usage: " << program << " [options]\n"
+            << "  --workers N         request worker threads (default: one per core)\n"
+            << "  --reactors N        TCP epoll reactor threads (default: " << TCP_REACTOR_THREADS << ")\n"
+            << "  --max-frame BYTES   largest accepted TCP frame (default: " << TCP_MAX_FRAME_SIZE << ")\n"
+            << "  --io-backend NAME   TCP socket I/O: epoll or io_uring, which falls back to epoll (default: epoll)\n"
+            << "  --zerocopy-min BYTES  send larger TCP replies with MSG_ZEROCOPY, 0 disables (default: " << TCP_ZEROCOPY_MIN_BYTES << ")\n"
+            << "  --outbound-budget BYTES  unsent reply bytes at which a TCP client is no longer read, 0 is unbounded (default: " << TCP_OUTBOUND_BUDGET << ")\n"
+            << "  --stall-timeout-ms N  disconnect TCP clients over their budget this long (default: " << TCP_STALL_TIMEOUT_MS << ")\n"
+            << "  --control-lane N    intake depth per transport for heartbeats and anonymous requests (default: " << CONTROL_LANE_CAPACITY << ")\n"
+            << "  --bulk-lane N       intake depth per transport for all other requests (default: " << BULK_LANE_CAPACITY << ")\n"
+            << "  --control-weight N  heartbeats dequeued per bulk request while both wait (default: " << CONTROL_LANE_WEIGHT << ")\n"
+            << "  --overload-target-ms N  queueing delay above which requests are shed, 0 disables (default: " << OVERLOAD_TARGET_MS << ")\n"
+            << "  --overload-interval-ms N  how long the delay must stay above target per shedding step (default: " << OVERLOAD_INTERVAL_MS << ")\n"
+            << "  --rate-limit NAME=RATE[/BURST]  per source address and second, 0 is unlimited; NAME is\n"
+            << "                      connections (default: " << RATE_LIMIT_CONNECTIONS << "), requests (default: " << RATE_LIMIT_REQUESTS << ")\n"
+            << "                      or a request type, e.g. create_user=5/10 (default: unlimited); repeatable\n"
+            << "  --dedup-entries N   requests with a request id remembered for retransmits (default: " << DEDUP_CACHE_ENTRIES << ")\n"
+            << "  --dedup-window-ms N  how long replies are replayed to retransmits, 0 disables (default: " << DEDUP_WINDOW_MS << ")\n"
+            << "  --listeners N       SO_REUSEPORT listeners per transport (default: 1)\n"
+            << "  --pin-cpus          pin every listener thread to its own core\n"
+            << "  --mailbox-dir PATH  directory of the mailbox segments (default: " << MAILBOX_DIRECTORY << ")\n"
+            << "  --persist URI       write users and friendships behind to \"memory\" or a mongodb:// URI\n"
+            << "  --admin-port PORT   loopback port serving metrics snapshots, 0 disables (default: " << SERVER_ADMIN_PORT << ")\n"
+            << "  --stats-file PATH   write a metrics snapshot to PATH periodically\n"
+            << "  --stats-interval-ms N  period of the metrics file (default: " << STATS_DUMP_INTERVAL_MS << ")\n";
+}
+
+//NAME=RATE[/BURST], see PrintUsage
+bool ParseRateLimit(const std::string& spec, common::RateLimits& limits) {
+  size_t equals = spec.find('=');
+  if (equals == std::string::npos) {
+    return false;
+  }
+
+  std::string name = spec.substr(0, equals);
+  common::RateLimit* limit = nullptr;
+  if (name == "connections") {
+    limit = &limits.Connections;
+  } else if (name == "requests") {
+    limit = &limits.Requests;
+  } else {
+    for (size_t type = 1; type < common::RateLimits::TYPES; ++type) {
+      if (name == common::Metrics::TypeName(type)) {
+        limit = &limits.Types[type];
+      }
+    }
+  }
+  if (limit == nullptr) {
+    return false;
+  }
+
+  std::string value = spec.substr(equals + 1);
+  size_t slash = value.find('/');
+  limit->Rate = std::stoul(value.substr(0, slash));
+  limit->Burst = slash == std::string::npos ? 0 : std::stoul(value.substr(slash + 1));
+  return true;
+}
+
+bool ParseOptions(int argc, char* argv[], sobertalk::SoberTalkOptions& options) {
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--pin-cpus") {
+      options.PinThreads = true;
+      continue;
+    }
+
+    if (i + 1 >= argc) {
+      return false;
+    }
+
+    if (arg == "--mailbox-dir") {
+      options.MailboxDirectory = argv[++i];
+      continue;
+    }
+
+    if (arg == "--persist") {
+      options.PersistenceUri = argv[++i];
+      continue;
+    }
+
+    if (arg == "--stats-file") {
+      options.StatsFile = argv[++i];
+      continue;
+    }
+
+    if (arg == "--rate-limit") {
+      if (!ParseRateLimit(argv[++i], options.RateLimits)) {
+        return false;
+      }
+      continue;
+    }
+
+    if (arg == "--io-backend") {
+      std::string backend = argv[++i];
+      if (backend == "io_uring") {
+        options.TcpIoBackend = network::IoBackend::IO_URING;
+      } else if (backend != "epoll") {
+        return false;
+      }
+      continue;
+    }
+
+    size_t value = std::stoul(argv[++i]);
+    if (arg == "--workers") {
+      options.Workers = value;
+    } else if (arg == "--reactors") {
+      options.TcpReactors = value;
+    } else if (arg == "--max-frame") {
+      options.MaxFrameSize = value;
+    } else if (arg == "--zerocopy-min") {
+      options.ZeroCopyMinBytes = value;
+    } else if (arg == "--outbound-budget") {
+      options.OutboundBudget = value;
+    } else if (arg == "--stall-timeout-ms") {
+      options.StallTimeoutMs = value;
+    } else if (arg == "--control-lane") {
+      options.ControlLaneCapacity = value;
+    } else if (arg == "--bulk-lane") {
+      options.BulkLaneCapacity = value;
+    } else if (arg == "--control-weight") {
+      options.ControlLaneWeight = value;
+    } else if (arg == "--overload-target-ms") {
+      options.OverloadTargetMs = value;
+    } else if (arg == "--overload-interval-ms") {
+      options.OverloadIntervalMs = value;
+    } else if (arg == "--dedup-entries") {
+      options.DedupEntries = value;
+    } else if (arg == "--dedup-window-ms") {
+      options.DedupWindowMs = value;
+    } else if (arg == "--listeners") {
+      options.ListenerShards = value;
+    } else if (arg == "--admin-port") {
+      options.AdminPort = value;
+    } else if (arg == "--stats-interval-ms") {
+      options.StatsIntervalMs = value;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+}
+
+int main(int argc, char* argv[]) {
+
+  sobertalk::SoberTalkOptions options;
+  try {
+    if (!ParseOptions(argc, argv, options)) {
+      PrintUsage(argv[0]);
+      return 1;
+    }
+  } catch (const std::exception&) {
+    PrintUsage(argv[0]);
+    return 1;
+  }
+
+  //block termination signals before any thread starts so only sigwait below sees them
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  std::unique_ptr<sobertalk::SoberTalkApp> app;
+  try {
+    app = std::make_unique<sobertalk::SoberTalkApp>(options);
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  app->Run();
+
+  int received;
+  sigwait(&signals, &received);
+
+  app->Stop();
+  return 0;
+}
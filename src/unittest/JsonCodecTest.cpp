@@ -0,0 +1,292 @@
+/*
+*   JsonCodec against the boost::property_tree reader and writer it
+*   replaces. Whatever the fast reader accepts, read_json has to read to
+*   the same fields; whatever it turns down goes to read_json anyway. The
+*   writer has to match write_json(pretty = false) byte for byte.
+*
+*   Author: Fu Qiao
+*   Email:  fqiao@protonmail.com
+*
+*/
+
+#include "UnitTest.hpp"
+#include "JsonCodec.h"
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <cstdint>
+#include <random>
+#include <sstream>
+
+using common::JsonRequestFields;
+
+namespace {
+
+//The fields as NetworkRequest::FromJson reads them when the fast reader declines
+bool ReadWithPtree(const std::string& document, JsonRequestFields& fields) {
+  try {
+    boost::property_tree::ptree pt;
+    std::istringstream in(document);
+    boost::property_tree::read_json(in, pt);
+    fields.Type = pt.get<int>("request_type");
+    fields.Parameters = pt.get<std::string>("parameters");
+    fields.UserId = pt.get<std::string>("user_id", "");
+    fields.RequestId = pt.get<uint64_t>("request_id", 0);
+    return true;
+  } catch (const std::exception&) {
+    return false;
+  }
+}
+
+std::string WriteWithPtree(int type, const std::string& parameters, const std::string& userId, uint64_t requestId) {
+  boost::property_tree::ptree pt;
+  pt.put("request_type", std::to_string(type));
+  pt.put("parameters", parameters);
+  if (!userId.empty()) {
+    pt.put("user_id", userId);
+  }
+  if (requestId != 0) {
+    pt.put("request_id", std::to_string(requestId));
+  }
+  std::ostringstream out;
+  boost::property_tree::write_json(out, pt, false);
+  return out.str();
+}
+
+//document with every byte outside printable ASCII as \xNN, for failure messages
+std::string Printable(const std::string& document) {
+  std::string out;
+  for (unsigned char c : document) {
+    if (c >= 0x20 && c < 0x7F) {
+      out += static_cast<char>(c);
+    } else {
+      char escaped[5];
+      snprintf(escaped, sizeof(escaped), "\\x%02X", c);
+      out += escaped;
+    }
+  }
+  return out;
+}
+
+//Returns whether the fast reader took document, failing if it read anything read_json reads differently
+bool CheckReader(const std::string& document) {
+  JsonRequestFields fast;
+  if (!common::ParseJsonRequest(document, fast)) {
+    return false;
+  }
+
+  JsonRequestFields reference;
+  if (!ReadWithPtree(document, reference)) {
+    unittest::Fail("read_json rejects what the fast reader took: " + Printable(document), __FILE__, __LINE__);
+  }
+  if (fast.Type != reference.Type || fast.Parameters != reference.Parameters || fast.UserId != reference.UserId ||
+      fast.RequestId != reference.RequestId) {
+    unittest::Fail("fast reader and read_json disagree on: " + Printable(document), __FILE__, __LINE__);
+  }
+  return true;
+}
+
+struct Fallback {
+  const char* Document;
+  const char* Parameters;  //what read_json reads, NULL where it rejects the document as well
+};
+
+//The fast reader has to decline document, and read_json has to read or reject it as expected
+void CheckFallback(const Fallback& fallback) {
+  std::string document = fallback.Document;
+  if (CheckReader(document)) {
+    unittest::Fail("fast reader took " + Printable(document), __FILE__, __LINE__);
+  }
+
+  JsonRequestFields reference;
+  bool read = ReadWithPtree(document, reference);
+  if (fallback.Parameters == nullptr && read) {
+    unittest::Fail("read_json took " + Printable(document), __FILE__, __LINE__);
+  }
+  if (fallback.Parameters != nullptr && (!read || reference.Parameters != fallback.Parameters)) {
+    unittest::Fail("read_json did not read the expected parameters from " + Printable(document), __FILE__, __LINE__);
+  }
+}
+
+void CheckWriter(int type, const std::string& parameters, const std::string& userId, uint64_t requestId) {
+  std::string fast;
+  common::AppendJsonRequest(fast, type, parameters, userId, requestId);
+  std::string reference = WriteWithPtree(type, parameters, userId, requestId);
+  if (fast != reference) {
+    unittest::Fail("writer gives " + Printable(fast) + " where write_json gives " + Printable(reference), __FILE__,
+                   __LINE__);
+  }
+}
+
+//Strings around the cases the codec treats specially, placed across 16-byte boundaries
+std::vector<std::string> Values() {
+  std::vector<std::string> values = {
+    "",
+    "hello",
+    "bob\nhi there",
+    "quote \" backslash \\ slash / tab \t",
+    "\b\f\n\r\t",
+    std::string("nul \0 inside", 12),
+    "del \x7F",
+    "caf\xC3\xA9 \xE2\x82\xAC \xF0\x9F\x98\x80",
+    "overlong \xC0\x80",
+    "surrogate \xED\xA0\x80",
+    "lone continuation \x80",
+    "truncated \xE2\x82",
+    "beyond U+10FFFF \xF4\x90\x80\x80",
+    "\xFF\xFE",
+  };
+  for (int c = 1; c < 0x20; ++c) {
+    values.push_back(std::string(1, static_cast<char>(c)));
+  }
+  for (size_t at = 0; at < 40; at += 3) {
+    for (char special : std::string("\"\\/\n\x01\xC3")) {
+      std::string value(40, 'a');
+      value[at] = special;
+      values.push_back(value);
+    }
+  }
+  return values;
+}
+}
+
+TEST(JsonWriterMatchesWriteJson) {
+  for (const std::string& value : Values()) {
+    CheckWriter(3, value, "alice", 0);
+    CheckWriter(4, "0", value, 7);
+  }
+  CheckWriter(0, "", "", 0);
+  CheckWriter(13, "team\nhi", "", UINT64_MAX);
+  CheckWriter(1, std::string(100000, 'x'), "bob", 1);
+}
+
+TEST(JsonWriterMatchesWriteJsonOnRandomBytes) {
+  std::mt19937 random(7);
+  for (int round = 0; round < 2000; ++round) {
+    std::string parameters(random() % 80, '\0');
+    for (char& c : parameters) {
+      c = static_cast<char>(random());
+    }
+    CheckWriter(random() % 14, parameters, round % 2 ? "u" + std::to_string(round) : "", round % 3 ? round : 0);
+  }
+}
+
+TEST(JsonWriterHeadAndTailMakeTheWholeDocument) {
+  std::string parameters = "line\none \"quoted\" caf\xC3\xA9 / done";
+  std::string whole;
+  common::AppendJsonRequest(whole, 13, parameters, "alice", 9);
+  for (size_t cut = 0; cut <= parameters.size(); ++cut) {
+    std::string split;
+    common::AppendJsonRequestHead(split, 13, parameters.substr(0, cut));
+    common::AppendJsonRequestTail(split, parameters.substr(cut), "alice", 9);
+    CHECK_EQUAL(whole, split);
+  }
+}
+
+TEST(JsonReaderAgreesWithReadJsonOnWrittenDocuments) {
+  for (const std::string& value : Values()) {
+    std::string document;
+    common::AppendJsonRequest(document, 3, value, value, 42);
+    bool taken = CheckReader(document);
+    //only \u escapes, which the writer emits for control characters, and invalid UTF-8 are declined
+    bool plain = true;
+    for (unsigned char c : value) {
+      plain = plain && c >= 0x20 && c < 0x80;
+    }
+    if (plain) {
+      CHECK(taken);
+    }
+  }
+}
+
+TEST(JsonReaderAgreesWithReadJsonOnValidInput) {
+  const char* documents[] = {
+    "{\"request_type\":\"3\",\"parameters\":\"bob\\nhi\",\"user_id\":\"alice\"}\n",
+    "{\"request_type\":3,\"parameters\":\"x\"}",
+    "  {  \"parameters\" : \"x\" ,\r\n\t\"request_type\" : \"12\" , \"user_id\":\"\" }  ",
+    "{\"request_type\":\"0\",\"parameters\":\"\",\"request_id\":18446744073709551615}",
+    "{\"request_type\":\"5\",\"parameters\":\"\\/\\\"\\\\\\b\\f\\r\\t\",\"request_id\":\"7\"}",
+    "{\"request_type\":\"007\",\"parameters\":\"leading zeros are fine in a string\"}",
+    "{\"client\":\"cli 1.0\",\"request_type\":\"2\",\"parameters\":\"unknown fields are skipped\"}",
+    "{\"request_type\":\"3\",\"parameters\":\"caf\xC3\xA9 \xF0\x9F\x98\x80\"}",
+  };
+  for (const char* document : documents) {
+    CHECK(CheckReader(document));
+  }
+}
+
+TEST(JsonReaderDeclinesMalformedEscapes) {
+  const Fallback fallbacks[] = {
+    {"{\"request_type\":\"3\",\"parameters\":\"\\u00e9\"}", "\xC3\xA9"},
+    {"{\"request_type\":\"3\",\"parameters\":\"\\uD83D\\uDE00\"}", "\xF0\x9F\x98\x80"},
+    {"{\"request_type\":\"3\",\"par\\u0061meters\":\"escaped key\"}", "escaped key"},
+    {"{\"request_type\":\"3\",\"parameters\":\"\\x41\"}", nullptr},
+    {"{\"request_type\":\"3\",\"parameters\":\"\\u00\"}", nullptr},
+    {"{\"request_type\":\"3\",\"parameters\":\"\\'\"}", nullptr},
+    {"{\"request_type\":\"3\",\"parameters\":\"ends in a backslash\\", nullptr},
+  };
+  for (const Fallback& fallback : fallbacks) {
+    CheckFallback(fallback);
+  }
+}
+
+TEST(JsonReaderDeclinesInvalidUtf8) {
+  //read_json lets overlong forms and surrogates through, the fast reader leaves them to it
+  const Fallback fallbacks[] = {
+    {"{\"request_type\":\"3\",\"parameters\":\"\xE0\x80\xAF\"}", "\xE0\x80\xAF"},
+    {"{\"request_type\":\"3\",\"parameters\":\"\xC0\xAF\"}", "\xC0\xAF"},
+    {"{\"request_type\":\"3\",\"parameters\":\"\xED\xA0\x80\"}", "\xED\xA0\x80"},
+    {"{\"request_type\":\"3\",\"parameters\":\"lone \x80\"}", nullptr},
+    {"{\"request_type\":\"3\",\"parameters\":\"truncated \xE2\x82\"}", nullptr},
+    {"{\"request_type\":\"3\",\"parameters\":\"x\",\"user_id\":\"\xFF\"}", nullptr},
+    {"{\"request_type\":\"3\",\"parameters\":\"raw control \x01\"}", nullptr},
+  };
+  for (const Fallback& fallback : fallbacks) {
+    CheckFallback(fallback);
+  }
+}
+
+TEST(JsonReaderLeavesUnusualDocumentsToReadJson) {
+  const Fallback fallbacks[] = {
+    //read_json keeps the first of duplicated fields
+    {"{\"request_type\":\"3\",\"parameters\":\"first\",\"parameters\":\"second\"}", "first"},
+    {"{\"request_type\":\"3\",\"parameters\":\"x\",\"extra\":{\"nested\":true}}", "x"},
+    {"{\"request_type\":\"3\",\"parameters\":\"x\",\"extra\":[1,2]}", "x"},
+    {"{\"request_type\":\"3\",\"parameters\":\"x\",\"extra\":null}", "x"},
+    {"{\"request_type\":\"3\",\"parameters\":\"x\",\"request_id\":-1}", "x"},
+    {"{\"request_type\":\"3\",\"parameters\":\"x\",\"request_id\":18446744073709551616}", "x"},
+    {"", nullptr},
+    {"[]", nullptr},
+    {"{\"request_type\":\"3\"}", nullptr},
+    {"{\"parameters\":\"no type\"}", nullptr},
+    {"{\"request_type\":\"3\",\"parameters\":\"x\"", nullptr},
+    {"{\"request_type\":\"3\",\"parameters\":\"x\"} trailing", nullptr},
+    {"{\"request_type\":\"3\",\"parameters\":\"x\",}", nullptr},
+    {"{\"request_type\":3.0,\"parameters\":\"x\"}", nullptr},
+    {"{\"request_type\":03,\"parameters\":\"x\"}", nullptr},
+    {"{\"request_type\":\"three\",\"parameters\":\"x\"}", nullptr},
+    {"{\"request_type\":\"3\",\"parameters\":\"unterminated}", nullptr},
+  };
+  for (const Fallback& fallback : fallbacks) {
+    CheckFallback(fallback);
+  }
+}
+
+TEST(JsonReaderAgreesWithReadJsonOnMutatedDocuments) {
+  std::string seed;
+  common::AppendJsonRequest(seed, 13, "team\nhello \"all\" caf\xC3\xA9", "alice", 12345);
+  std::mt19937 random(11);
+  const std::string alphabet = "{}[]:,\"\\/ 0123456789abcdefnrtu-.\n\x80\xC3\xE2\xED\xF0\xFF";
+  for (int round = 0; round < 20000; ++round) {
+    std::string document = seed;
+    for (int edits = 1 + random() % 3; edits > 0 && !document.empty(); --edits) {
+      size_t at = random() % document.size();
+      char c = alphabet[random() % alphabet.size()];
+      switch (random() % 3) {
+        case 0: document[at] = c; break;
+        case 1: document.insert(document.begin() + at, c); break;
+        default: document.erase(at, 1);
+      }
+    }
+    CheckReader(document);
+  }
+}
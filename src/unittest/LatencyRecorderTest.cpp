@@ -0,0 +1,78 @@
+/*
+*   LatencyRecorder percentiles on inputs whose nearest-rank answer is known.
+*
+*   Author: Fu Qiao
+*   Email:  fqiao@protonmail.com
+*
+*/
+
+#include "UnitTest.hpp"
+#include "bench/LatencyRecorder.hpp"
+#include <algorithm>
+#include <random>
+
+using bench::LatencyRecorder;
+
+namespace {
+
+//1..count nanoseconds in a fixed shuffled order
+LatencyRecorder Shuffled(int64_t count) {
+  std::vector<int64_t> values;
+  for (int64_t i = 1; i <= count; ++i) {
+    values.push_back(i);
+  }
+  std::shuffle(values.begin(), values.end(), std::mt19937(42));
+
+  LatencyRecorder recorder;
+  for (int64_t value : values) {
+    recorder.Record(std::chrono::nanoseconds(value));
+  }
+  return recorder;
+}
+}
+
+TEST(LatencyRecorderNearestRankPercentiles) {
+  LatencyRecorder recorder = Shuffled(1000);
+  CHECK_EQUAL(1000u, recorder.Count());
+  CHECK_EQUAL(1, recorder.Percentile(0));
+  CHECK_EQUAL(500, recorder.Percentile(50));
+  CHECK_EQUAL(990, recorder.Percentile(99));
+  CHECK_EQUAL(999, recorder.Percentile(99.9));
+  CHECK_EQUAL(1000, recorder.Percentile(100));
+  CHECK_EQUAL(1000, recorder.Max());
+
+  LatencyRecorder large = Shuffled(100000);
+  CHECK_EQUAL(50000, large.Percentile(50));
+  CHECK_EQUAL(99000, large.Percentile(99));
+  CHECK_EQUAL(99900, large.Percentile(99.9));
+}
+
+TEST(LatencyRecorderFewSamples) {
+  LatencyRecorder empty;
+  CHECK_EQUAL(0, empty.Percentile(50));
+  CHECK_EQUAL(0, empty.Max());
+
+  //with ten samples every tail percentile is the slowest one
+  LatencyRecorder recorder = Shuffled(10);
+  CHECK_EQUAL(5, recorder.Percentile(50));
+  CHECK_EQUAL(6, recorder.Percentile(51));
+  CHECK_EQUAL(10, recorder.Percentile(99));
+  CHECK_EQUAL(10, recorder.Percentile(99.9));
+}
+
+TEST(LatencyRecorderMergeResorts) {
+  LatencyRecorder slow;
+  LatencyRecorder fast;
+  for (int64_t i = 1; i <= 50; ++i) {
+    fast.Record(std::chrono::nanoseconds(i));
+    slow.Record(std::chrono::nanoseconds(1000 + i));
+  }
+  //sort fast before merging so Merge has to invalidate the order
+  CHECK_EQUAL(25, fast.Percentile(50));
+
+  fast.Merge(slow);
+  CHECK_EQUAL(100u, fast.Count());
+  CHECK_EQUAL(50, fast.Percentile(50));
+  CHECK_EQUAL(1049, fast.Percentile(99));
+  CHECK_EQUAL(1050, fast.Max());
+}
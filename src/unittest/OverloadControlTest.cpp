@@ -0,0 +1,79 @@
+/*
+*   OverloadControl levels and what they shed, driven with made-up clocks.
+*
+*   Author: Fu Qiao
+*   Email:  fqiao@protonmail.com
+*
+*/
+
+#include "UnitTest.hpp"
+#include "OverloadControl.h"
+
+using sobertalk::OverloadControl;
+using RequestType = common::NetworkRequest::RequestType;
+
+namespace {
+  const uint64_t MS = 1000000;
+  const uint64_t START = 1000 * MS;
+}
+
+TEST(OverloadLevelRisesPerIntervalAboveTarget) {
+  OverloadControl overload(5, 100);
+  overload.Observe(10 * MS, START);
+  CHECK_EQUAL(0, overload.Level(START + 50 * MS));
+
+  overload.Observe(10 * MS, START + 150 * MS);
+  CHECK_EQUAL(1, overload.Level(START + 150 * MS));
+  overload.Observe(10 * MS, START + 350 * MS);
+  CHECK_EQUAL(3, overload.Level(START + 350 * MS));
+  overload.Observe(10 * MS, START + 950 * MS);
+  CHECK_EQUAL(OverloadControl::MAX_LEVEL, overload.Level(START + 950 * MS));
+
+  //an interval without any request picked up means the queue is gone
+  CHECK_EQUAL(0, overload.Level(START + 1100 * MS));
+
+  overload.Observe(1 * MS, START + 1200 * MS);
+  CHECK_EQUAL(0, overload.Level(START + 1200 * MS));
+}
+
+TEST(OverloadShedsOnArrivalByLevelAndType) {
+  OverloadControl overload(5, 100);
+  auto levelAt = [&overload](uint64_t offsetMs) {
+    overload.Observe(10 * MS, START + offsetMs * MS);
+    return START + offsetMs * MS;
+  };
+
+  uint64_t now = levelAt(0);
+  CHECK(!overload.ShedOnArrival(RequestType::PUSH_MESSAGE, now));
+
+  now = levelAt(150);
+  CHECK_EQUAL(1, overload.Level(now));
+  CHECK(!overload.ShedOnArrival(RequestType::POLL_MESSAGE, now));
+  CHECK(!overload.ShedOnArrival(RequestType::PUSH_MESSAGE, now));
+
+  now = levelAt(250);
+  CHECK_EQUAL(2, overload.Level(now));
+  CHECK(overload.ShedOnArrival(RequestType::POLL_MESSAGE, now));
+  CHECK(!overload.ShedOnArrival(RequestType::PUSH_MESSAGE, now));
+
+  now = levelAt(350);
+  CHECK_EQUAL(3, overload.Level(now));
+  CHECK(overload.ShedOnArrival(RequestType::POLL_MESSAGE, now));
+  CHECK(overload.ShedOnArrival(RequestType::PUSH_MESSAGE, now));
+  CHECK(overload.ShedOnArrival(RequestType::CREATE_USER, now));
+  //stats are always served, heartbeats need the user's presence to judge
+  CHECK(!overload.ShedOnArrival(RequestType::STATS, now));
+  CHECK(!overload.ShedOnArrival(RequestType::REGULAR_CHECK, now));
+
+  overload.Observe(1 * MS, now);
+  CHECK(!overload.ShedOnArrival(RequestType::POLL_MESSAGE, now));
+}
+
+TEST(OverloadDisabledNeverSheds) {
+  OverloadControl overload(0, 100);
+  for (uint64_t offset = 0; offset <= 1000; offset += 50) {
+    overload.Observe(1000 * MS, START + offset * MS);
+  }
+  CHECK_EQUAL(0, overload.Level(START + 1000 * MS));
+  CHECK(!overload.ShedOnArrival(RequestType::POLL_MESSAGE, START + 1000 * MS));
+}
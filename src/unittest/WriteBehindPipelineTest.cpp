@@ -0,0 +1,178 @@
+/*
+*   WriteBehindPipeline against an in-memory sink that can be made to fail
+*   or to hold its writes, standing in for a slow or broken database.
+*
+*   Author: Fu Qiao
+*   Email:  fqiao@protonmail.com
+*
+*/
+
+#include "UnitTest.hpp"
+#include "WriteBehindPipeline.h"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+using namespace sobertalk;
+
+namespace {
+
+class ScriptedSink final : public PersistenceSink {
+
+public:
+  void Write(const std::vector<Mutation>& batch) override {
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      ++_attempts;
+      _gate.wait(lock, [this] { return _open; });
+      if (_failures > 0) {
+        --_failures;
+        throw std::runtime_error("sink unavailable");
+      }
+      _sizes.push_back(batch.size());
+    }
+    _store.Write(batch);
+  }
+
+  void FailNext(int count) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _failures = count;
+  }
+
+  void Hold() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _open = false;
+  }
+
+  void Release() {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _open = true;
+    }
+    _gate.notify_all();
+  }
+
+  size_t Attempts() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _attempts;
+  }
+
+  std::vector<size_t> BatchSizes() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _sizes;
+  }
+
+  const MemoryPersistenceSink& Store() const { return _store; }
+
+private:
+  mutable std::mutex _mutex;
+  std::condition_variable _gate;
+  bool _open {true};
+  int _failures {0};
+  size_t _attempts {0};
+  std::vector<size_t> _sizes;
+  MemoryPersistenceSink _store;
+};
+
+Mutation Upsert(const std::string& key, const std::string& document) {
+  Mutation mutation;
+  mutation.Collection = "users";
+  mutation.Key = key;
+  mutation.Document = document;
+  return mutation;
+}
+
+ScriptedSink& SinkOf(WriteBehindPipeline& pipeline) {
+  return static_cast<ScriptedSink&>(pipeline.Sink());
+}
+}
+
+TEST(WriteBehindCoalescesPendingWritesOfOneDocument) {
+  //a long interval and a large batch keep everything pending until Flush
+  WriteBehindPipeline pipeline(std::unique_ptr<PersistenceSink>(new ScriptedSink()), 100, 60000, 100);
+  pipeline.Start();
+  for (int i = 0; i < 5; ++i) {
+    pipeline.Submit(Upsert("alice", "{\"v\":" + std::to_string(i) + "}"));
+  }
+  pipeline.Submit(Upsert("bob", "{\"v\":0}"));
+  CHECK_EQUAL(2u, pipeline.Backlog());
+
+  pipeline.Flush();
+  ScriptedSink& sink = SinkOf(pipeline);
+  CHECK_EQUAL(1u, sink.BatchSizes().size());
+  CHECK_EQUAL(2u, sink.BatchSizes()[0]);
+  CHECK_EQUAL(std::string("{\"v\":4}"), sink.Store().Find("users", "alice"));
+  CHECK_EQUAL(0u, pipeline.Backlog());
+  pipeline.Stop();
+}
+
+TEST(WriteBehindBlocksSubmitAtMaxPending) {
+  WriteBehindPipeline pipeline(std::unique_ptr<PersistenceSink>(new ScriptedSink()), 100, 60000, 2);
+  pipeline.Submit(Upsert("a", "{}"));
+  pipeline.Submit(Upsert("b", "{}"));
+  //replacing a pending document takes no room, so it must not block
+  pipeline.Submit(Upsert("a", "{\"v\":1}"));
+  CHECK_EQUAL(2u, pipeline.Backlog());
+
+  std::atomic<bool> submitted {false};
+  std::thread submitter([&] {
+    pipeline.Submit(Upsert("c", "{}"));
+    submitted = true;
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  CHECK(!submitted);
+
+  //the held sink keeps a and b in flight, which still counts against the limit
+  ScriptedSink& sink = SinkOf(pipeline);
+  sink.Hold();
+  pipeline.Start();
+  std::thread flusher([&] { pipeline.Flush(); });
+  while (sink.Attempts() == 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  CHECK(!submitted);
+
+  sink.Release();
+  submitter.join();
+  flusher.join();
+  CHECK(submitted);
+  pipeline.Flush();
+  CHECK_EQUAL(std::string("{\"v\":1}"), sink.Store().Find("users", "a"));
+  CHECK_EQUAL(3u, sink.Store().Size("users"));
+  pipeline.Stop();
+}
+
+TEST(WriteBehindRetriesBatchAfterSinkFailure) {
+  WriteBehindPipeline pipeline(std::unique_ptr<PersistenceSink>(new ScriptedSink()), 100, 60000, 100);
+  ScriptedSink& sink = SinkOf(pipeline);
+  sink.FailNext(2);
+  pipeline.Start();
+  pipeline.Submit(Upsert("alice", "{\"v\":1}"));
+
+  pipeline.Flush();
+  CHECK_EQUAL(3u, sink.Attempts());
+  CHECK_EQUAL(1u, sink.BatchSizes().size());
+  CHECK_EQUAL(std::string("{\"v\":1}"), sink.Store().Find("users", "alice"));
+  CHECK_EQUAL(0u, pipeline.Backlog());
+  pipeline.Stop();
+}
+
+TEST(WriteBehindStopFlushesEverythingPending) {
+  const size_t documents = 2500;
+  WriteBehindPipeline pipeline(std::unique_ptr<PersistenceSink>(new ScriptedSink()), 1000, 60000, documents);
+  pipeline.Start();
+  for (size_t i = 0; i < documents; ++i) {
+    pipeline.Submit(Upsert("user" + std::to_string(i), "{}"));
+  }
+
+  pipeline.Stop();
+  ScriptedSink& sink = SinkOf(pipeline);
+  CHECK_EQUAL(documents, sink.Store().Size("users"));
+  for (size_t size : sink.BatchSizes()) {
+    CHECK(size <= 1000u);
+  }
+  CHECK_EQUAL(0u, pipeline.Backlog());
+}
@@ -0,0 +1,38 @@
+/*
+*   unittest: runs the registered test cases, see UnitTest.hpp
+*
+*   Usage: ./unittest [name filter]
+*
+*   Author: Fu Qiao
+*   Email:  fqiao@protonmail.com
+*
+*/
+
+#include "UnitTest.hpp"
+#include <exception>
+#include <iostream>
+#include <string.h>
+
+int main(int argc, char** argv) {
+
+  const char* filter = argc > 1 ? argv[1] : "";
+  size_t run = 0;
+  size_t failed = 0;
+  for (const unittest::TestCase& test : unittest::Registry()) {
+    if (strstr(test.Name, filter) == nullptr) {
+      continue;
+    }
+
+    ++run;
+    try {
+      test.Function();
+      std::cout << "[  OK  ] " << test.Name << std::endl;
+    } catch (const std::exception& e) {
+      ++failed;
+      std::cout << "[ FAIL ] " << test.Name << ": " << e.what() << std::endl;
+    }
+  }
+
+  std::cout << run - failed << " of " << run << " tests passed" << std::endl;
+  return failed == 0 ? 0 : 1;
+}